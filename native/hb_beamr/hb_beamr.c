@@ -2,12 +2,49 @@
 #include "include/hb_logging.h"
 #include "include/hb_driver.h"
 #include "include/hb_wasm.h"
+#include "include/hb_module_cache.h"
+#include "include/hb_dirty.h"
+#include "include/hb_template.h"
+#include "include/hb_wasi.h"
+#include "include/hb_prefetch.h"
+#include "include/hb_threads.h"
+#include "include/hb_budget.h"
+#include "include/hb_stats.h"
+#include "include/hb_trace.h"
+#include "include/hb_indirect.h"
+#include "include/hb_queue.h"
+#include "include/hb_restore.h"
 
 // Declare the atoms used in Erlang driver communication
 ErlDrvTermData atom_ok;
 ErlDrvTermData atom_error;
 ErlDrvTermData atom_import;
 ErlDrvTermData atom_execution_result;
+ErlDrvTermData atom_undefined;
+ErlDrvTermData atom_budget_exhausted;
+ErlDrvTermData atom_reply;
+
+// Commands sent to the port as raw iolists, rather than as `term_to_binary'
+// encoded tuples, begin with one of these opcodes. External term format
+// messages always begin with the version byte (131), so the two can not be
+// confused.
+#define HB_OPCODE_WRITE 1
+#define HB_OPCODE_APPLY_DELTA 2
+// Opcode (1 byte), offset (8 bytes, big-endian), length (8 bytes, big-endian).
+// The offset is unused (zero) for delta application.
+#define HB_OPCODE_HEADER_SIZE 17
+
+// Synchronous memory operations, issued with `port_control/3'. Their replies
+// begin with a status byte: HB_CONTROL_OK followed by the result, or
+// HB_CONTROL_ERROR followed by an error message.
+#define HB_CONTROL_SIZE 1    // No arguments. Replies with the size (8 bytes, big-endian).
+#define HB_CONTROL_READ 2    // Offset (8 bytes), length (8 bytes). Replies with the bytes.
+#define HB_CONTROL_WRITE 3   // Offset (8 bytes), then the data. Replies with nothing.
+#define HB_CONTROL_STATS 4   // No arguments. Replies with the counters, as an encoded term.
+#define HB_CONTROL_TRACE 5   // No arguments. Replies with the trace events, as an encoded term.
+#define HB_CONTROL_CANCEL 6  // Request ID (8 bytes). Replies with 1 if its command was dequeued, or 0.
+#define HB_CONTROL_OK 0
+#define HB_CONTROL_ERROR 1
 
 static ErlDrvData wasm_driver_start(ErlDrvPort port, char *buff) {
     ErlDrvSysInfo info;
@@ -35,8 +72,36 @@ static ErlDrvData wasm_driver_start(ErlDrvPort port, char *buff) {
     DRV_DEBUG("Port: %p", proc->port);
     proc->port_term = driver_mk_port(proc->port);
     DRV_DEBUG("Port term: %p", proc->port_term);
+    // Replies to `port_control/3' are returned as binaries, not lists.
+    set_port_control_flags(port, PORT_CONTROL_FLAG_BINARY);
     proc->is_running = erl_drv_mutex_create("wasm_instance_mutex");
     proc->is_initialized = 0;
+    proc->current_import = NULL;
+    proc->import.response_ready = erl_drv_mutex_create("response_mutex");
+    proc->import.cond = erl_drv_cond_create("response_cond");
+    proc->import.ready = 0;
+    proc->import.error_message = NULL;
+    proc->import.result_terms = NULL;
+    proc->import_msg = NULL;
+    proc->import_msg_size = 0;
+    proc->prefetch = NULL;
+    proc->prefetch_count = 0;
+    queue_init(proc);
+    proc->indirect_cache = NULL;
+    proc->indirect_cache_size = 0;
+    proc->has_indirect_table_inst = 0;
+    budget_init(proc);
+    stats_instance_started(proc);
+    // Pick the worker thread for the instance (starting the pool if needed)
+    threads_configure(proc, buff);
+    proc->module_entry = NULL;
+    memset(&proc->exports, 0, sizeof(ExportTable));
+    proc->snapshot = NULL;
+    proc->checkpoint = NULL;
+    proc->checkpoint_pages = 0;
+    proc->wasi_out = NULL;
+    proc->wasi_out_len = 0;
+    proc->wasi_out_fd = 0;
     proc->start_time = time(NULL);
     return (ErlDrvData)proc;
 }
@@ -48,34 +113,204 @@ static void wasm_driver_stop(ErlDrvData raw) {
     if(proc->current_import) {
         DRV_DEBUG("Shutting down during import response...");
         proc->current_import->error_message = "WASM driver unloaded during import response";
-        proc->current_import->ready = 1;
         DRV_DEBUG("Signalling import_response with error");
         drv_signal(proc->current_import->response_ready, proc->current_import->cond, &proc->current_import->ready);
         DRV_DEBUG("Signalled worker to fail. Locking is_running mutex to shutdown");
     }
 
+    // Drop the jobs that have not started, and wait for the one running (if
+    // any), which no longer waits on its import.
+    threads_release(proc);
     // We need to first grab the lock, then unlock it and destroy it. Must be a better way...
     DRV_DEBUG("Grabbing is_running mutex to shutdown...");
     drv_lock(proc->is_running);
     drv_unlock(proc->is_running);
+    budget_destroy(proc);
+    stats_instance_stopped(proc);
     DRV_DEBUG("Destroying is_running mutex");
     erl_drv_mutex_destroy(proc->is_running);
+    // No import can be pending now that the instance has stopped running.
+    erl_drv_cond_destroy(proc->import.cond);
+    erl_drv_mutex_destroy(proc->import.response_ready);
+    if (proc->import.result_terms) driver_free(proc->import.result_terms);
+    if (proc->import_msg) driver_free(proc->import_msg);
+    prefetch_free(proc);
+    queue_destroy(proc);
+    indirect_cache_free(proc);
     // Cleanup WASM resources
     DRV_DEBUG("Cleaning up WASM resources");
     if (proc->is_initialized) {
+        DRV_DEBUG("Freeing export table");
+        free_export_table(proc);
         DRV_DEBUG("Deleting WASM instance");
         wasm_instance_delete(proc->instance);
         DRV_DEBUG("Deleted WASM instance");
-        wasm_module_delete(proc->module);
-        DRV_DEBUG("Deleted WASM module");
         wasm_store_delete(proc->store);
         DRV_DEBUG("Deleted WASM store");
+        module_cache_release(proc->module_entry);
+        DRV_DEBUG("Released WASM module");
+    }
+    if (proc->snapshot) {
+        DRV_DEBUG("Releasing memory snapshot");
+        driver_free_binary(proc->snapshot);
     }
+    dirty_free(proc);
+    wasi_free(proc);
     DRV_DEBUG("Freeing proc");
     driver_free(proc);
     DRV_DEBUG("Freed proc");
 }
 
+// Map the name of an engine to a WAMR running mode.
+static int decode_engine(const char* engine, RunningMode* mode) {
+    if (strcmp(engine, "default") == 0) *mode = Mode_Default;
+    else if (strcmp(engine, "interp") == 0) *mode = Mode_Interp;
+    else if (strcmp(engine, "fast_jit") == 0) *mode = Mode_Fast_JIT;
+    else if (strcmp(engine, "llvm_jit") == 0) *mode = Mode_LLVM_JIT;
+    else if (strcmp(engine, "multi_tier_jit") == 0) *mode = Mode_Multi_Tier_JIT;
+    else return -1;
+    return 0;
+}
+
+// Decode the {Signature, Packed} arguments of a call into its command.
+static int decode_packed_args(QueuedCommand* cmd, const char* buff, int* index) {
+    int arity, type, size;
+    if (ei_decode_tuple_header(buff, index, &arity) != 0 || arity != 2) return -1;
+    if (ei_get_type(buff, index, &type, &size) != 0 ||
+            (type != ERL_STRING_EXT && type != ERL_NIL_EXT) ||
+            size >= HB_QUEUED_MAX_SIG) return -1;
+    if (ei_decode_string(buff, index, cmd->sig) != 0) return -1;
+    if (ei_get_type(buff, index, &type, &size) != 0 || type != ERL_BINARY_EXT) return -1;
+    queue_reserve(cmd, size ? size : 1);
+    return ei_decode_binary(buff, index, cmd->data, &cmd->data_size);
+}
+
+// Decode the rest of a `{call, FunctionName, Args[, Prefetch[, Budget]]}'
+// tuple of the given arity into a queued call. On failure, returns NULL and
+// sets the error to report.
+static QueuedCommand* decode_call(Proc* proc, char* buff, int* index, int arity,
+        uint64_t request_id, const char** error) {
+    QueuedCommand* cmd = queue_alloc(proc, HB_QUEUED_CALL, request_id);
+    if (ei_decode_string(buff, index, cmd->function_name) != 0) {
+        *error = "Failed to decode function name.";
+        goto fail;
+    }
+    DRV_DEBUG("Function name: %s", cmd->function_name);
+
+    DRV_DEBUG("Decoding args. Buff: %p. Index: %d", buff, *index);
+    int args_type, args_size;
+    ei_get_type(buff, index, &args_type, &args_size);
+    if (args_type == ERL_SMALL_TUPLE_EXT) {
+        // {Signature, Packed}: the arguments packed for the signature
+        // of the export, decoded by the job without per-argument terms.
+        if (decode_packed_args(cmd, buff, index) != 0) {
+            *error = "Failed to decode packed arguments.";
+            goto fail;
+        }
+    } else {
+        cmd->args = decode_list(buff, index);
+    }
+
+    // The memory to attach to imports during this call, if any.
+    if (arity >= 4 && prefetch_decode(buff, index, &cmd->prefetch, &cmd->prefetch_count) != 0) {
+        *error = "Failed to decode import prefetch descriptors.";
+        goto fail;
+    }
+
+    // The budget of the call, if it has one.
+    if (arity >= 5 && budget_decode(buff, index, &cmd->fuel, &cmd->time_ms, error) != 0) {
+        goto fail;
+    }
+    return cmd;
+fail:
+    queue_discard(proc, cmd);
+    return NULL;
+}
+
+// Decode the rest of a `{read, Offset, Size}' or `{write, Offset, Data}'
+// tuple into a queued memory command.
+static QueuedCommand* decode_memory_command(Proc* proc, const char* buff, int* index,
+        int kind, uint64_t request_id) {
+    QueuedCommand* cmd = queue_alloc(proc, kind, request_id);
+    unsigned long long offset, length;
+    int type, size;
+    if (ei_decode_ulonglong(buff, index, &offset) != 0) goto fail;
+    cmd->offset = offset;
+    if (kind == HB_QUEUED_READ) {
+        if (ei_decode_ulonglong(buff, index, &length) != 0) goto fail;
+        cmd->length = length;
+        return cmd;
+    }
+    if (ei_get_type(buff, index, &type, &size) != 0 || type != ERL_BINARY_EXT) goto fail;
+    queue_reserve(cmd, size ? size : 1);
+    if (ei_decode_binary(buff, index, cmd->data, &cmd->data_size) != 0) goto fail;
+    return cmd;
+fail:
+    queue_discard(proc, cmd);
+    return NULL;
+}
+
+// Decode a non-negative integer that must fit in 32 bits.
+static int decode_uint32(const char* buff, int* index, uint32_t* out) {
+    unsigned long long value;
+    if (ei_decode_ulonglong(buff, index, &value) != 0 || value > UINT32_MAX) return -1;
+    *out = (uint32_t)value;
+    return 0;
+}
+
+// Decode the proplist of instance options given to `init'. Unknown options
+// are skipped, such that callers can pass options to newer drivers.
+static int decode_instance_opts(const char* buff, int* index, InstanceOpts* opts) {
+    int count, arity;
+    if (ei_decode_list_header(buff, index, &count) != 0) return -1;
+    for (int i = 0; i < count; i++) {
+        char key[MAXATOMLEN];
+        if (ei_decode_tuple_header(buff, index, &arity) != 0 || arity != 2 ||
+                ei_decode_atom(buff, index, key) != 0) {
+            return -1;
+        }
+        if (strcmp(key, "engine") == 0) {
+            char engine[MAXATOMLEN];
+            if (ei_decode_atom(buff, index, engine) != 0 ||
+                    decode_engine(engine, &opts->running_mode) != 0) {
+                return -1;
+            }
+        } else if (strcmp(key, "native_wasi") == 0) {
+            int names;
+            if (ei_decode_list_header(buff, index, &names) != 0) return -1;
+            for (int j = 0; j < names; j++) {
+                char name[MAXATOMLEN];
+                if (ei_decode_atom(buff, index, name) != 0) return -1;
+                opts->native_wasi |= wasi_native_flag(name);
+            }
+            if (names > 0 && ei_decode_list_header(buff, index, &names) != 0) return -1;
+        } else if (strcmp(key, "random_seed") == 0) {
+            unsigned long long seed;
+            if (ei_decode_ulonglong(buff, index, &seed) != 0) return -1;
+            opts->random_seed = seed;
+        } else if (strcmp(key, "stack_size") == 0) {
+            if (decode_uint32(buff, index, &opts->stack_size) != 0) return -1;
+        } else if (strcmp(key, "heap_size") == 0) {
+            if (decode_uint32(buff, index, &opts->heap_size) != 0) return -1;
+        } else if (strcmp(key, "initial_pages") == 0) {
+            if (decode_uint32(buff, index, &opts->initial_pages) != 0) return -1;
+        } else if (strcmp(key, "max_pages") == 0) {
+            if (decode_uint32(buff, index, &opts->max_pages) != 0) return -1;
+        } else if (strcmp(key, "bounds_checks") == 0) {
+            char mode[MAXATOMLEN];
+            if (ei_decode_atom(buff, index, mode) != 0) return -1;
+            if (strcmp(mode, "default") == 0) opts->bounds_checks = HB_BOUNDS_DEFAULT;
+            else if (strcmp(mode, "software") == 0) opts->bounds_checks = HB_BOUNDS_SOFTWARE;
+            else if (strcmp(mode, "hardware") == 0) opts->bounds_checks = HB_BOUNDS_HARDWARE;
+            else return -1;
+        } else if (ei_skip_term(buff, index) != 0) {
+            return -1;
+        }
+    }
+    if (count > 0 && ei_decode_list_header(buff, index, &count) != 0) return -1;
+    return 0;
+}
+
 static void wasm_driver_output(ErlDrvData raw, char *buff, ErlDrvSizeT bufflen) {
     DRV_DEBUG("WASM driver output received");
     Proc* proc = (Proc*)raw;
@@ -113,29 +348,165 @@ static void wasm_driver_output(ErlDrvData raw, char *buff, ErlDrvSizeT bufflen)
         // the init message size + '\0' character
         mode = driver_alloc(mode_size + 1);
         ei_decode_atom(buff, &index, mode);
+        // The SHA-256 of the binary, used to key the module cache.
         LoadWasmReq* mod_bin = driver_alloc(sizeof(LoadWasmReq));
+        long hash_size;
+        ei_get_type(buff, &index, &type, &size);
+        if (type != ERL_BINARY_EXT || size != sizeof(mod_bin->hash) ||
+                ei_decode_binary(buff, &index, mod_bin->hash, &hash_size) != 0) {
+            driver_free(wasm_binary);
+            driver_free(mode);
+            driver_free(mod_bin);
+            send_error(proc, "Failed to decode module hash.");
+            return;
+        }
+        memset(&mod_bin->opts, 0, sizeof(InstanceOpts));
+        mod_bin->opts.running_mode = Mode_Default;
+        if (arity >= 5 && decode_instance_opts(buff, &index, &mod_bin->opts) != 0) {
+            driver_free(wasm_binary);
+            driver_free(mode);
+            driver_free(mod_bin);
+            send_error(proc, "Failed to decode instance options.");
+            return;
+        }
         mod_bin->proc = proc;
         mod_bin->binary = wasm_binary;
-        mod_bin->size = size;
+        mod_bin->size = size_l;
         mod_bin->mode = mode;
         //DRV_DEBUG("Calling for async thread to init");
-        driver_async(proc->port, NULL, wasm_initialize_runtime, mod_bin, NULL);
+        threads_submit(proc, wasm_initialize_runtime, mod_bin);
     } else if (strcmp(command, "call") == 0) {
         if (!proc->is_initialized) {
             send_error(proc, "Cannot run WASM function as module not initialized.");
             return;
         }
-        // Extract the function name and the args from the Erlang term and generate the wasm_val_vec_t
-        char* function_name = driver_alloc(MAXATOMLEN);
-        ei_decode_string(buff, &index, function_name);
-        DRV_DEBUG("Function name: %s", function_name);
-        proc->current_function = function_name;
+        // Decode the call into a command, queued behind any earlier ones. Its
+        // replies are untagged, as they were before calls could be queued.
+        const char* error = NULL;
+        QueuedCommand* cmd = decode_call(proc, buff, &index, arity, 0, &error);
+        if (!cmd) {
+            send_error(proc, "%s", error);
+            return;
+        }
+        cmd->budget_seq = budget_arm(proc, cmd->time_ms);
+        queue_submit(proc, cmd);
+    }
+    else if (strcmp(command, "queue") == 0) {
+        // {queue, RequestId, Command}: a call or memory operation, run in
+        // order with the instance's other commands, whose replies are tagged
+        // with the request's ID so that they can be pipelined.
+        unsigned long long request_id;
+        int cmd_arity;
+        char kind[MAXATOMLEN];
+        if (ei_decode_ulonglong(buff, &index, &request_id) != 0 || request_id == 0 ||
+                ei_decode_tuple_header(buff, &index, &cmd_arity) != 0 ||
+                ei_decode_atom(buff, &index, kind) != 0) {
+            send_error(proc, "Failed to decode queued command.");
+            return;
+        }
+        if (!proc->is_initialized) {
+            send_reply_error(proc, request_id, "Cannot queue command as module not initialized.");
+            return;
+        }
+        const char* error = "Failed to decode queued command.";
+        QueuedCommand* cmd = NULL;
+        if (strcmp(kind, "call") == 0) {
+            cmd = decode_call(proc, buff, &index, cmd_arity, request_id, &error);
+        } else if (strcmp(kind, "read") == 0 && cmd_arity == 3) {
+            cmd = decode_memory_command(proc, buff, &index, HB_QUEUED_READ, request_id);
+        } else if (strcmp(kind, "write") == 0 && cmd_arity == 3) {
+            cmd = decode_memory_command(proc, buff, &index, HB_QUEUED_WRITE, request_id);
+        }
+        if (!cmd) {
+            send_reply_error(proc, request_id, "%s", error);
+            return;
+        }
+        if (cmd->kind == HB_QUEUED_CALL) cmd->budget_seq = budget_arm(proc, cmd->time_ms);
+        queue_submit(proc, cmd);
+    } 
+    else if (strcmp(command, "call_batch") == 0) {
+        if (!proc->is_initialized) {
+            send_error(proc, "Cannot run WASM function batch as module not initialized.");
+            return;
+        }
+        // Decode the list of {FunctionName, Args} calls into a batch that is
+        // executed by a single async job.
+        int count;
+        if (ei_decode_list_header(buff, &index, &count) != 0) {
+            send_error(proc, "Failed to decode call batch.");
+            return;
+        }
+        DRV_DEBUG("Decoding batch of %d calls", count);
+        CallBatch* batch = driver_alloc(sizeof(CallBatch));
+        batch->proc = proc;
+        batch->count = 0;
+        batch->items = driver_alloc(sizeof(BatchItem) * (count ? count : 1));
+        for (int i = 0; i < count; i++) {
+            int item_arity;
+            BatchItem* item = &batch->items[batch->count++];
+            item->function_name = driver_alloc(MAXATOMLEN);
+            item->args = NULL;
+            if (ei_decode_tuple_header(buff, &index, &item_arity) != 0 ||
+                    item_arity != 2 ||
+                    ei_decode_string(buff, &index, item->function_name) != 0) {
+                free_call_batch(batch);
+                send_error(proc, "Failed to decode call %d of batch.", i + 1);
+                return;
+            }
+            item->args = decode_list(buff, &index);
+        }
+        threads_submit(proc, wasm_execute_batch, batch);
+    }
+    else if (strcmp(command, "call_with_buffers") == 0) {
+        if (!proc->is_initialized) {
+            send_error(proc, "Cannot run WASM function as module not initialized.");
+            return;
+        }
+        // Decode {call_with_buffers, FunctionName, Buffers, Free[, Budget]},
+        // copying the buffers out of the command for the async job.
+        int count;
+        char free_buffers[MAXATOMLEN];
+        BufferCall* call = driver_alloc(sizeof(BufferCall));
+        memset(call, 0, sizeof(BufferCall));
+        call->proc = proc;
+        call->function_name = driver_alloc(MAXATOMLEN);
+        if (ei_decode_string(buff, &index, call->function_name) != 0 ||
+                ei_decode_list_header(buff, &index, &count) != 0) {
+            free_buffer_call(call);
+            send_error(proc, "Failed to decode buffer call.");
+            return;
+        }
+        call->data = driver_alloc(sizeof(char*) * (count ? count : 1));
+        call->sizes = driver_alloc(sizeof(long) * (count ? count : 1));
+        for (int i = 0; i < count; i++) {
+            int type, size;
+            if (ei_get_type(buff, &index, &type, &size) != 0 || type != ERL_BINARY_EXT) {
+                free_buffer_call(call);
+                send_error(proc, "Failed to decode buffer %d of call.", i + 1);
+                return;
+            }
+            call->data[call->count] = driver_alloc(size ? size : 1);
+            ei_decode_binary(buff, &index, call->data[call->count], &call->sizes[call->count]);
+            call->count++;
+        }
+        if ((count > 0 && ei_decode_list_header(buff, &index, &count) != 0) ||
+                ei_decode_atom(buff, &index, free_buffers) != 0) {
+            free_buffer_call(call);
+            send_error(proc, "Failed to decode buffer call.");
+            return;
+        }
+        call->free_buffers = strcmp(free_buffers, "true") == 0;
 
-        DRV_DEBUG("Decoding args. Buff: %p. Index: %d", buff, index);
-        proc->current_args = decode_list(buff, &index);
+        const char* budget_error = NULL;
+        if (arity >= 5 && budget_decode(buff, &index, &call->fuel, &call->time_ms, &budget_error) != 0) {
+            free_buffer_call(call);
+            send_error(proc, "%s", budget_error);
+            return;
+        }
 
-        driver_async(proc->port, NULL, wasm_execute_function, proc, NULL);
-    } 
+        call->budget_seq = budget_arm(proc, call->time_ms);
+        threads_submit(proc, wasm_execute_buffer_call, call);
+    }
     // else if (strcmp(command, "indirect_call") == 0) {
     //     if (!proc->is_initialized) {
     //         send_error(proc, "Cannot run WASM indirect function as module not initialized.");
@@ -156,6 +527,10 @@ static void wasm_driver_output(ErlDrvData raw, char *buff, ErlDrvSizeT bufflen)
             DRV_DEBUG("Decoding import response from Erlang...");
             proc->current_import->result_terms = decode_list(buff, &index);
             proc->current_import->error_message = NULL;
+            // Memory writes that the import made, applied before it returns.
+            if (arity >= 3 && prefetch_apply_writes(proc, buff, &index) != 0) {
+                proc->current_import->error_message = "Invalid memory writes in import response.";
+            }
 
             // Signal that the response is ready
             drv_signal(
@@ -189,6 +564,7 @@ static void wasm_driver_output(ErlDrvData raw, char *buff, ErlDrvSizeT bufflen)
         DRV_DEBUG("Memory location to write to: %p", ptr+memory_data);
 
         memcpy(memory_data + ptr, wasm_binary, size_bytes);
+        stats_memory(proc, 0, size_bytes);
         DRV_DEBUG("Write complete");
 
         ErlDrvTermData* msg = driver_alloc(sizeof(ErlDrvTermData) * 2);
@@ -205,32 +581,136 @@ static void wasm_driver_output(ErlDrvData raw, char *buff, ErlDrvSizeT bufflen)
         long size_l = (long)size;
         long memory_size = get_memory_size(proc);
         DRV_DEBUG("Read received. Ptr: %ld. Size: %ld. Memory size: %ld", ptr, size_l, memory_size);
-        if(ptr + size_l > memory_size) {
+        if(ptr < 0 || size_l < 0 || ptr + size_l > memory_size) {
             DRV_DEBUG("Read request out of bounds.");
             send_error(proc, "Read request out of bounds");
             return;
         }
         byte_t* memory_data = wasm_memory_data(get_memory(proc));
         DRV_DEBUG("Memory location to read from: %p", memory_data + ptr);
-        
-        char* out_binary = driver_alloc(size_l);
-        memcpy(out_binary, memory_data + ptr, size_l);
+
+        // Copy once into a refcounted driver binary, which the emulator
+        // references directly rather than copying again.
+        ErlDrvBinary* out_binary = driver_alloc_binary(size_l);
+        memcpy(out_binary->orig_bytes, memory_data + ptr, size_l);
+        stats_memory(proc, size_l, 0);
 
         DRV_DEBUG("Read complete. Binary: %p", out_binary);
 
-        ErlDrvTermData* msg = driver_alloc(sizeof(ErlDrvTermData) * 7);
-        int msg_index = 0;
-        msg[msg_index++] = ERL_DRV_ATOM;
-        msg[msg_index++] = atom_execution_result;
-        msg[msg_index++] = ERL_DRV_BUF2BINARY;
-        msg[msg_index++] = (ErlDrvTermData)out_binary;
-        msg[msg_index++] = size_l;
-        msg[msg_index++] = ERL_DRV_TUPLE;
-        msg[msg_index++] = 2;
-        
-        int msg_res = erl_drv_output_term(proc->port_term, msg, msg_index);
+        ErlDrvTermData msg[] = {
+            ERL_DRV_ATOM, atom_execution_result,
+            ERL_DRV_BINARY, (ErlDrvTermData)out_binary, size_l, 0,
+            ERL_DRV_TUPLE, 2
+        };
+        int msg_res = erl_drv_output_term(proc->port_term, msg, sizeof(msg) / sizeof(msg[0]));
+        // The message now holds its own reference to the binary.
+        driver_free_binary(out_binary);
         DRV_DEBUG("Read response sent: %d", msg_res);
     }
+    else if (strcmp(command, "snapshot") == 0) {
+        DRV_DEBUG("Snapshot received");
+        // The copy of the memory can take a while, and the memory must not
+        // change as it is taken, so the snapshot runs as a job.
+        threads_submit(proc, snapshot_job, proc);
+    }
+    else if (strcmp(command, "read_snapshot") == 0) {
+        DRV_DEBUG("Read snapshot received");
+        long ptr, size;
+        ei_decode_tuple_header(buff, &index, &arity);
+        ei_decode_long(buff, &index, &ptr);
+        ei_decode_long(buff, &index, &size);
+        if (!proc->snapshot) {
+            send_error(proc, "No snapshot taken");
+            return;
+        }
+        if (ptr < 0 || size < 0 || ptr + size > proc->snapshot->orig_size) {
+            DRV_DEBUG("Snapshot read request out of bounds.");
+            send_error(proc, "Read request out of bounds");
+            return;
+        }
+        // Sub-binary of the snapshot: no copy is made, and the snapshot buffer
+        // is kept alive for as long as any of the returned binaries are.
+        ErlDrvTermData msg[] = {
+            ERL_DRV_ATOM, atom_execution_result,
+            ERL_DRV_BINARY, (ErlDrvTermData)proc->snapshot, size, ptr,
+            ERL_DRV_TUPLE, 2
+        };
+        erl_drv_output_term(proc->port_term, msg, sizeof(msg) / sizeof(msg[0]));
+    }
+    else if (strcmp(command, "release_snapshot") == 0) {
+        DRV_DEBUG("Release snapshot received");
+        if (proc->snapshot) {
+            driver_free_binary(proc->snapshot);
+            proc->snapshot = NULL;
+        }
+        ErlDrvTermData msg[] = { ERL_DRV_ATOM, atom_ok };
+        erl_drv_output_term(proc->port_term, msg, 2);
+    }
+    else if (strcmp(command, "checkpoint") == 0 || strcmp(command, "serialize_delta") == 0) {
+        DRV_DEBUG("%s received", command);
+        // Both scan the whole memory, which must not change as they do, so
+        // they run as jobs.
+        DirtyReq* req = driver_alloc(sizeof(DirtyReq));
+        req->proc = proc;
+        req->kind = strcmp(command, "checkpoint") == 0 ? HB_DIRTY_CHECKPOINT : HB_DIRTY_SERIALIZE;
+        req->delta = NULL;
+        req->delta_len = 0;
+        threads_submit(proc, dirty_job, req);
+    }
+    else if (strcmp(command, "make_template") == 0 || strcmp(command, "apply_template") == 0) {
+        DRV_DEBUG("%s received", command);
+        TemplateReq* req = driver_alloc(sizeof(TemplateReq));
+        req->proc = proc;
+        req->id = 0;
+        if (strcmp(command, "apply_template") == 0) {
+            ei_decode_tuple_header(buff, &index, &arity);
+            if (ei_decode_long(buff, &index, &req->id) != 0 || req->id <= 0) {
+                driver_free(req);
+                send_error(proc, "Malformed template ID");
+                return;
+            }
+        }
+        // The memory must not change under the instance's calls (or be read
+        // while one writes it), so templates are made and applied by a job.
+        threads_submit(proc, template_job, req);
+    }
+    else if (strcmp(command, "release_template") == 0) {
+        DRV_DEBUG("Release template received");
+        long id;
+        ei_decode_tuple_header(buff, &index, &arity);
+        ei_decode_long(buff, &index, &id);
+        if (template_release(id) != 0) {
+            send_error(proc, "Unknown template: %ld", id);
+            return;
+        }
+        ErlDrvTermData msg[] = { ERL_DRV_ATOM, atom_ok };
+        erl_drv_output_term(proc->port_term, msg, 2);
+    }
+    else if (strcmp(command, "restore_file") == 0) {
+        DRV_DEBUG("Restore file received");
+        int type, path_size;
+        long path_len;
+        RestoreReq* req = driver_alloc(sizeof(RestoreReq));
+        req->proc = proc;
+        ei_decode_tuple_header(buff, &index, &arity);
+        if (ei_get_type(buff, &index, &type, &path_size) != 0 || type != ERL_BINARY_EXT ||
+                path_size >= (int)sizeof(req->path) ||
+                ei_decode_binary(buff, &index, req->path, &path_len) != 0) {
+            driver_free(req);
+            send_error(proc, "Malformed snapshot path");
+            return;
+        }
+        req->path[path_len] = '\0';
+        // Reading the file in can take a while, and the memory must not
+        // change under the instance's calls, so the restore runs as a job.
+        threads_submit(proc, restore_file_job, req);
+    }
+    else if (strcmp(command, "seed_random") == 0) {
+        DRV_DEBUG("Seed random received");
+        // Restores from a serialized memory reset the native `random_get'
+        // once the memory is written, in order with the writes' calls.
+        threads_submit(proc, wasi_seed_random_job, proc);
+    }
     else if (strcmp(command, "size") == 0) {
         DRV_DEBUG("Size received");
         long size = get_memory_size(proc);
@@ -246,12 +726,202 @@ static void wasm_driver_output(ErlDrvData raw, char *buff, ErlDrvSizeT bufflen)
         msg[msg_index++] = 2;
         erl_drv_output_term(proc->port_term, msg, msg_index);
     }
+    else if (strcmp(command, "module_cache_info") == 0) {
+        long hits, misses, entries;
+        module_cache_stats(&hits, &misses, &entries);
+        DRV_DEBUG("Module cache info: hits=%ld, misses=%ld, entries=%ld", hits, misses, entries);
+
+        ErlDrvTermData msg[] = {
+            ERL_DRV_ATOM, atom_execution_result,
+            ERL_DRV_INT, hits,
+            ERL_DRV_INT, misses,
+            ERL_DRV_INT, entries,
+            ERL_DRV_TUPLE, 3,
+            ERL_DRV_TUPLE, 2
+        };
+        erl_drv_output_term(proc->port_term, msg, sizeof(msg) / sizeof(msg[0]));
+    }
     else {
         DRV_DEBUG("Unknown command: %s", command);
         send_error(proc, "Unknown command");
     }
 }
 
+static void wasm_driver_outputv(ErlDrvData raw, ErlIOVec* ev) {
+    Proc* proc = (Proc*)raw;
+    unsigned char header[HB_OPCODE_HEADER_SIZE];
+    ErlDrvSizeT header_len = ev->size < HB_OPCODE_HEADER_SIZE ? ev->size : HB_OPCODE_HEADER_SIZE;
+    copy_from_iovec(ev, 0, (char*)header, header_len);
+
+    if (header_len == 0 ||
+            (header[0] != HB_OPCODE_WRITE && header[0] != HB_OPCODE_APPLY_DELTA)) {
+        // A `term_to_binary' encoded command: flatten it for the normal path.
+        char* buff = driver_alloc(ev->size);
+        driver_vec_to_buf(ev, buff, ev->size);
+        wasm_driver_output(raw, buff, ev->size);
+        driver_free(buff);
+        return;
+    }
+
+    if (header_len < HB_OPCODE_HEADER_SIZE) {
+        send_error(proc, "Malformed write header");
+        return;
+    }
+    uint64_t ptr = decode_uint64_be(header + 1);
+    uint64_t size = decode_uint64_be(header + 9);
+    DRV_DEBUG("Vectored write received. Ptr: %lu. Bytes: %lu", (unsigned long)ptr, (unsigned long)size);
+    if (size != ev->size - HB_OPCODE_HEADER_SIZE) {
+        send_error(proc, "Write length %lu does not match payload of %lu bytes",
+            (unsigned long)size, (unsigned long)(ev->size - HB_OPCODE_HEADER_SIZE));
+        return;
+    }
+    if (header[0] == HB_OPCODE_APPLY_DELTA) {
+        // Applying a delta may grow the memory, so it runs as a job, with a
+        // copy of the delta.
+        DirtyReq* req = driver_alloc(sizeof(DirtyReq));
+        req->proc = proc;
+        req->kind = HB_DIRTY_APPLY;
+        req->delta = driver_alloc(size ? size : 1);
+        req->delta_len = size;
+        copy_from_iovec(ev, HB_OPCODE_HEADER_SIZE, (char*)req->delta, size);
+        threads_submit(proc, dirty_job, req);
+        return;
+    }
+    // As for control writes: an import handler may write the memory while its
+    // call waits (holding the lock), but otherwise the instance must be idle.
+    ImportResponse* import = __atomic_load_n(&proc->current_import, __ATOMIC_ACQUIRE);
+    int locked = 0;
+    if (!import || __atomic_load_n(&import->ready, __ATOMIC_ACQUIRE)) {
+        if (erl_drv_mutex_trylock(proc->is_running) != 0) {
+            send_error(proc, "Instance is busy");
+            return;
+        }
+        locked = 1;
+    }
+    uint64_t memory_size = (uint64_t)get_memory_size(proc);
+    if (ptr > memory_size || size > memory_size - ptr) {
+        if (locked) drv_unlock(proc->is_running);
+        DRV_DEBUG("Write request out of bounds.");
+        send_error(proc, "Write request out of bounds");
+        return;
+    }
+    if (size > 0) {
+        // Copy each fragment (typically refc binaries) straight into memory.
+        byte_t* memory_data = wasm_memory_data(get_memory(proc));
+        copy_from_iovec(ev, HB_OPCODE_HEADER_SIZE, memory_data + ptr, size);
+        stats_memory(proc, 0, size);
+    }
+    if (locked) drv_unlock(proc->is_running);
+    DRV_DEBUG("Vectored write complete");
+
+    ErlDrvTermData msg[] = { ERL_DRV_ATOM, atom_ok };
+    erl_drv_output_term(proc->port_term, msg, 2);
+}
+
+// Build the reply to a control operation: a status byte and a payload.
+static ErlDrvSSizeT control_reply(char** rbuf, int status, const void* data, size_t len) {
+    ErlDrvBinary* reply = driver_alloc_binary(len + 1);
+    reply->orig_bytes[0] = (char)status;
+    if (len > 0) memcpy(reply->orig_bytes + 1, data, len);
+    *rbuf = (char*)reply;
+    return (ErlDrvSSizeT)(len + 1);
+}
+
+static ErlDrvSSizeT control_error(char** rbuf, const char* message) {
+    DRV_DEBUG("Control operation failed: %s", message);
+    return control_reply(rbuf, HB_CONTROL_ERROR, message, strlen(message));
+}
+
+// Run a synchronous memory operation against the instance, on the scheduler
+// thread. This is only safe while nothing else can touch the instance's
+// memory: either the instance is idle, or its call is blocked waiting for an
+// import response. Import responses arrive through this port's callbacks,
+// which are serialized with this one, so a blocked call can not resume while
+// the operation runs. While a call is executing, the operation fails instead.
+static ErlDrvSSizeT wasm_driver_control(ErlDrvData raw, unsigned int command,
+        char* buf, ErlDrvSizeT len, char** rbuf, ErlDrvSizeT rlen) {
+    Proc* proc = (Proc*)raw;
+    if (command == HB_CONTROL_STATS || command == HB_CONTROL_TRACE) {
+        // Counters and trace rings can be read whatever the instance is doing.
+        ei_x_buff x;
+        ei_x_new_with_version(&x);
+        if (command == HB_CONTROL_STATS) stats_encode(proc, &x);
+        else trace_encode(&x);
+        ErlDrvSSizeT res = control_reply(rbuf, HB_CONTROL_OK, x.buff, x.index);
+        ei_x_free(&x);
+        return res;
+    }
+    if (command == HB_CONTROL_CANCEL) {
+        // Only commands that have not started can be cancelled, so this does
+        // not need the instance either.
+        if (len != 8) return control_error(rbuf, "Malformed cancel operation");
+        unsigned char cancelled = (unsigned char)queue_cancel(proc, decode_uint64_be((unsigned char*)buf));
+        return control_reply(rbuf, HB_CONTROL_OK, &cancelled, 1);
+    }
+    ImportResponse* import = __atomic_load_n(&proc->current_import, __ATOMIC_ACQUIRE);
+    int locked = 0;
+    if (!import || __atomic_load_n(&import->ready, __ATOMIC_ACQUIRE)) {
+        if (erl_drv_mutex_trylock(proc->is_running) != 0) {
+            return control_error(rbuf, "Instance is busy");
+        }
+        locked = 1;
+    }
+
+    ErlDrvSSizeT res;
+    wasm_memory_t* memory = proc->is_initialized ? get_memory(proc) : NULL;
+    uint64_t memory_size = memory ? (uint64_t)get_memory_size(proc) : 0;
+    if (!memory) {
+        res = control_error(rbuf, "Instance has no memory");
+    }
+    else if (command == HB_CONTROL_SIZE) {
+        unsigned char size[8];
+        encode_uint64_be(size, memory_size);
+        res = control_reply(rbuf, HB_CONTROL_OK, size, sizeof(size));
+    }
+    else if (command == HB_CONTROL_READ && len == 16) {
+        uint64_t ptr = decode_uint64_be((unsigned char*)buf);
+        uint64_t size = decode_uint64_be((unsigned char*)buf + 8);
+        DRV_DEBUG("Control read. Ptr: %lu. Size: %lu", (unsigned long)ptr, (unsigned long)size);
+        if (!memory_in_bounds(ptr, size, memory_size)) {
+            res = control_error(rbuf, "Read request out of bounds");
+        } else {
+            res = control_reply(rbuf, HB_CONTROL_OK, wasm_memory_data(memory) + ptr, size);
+            stats_memory(proc, size, 0);
+        }
+    }
+    else if (command == HB_CONTROL_WRITE && len >= 8) {
+        uint64_t ptr = decode_uint64_be((unsigned char*)buf);
+        uint64_t size = len - 8;
+        DRV_DEBUG("Control write. Ptr: %lu. Size: %lu", (unsigned long)ptr, (unsigned long)size);
+        if (!memory_in_bounds(ptr, size, memory_size)) {
+            res = control_error(rbuf, "Write request out of bounds");
+        } else {
+            if (size > 0) memcpy(wasm_memory_data(memory) + ptr, buf + 8, size);
+            stats_memory(proc, 0, size);
+            res = control_reply(rbuf, HB_CONTROL_OK, NULL, 0);
+        }
+    }
+    else {
+        res = control_error(rbuf, "Unknown or malformed control operation");
+    }
+
+    if (locked) drv_unlock(proc->is_running);
+    return res;
+}
+
+static void wasm_driver_timeout(ErlDrvData raw) {
+    budget_timeout((Proc*)raw);
+}
+
+static void wasm_driver_finish(void) {
+    DRV_DEBUG("Unloading WASM driver");
+    threads_destroy();
+    stats_destroy();
+    trace_destroy();
+    template_destroy();
+    module_cache_destroy();
+}
+
 static ErlDrvEntry wasm_driver_entry = {
     NULL,
     wasm_driver_start,
@@ -260,11 +930,11 @@ static ErlDrvEntry wasm_driver_entry = {
     NULL,
     NULL,
     "hb_beamr",
+    wasm_driver_finish,
     NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
+    wasm_driver_control,
+    wasm_driver_timeout,
+    wasm_driver_outputv,
     NULL,
     NULL,
     NULL,
@@ -281,7 +951,17 @@ static ErlDrvEntry wasm_driver_entry = {
 DRIVER_INIT(wasm_driver) {
     atom_ok = driver_mk_atom("ok");
     atom_error = driver_mk_atom("error");
+    atom_undefined = driver_mk_atom("undefined");
+    atom_budget_exhausted = driver_mk_atom("budget_exhausted");
+    atom_reply = driver_mk_atom("reply");
     atom_import = driver_mk_atom("import");
     atom_execution_result = driver_mk_atom("execution_result");
+    if (module_cache_init() != 0) {
+        return NULL;
+    }
+    template_init();
+    if (threads_init() != 0 || stats_init() != 0 || trace_init() != 0) {
+        return NULL;
+    }
     return &wasm_driver_entry;
 }
\ No newline at end of file
@@ -0,0 +1,161 @@
+#include "include/hb_budget.h"
+#include "include/hb_driver.h"
+#include "include/hb_logging.h"
+#include <limits.h>
+
+extern ErlDrvTermData atom_error;
+extern ErlDrvTermData atom_budget_exhausted;
+
+// Instruction metering is only present in runtimes built with
+// WAMR_BUILD_INSTRUCTION_METERING (from WAMR 2.3.0). The symbol is weak, so
+// that the driver still loads against a runtime without it.
+extern void wasm_runtime_set_instruction_count_limit(wasm_exec_env_t exec_env, int instructions)
+    __attribute__((weak));
+
+// The exceptions raised by WAMR for an exhausted instruction limit, and for an
+// instance stopped by wasm_runtime_terminate.
+#define HB_INSTRUCTION_LIMIT_EXCEPTION "instruction limit exceeded"
+#define HB_TERMINATED_EXCEPTION "terminated by user"
+
+static void set_instruction_limit(Proc* proc, int limit) {
+    if (!wasm_runtime_set_instruction_count_limit) return;
+    wasm_exec_env_t exec_env = wasm_runtime_get_exec_env_singleton(proc->instance->inst_comm_rt);
+    if (exec_env) wasm_runtime_set_instruction_count_limit(exec_env, limit);
+}
+
+void budget_init(Proc* proc) {
+    memset(&proc->budget, 0, sizeof(CallBudget));
+    proc->budget.lock = erl_drv_mutex_create("wasm_budget_mutex");
+}
+
+void budget_destroy(Proc* proc) {
+    driver_cancel_timer(proc->port);
+    erl_drv_mutex_destroy(proc->budget.lock);
+}
+
+int budget_decode(const char* buff, int* index, long* fuel_out, long* time_ms_out, const char** error) {
+    int arity;
+    long fuel, time_ms;
+    if (ei_decode_tuple_header(buff, index, &arity) != 0 || arity != 2 ||
+            ei_decode_long(buff, index, &fuel) != 0 ||
+            ei_decode_long(buff, index, &time_ms) != 0 ||
+            fuel < 0 || time_ms < 0) {
+        *error = "Invalid call budget.";
+        return -1;
+    }
+    if (fuel > 0 && !wasm_runtime_set_instruction_count_limit) {
+        *error = "Instruction budgets are not supported by this build of the runtime.";
+        return -1;
+    }
+    *fuel_out = fuel > INT_MAX ? INT_MAX : fuel;
+    *time_ms_out = time_ms;
+    return 0;
+}
+
+static ErlDrvTime now_ms(void) {
+    return erl_drv_monotonic_time(ERL_DRV_MSEC);
+}
+
+// Sets the port's timer to go off at `at', unless it will already go off
+// sooner. Only called from the driver's callbacks, as the timer can only be
+// set from a scheduler thread.
+static void set_timer(Proc* proc, ErlDrvTime at, ErlDrvTime now) {
+    CallBudget* budget = &proc->budget;
+    if (budget->timer_at != 0 && budget->timer_at <= at) return;
+    budget->timer_at = at;
+    driver_set_timer(proc->port, at > now ? (unsigned long)(at - now) : 0);
+}
+
+unsigned long budget_arm(Proc* proc, long time_ms) {
+    CallBudget* budget = &proc->budget;
+    ErlDrvTime now = now_ms();
+    drv_lock(budget->lock);
+    unsigned long seq = ++budget->seq;
+    if (time_ms > 0) {
+        if (budget->pending == 0 || time_ms < budget->pending_ms) budget->pending_ms = time_ms;
+        budget->pending++;
+    }
+    drv_unlock(budget->lock);
+    // The call's time only starts when it does, but it can not start before
+    // now: the timer goes off by the earliest it can run out, and is set
+    // again for the rest of its time then (see budget_timeout).
+    if (time_ms > 0) set_timer(proc, now + time_ms, now);
+    return seq;
+}
+
+void budget_cancel(Proc* proc, long time_ms) {
+    if (time_ms <= 0) return;
+    CallBudget* budget = &proc->budget;
+    drv_lock(budget->lock);
+    budget->pending--;
+    drv_unlock(budget->lock);
+}
+
+void budget_enter(Proc* proc, long fuel, long time_ms, unsigned long seq) {
+    CallBudget* budget = &proc->budget;
+    budget->fuel = fuel;
+    drv_lock(budget->lock);
+    budget->running_seq = seq;
+    if (time_ms > 0) {
+        budget->running_deadline = now_ms() + time_ms;
+        budget->pending--;
+    }
+    drv_unlock(budget->lock);
+    if (budget->fuel > 0) set_instruction_limit(proc, (int)budget->fuel);
+}
+
+int budget_leave(Proc* proc, const char* error) {
+    CallBudget* budget = &proc->budget;
+    drv_lock(budget->lock);
+    int expired = budget->expired_seq == budget->running_seq;
+    budget->running_seq = 0;
+    budget->running_deadline = 0;
+    drv_unlock(budget->lock);
+    if (budget->fuel > 0) set_instruction_limit(proc, -1);
+
+    int exhausted = error &&
+        ((expired && strstr(error, HB_TERMINATED_EXCEPTION)) ||
+         (budget->fuel > 0 && strstr(error, HB_INSTRUCTION_LIMIT_EXCEPTION)));
+    // The instance stays usable: clear the exception that stopped the call,
+    // or that the timer raised just as it returned.
+    if (exhausted || expired) {
+        wasm_runtime_clear_exception(proc->instance->inst_comm_rt);
+    }
+    return exhausted ? HB_BUDGET_EXHAUSTED : 0;
+}
+
+void budget_timeout(Proc* proc) {
+    CallBudget* budget = &proc->budget;
+    ErlDrvTime now = now_ms();
+    ErlDrvTime next = 0;
+    budget->timer_at = 0;
+    drv_lock(budget->lock);
+    if (budget->running_deadline != 0) {
+        if (budget->running_deadline <= now) {
+            DRV_DEBUG("Call %lu ran out of time", budget->running_seq);
+            budget->expired_seq = budget->running_seq;
+            budget->running_deadline = 0;
+            // Holding the lock, the call can not finish (and another start)
+            // until its termination has been requested.
+            wasm_runtime_terminate(proc->instance->inst_comm_rt);
+        } else {
+            next = budget->running_deadline;
+        }
+    }
+    // Calls that have not started yet can run out no sooner than their time
+    // limit from now.
+    if (budget->pending > 0 && (next == 0 || now + budget->pending_ms < next)) {
+        next = now + budget->pending_ms;
+    }
+    drv_unlock(budget->lock);
+    if (next != 0) set_timer(proc, next, now);
+}
+
+void budget_send_exhausted(ErlDrvTermData port_term, uint64_t request_id) {
+    ErlDrvTermData msg[] = {
+        ERL_DRV_ATOM, atom_error,
+        ERL_DRV_ATOM, atom_budget_exhausted,
+        ERL_DRV_TUPLE, 2
+    };
+    drv_output_reply(port_term, request_id, msg, sizeof(msg) / sizeof(msg[0]));
+}
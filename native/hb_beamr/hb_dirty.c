@@ -0,0 +1,219 @@
+#include "include/hb_dirty.h"
+#include "include/hb_driver.h"
+#include "include/hb_helpers.h"
+#include "include/hb_logging.h"
+#include "include/hb_threads.h"
+#include <stdio.h>
+
+extern ErlDrvTermData atom_ok;
+extern ErlDrvTermData atom_execution_result;
+
+// Whether a page differs from its copy at the last checkpoint. Pages beyond
+// the end of the memory at the checkpoint always do.
+static int page_changed(Proc* proc, const byte_t* memory_data, long page) {
+    if (page >= proc->checkpoint_pages) return 1;
+    return memcmp(memory_data + page * HB_DIRTY_PAGE_SIZE,
+        proc->checkpoint + page * HB_DIRTY_PAGE_SIZE, HB_DIRTY_PAGE_SIZE) != 0;
+}
+
+static void encode_uint32_be(unsigned char* buf, uint32_t value) {
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+static uint32_t decode_uint32_be(const unsigned char* buf) {
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+        ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
+
+long dirty_checkpoint(Proc* proc) {
+    long pages = get_memory_size(proc) / HB_DIRTY_PAGE_SIZE;
+    byte_t* copy = driver_alloc(pages ? pages * HB_DIRTY_PAGE_SIZE : 1);
+    if (!copy) return -1;
+    if (pages > 0) {
+        memcpy(copy, wasm_memory_data(get_memory(proc)), pages * HB_DIRTY_PAGE_SIZE);
+    }
+    dirty_free(proc);
+    proc->checkpoint = copy;
+    proc->checkpoint_pages = pages;
+    DRV_DEBUG("Checkpoint taken of %ld pages", pages);
+    return pages;
+}
+
+ErlDrvBinary* dirty_serialize_delta(Proc* proc, long* page_count) {
+    long memory_size = get_memory_size(proc);
+    long pages = memory_size / HB_DIRTY_PAGE_SIZE;
+    byte_t* memory_data = pages > 0 ? wasm_memory_data(get_memory(proc)) : NULL;
+    unsigned char* changed = driver_alloc(pages ? pages : 1);
+    if (!changed) return NULL;
+
+    // First pass: compare every page with its copy and count those that changed.
+    long dirty = 0;
+    for (long i = 0; i < pages; i++) {
+        changed[i] = page_changed(proc, memory_data, i);
+        dirty += changed[i];
+    }
+
+    // The memory only grows, so the copy is extended to cover new pages.
+    byte_t* copy = proc->checkpoint;
+    if (!copy || pages > proc->checkpoint_pages) {
+        copy = driver_realloc(proc->checkpoint, pages ? pages * HB_DIRTY_PAGE_SIZE : 1);
+        if (!copy) {
+            driver_free(changed);
+            return NULL;
+        }
+        proc->checkpoint = copy;
+    }
+
+    ErlDrvBinary* delta = driver_alloc_binary(
+        HB_DELTA_HEADER_SIZE + dirty * (HB_DELTA_PAGE_HEADER_SIZE + HB_DIRTY_PAGE_SIZE));
+    if (!delta) {
+        driver_free(changed);
+        return NULL;
+    }
+    unsigned char* out = (unsigned char*)delta->orig_bytes;
+    encode_uint64_be(out, (uint64_t)memory_size);
+    encode_uint32_be(out + 8, HB_DIRTY_PAGE_SIZE);
+    encode_uint32_be(out + 12, (uint32_t)dirty);
+    out += HB_DELTA_HEADER_SIZE;
+
+    // Second pass: copy out the changed pages, and into the checkpoint.
+    for (long i = 0; i < pages; i++) {
+        if (!changed[i]) continue;
+        const byte_t* page = memory_data + i * HB_DIRTY_PAGE_SIZE;
+        encode_uint32_be(out, (uint32_t)i);
+        memcpy(out + HB_DELTA_PAGE_HEADER_SIZE, page, HB_DIRTY_PAGE_SIZE);
+        memcpy(copy + i * HB_DIRTY_PAGE_SIZE, page, HB_DIRTY_PAGE_SIZE);
+        out += HB_DELTA_PAGE_HEADER_SIZE + HB_DIRTY_PAGE_SIZE;
+    }
+
+    driver_free(changed);
+    proc->checkpoint_pages = pages;
+    *page_count = dirty;
+    DRV_DEBUG("Delta serialized. Dirty pages: %ld of %ld", dirty, pages);
+    return delta;
+}
+
+int dirty_apply_delta(Proc* proc, const unsigned char* delta, size_t len, char* error, size_t error_len) {
+    if (len < HB_DELTA_HEADER_SIZE) {
+        snprintf(error, error_len, "Malformed delta header");
+        return -1;
+    }
+    uint64_t target_size = decode_uint64_be(delta);
+    uint32_t page_size = decode_uint32_be(delta + 8);
+    uint32_t count = decode_uint32_be(delta + 12);
+    if (page_size != HB_DIRTY_PAGE_SIZE) {
+        snprintf(error, error_len, "Unsupported delta page size: %u", page_size);
+        return -1;
+    }
+    if (len != HB_DELTA_HEADER_SIZE + (size_t)count * (HB_DELTA_PAGE_HEADER_SIZE + HB_DIRTY_PAGE_SIZE)) {
+        snprintf(error, error_len, "Delta length does not match its page count");
+        return -1;
+    }
+
+    wasm_memory_t* memory = get_memory(proc);
+    if (!memory) {
+        snprintf(error, error_len, "Instance has no memory");
+        return -1;
+    }
+    // Check every page against the size the memory will have, before growing
+    // it or writing anything.
+    uint64_t memory_size = (uint64_t)get_memory_size(proc);
+    wasm_memory_pages_t grow = target_size > memory_size ?
+        (wasm_memory_pages_t)((target_size - memory_size + 65535) / 65536) : 0;
+    uint64_t new_size = memory_size + (uint64_t)grow * 65536;
+    const unsigned char* pages = delta + HB_DELTA_HEADER_SIZE;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t page = decode_uint32_be(pages + (size_t)i * (HB_DELTA_PAGE_HEADER_SIZE + HB_DIRTY_PAGE_SIZE));
+        if ((page + 1) * HB_DIRTY_PAGE_SIZE > new_size) {
+            snprintf(error, error_len, "Delta page %lu out of bounds", (unsigned long)page);
+            return -1;
+        }
+    }
+    if (grow > 0) {
+        DRV_DEBUG("Growing memory by %u pages to apply delta", grow);
+        if (!wasm_memory_grow(memory, grow)) {
+            snprintf(error, error_len, "Failed to grow memory to %lu bytes", (unsigned long)target_size);
+            return -1;
+        }
+    }
+
+    byte_t* memory_data = wasm_memory_data(memory);
+    for (uint32_t i = 0; i < count; i++) {
+        const unsigned char* entry = pages + (size_t)i * (HB_DELTA_PAGE_HEADER_SIZE + HB_DIRTY_PAGE_SIZE);
+        uint64_t page = decode_uint32_be(entry);
+        byte_t* dest = memory_data + page * HB_DIRTY_PAGE_SIZE;
+        memcpy(dest, entry + HB_DELTA_PAGE_HEADER_SIZE, HB_DIRTY_PAGE_SIZE);
+        if ((long)page < proc->checkpoint_pages) {
+            memcpy(proc->checkpoint + page * HB_DIRTY_PAGE_SIZE, dest, HB_DIRTY_PAGE_SIZE);
+        }
+    }
+    DRV_DEBUG("Applied delta of %u pages", count);
+    return 0;
+}
+
+void dirty_job(void* raw) {
+    DirtyReq* req = (DirtyReq*)raw;
+    Proc* proc = req->proc;
+    threads_enter_runtime();
+    char error[256];
+    long pages = 0;
+    ErlDrvBinary* delta = NULL;
+    int res = 0;
+    drv_lock(proc->is_running);
+    switch (req->kind) {
+        case HB_DIRTY_CHECKPOINT:
+            pages = dirty_checkpoint(proc);
+            if (pages < 0) {
+                snprintf(error, sizeof(error), "Failed to allocate checkpoint");
+                res = -1;
+            }
+            break;
+        case HB_DIRTY_SERIALIZE:
+            delta = dirty_serialize_delta(proc, &pages);
+            if (!delta) {
+                snprintf(error, sizeof(error), "Failed to allocate delta");
+                res = -1;
+            }
+            break;
+        default:
+            res = dirty_apply_delta(proc, req->delta, req->delta_len, error, sizeof(error));
+            break;
+    }
+    drv_unlock(proc->is_running);
+    int kind = req->kind;
+    if (req->delta) driver_free(req->delta);
+    driver_free(req);
+
+    if (res != 0) {
+        send_error(proc, "%s", error);
+    } else if (kind == HB_DIRTY_CHECKPOINT) {
+        ErlDrvTermData msg[] = {
+            ERL_DRV_ATOM, atom_execution_result,
+            ERL_DRV_INT, pages,
+            ERL_DRV_TUPLE, 2
+        };
+        erl_drv_output_term(proc->port_term, msg, sizeof(msg) / sizeof(msg[0]));
+    } else if (kind == HB_DIRTY_SERIALIZE) {
+        ErlDrvTermData msg[] = {
+            ERL_DRV_ATOM, atom_execution_result,
+            ERL_DRV_BINARY, (ErlDrvTermData)delta, delta->orig_size, 0,
+            ERL_DRV_TUPLE, 2
+        };
+        erl_drv_output_term(proc->port_term, msg, sizeof(msg) / sizeof(msg[0]));
+        driver_free_binary(delta);
+    } else {
+        ErlDrvTermData msg[] = { ERL_DRV_ATOM, atom_ok };
+        erl_drv_output_term(proc->port_term, msg, 2);
+    }
+}
+
+void dirty_free(Proc* proc) {
+    if (proc->checkpoint) {
+        driver_free(proc->checkpoint);
+    }
+    proc->checkpoint = NULL;
+    proc->checkpoint_pages = 0;
+}
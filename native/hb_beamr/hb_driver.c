@@ -2,6 +2,8 @@
 #include "include/hb_logging.h"
 #include "include/hb_helpers.h"
 
+extern ErlDrvTermData atom_reply;
+
 
 void drv_lock(ErlDrvMutex* mutex) {
     DRV_DEBUG("Locking: %s", erl_drv_mutex_name(mutex));
@@ -19,7 +21,8 @@ void drv_unlock(ErlDrvMutex* mutex) {
 void drv_signal(ErlDrvMutex* mut, ErlDrvCond* cond, int* ready) {
     DRV_DEBUG("Signaling: %s. Pre-signal ready state: %d", erl_drv_cond_name(cond), *ready);
     drv_lock(mut);
-    *ready = 1;
+    // Released atomically, as drv_spin_wait may read it without the lock.
+    __atomic_store_n(ready, 1, __ATOMIC_RELEASE);
     erl_drv_cond_signal(cond);
     drv_unlock(mut);
     DRV_DEBUG("Signaled: %s. Post-signal ready state: %d", erl_drv_cond_name(cond), *ready);
@@ -29,7 +32,7 @@ void drv_wait(ErlDrvMutex* mut, ErlDrvCond* cond, int* ready) {
     DRV_DEBUG("Started to wait: %s. Ready: %d", erl_drv_cond_name(cond), *ready);
     DRV_DEBUG("Mutex: %s", erl_drv_mutex_name(mut));
     drv_lock(mut);
-    while (!*ready) {
+    while (!__atomic_load_n(ready, __ATOMIC_ACQUIRE)) {
         DRV_DEBUG("Waiting: %s", erl_drv_cond_name(cond));
         erl_drv_cond_wait(cond, mut);
         DRV_DEBUG("Woke up: Ready: %d", *ready);
@@ -37,3 +40,47 @@ void drv_wait(ErlDrvMutex* mut, ErlDrvCond* cond, int* ready) {
     drv_unlock(mut);
     DRV_DEBUG("Finish waiting: %s", erl_drv_cond_name(cond));
 }
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+void drv_spin_wait(ErlDrvMutex* mut, ErlDrvCond* cond, int* ready, int spins) {
+    for (int i = 0; i < spins; i++) {
+        if (__atomic_load_n(ready, __ATOMIC_ACQUIRE)) {
+            DRV_DEBUG("Ready after %d spins: %s", i, erl_drv_cond_name(cond));
+            return;
+        }
+        cpu_relax();
+    }
+    drv_wait(mut, cond, ready);
+}
+
+// The number of terms that a tagged reply can be built with on the stack.
+#define HB_REPLY_STACK_TERMS 128
+
+int drv_output_reply(ErlDrvTermData port_term, uint64_t request_id, ErlDrvTermData* msg, int len) {
+    if (request_id == 0) {
+        return erl_drv_output_term(port_term, msg, len);
+    }
+    // {reply, RequestId, Message}: the message's terms, after the tag and ID.
+    ErlDrvTermData stack_terms[HB_REPLY_STACK_TERMS];
+    int terms = len + 6;
+    ErlDrvTermData* tagged = terms <= HB_REPLY_STACK_TERMS ?
+        stack_terms : driver_alloc(sizeof(ErlDrvTermData) * terms);
+    ErlDrvUInt64 id = request_id;
+    tagged[0] = ERL_DRV_ATOM;
+    tagged[1] = atom_reply;
+    tagged[2] = ERL_DRV_UINT64;
+    tagged[3] = (ErlDrvTermData)&id;
+    memcpy(&tagged[4], msg, sizeof(ErlDrvTermData) * len);
+    tagged[len + 4] = ERL_DRV_TUPLE;
+    tagged[len + 5] = 3;
+    int res = erl_drv_output_term(port_term, tagged, terms);
+    if (tagged != stack_terms) driver_free(tagged);
+    return res;
+}
@@ -8,6 +8,7 @@ const char* get_wasm_type_name(wasm_valkind_t kind) {
         case WASM_I64: return "i64";
         case WASM_F32: return "f32";
         case WASM_F64: return "f64";
+        case WASM_V128: return "v128";
         default: return "unknown";
     }
 }
@@ -24,7 +25,11 @@ const char* wasm_externtype_to_kind_string(const wasm_externtype_t* type) {
 
 // Helper function to convert wasm_valtype_t to char
 char wasm_valtype_kind_to_char(const wasm_valtype_t* valtype) {
-    switch (wasm_valtype_kind(valtype)) {
+    return wasm_valkind_to_char(wasm_valtype_kind(valtype));
+}
+
+char wasm_valkind_to_char(wasm_valkind_t kind) {
+    switch (kind) {
         case WASM_I32: return 'i';
         case WASM_I64: return 'I';
         case WASM_F32: return 'f';
@@ -107,9 +112,13 @@ ei_term* decode_list(char* buff, int* index) {
     }
     DRV_DEBUG("Decoded header. Arity: %d", arity);
 
-    ei_term* res = driver_alloc(sizeof(ei_term) * arity);
+    ei_term* res = driver_alloc(sizeof(ei_term) * (arity ? arity : 1));
 
-    if(type == ERL_LIST_EXT) {
+    if(type == ERL_NIL_EXT) {
+        // An empty list: consume it so that the index points at the next term.
+        ei_decode_list_header(buff, index, &arity);
+    }
+    else if(type == ERL_LIST_EXT) {
         //DRV_DEBUG("Decoding list");
         ei_decode_list_header(buff, index, &arity);
         //DRV_DEBUG("Decoded list header. Arity: %d", arity);
@@ -117,6 +126,8 @@ ei_term* decode_list(char* buff, int* index) {
             ei_decode_ei_term(buff, index, &res[i]);
             DRV_DEBUG("Decoded term (assuming int) %d: %d", i, res[i].value.i_val);
         }
+        // Skip the list's tail, leaving the index after the whole list.
+        ei_skip_term(buff, index);
     }
     else if(type == ERL_STRING_EXT) {
         //DRV_DEBUG("Decoding list encoded as string");
@@ -166,40 +177,250 @@ int get_function_sig(const wasm_externtype_t* type, char* type_str) {
     return 0;
 }
 
-wasm_func_t* get_exported_function(Proc* proc, const char* target_name) {
-    wasm_extern_vec_t exports;
-    wasm_instance_exports(proc->instance, &exports);
-    wasm_exporttype_vec_t export_types;
-    wasm_module_exports(proc->module, &export_types);
-    wasm_func_t* func = NULL;
-
-    for (size_t i = 0; i < exports.size; ++i) {
-        wasm_extern_t* ext = exports.data[i];
-        if (wasm_extern_kind(ext) == WASM_EXTERN_FUNC) {
-            const wasm_name_t* exp_name = wasm_exporttype_name(export_types.data[i]);
-            if (exp_name && exp_name->size == strlen(target_name) + 1 && 
-                strncmp(exp_name->data, target_name, exp_name->size - 1) == 0) {
-                func = wasm_extern_as_func(ext);
-                break;
-            }
+// FNV-1a hash of an export name
+static size_t export_name_hash(const char* name, size_t len) {
+    size_t hash = (size_t)14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= (size_t)1099511628211ULL;
+    }
+    return hash;
+}
+
+static wasm_valkind_t* valtype_kinds(const wasm_valtype_vec_t* types) {
+    if (types->size == 0) return NULL;
+    wasm_valkind_t* kinds = driver_alloc(sizeof(wasm_valkind_t) * types->size);
+    for (size_t i = 0; i < types->size; i++) {
+        kinds[i] = wasm_valtype_kind(types->data[i]);
+    }
+    return kinds;
+}
+
+void build_export_table(Proc* proc, const wasm_exporttype_vec_t* export_types, wasm_extern_vec_t* externs) {
+    ExportTable* table = &proc->exports;
+    memset(table, 0, sizeof(ExportTable));
+    table->externs = *externs;
+
+    size_t func_count = 0;
+    for (size_t i = 0; i < externs->size; i++) {
+        if (wasm_extern_kind(externs->data[i]) == WASM_EXTERN_FUNC) func_count++;
+    }
+
+    // Size the hash table to at least twice the number of functions, so that
+    // probe sequences stay short.
+    size_t slot_count = 4;
+    while (slot_count < func_count * 2) slot_count <<= 1;
+    table->slot_mask = slot_count - 1;
+    table->slots = driver_alloc(sizeof(size_t) * slot_count);
+    memset(table->slots, 0, sizeof(size_t) * slot_count);
+    table->entries = driver_alloc(sizeof(ExportEntry) * (func_count ? func_count : 1));
+
+    for (size_t i = 0; i < externs->size; i++) {
+        wasm_extern_t* ext = externs->data[i];
+        if (wasm_extern_kind(ext) == WASM_EXTERN_MEMORY) {
+            if (!table->memory) table->memory = wasm_extern_as_memory(ext);
+            continue;
         }
+        if (wasm_extern_kind(ext) != WASM_EXTERN_FUNC) continue;
+
+        const wasm_name_t* exp_name = wasm_exporttype_name(export_types->data[i]);
+        ExportEntry* entry = &table->entries[table->count];
+        // Export names are NUL-terminated, and their size includes the NUL.
+        entry->name_len = exp_name->size - 1;
+        entry->name = driver_alloc(entry->name_len + 1);
+        memcpy(entry->name, exp_name->data, entry->name_len);
+        entry->name[entry->name_len] = '\0';
+        entry->func = wasm_extern_as_func(ext);
+
+        const wasm_functype_t* func_type = wasm_func_type(entry->func);
+        const wasm_valtype_vec_t* params = wasm_functype_params(func_type);
+        const wasm_valtype_vec_t* results = wasm_functype_results(func_type);
+        entry->param_count = params->size;
+        entry->param_kinds = valtype_kinds(params);
+        entry->result_count = results->size;
+        entry->result_kinds = valtype_kinds(results);
+        entry->has_v128 = 0;
+        for (size_t k = 0; k < entry->param_count; k++) {
+            if (entry->param_kinds[k] == WASM_V128) entry->has_v128 = 1;
+        }
+        for (size_t k = 0; k < entry->result_count; k++) {
+            if (entry->result_kinds[k] == WASM_V128) entry->has_v128 = 1;
+        }
+
+        size_t slot = export_name_hash(entry->name, entry->name_len) & table->slot_mask;
+        while (table->slots[slot]) slot = (slot + 1) & table->slot_mask;
+        table->slots[slot] = ++table->count;
+        DRV_DEBUG("Indexed export: %s. Slot: %zu", entry->name, slot);
     }
+}
 
-    return func;
+void free_export_table(Proc* proc) {
+    ExportTable* table = &proc->exports;
+    for (size_t i = 0; i < table->count; i++) {
+        driver_free(table->entries[i].name);
+        if (table->entries[i].param_kinds) driver_free(table->entries[i].param_kinds);
+        if (table->entries[i].result_kinds) driver_free(table->entries[i].result_kinds);
+    }
+    if (table->entries) driver_free(table->entries);
+    if (table->slots) driver_free(table->slots);
+    wasm_extern_vec_delete(&table->externs);
+    memset(table, 0, sizeof(ExportTable));
 }
 
-wasm_memory_t* get_memory(Proc* proc) {
-    wasm_extern_vec_t exports;
-    wasm_instance_exports(proc->instance, &exports);
-    for (size_t i = 0; i < exports.size; i++) {
-        if (wasm_extern_kind(exports.data[i]) == WASM_EXTERN_MEMORY) {
-            return wasm_extern_as_memory(exports.data[i]);
+ExportEntry* lookup_export(Proc* proc, const char* target_name) {
+    ExportTable* table = &proc->exports;
+    if (!table->slots) return NULL;
+    size_t len = strlen(target_name);
+    size_t slot = export_name_hash(target_name, len) & table->slot_mask;
+    while (table->slots[slot]) {
+        ExportEntry* entry = &table->entries[table->slots[slot] - 1];
+        if (entry->name_len == len && memcmp(entry->name, target_name, len) == 0) {
+            return entry;
         }
+        slot = (slot + 1) & table->slot_mask;
     }
     return NULL;
 }
 
+wasm_func_t* get_exported_function(Proc* proc, const char* target_name) {
+    ExportEntry* entry = lookup_export(proc, target_name);
+    return entry ? entry->func : NULL;
+}
+
+wasm_memory_t* get_memory(Proc* proc) {
+    return proc->exports.memory;
+}
+
 long get_memory_size(Proc* proc) {
     wasm_memory_t* memory = get_memory(proc);
+    if (!memory) return 0;
     return wasm_memory_size(memory) * 65536;
 }
+void copy_from_iovec(ErlIOVec* ev, ErlDrvSizeT skip, char* dest, ErlDrvSizeT len) {
+    for (int i = 0; i < ev->vsize && len > 0; i++) {
+        ErlDrvSizeT iov_len = ev->iov[i].iov_len;
+        if (skip >= iov_len) {
+            skip -= iov_len;
+            continue;
+        }
+        ErlDrvSizeT chunk = iov_len - skip;
+        if (chunk > len) chunk = len;
+        memcpy(dest, ev->iov[i].iov_base + skip, chunk);
+        dest += chunk;
+        len -= chunk;
+        skip = 0;
+    }
+}
+
+uint64_t decode_uint64_be(const unsigned char* buf) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+void encode_uint64_be(unsigned char* buf, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        buf[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+uint64_t wasm_arg_u64(const wasm_val_vec_t* args, size_t i) {
+    return args->data[i].kind == WASM_I64 ?
+        (uint64_t)args->data[i].of.i64 : (uint64_t)(uint32_t)args->data[i].of.i32;
+}
+
+uint64_t load_uint_le(const byte_t* at, size_t width) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < width; i++) value |= (uint64_t)(unsigned char)at[i] << (8 * i);
+    return value;
+}
+
+void store_uint_le(byte_t* at, size_t width, uint64_t value) {
+    for (size_t i = 0; i < width; i++) at[i] = (value >> (8 * i)) & 0xff;
+}
+
+int memory_in_bounds(uint64_t ptr, uint64_t len, uint64_t memory_size) {
+    return ptr <= memory_size && len <= memory_size - ptr;
+}
+
+int export_signature(const ExportEntry* export, char* out, size_t len) {
+    if (export->param_count + export->result_count + 3 > len) return -1;
+    size_t offset = 0;
+    out[offset++] = '(';
+    for (size_t i = 0; i < export->param_count; i++) {
+        out[offset++] = wasm_valkind_to_char(export->param_kinds[i]);
+    }
+    out[offset++] = ')';
+    for (size_t i = 0; i < export->result_count; i++) {
+        out[offset++] = wasm_valkind_to_char(export->result_kinds[i]);
+    }
+    out[offset] = '\0';
+    return 0;
+}
+
+size_t packed_width(wasm_valkind_t kind) {
+    switch (kind) {
+        case WASM_I32: case WASM_F32: return 4;
+        case WASM_I64: case WASM_F64: return 8;
+        case WASM_V128: return 16;
+        default: return 0;
+    }
+}
+
+size_t packed_size(const wasm_valkind_t* kinds, size_t count) {
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t width = packed_width(kinds[i]);
+        if (width == 0) return 0;
+        size += width;
+    }
+    return size;
+}
+
+int unpack_wasm_vals(wasm_val_vec_t* vals, const byte_t* data, size_t size) {
+    size_t offset = 0;
+    for (size_t i = 0; i < vals->size; i++) {
+        size_t width = packed_width(vals->data[i].kind);
+        // The C API's values can not hold v128s: see packed_size.
+        if (width == 0 || width > 8 || offset + width > size) return -1;
+        uint64_t bits = load_uint_le(data + offset, width);
+        switch (vals->data[i].kind) {
+            case WASM_I32: vals->data[i].of.i32 = (int32_t)(uint32_t)bits; break;
+            case WASM_I64: vals->data[i].of.i64 = (int64_t)bits; break;
+            case WASM_F32: {
+                uint32_t narrow = (uint32_t)bits;
+                memcpy(&vals->data[i].of.f32, &narrow, 4);
+                break;
+            }
+            default: memcpy(&vals->data[i].of.f64, &bits, 8); break;
+        }
+        offset += width;
+    }
+    return offset == size ? 0 : -1;
+}
+
+size_t pack_wasm_vals(const wasm_val_vec_t* vals, byte_t* out) {
+    size_t offset = 0;
+    for (size_t i = 0; i < vals->size; i++) {
+        size_t width = packed_width(vals->data[i].kind);
+        uint64_t bits = 0;
+        switch (vals->data[i].kind) {
+            case WASM_I32: bits = (uint32_t)vals->data[i].of.i32; break;
+            case WASM_I64: bits = (uint64_t)vals->data[i].of.i64; break;
+            case WASM_F32: {
+                uint32_t narrow;
+                memcpy(&narrow, &vals->data[i].of.f32, 4);
+                bits = narrow;
+                break;
+            }
+            case WASM_F64: memcpy(&bits, &vals->data[i].of.f64, 8); break;
+            default: continue;
+        }
+        store_uint_le(out + offset, width, bits);
+        offset += width;
+    }
+    return offset;
+}
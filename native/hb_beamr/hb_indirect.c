@@ -0,0 +1,165 @@
+#include "include/hb_indirect.h"
+#include "include/hb_helpers.h"
+#include "include/hb_logging.h"
+#include <stdio.h>
+
+// Reading the function at an index of a table without allocating needs the
+// runtime's table API (from WAMR 1.3.0). The symbols are weak, so that the
+// driver still loads against a runtime without it. Entries are then resolved
+// again on every call.
+extern bool wasm_runtime_get_export_table_inst(const wasm_module_inst_t module_inst,
+    const char* name, wasm_table_inst_t* table_inst) __attribute__((weak));
+extern wasm_function_inst_t wasm_table_get_func_inst(const wasm_module_inst_t module_inst,
+    const wasm_table_inst_t* table_inst, uint32_t idx) __attribute__((weak));
+
+static wasm_trap_t* indirect_trap(Proc* proc, const char* message) {
+    wasm_name_t name;
+    wasm_name_new_from_string_nt(&name, message);
+    wasm_trap_t* trap = wasm_trap_new(proc->store, &name);
+    wasm_name_delete(&name);
+    return trap;
+}
+
+// The number of 32-bit cells a value takes in the argv of an indirect call.
+static int value_cells(wasm_valkind_t kind) {
+    return (kind == WASM_I64 || kind == WASM_F64) ? 2 : 1;
+}
+
+// Resolve the type of the function at an index of the table into its cache
+// entry. Returns an error message on failure.
+static const char* resolve_entry(Proc* proc, uint32_t index, IndirectEntry* entry) {
+    wasm_ref_t* ref = wasm_table_get(proc->indirect_func_table, index);
+    const wasm_func_t* func = ref ? wasm_ref_as_func(ref) : NULL;
+    if (!func) {
+        if (ref) wasm_ref_delete(ref);
+        return "indirect call to an uninitialized element";
+    }
+    wasm_functype_t* type = wasm_func_type(func);
+    const wasm_valtype_vec_t* params = wasm_functype_params(type);
+    const wasm_valtype_vec_t* results = wasm_functype_results(type);
+    const char* error = NULL;
+    if (params->size > HB_INDIRECT_MAX_PARAMS || results->size > HB_INDIRECT_MAX_RESULTS) {
+        error = "indirect call to a function with too many parameters or results";
+    } else {
+        entry->param_count = (uint8_t)params->size;
+        entry->result_count = (uint8_t)results->size;
+        for (size_t i = 0; i < params->size; i++) {
+            entry->params[i] = wasm_valtype_kind(params->data[i]);
+        }
+        for (size_t i = 0; i < results->size; i++) {
+            entry->results[i] = wasm_valtype_kind(results->data[i]);
+        }
+        entry->resolved = 1;
+        DRV_DEBUG("Resolved indirect function %u: %zu params, %zu results",
+            index, params->size, results->size);
+    }
+    wasm_functype_delete(type);
+    wasm_ref_delete(ref);
+    return error;
+}
+
+// The function at an index of the table, as the runtime holds it. NULL if it
+// can not be read without allocating, or the element is uninitialized.
+static wasm_function_inst_t table_func(Proc* proc, uint32_t index) {
+    if (!proc->has_indirect_table_inst) return NULL;
+    return wasm_table_get_func_inst(proc->instance->inst_comm_rt, &proc->indirect_table_inst, index);
+}
+
+// Find the cache entry of a table index, resolving it on first use. The cache
+// is sized to the table, and starts afresh if the table grows. Elements can be
+// replaced (by `table.set' or `table.init', for example), so an entry is only
+// used while the table still holds the function it was resolved from.
+static const char* lookup_entry(Proc* proc, uint32_t index, IndirectEntry** out) {
+    if (!proc->indirect_func_table) return "indirect call without a function table";
+    size_t size = wasm_table_size(proc->indirect_func_table);
+    if (index >= size) return "indirect call index out of bounds";
+    if (proc->indirect_cache_size != size) {
+        indirect_cache_free(proc);
+        proc->indirect_cache = driver_alloc(sizeof(IndirectEntry) * size);
+        memset(proc->indirect_cache, 0, sizeof(IndirectEntry) * size);
+        proc->indirect_cache_size = size;
+        // The runtime's view of the table records its size, so it is taken
+        // again whenever the table grows.
+        proc->has_indirect_table_inst =
+            wasm_runtime_get_export_table_inst && wasm_table_get_func_inst &&
+            wasm_runtime_get_export_table_inst(proc->instance->inst_comm_rt,
+                "__indirect_function_table", &proc->indirect_table_inst);
+    }
+    IndirectEntry* entry = &proc->indirect_cache[index];
+    wasm_function_inst_t func = table_func(proc, index);
+    if (!entry->resolved || !func || entry->func != func) {
+        entry->resolved = 0;
+        const char* error = resolve_entry(proc, index, entry);
+        if (error) return error;
+        entry->func = func;
+    }
+    *out = entry;
+    return NULL;
+}
+
+wasm_trap_t* indirect_call(Proc* proc, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    // The index is an i64 in wasm64 modules, and an i32 otherwise.
+    if (args->size < 1 || (args->data[0].kind != WASM_I32 && args->data[0].kind != WASM_I64)) {
+        return indirect_trap(proc, "indirect call without a function index");
+    }
+    uint64_t index64 = wasm_arg_u64(args, 0);
+    if (index64 > UINT32_MAX) return indirect_trap(proc, "indirect call index out of bounds");
+    uint32_t index = (uint32_t)index64;
+    IndirectEntry* entry;
+    const char* error = lookup_entry(proc, index, &entry);
+    if (error) return indirect_trap(proc, error);
+
+    // The import must pass (and expect) exactly the values of the function.
+    int matches = args->size - 1 == entry->param_count && results->size == entry->result_count;
+    for (size_t i = 0; matches && i < entry->param_count; i++) {
+        matches = args->data[i + 1].kind == entry->params[i];
+    }
+    for (size_t i = 0; matches && i < entry->result_count; i++) {
+        matches = results->data[i].kind == entry->results[i];
+    }
+    if (!matches) return indirect_trap(proc, "indirect call signature mismatch");
+
+    // Arguments go in, and results come out, as 32-bit cells in one buffer.
+    // It is on the stack, so nested invocations each have their own.
+    uint32_t argv[2 * (HB_INDIRECT_MAX_PARAMS > HB_INDIRECT_MAX_RESULTS ?
+        HB_INDIRECT_MAX_PARAMS : HB_INDIRECT_MAX_RESULTS)];
+    uint32_t cells = 0;
+    for (size_t i = 0; i < entry->param_count; i++) {
+        const wasm_val_t* arg = &args->data[i + 1];
+        if (value_cells(arg->kind) == 2) {
+            memcpy(&argv[cells], &arg->of.i64, sizeof(uint64_t));
+        } else {
+            memcpy(&argv[cells], &arg->of.i32, sizeof(uint32_t));
+        }
+        cells += value_cells(arg->kind);
+    }
+
+    if (!wasm_runtime_call_indirect(proc->exec_env, index, cells, argv)) {
+        const char* exception = wasm_runtime_get_exception(wasm_runtime_get_module_inst(proc->exec_env));
+        char message[256];
+        snprintf(message, sizeof(message), "%s", exception ? exception : "indirect call failed");
+        DRV_DEBUG("Indirect call %u failed: %s", index, message);
+        // The trap carries the exception back to the caller instead.
+        wasm_runtime_clear_exception(wasm_runtime_get_module_inst(proc->exec_env));
+        return indirect_trap(proc, message);
+    }
+
+    cells = 0;
+    for (size_t i = 0; i < entry->result_count; i++) {
+        wasm_val_t* result = &results->data[i];
+        if (value_cells(result->kind) == 2) {
+            memcpy(&result->of.i64, &argv[cells], sizeof(uint64_t));
+        } else {
+            memcpy(&result->of.i32, &argv[cells], sizeof(uint32_t));
+        }
+        cells += value_cells(result->kind);
+    }
+    return NULL;
+}
+
+void indirect_cache_free(Proc* proc) {
+    if (proc->indirect_cache) driver_free(proc->indirect_cache);
+    proc->indirect_cache = NULL;
+    proc->indirect_cache_size = 0;
+    proc->has_indirect_table_inst = 0;
+}
@@ -1,4 +1,5 @@
 #include "include/hb_logging.h"
+#include "include/hb_driver.h"
 
 extern ErlDrvTermData atom_error;
 
@@ -14,9 +15,7 @@ void beamr_print(int print, const char* file, int line, const char* format, ...)
     va_end(args);
 }
 
-void send_error(Proc* proc, const char* message_fmt, ...) {
-    va_list args;
-    va_start(args, message_fmt);
+static void vsend_error(Proc* proc, uint64_t request_id, const char* message_fmt, va_list args) {
     char* message = driver_alloc(256);
     vsnprintf(message, 256, message_fmt, args);
     DRV_DEBUG("Sending error message: %s", message);
@@ -30,7 +29,23 @@ void send_error(Proc* proc, const char* message_fmt, ...) {
     msg[msg_index++] = ERL_DRV_TUPLE;
     msg[msg_index++] = 2;
 
-    int msg_res = erl_drv_output_term(proc->port_term, msg, msg_index);
+    int msg_res = drv_output_reply(proc->port_term, request_id, msg, msg_index);
     DRV_DEBUG("Sent error message. Res: %d", msg_res);
+    // The message has been copied into the receiver's heap.
+    driver_free(msg);
+    driver_free(message);
+}
+
+void send_error(Proc* proc, const char* message_fmt, ...) {
+    va_list args;
+    va_start(args, message_fmt);
+    vsend_error(proc, 0, message_fmt, args);
     va_end(args);
-}
\ No newline at end of file
+}
+
+void send_reply_error(Proc* proc, uint64_t request_id, const char* message_fmt, ...) {
+    va_list args;
+    va_start(args, message_fmt);
+    vsend_error(proc, request_id, message_fmt, args);
+    va_end(args);
+}
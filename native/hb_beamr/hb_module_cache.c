@@ -0,0 +1,167 @@
+#include "include/hb_module_cache.h"
+#include "include/hb_logging.h"
+#include "include/hb_driver.h"
+
+wasm_engine_t* hb_engine = NULL;
+
+static ModuleCacheEntry* cache_head = NULL;
+static ErlDrvMutex* cache_lock = NULL;
+static ErlDrvCond* cache_loaded = NULL;
+static unsigned long cache_release_seq = 0;
+static long cache_hits = 0;
+static long cache_misses = 0;
+static long cache_entries = 0;
+
+int module_cache_init(void) {
+    hb_engine = wasm_engine_new();
+    if (!hb_engine) {
+        DRV_PRINT("Failed to create shared WASM engine");
+        return -1;
+    }
+#if HB_DEBUG==1
+    wasm_runtime_set_log_level(WASM_LOG_LEVEL_VERBOSE);
+#else
+    wasm_runtime_set_log_level(WASM_LOG_LEVEL_ERROR);
+#endif
+    cache_lock = erl_drv_mutex_create("wasm_module_cache_mutex");
+    cache_loaded = erl_drv_cond_create("wasm_module_cache_cond");
+    DRV_DEBUG("Created shared engine: %p", hb_engine);
+    return 0;
+}
+
+static void delete_entry(ModuleCacheEntry* entry) {
+    DRV_DEBUG("Deleting cached module: %p", entry->module);
+    // The module is owned by the entry's store, so this releases it.
+    if (entry->store) {
+        wasm_store_delete(entry->store);
+    }
+    wasm_byte_vec_delete(&entry->binary);
+    driver_free(entry);
+}
+
+static void unlink_entry(ModuleCacheEntry* entry) {
+    ModuleCacheEntry** link = &cache_head;
+    while (*link && *link != entry) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = entry->next;
+        cache_entries--;
+    }
+}
+
+void module_cache_destroy(void) {
+    DRV_DEBUG("Destroying module cache");
+    ModuleCacheEntry* entry = cache_head;
+    while (entry) {
+        ModuleCacheEntry* next = entry->next;
+        delete_entry(entry);
+        entry = next;
+    }
+    cache_head = NULL;
+    cache_entries = 0;
+    erl_drv_cond_destroy(cache_loaded);
+    erl_drv_mutex_destroy(cache_lock);
+    wasm_engine_delete(hb_engine);
+    hb_engine = NULL;
+}
+
+static ModuleCacheEntry* find_entry(const unsigned char* hash) {
+    for (ModuleCacheEntry* entry = cache_head; entry; entry = entry->next) {
+        if (memcmp(entry->hash, hash, sizeof(entry->hash)) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+ModuleCacheEntry* module_cache_acquire(const unsigned char* hash, const void* binary, long size, int* hit) {
+    drv_lock(cache_lock);
+    ModuleCacheEntry* entry = find_entry(hash);
+    while (entry && entry->loading) {
+        // Another instance is compiling this image. Wait for it to finish.
+        DRV_DEBUG("Waiting for module to finish compiling: %p", entry);
+        erl_drv_cond_wait(cache_loaded, cache_lock);
+        entry = find_entry(hash);
+    }
+    if (entry) {
+        entry->refs++;
+        cache_hits++;
+        *hit = 1;
+        DRV_DEBUG("Module cache hit: %p. Refs: %ld", entry->module, entry->refs);
+        drv_unlock(cache_lock);
+        return entry;
+    }
+
+    // Insert a placeholder so that concurrent starts of the same image wait
+    // for this compilation rather than duplicating it.
+    entry = driver_alloc(sizeof(ModuleCacheEntry));
+    memset(entry, 0, sizeof(ModuleCacheEntry));
+    memcpy(entry->hash, hash, sizeof(entry->hash));
+    entry->loading = 1;
+    entry->refs = 1;
+    entry->next = cache_head;
+    cache_head = entry;
+    cache_entries++;
+    cache_misses++;
+    *hit = 0;
+    drv_unlock(cache_lock);
+
+    DRV_DEBUG("Module cache miss. Compiling %ld bytes", size);
+    entry->store = wasm_store_new(hb_engine);
+    wasm_byte_vec_new(&entry->binary, size, (const wasm_byte_t*)binary);
+    entry->module = wasm_module_new(entry->store, &entry->binary);
+
+    drv_lock(cache_lock);
+    entry->loading = 0;
+    if (!entry->module) {
+        DRV_DEBUG("Failed to compile module");
+        unlink_entry(entry);
+        erl_drv_cond_broadcast(cache_loaded);
+        drv_unlock(cache_lock);
+        delete_entry(entry);
+        return NULL;
+    }
+    erl_drv_cond_broadcast(cache_loaded);
+    drv_unlock(cache_lock);
+    DRV_DEBUG("Module compiled and cached: %p", entry->module);
+    return entry;
+}
+
+void module_cache_release(ModuleCacheEntry* entry) {
+    if (!entry) return;
+    ModuleCacheEntry* evict = NULL;
+    drv_lock(cache_lock);
+    entry->refs--;
+    entry->last_release = ++cache_release_seq;
+    DRV_DEBUG("Released cached module: %p. Refs: %ld", entry->module, entry->refs);
+    if (entry->refs == 0) {
+        // Find the least recently released idle entry, if we are holding
+        // more idle modules than allowed.
+        long idle = 0;
+        for (ModuleCacheEntry* e = cache_head; e; e = e->next) {
+            if (e->refs > 0 || e->loading) continue;
+            idle++;
+            if (!evict || e->last_release < evict->last_release) {
+                evict = e;
+            }
+        }
+        if (idle > HB_MODULE_CACHE_IDLE_MAX) {
+            unlink_entry(evict);
+        } else {
+            evict = NULL;
+        }
+    }
+    drv_unlock(cache_lock);
+    if (evict) {
+        delete_entry(evict);
+    }
+}
+
+void module_cache_stats(long* hits, long* misses, long* entries) {
+    drv_lock(cache_lock);
+    *hits = cache_hits;
+    *misses = cache_misses;
+    *entries = cache_entries;
+    drv_unlock(cache_lock);
+}
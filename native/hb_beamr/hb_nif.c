@@ -0,0 +1,671 @@
+#include "include/hb_nif.h"
+#include <stdio.h>
+
+static ErlNifResourceType* instance_type = NULL;
+static wasm_engine_t* engine = NULL;
+
+// Instances whose resources are gone, but whose threads are still to be
+// joined, for the reaper thread.
+static ErlNifMutex* reap_lock = NULL;
+static ErlNifCond* reap_cond = NULL;
+static NifInstance* reap_head = NULL;
+static ErlNifTid reaper_tid;
+
+static ERL_NIF_TERM atom_ok;
+static ERL_NIF_TERM atom_error;
+static ERL_NIF_TERM atom_import;
+static ERL_NIF_TERM atom_abort;
+
+// The options of `hb_beamr:start/3' that the NIF backend applies.
+typedef struct {
+    uint32_t stack_size;
+    uint32_t heap_size;
+    uint32_t initial_pages;
+    uint32_t max_pages;
+} NifOpts;
+
+static ERL_NIF_TERM make_error(ErlNifEnv* env, const char* message) {
+    return enif_make_tuple2(env, atom_error, enif_make_string(env, message, ERL_NIF_LATIN1));
+}
+
+// Threads that run WASM need the runtime's thread environment, as the pool
+// threads of the driver do. Dirty schedulers keep theirs for their lifetime.
+static void enter_runtime(void) {
+    if (!wasm_runtime_thread_env_inited()) wasm_runtime_init_thread_env();
+}
+
+static char valkind_to_char(wasm_valkind_t kind) {
+    switch (kind) {
+        case WASM_I32: return 'i';
+        case WASM_I64: return 'I';
+        case WASM_F32: return 'f';
+        case WASM_F64: return 'F';
+        default: return 0;
+    }
+}
+
+// Writes the signature of a function type in the driver's notation. Fails for
+// types with values that can not be passed as terms.
+static int function_sig(const wasm_functype_t* type, char* out, size_t len) {
+    const wasm_valtype_vec_t* params = wasm_functype_params(type);
+    const wasm_valtype_vec_t* results = wasm_functype_results(type);
+    if (params->size + results->size + 3 > len) return 0;
+    size_t offset = 0;
+    out[offset++] = '(';
+    for (size_t i = 0; i < params->size; i++) {
+        if (!(out[offset++] = valkind_to_char(wasm_valtype_kind(params->data[i])))) return 0;
+    }
+    out[offset++] = ')';
+    for (size_t i = 0; i < results->size; i++) {
+        if (!(out[offset++] = valkind_to_char(wasm_valtype_kind(results->data[i])))) return 0;
+    }
+    out[offset] = '\0';
+    return 1;
+}
+
+static const char* extern_kind_name(const wasm_externtype_t* type) {
+    switch (wasm_externtype_kind(type)) {
+        case WASM_EXTERN_FUNC: return "func";
+        case WASM_EXTERN_GLOBAL: return "global";
+        case WASM_EXTERN_TABLE: return "table";
+        case WASM_EXTERN_MEMORY: return "memory";
+        default: return "unknown";
+    }
+}
+
+static ERL_NIF_TERM val_to_term(ErlNifEnv* env, const wasm_val_t* val) {
+    switch (val->kind) {
+        case WASM_I32: return enif_make_int(env, val->of.i32);
+        case WASM_I64: return enif_make_int64(env, val->of.i64);
+        case WASM_F32: return enif_make_double(env, val->of.f32);
+        case WASM_F64: return enif_make_double(env, val->of.f64);
+        default: return enif_make_atom(env, "undefined");
+    }
+}
+
+static ERL_NIF_TERM vals_to_list(ErlNifEnv* env, const wasm_val_vec_t* vals) {
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    for (size_t i = vals->size; i > 0; i--) {
+        list = enif_make_list_cell(env, val_to_term(env, &vals->data[i - 1]), list);
+    }
+    return list;
+}
+
+// Converts a number to a value of the kind already set. Integers are accepted
+// for floats, and the full unsigned range for integers, as the driver does.
+static int term_to_val(ErlNifEnv* env, ERL_NIF_TERM term, wasm_val_t* val) {
+    ErlNifSInt64 i;
+    ErlNifUInt64 u;
+    double d;
+    switch (val->kind) {
+        case WASM_I32:
+        case WASM_I64:
+            if (!enif_get_int64(env, term, &i)) {
+                if (!enif_get_uint64(env, term, &u)) return 0;
+                i = (ErlNifSInt64)u;
+            }
+            if (val->kind == WASM_I32) val->of.i32 = (int32_t)i;
+            else val->of.i64 = i;
+            return 1;
+        case WASM_F32:
+        case WASM_F64:
+            if (!enif_get_double(env, term, &d)) {
+                if (!enif_get_int64(env, term, &i)) return 0;
+                d = (double)i;
+            }
+            if (val->kind == WASM_F32) val->of.f32 = (float)d;
+            else val->of.f64 = d;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Converts a list of numbers to values of the given types, into a vector of
+// at least as many values.
+static int list_to_vals(ErlNifEnv* env, ERL_NIF_TERM list, const wasm_valtype_vec_t* types, wasm_val_vec_t* vals) {
+    unsigned len;
+    if (!enif_get_list_length(env, list, &len) || len != types->size || vals->size < types->size) return 0;
+    ERL_NIF_TERM head, tail = list;
+    for (size_t i = 0; enif_get_list_cell(env, tail, &head, &tail); i++) {
+        vals->data[i].kind = wasm_valtype_kind(types->data[i]);
+        if (!term_to_val(env, head, &vals->data[i])) return 0;
+    }
+    vals->num_elems = types->size;
+    return 1;
+}
+
+static void run_call(NifInstance* inst) {
+    wasm_trap_t* trap = wasm_func_call(inst->func, &inst->args, &inst->results);
+    inst->trapped = trap != NULL;
+    if (trap) {
+        wasm_message_t message;
+        wasm_trap_message(trap, &message);
+        snprintf(inst->error, sizeof(inst->error), "%.*s", (int)message.size, message.data);
+        wasm_byte_vec_delete(&message);
+        wasm_trap_delete(trap);
+    }
+}
+
+// The host function of every import: parks the call until Erlang resumes it.
+static wasm_trap_t* handle_import(void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    NifImport* import = (NifImport*)env;
+    NifInstance* inst = import->inst;
+    enif_mutex_lock(inst->lock);
+    inst->import = import;
+    inst->import_args = args;
+    inst->import_results = results;
+    inst->import_failed = 0;
+    inst->state = HB_NIF_IMPORT;
+    enif_cond_broadcast(inst->cond);
+    while (inst->state == HB_NIF_IMPORT) enif_cond_wait(inst->cond, inst->lock);
+    int failed = inst->import_failed;
+    inst->import = NULL;
+    inst->import_args = NULL;
+    inst->import_results = NULL;
+    enif_mutex_unlock(inst->lock);
+    if (!failed) return NULL;
+    wasm_message_t message;
+    wasm_name_new_from_string_nt(&message, "Import failed.");
+    wasm_trap_t* trap = wasm_trap_new(inst->store, &message);
+    wasm_byte_vec_delete(&message);
+    return trap;
+}
+
+// The execution thread of an instance with imports: runs each call handed to
+// it, until the instance is stopped.
+static void* exec_loop(void* raw) {
+    NifInstance* inst = (NifInstance*)raw;
+    enter_runtime();
+    enif_mutex_lock(inst->lock);
+    while (1) {
+        while (inst->state != HB_NIF_RUNNING && !inst->stopping) enif_cond_wait(inst->cond, inst->lock);
+        if (inst->state != HB_NIF_RUNNING) break;
+        enif_mutex_unlock(inst->lock);
+        run_call(inst);
+        enif_mutex_lock(inst->lock);
+        inst->state = HB_NIF_DONE;
+        enif_cond_broadcast(inst->cond);
+    }
+    enif_mutex_unlock(inst->lock);
+    wasm_runtime_destroy_thread_env();
+    return NULL;
+}
+
+// Collects the outcome of a finished call. Called with the lock held.
+static ERL_NIF_TERM finish_call(ErlNifEnv* env, NifInstance* inst) {
+    ERL_NIF_TERM res = inst->trapped ?
+        make_error(env, inst->error) :
+        enif_make_tuple2(env, atom_ok, vals_to_list(env, &inst->results));
+    wasm_val_vec_delete(&inst->args);
+    wasm_val_vec_delete(&inst->results);
+    inst->func = NULL;
+    inst->state = HB_NIF_IDLE;
+    return res;
+}
+
+// Waits for the running call to finish or to reach an import, and returns
+// which. Called with the lock held, which it releases.
+static ERL_NIF_TERM await_call(ErlNifEnv* env, NifInstance* inst) {
+    while (inst->state == HB_NIF_RUNNING) enif_cond_wait(inst->cond, inst->lock);
+    ERL_NIF_TERM res;
+    if (inst->state == HB_NIF_IMPORT) {
+        NifImport* import = inst->import;
+        size_t sig_len = strlen(import->signature);
+        res = enif_make_tuple5(env,
+            atom_import,
+            enif_make_string(env, import->module_name, ERL_NIF_LATIN1),
+            enif_make_string(env, import->field_name, ERL_NIF_LATIN1),
+            vals_to_list(env, inst->import_args),
+            // Cut as the driver's import messages cut it.
+            enif_make_string_len(env, import->signature, sig_len - 1, ERL_NIF_LATIN1));
+    } else {
+        res = finish_call(env, inst);
+    }
+    enif_mutex_unlock(inst->lock);
+    return res;
+}
+
+// Stops an instance: a call parked at an import traps, and the execution
+// thread exits once it is idle.
+static void stop_instance(NifInstance* inst) {
+    enif_mutex_lock(inst->lock);
+    inst->stopping = 1;
+    if (inst->state == HB_NIF_IMPORT) {
+        inst->import_failed = 1;
+        inst->state = HB_NIF_RUNNING;
+    }
+    enif_cond_broadcast(inst->cond);
+    enif_mutex_unlock(inst->lock);
+}
+
+// Frees an instance whose thread, if any, has exited.
+static void free_instance(NifInstance* inst) {
+    enter_runtime();
+    if (inst->func) {
+        wasm_val_vec_delete(&inst->args);
+        wasm_val_vec_delete(&inst->results);
+    }
+    wasm_extern_vec_delete(&inst->exports);
+    if (inst->instance) wasm_instance_delete(inst->instance);
+    wasm_extern_vec_delete(&inst->import_externs);
+    if (inst->imports) enif_free(inst->imports);
+    wasm_importtype_vec_delete(&inst->import_types);
+    wasm_exporttype_vec_delete(&inst->export_types);
+    if (inst->module) wasm_module_delete(inst->module);
+    if (inst->store) wasm_store_delete(inst->store);
+    if (inst->cond) enif_cond_destroy(inst->cond);
+    if (inst->lock) enif_mutex_destroy(inst->lock);
+    enif_free(inst);
+}
+
+// Joins the threads of the instances handed to it, and frees them, for the
+// lifetime of the library.
+static void* reap_loop(void* raw) {
+    enif_mutex_lock(reap_lock);
+    while (1) {
+        while (!reap_head) enif_cond_wait(reap_cond, reap_lock);
+        NifInstance* inst = reap_head;
+        reap_head = inst->next;
+        enif_mutex_unlock(reap_lock);
+        enif_thread_join(inst->tid, NULL);
+        free_instance(inst);
+        enif_mutex_lock(reap_lock);
+    }
+    return NULL;
+}
+
+static void instance_dtor(ErlNifEnv* env, void* obj) {
+    NifInstance* inst = ((NifHandle*)obj)->inst;
+    if (!inst) return;
+    stop_instance(inst);
+    if (!inst->has_thread) {
+        // The last reference may be dropped on any scheduler.
+        free_instance(inst);
+        return;
+    }
+    // The thread may still be unwinding a call that was parked at an import,
+    // so it is not joined on the scheduler.
+    enif_mutex_lock(reap_lock);
+    inst->next = reap_head;
+    reap_head = inst;
+    enif_cond_broadcast(reap_cond);
+    enif_mutex_unlock(reap_lock);
+}
+
+static int get_instance(ErlNifEnv* env, ERL_NIF_TERM term, NifInstance** inst) {
+    NifHandle* handle;
+    if (!enif_get_resource(env, term, instance_type, (void**)&handle)) return 0;
+    *inst = handle->inst;
+    return 1;
+}
+
+static const char* decode_opts(ErlNifEnv* env, ERL_NIF_TERM list, NifOpts* opts) {
+    ERL_NIF_TERM head, tail = list;
+    while (enif_get_list_cell(env, tail, &head, &tail)) {
+        int arity;
+        const ERL_NIF_TERM* pair;
+        char key[32], value[32];
+        if (!enif_get_tuple(env, head, &arity, &pair) || arity != 2 ||
+                enif_get_atom(env, pair[0], key, sizeof(key), ERL_NIF_LATIN1) <= 0) {
+            return "Failed to decode instance options.";
+        }
+        if (strcmp(key, "engine") == 0 || strcmp(key, "bounds_checks") == 0) {
+            if (enif_get_atom(env, pair[1], value, sizeof(value), ERL_NIF_LATIN1) <= 0) {
+                return "Failed to decode instance options.";
+            }
+            if (strcmp(value, "default") != 0) {
+                return strcmp(key, "engine") == 0 ?
+                    "Engine selection is not supported by the NIF backend." :
+                    "Bounds check modes are not supported by the NIF backend.";
+            }
+        } else if (strcmp(key, "native_wasi") == 0) {
+            if (!enif_is_empty_list(env, pair[1])) {
+                return "Native WASI imports are not supported by the NIF backend.";
+            }
+        } else if (strcmp(key, "stack_size") == 0 || strcmp(key, "heap_size") == 0 ||
+                strcmp(key, "initial_pages") == 0 || strcmp(key, "max_pages") == 0) {
+            unsigned int n;
+            if (!enif_get_uint(env, pair[1], &n)) return "Failed to decode instance options.";
+            if (key[0] == 's') opts->stack_size = n;
+            else if (key[0] == 'h') opts->heap_size = n;
+            else if (key[0] == 'i') opts->initial_pages = n;
+            else opts->max_pages = n;
+        }
+        // Other options (such as the seed of the native WASI imports) have
+        // no effect on this backend.
+    }
+    return NULL;
+}
+
+// Loads and instantiates the module into the fresh instance of a resource.
+// On failure, the instance is left for its destructor to clean up.
+static ERL_NIF_TERM instantiate(ErlNifEnv* env, NifHandle* handle, ErlNifBinary* binary, NifOpts* opts) {
+    NifInstance* inst = handle->inst;
+    inst->store = wasm_store_new(engine);
+    wasm_byte_vec_t bytes;
+    wasm_byte_vec_new(&bytes, binary->size, (const wasm_byte_t*)binary->data);
+    inst->module = wasm_module_new(inst->store, &bytes);
+    wasm_byte_vec_delete(&bytes);
+    if (!inst->module) return make_error(env, "Failed to create module.");
+
+    wasm_module_imports(inst->module, &inst->import_types);
+    wasm_module_exports(inst->module, &inst->export_types);
+
+    size_t import_count = inst->import_types.size;
+    inst->imports = enif_alloc(sizeof(NifImport) * (import_count ? import_count : 1));
+    memset(inst->imports, 0, sizeof(NifImport) * (import_count ? import_count : 1));
+    inst->import_count = import_count;
+    for (size_t i = 0; i < import_count; i++) {
+        const wasm_importtype_t* type = inst->import_types.data[i];
+        const wasm_externtype_t* extern_type = wasm_importtype_type(type);
+        NifImport* import = &inst->imports[i];
+        if (wasm_externtype_kind(extern_type) != WASM_EXTERN_FUNC) {
+            return make_error(env, "Only function imports are supported by the NIF backend.");
+        }
+        import->inst = inst;
+        import->module_name = wasm_importtype_module(type)->data;
+        import->field_name = wasm_importtype_name(type)->data;
+        import->type = wasm_externtype_as_functype_const(extern_type);
+        if (!function_sig(import->type, import->signature, sizeof(import->signature))) {
+            return make_error(env, "Import signature not supported by the NIF backend.");
+        }
+    }
+
+    ERL_NIF_TERM atom_func = enif_make_atom(env, "func");
+    ERL_NIF_TERM* import_terms = enif_alloc(sizeof(ERL_NIF_TERM) * (import_count ? import_count : 1));
+    wasm_extern_t** stubs = enif_alloc(sizeof(wasm_extern_t*) * (import_count ? import_count : 1));
+    for (size_t i = 0; i < import_count; i++) {
+        NifImport* import = &inst->imports[i];
+        wasm_func_t* func =
+            wasm_func_new_with_env(inst->store, import->type, handle_import, import, NULL);
+        stubs[i] = wasm_func_as_extern(func);
+        import_terms[i] = enif_make_tuple4(env,
+            atom_func,
+            enif_make_string(env, import->module_name, ERL_NIF_LATIN1),
+            enif_make_string(env, import->field_name, ERL_NIF_LATIN1),
+            enif_make_string(env, import->signature, ERL_NIF_LATIN1));
+    }
+    wasm_extern_vec_new(&inst->import_externs, import_count, stubs);
+    ERL_NIF_TERM imports = enif_make_list_from_array(env, import_terms, import_count);
+    enif_free(stubs);
+    enif_free(import_terms);
+
+    wasm_trap_t* trap = NULL;
+    InstantiationArgs inst_args = {
+        .default_stack_size = opts->stack_size ? opts->stack_size : 0x10000,
+        .host_managed_heap_size = opts->heap_size ? opts->heap_size : 0x10000,
+        .max_memory_pages = opts->max_pages
+    };
+    inst->instance =
+        wasm_instance_new_with_args_ex(inst->store, inst->module, &inst->import_externs, &trap, &inst_args);
+    if (!inst->instance) {
+        if (trap) wasm_trap_delete(trap);
+        return make_error(env, "Failed to create WASM instance (although module was created).");
+    }
+
+    wasm_instance_exports(inst->instance, &inst->exports);
+    size_t export_count = inst->export_types.size;
+    ERL_NIF_TERM* export_terms = enif_alloc(sizeof(ERL_NIF_TERM) * (export_count ? export_count : 1));
+    for (size_t i = 0; i < export_count; i++) {
+        const wasm_exporttype_t* export = inst->export_types.data[i];
+        const wasm_externtype_t* type = wasm_exporttype_type(export);
+        char sig[HB_NIF_MAX_SIG] = "";
+        if (wasm_externtype_kind(type) == WASM_EXTERN_FUNC &&
+                !function_sig(wasm_externtype_as_functype_const(type), sig, sizeof(sig))) {
+            // Functions taking v128 values are listed, but can not be called.
+            sig[0] = '\0';
+        }
+        if (wasm_externtype_kind(type) == WASM_EXTERN_MEMORY && !inst->memory && i < inst->exports.size) {
+            inst->memory = wasm_extern_as_memory(inst->exports.data[i]);
+        }
+        export_terms[i] = enif_make_tuple3(env,
+            enif_make_atom(env, extern_kind_name(type)),
+            enif_make_string(env, wasm_exporttype_name(export)->data, ERL_NIF_LATIN1),
+            enif_make_string(env, sig, ERL_NIF_LATIN1));
+    }
+    ERL_NIF_TERM exports = enif_make_list_from_array(env, export_terms, export_count);
+    enif_free(export_terms);
+
+    // Grow the memory to its initial size in one step, as the driver does.
+    if (inst->memory && opts->initial_pages > wasm_memory_size(inst->memory) &&
+            !wasm_memory_grow(inst->memory, opts->initial_pages - wasm_memory_size(inst->memory))) {
+        return make_error(env, "Failed to grow the memory to its initial size.");
+    }
+
+    if (import_count > 0) {
+        ErlNifThreadOpts* thread_opts = enif_thread_opts_create("hb_beamr_nif_thread_opts");
+        thread_opts->suggested_stack_size = HB_NIF_THREAD_STACK;
+        int failed = enif_thread_create("hb_beamr_nif", &inst->tid, exec_loop, inst, thread_opts);
+        enif_thread_opts_destroy(thread_opts);
+        if (failed) return make_error(env, "Failed to create the instance's thread.");
+        inst->has_thread = 1;
+    }
+
+    return enif_make_tuple4(env, atom_ok, enif_make_resource(env, handle), imports, exports);
+}
+
+// nif_start(WasmBinary, Mode, InstanceOpts)
+static ERL_NIF_TERM nif_start(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary binary;
+    char mode[8];
+    if (!enif_inspect_binary(env, argv[0], &binary) ||
+            enif_get_atom(env, argv[1], mode, sizeof(mode), ERL_NIF_LATIN1) <= 0 ||
+            !enif_is_list(env, argv[2])) {
+        return enif_make_badarg(env);
+    }
+    NifOpts opts = { 0 };
+    const char* error = decode_opts(env, argv[2], &opts);
+    if (error) return make_error(env, error);
+    int is_aot = binary.size >= 4 && memcmp(binary.data, "\0aot", 4) == 0;
+    if (strcmp(mode, "aot") == 0 && !is_aot) {
+        return make_error(env, "AOT mode requires a precompiled AOT image.");
+    } else if (strcmp(mode, "wasm") == 0 && is_aot) {
+        return make_error(env, "WASM mode can not load a precompiled AOT image.");
+    }
+
+    enter_runtime();
+    NifHandle* handle = enif_alloc_resource(instance_type, sizeof(NifHandle));
+    NifInstance* inst = enif_alloc(sizeof(NifInstance));
+    memset(inst, 0, sizeof(NifInstance));
+    inst->lock = enif_mutex_create("hb_beamr_nif_lock");
+    inst->cond = enif_cond_create("hb_beamr_nif_cond");
+    handle->inst = inst;
+    ERL_NIF_TERM res = instantiate(env, handle, &binary, &opts);
+    enif_release_resource(handle);
+    return res;
+}
+
+// nif_call(Instance, FunctionName, Args)
+static ERL_NIF_TERM nif_call(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    NifInstance* inst;
+    ErlNifBinary name;
+    if (!get_instance(env, argv[0], &inst) || !enif_inspect_binary(env, argv[1], &name) ||
+            !enif_is_list(env, argv[2])) {
+        return enif_make_badarg(env);
+    }
+    const wasm_functype_t* type = NULL;
+    wasm_func_t* func = NULL;
+    for (size_t i = 0; i < inst->export_types.size && i < inst->exports.size; i++) {
+        const wasm_exporttype_t* export = inst->export_types.data[i];
+        const char* export_name = wasm_exporttype_name(export)->data;
+        if (wasm_externtype_kind(wasm_exporttype_type(export)) == WASM_EXTERN_FUNC &&
+                strlen(export_name) == name.size && memcmp(export_name, name.data, name.size) == 0) {
+            type = wasm_externtype_as_functype_const(wasm_exporttype_type(export));
+            func = wasm_extern_as_func(inst->exports.data[i]);
+            break;
+        }
+    }
+    if (!func) {
+        char error[HB_NIF_ERROR_LEN];
+        snprintf(error, sizeof(error), "Function not found: %.*s", (int)name.size, name.data);
+        return make_error(env, error);
+    }
+    char sig[HB_NIF_MAX_SIG];
+    if (!function_sig(type, sig, sizeof(sig))) {
+        return make_error(env, "Function signature not supported by the NIF backend.");
+    }
+
+    enif_mutex_lock(inst->lock);
+    if (inst->stopping || !inst->instance) {
+        enif_mutex_unlock(inst->lock);
+        return make_error(env, "Instance stopped.");
+    }
+    if (inst->state != HB_NIF_IDLE) {
+        enif_mutex_unlock(inst->lock);
+        return make_error(env, "Instance is busy.");
+    }
+    const wasm_valtype_vec_t* params = wasm_functype_params(type);
+    const wasm_valtype_vec_t* results = wasm_functype_results(type);
+    wasm_val_vec_new_uninitialized(&inst->args, params->size);
+    if (!list_to_vals(env, argv[2], params, &inst->args)) {
+        wasm_val_vec_delete(&inst->args);
+        enif_mutex_unlock(inst->lock);
+        return make_error(env, "Call arguments do not match the function's signature.");
+    }
+    wasm_val_vec_new_uninitialized(&inst->results, results->size);
+    inst->results.num_elems = results->size;
+    for (size_t i = 0; i < results->size; i++) {
+        inst->results.data[i].kind = wasm_valtype_kind(results->data[i]);
+    }
+    inst->func = func;
+    inst->trapped = 0;
+    inst->state = HB_NIF_RUNNING;
+    if (!inst->has_thread) {
+        // Without imports the call can not park, so it runs right here.
+        enif_mutex_unlock(inst->lock);
+        enter_runtime();
+        run_call(inst);
+        enif_mutex_lock(inst->lock);
+        ERL_NIF_TERM res = finish_call(env, inst);
+        enif_mutex_unlock(inst->lock);
+        return res;
+    }
+    enif_cond_broadcast(inst->cond);
+    return await_call(env, inst);
+}
+
+// nif_resume(Instance, Results | abort)
+static ERL_NIF_TERM nif_resume(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    NifInstance* inst;
+    if (!get_instance(env, argv[0], &inst)) return enif_make_badarg(env);
+    enif_mutex_lock(inst->lock);
+    if (inst->state != HB_NIF_IMPORT) {
+        enif_mutex_unlock(inst->lock);
+        return make_error(env, "No import to resume.");
+    }
+    if (enif_is_identical(argv[1], atom_abort)) {
+        inst->import_failed = 1;
+    } else if (!list_to_vals(env, argv[1], wasm_functype_results(inst->import->type), inst->import_results)) {
+        // The call stays parked at the import, to be resumed again or aborted.
+        enif_mutex_unlock(inst->lock);
+        return make_error(env, "Import results do not match the import's signature.");
+    }
+    inst->state = HB_NIF_RUNNING;
+    enif_cond_broadcast(inst->cond);
+    return await_call(env, inst);
+}
+
+// Checks that memory can be accessed: not while a call is executing, as
+// its guest may be using it. Called with the lock held.
+static const char* check_memory(NifInstance* inst, ErlNifUInt64 offset, ErlNifUInt64 length, const char* request) {
+    if (inst->state == HB_NIF_RUNNING) return "Instance is busy.";
+    if (!inst->memory) return "Instance has no memory";
+    ErlNifUInt64 size = wasm_memory_data_size(inst->memory);
+    if (offset > size || length > size - offset) return request;
+    return NULL;
+}
+
+// nif_read(Instance, Offset, Length)
+static ERL_NIF_TERM nif_read(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    NifInstance* inst;
+    ErlNifUInt64 offset, length;
+    if (!get_instance(env, argv[0], &inst) || !enif_get_uint64(env, argv[1], &offset) ||
+            !enif_get_uint64(env, argv[2], &length)) {
+        return enif_make_badarg(env);
+    }
+    if (length > HB_NIF_DIRTY_BYTES && enif_thread_type() == ERL_NIF_THR_NORMAL_SCHEDULER) {
+        return enif_schedule_nif(env, "nif_read", ERL_NIF_DIRTY_JOB_CPU_BOUND, nif_read, argc, argv);
+    }
+    enif_mutex_lock(inst->lock);
+    const char* error = check_memory(inst, offset, length, "Read request out of bounds");
+    if (error) {
+        enif_mutex_unlock(inst->lock);
+        return make_error(env, error);
+    }
+    ERL_NIF_TERM bin;
+    unsigned char* out = enif_make_new_binary(env, length, &bin);
+    memcpy(out, wasm_memory_data(inst->memory) + offset, length);
+    enif_mutex_unlock(inst->lock);
+    return enif_make_tuple2(env, atom_ok, bin);
+}
+
+// nif_write(Instance, Offset, IOData)
+static ERL_NIF_TERM nif_write(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    NifInstance* inst;
+    ErlNifUInt64 offset;
+    ErlNifBinary data;
+    if (!get_instance(env, argv[0], &inst) || !enif_get_uint64(env, argv[1], &offset) ||
+            !enif_inspect_iolist_as_binary(env, argv[2], &data)) {
+        return enif_make_badarg(env);
+    }
+    if (data.size > HB_NIF_DIRTY_BYTES && enif_thread_type() == ERL_NIF_THR_NORMAL_SCHEDULER) {
+        return enif_schedule_nif(env, "nif_write", ERL_NIF_DIRTY_JOB_CPU_BOUND, nif_write, argc, argv);
+    }
+    enif_mutex_lock(inst->lock);
+    const char* error = check_memory(inst, offset, data.size, "Write request out of bounds");
+    if (error) {
+        enif_mutex_unlock(inst->lock);
+        return make_error(env, error);
+    }
+    memcpy(wasm_memory_data(inst->memory) + offset, data.data, data.size);
+    enif_mutex_unlock(inst->lock);
+    return atom_ok;
+}
+
+// nif_size(Instance)
+static ERL_NIF_TERM nif_size(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    NifInstance* inst;
+    if (!get_instance(env, argv[0], &inst)) return enif_make_badarg(env);
+    enif_mutex_lock(inst->lock);
+    ErlNifUInt64 size = inst->memory ? wasm_memory_data_size(inst->memory) : 0;
+    enif_mutex_unlock(inst->lock);
+    return enif_make_tuple2(env, atom_ok, enif_make_uint64(env, size));
+}
+
+// nif_stop(Instance)
+static ERL_NIF_TERM nif_stop(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+    NifInstance* inst;
+    if (!get_instance(env, argv[0], &inst)) return enif_make_badarg(env);
+    stop_instance(inst);
+    return atom_ok;
+}
+
+static int load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info) {
+    instance_type = enif_open_resource_type(env, NULL, "hb_beamr_nif_instance",
+        instance_dtor, ERL_NIF_RT_CREATE, NULL);
+    if (!instance_type) return 1;
+    // This is the library's own copy of the runtime (see hb_nif.h).
+    engine = wasm_engine_new();
+    if (!engine) return 1;
+    reap_lock = enif_mutex_create("hb_beamr_nif_reap_lock");
+    reap_cond = enif_cond_create("hb_beamr_nif_reap_cond");
+    if (enif_thread_create("hb_beamr_nif_reaper", &reaper_tid, reap_loop, NULL, NULL) != 0) return 1;
+    atom_ok = enif_make_atom(env, "ok");
+    atom_error = enif_make_atom(env, "error");
+    atom_import = enif_make_atom(env, "import");
+    atom_abort = enif_make_atom(env, "abort");
+    return 0;
+}
+
+static ErlNifFunc nif_funcs[] = {
+    {"nif_start", 3, nif_start, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"nif_call", 3, nif_call, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"nif_resume", 2, nif_resume, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"nif_read", 3, nif_read, 0},
+    {"nif_write", 3, nif_write, 0},
+    {"nif_size", 1, nif_size, 0},
+    {"nif_stop", 1, nif_stop, 0}
+};
+
+ERL_NIF_INIT(hb_beamr_nif, nif_funcs, load, NULL, NULL, NULL)
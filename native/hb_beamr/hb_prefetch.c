@@ -0,0 +1,249 @@
+#include "include/hb_prefetch.h"
+#include "include/hb_helpers.h"
+#include "include/hb_logging.h"
+
+extern ErlDrvTermData atom_undefined;
+
+// Decode an import or module name, given as a string or a binary, into a
+// freshly allocated NUL-terminated buffer.
+static char* decode_name(const char* buff, int* index) {
+    int type, size;
+    if (ei_get_type(buff, index, &type, &size) != 0) return NULL;
+    char* name = driver_alloc(size + 1);
+    if (type == ERL_BINARY_EXT) {
+        long len;
+        if (ei_decode_binary(buff, index, name, &len) != 0) goto fail;
+        name[len] = '\0';
+    } else if (type == ERL_STRING_EXT || type == ERL_NIL_EXT) {
+        if (ei_decode_string(buff, index, name) != 0) goto fail;
+    } else {
+        goto fail;
+    }
+    return name;
+fail:
+    driver_free(name);
+    return NULL;
+}
+
+static int decode_desc(const char* buff, int* index, PrefetchDesc* desc) {
+    int arity;
+    char kind[MAXATOMLEN];
+    long ptr_arg, len;
+    if (ei_decode_tuple_header(buff, index, &arity) != 0 || arity != 3) return -1;
+    if (ei_decode_atom(buff, index, kind) != 0) return -1;
+    if (ei_decode_long(buff, index, &ptr_arg) != 0 || ptr_arg < 0) return -1;
+    if (ei_decode_long(buff, index, &len) != 0 || len < 0) return -1;
+    if (strcmp(kind, "bytes") == 0) desc->kind = HB_PREFETCH_BYTES;
+    else if (strcmp(kind, "fixed") == 0) desc->kind = HB_PREFETCH_FIXED;
+    else if (strcmp(kind, "iovec") == 0) desc->kind = HB_PREFETCH_IOVEC;
+    else return -1;
+    desc->ptr_arg = (int)ptr_arg;
+    desc->len = len;
+    return 0;
+}
+
+void prefetch_free_table(PrefetchEntry* table, int count) {
+    for (int i = 0; i < count; i++) {
+        if (table[i].module_name) driver_free(table[i].module_name);
+        if (table[i].field_name) driver_free(table[i].field_name);
+        if (table[i].descs) driver_free(table[i].descs);
+    }
+    if (table) driver_free(table);
+}
+
+void prefetch_free(Proc* proc) {
+    prefetch_free_table(proc->prefetch, proc->prefetch_count);
+    proc->prefetch = NULL;
+    proc->prefetch_count = 0;
+}
+
+void prefetch_install(Proc* proc, PrefetchEntry* table, int count) {
+    prefetch_free(proc);
+    proc->prefetch = table;
+    proc->prefetch_count = count;
+}
+
+int prefetch_decode(const char* buff, int* index, PrefetchEntry** table_out, int* count_out) {
+    int count;
+    PrefetchEntry* table = NULL;
+    int decoded = 0;
+    *table_out = NULL;
+    *count_out = 0;
+    if (ei_decode_list_header(buff, index, &count) != 0) return -1;
+    if (count == 0) return 0;
+    table = driver_alloc(sizeof(PrefetchEntry) * count);
+    memset(table, 0, sizeof(PrefetchEntry) * count);
+    for (int i = 0; i < count; i++) {
+        PrefetchEntry* entry = &table[i];
+        int arity, descs;
+        decoded = i + 1;
+        if (ei_decode_tuple_header(buff, index, &arity) != 0 || arity != 3) goto fail;
+        if (!(entry->module_name = decode_name(buff, index))) goto fail;
+        if (!(entry->field_name = decode_name(buff, index))) goto fail;
+        if (ei_decode_list_header(buff, index, &descs) != 0) goto fail;
+        if (descs > 0) {
+            entry->descs = driver_alloc(sizeof(PrefetchDesc) * descs);
+            for (int j = 0; j < descs; j++) {
+                if (decode_desc(buff, index, &entry->descs[j]) != 0) goto fail;
+            }
+            entry->count = descs;
+            if (ei_decode_list_header(buff, index, &descs) != 0) goto fail;
+        }
+        DRV_DEBUG("Registered %d prefetch descriptors for %s.%s",
+            entry->count, entry->module_name, entry->field_name);
+    }
+    if (ei_decode_list_header(buff, index, &count) != 0) goto fail;
+    *table_out = table;
+    *count_out = decoded;
+    return 0;
+fail:
+    prefetch_free_table(table, decoded);
+    return -1;
+}
+
+PrefetchEntry* prefetch_lookup(Proc* proc, ImportHook* hook) {
+    for (int i = 0; i < proc->prefetch_count; i++) {
+        PrefetchEntry* entry = &proc->prefetch[i];
+        if (strcmp(entry->field_name, hook->field_name) == 0 &&
+                strcmp(entry->module_name, hook->module_name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// The number of I/O vectors a descriptor reads, or -1 if there are more than
+// are prefetched (in which case Erlang reads them itself).
+static long iovec_count(const PrefetchDesc* desc, const wasm_val_vec_t* args) {
+    if (desc->len >= (long)args->size) return -1;
+    uint64_t count = wasm_arg_u64(args, desc->len);
+    return count > HB_PREFETCH_MAX_IOVECS ? -1 : (long)count;
+}
+
+size_t prefetch_terms(Proc* proc, PrefetchEntry* entry, const wasm_val_vec_t* args) {
+    // The list of prefetched values: NIL, LIST and its length.
+    size_t terms = 3;
+    for (int i = 0; i < entry->count; i++) {
+        if (entry->descs[i].kind == HB_PREFETCH_IOVEC) {
+            // A binary of each buffer, and their list.
+            long count = iovec_count(&entry->descs[i], args);
+            terms += count > 0 ? count * 3 + 3 : 3;
+        } else {
+            terms += 3;
+        }
+    }
+    return terms;
+}
+
+// Find the range of memory described by a descriptor that is read in one
+// piece. Returns 0 if it is out of bounds.
+static int resolve_range(const PrefetchDesc* desc, const wasm_val_vec_t* args,
+        uint64_t memory_size, uint64_t* ptr, uint64_t* len) {
+    if (desc->ptr_arg >= (int)args->size) return 0;
+    *ptr = wasm_arg_u64(args, desc->ptr_arg);
+    switch (desc->kind) {
+        case HB_PREFETCH_FIXED:
+            *len = (uint64_t)desc->len;
+            break;
+        case HB_PREFETCH_BYTES:
+            if (desc->len >= (long)args->size) return 0;
+            *len = wasm_arg_u64(args, desc->len);
+            break;
+        default:
+            return 0;
+    }
+    return memory_in_bounds(*ptr, *len, memory_size);
+}
+
+int prefetch_encode(Proc* proc, PrefetchEntry* entry, const wasm_val_vec_t* args, ErlDrvTermData* msg) {
+    int msg_index = 0;
+    wasm_memory_t* memory = get_memory(proc);
+    byte_t* memory_data = memory ? wasm_memory_data(memory) : NULL;
+    uint64_t memory_size = memory ? (uint64_t)get_memory_size(proc) : 0;
+
+    for (int i = 0; i < entry->count; i++) {
+        const PrefetchDesc* desc = &entry->descs[i];
+        uint64_t ptr, len;
+        if (desc->kind == HB_PREFETCH_IOVEC) {
+            // Pointers (and sizes) are 64-bit in wasm64 modules and 32-bit otherwise.
+            size_t width = desc->ptr_arg < (int)args->size &&
+                args->data[desc->ptr_arg].kind == WASM_I64 ? 8 : 4;
+            long count = iovec_count(desc, args);
+            int valid = count >= 0 && desc->ptr_arg < (int)args->size;
+            ptr = valid ? wasm_arg_u64(args, desc->ptr_arg) : 0;
+            // Check the array and all of its buffers before emitting any of them.
+            valid = valid && memory_in_bounds(ptr, (uint64_t)count * 2 * width, memory_size);
+            for (long j = 0; valid && j < count; j++) {
+                const byte_t* iov = memory_data + ptr + j * 2 * width;
+                valid = memory_in_bounds(load_uint_le(iov, width), load_uint_le(iov + width, width), memory_size);
+            }
+            if (!valid) {
+                msg[msg_index++] = ERL_DRV_ATOM;
+                msg[msg_index++] = atom_undefined;
+                continue;
+            }
+            for (long j = 0; j < count; j++) {
+                const byte_t* iov = memory_data + ptr + j * 2 * width;
+                msg[msg_index++] = ERL_DRV_BUF2BINARY;
+                msg[msg_index++] = (ErlDrvTermData)(memory_data + load_uint_le(iov, width));
+                msg[msg_index++] = (ErlDrvTermData)load_uint_le(iov + width, width);
+            }
+            msg[msg_index++] = ERL_DRV_NIL;
+            msg[msg_index++] = ERL_DRV_LIST;
+            msg[msg_index++] = count + 1;
+        } else if (memory && resolve_range(desc, args, memory_size, &ptr, &len)) {
+            msg[msg_index++] = ERL_DRV_BUF2BINARY;
+            msg[msg_index++] = (ErlDrvTermData)(memory_data + ptr);
+            msg[msg_index++] = (ErlDrvTermData)len;
+        } else {
+            msg[msg_index++] = ERL_DRV_ATOM;
+            msg[msg_index++] = atom_undefined;
+        }
+    }
+    msg[msg_index++] = ERL_DRV_NIL;
+    msg[msg_index++] = ERL_DRV_LIST;
+    msg[msg_index++] = entry->count + 1;
+    return msg_index;
+}
+
+// Decode the header of a `{Offset, Binary}' write, leaving the index at the
+// binary.
+static int decode_write_header(const char* buff, int* index, uint64_t* offset, uint64_t* len) {
+    int arity, type, size;
+    unsigned long long off;
+    if (ei_decode_tuple_header(buff, index, &arity) != 0 || arity != 2) return -1;
+    if (ei_decode_ulonglong(buff, index, &off) != 0) return -1;
+    if (ei_get_type(buff, index, &type, &size) != 0 || type != ERL_BINARY_EXT) return -1;
+    *offset = off;
+    *len = (uint64_t)size;
+    return 0;
+}
+
+int prefetch_apply_writes(Proc* proc, const char* buff, int* index) {
+    int count;
+    if (ei_decode_list_header(buff, index, &count) != 0) return -1;
+    if (count == 0) return 0;
+    wasm_memory_t* memory = get_memory(proc);
+    if (!memory) return -1;
+    uint64_t memory_size = (uint64_t)get_memory_size(proc);
+
+    // Validate every write first, so that a bad response changes nothing.
+    int check = *index;
+    for (int i = 0; i < count; i++) {
+        uint64_t offset, len;
+        if (decode_write_header(buff, &check, &offset, &len) != 0) return -1;
+        if (!memory_in_bounds(offset, len, memory_size)) return -1;
+        if (ei_skip_term(buff, &check) != 0) return -1;
+    }
+
+    byte_t* memory_data = wasm_memory_data(memory);
+    for (int i = 0; i < count; i++) {
+        uint64_t offset, len;
+        long decoded;
+        decode_write_header(buff, index, &offset, &len);
+        ei_decode_binary(buff, index, memory_data + offset, &decoded);
+        DRV_DEBUG("Applied import response write of %ld bytes at %llu", decoded, (unsigned long long)offset);
+    }
+    if (ei_decode_list_header(buff, index, &count) != 0) return -1;
+    return 0;
+}
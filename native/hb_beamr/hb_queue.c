@@ -0,0 +1,189 @@
+#include "include/hb_queue.h"
+#include "include/hb_budget.h"
+#include "include/hb_driver.h"
+#include "include/hb_helpers.h"
+#include "include/hb_logging.h"
+#include "include/hb_prefetch.h"
+#include "include/hb_stats.h"
+#include "include/hb_threads.h"
+#include "include/hb_wasm.h"
+
+extern ErlDrvTermData atom_ok;
+extern ErlDrvTermData atom_execution_result;
+
+void queue_init(Proc* proc) {
+    proc->queue_lock = erl_drv_mutex_create("wasm_queue_mutex");
+    proc->queue_head = NULL;
+    proc->queue_tail = NULL;
+    proc->queue_free = NULL;
+    proc->request_id = 0;
+}
+
+static void free_node(QueuedCommand* cmd) {
+    if (cmd->args) driver_free(cmd->args);
+    prefetch_free_table(cmd->prefetch, cmd->prefetch_count);
+    if (cmd->data) driver_free(cmd->data);
+    driver_free(cmd);
+}
+
+void queue_destroy(Proc* proc) {
+    QueuedCommand* lists[] = { proc->queue_head, proc->queue_free };
+    for (int i = 0; i < 2; i++) {
+        QueuedCommand* cmd = lists[i];
+        while (cmd) {
+            QueuedCommand* next = cmd->next;
+            free_node(cmd);
+            cmd = next;
+        }
+    }
+    proc->queue_head = proc->queue_tail = proc->queue_free = NULL;
+    erl_drv_mutex_destroy(proc->queue_lock);
+}
+
+QueuedCommand* queue_alloc(Proc* proc, int kind, uint64_t request_id) {
+    drv_lock(proc->queue_lock);
+    QueuedCommand* cmd = proc->queue_free;
+    if (cmd) proc->queue_free = cmd->next;
+    drv_unlock(proc->queue_lock);
+    if (!cmd) {
+        cmd = driver_alloc(sizeof(QueuedCommand));
+        cmd->data = NULL;
+        cmd->data_capacity = 0;
+    }
+    cmd->kind = kind;
+    cmd->request_id = request_id;
+    cmd->function_name[0] = '\0';
+    cmd->args = NULL;
+    cmd->sig[0] = '\0';
+    cmd->data_size = 0;
+    cmd->offset = 0;
+    cmd->length = 0;
+    cmd->prefetch = NULL;
+    cmd->prefetch_count = 0;
+    cmd->fuel = 0;
+    cmd->time_ms = 0;
+    cmd->budget_seq = 0;
+    cmd->next = NULL;
+    return cmd;
+}
+
+char* queue_reserve(QueuedCommand* cmd, long size) {
+    if (size > cmd->data_capacity) {
+        if (cmd->data) driver_free(cmd->data);
+        cmd->data = driver_alloc(size);
+        cmd->data_capacity = size;
+    }
+    return cmd->data;
+}
+
+void queue_discard(Proc* proc, QueuedCommand* cmd) {
+    if (cmd->args) driver_free(cmd->args);
+    cmd->args = NULL;
+    prefetch_free_table(cmd->prefetch, cmd->prefetch_count);
+    cmd->prefetch = NULL;
+    cmd->prefetch_count = 0;
+    drv_lock(proc->queue_lock);
+    cmd->next = proc->queue_free;
+    proc->queue_free = cmd;
+    drv_unlock(proc->queue_lock);
+}
+
+// Read or write memory for a queued command, ordered with the calls around it.
+static void run_memory_command(Proc* proc, QueuedCommand* cmd) {
+    drv_lock(proc->is_running);
+    wasm_memory_t* memory = proc->is_initialized ? get_memory(proc) : NULL;
+    uint64_t memory_size = memory ? (uint64_t)get_memory_size(proc) : 0;
+    uint64_t length = cmd->kind == HB_QUEUED_READ ? cmd->length : (uint64_t)cmd->data_size;
+    if (!memory || !memory_in_bounds(cmd->offset, length, memory_size)) {
+        drv_unlock(proc->is_running);
+        send_reply_error(proc, cmd->request_id,
+            memory ? "%s request out of bounds" : "Instance has no memory",
+            cmd->kind == HB_QUEUED_READ ? "Read" : "Write");
+        return;
+    }
+    byte_t* memory_data = wasm_memory_data(memory);
+    if (cmd->kind == HB_QUEUED_WRITE) {
+        if (length > 0) memcpy(memory_data + cmd->offset, cmd->data, length);
+        stats_memory(proc, 0, length);
+        drv_unlock(proc->is_running);
+        ErlDrvTermData msg[] = { ERL_DRV_ATOM, atom_ok };
+        drv_output_reply(proc->port_term, cmd->request_id, msg, 2);
+        return;
+    }
+    ErlDrvBinary* out_binary = driver_alloc_binary(length);
+    memcpy(out_binary->orig_bytes, memory_data + cmd->offset, length);
+    stats_memory(proc, length, 0);
+    drv_unlock(proc->is_running);
+    ErlDrvTermData msg[] = {
+        ERL_DRV_ATOM, atom_execution_result,
+        ERL_DRV_BINARY, (ErlDrvTermData)out_binary, length, 0,
+        ERL_DRV_TUPLE, 2
+    };
+    drv_output_reply(proc->port_term, cmd->request_id, msg, sizeof(msg) / sizeof(msg[0]));
+    driver_free_binary(out_binary);
+}
+
+// The job submitted for each queued command: runs the oldest command of the
+// queue, if one remains (others may have been cancelled).
+static void run_next_command(void* raw) {
+    Proc* proc = (Proc*)raw;
+    threads_enter_runtime();
+    drv_lock(proc->queue_lock);
+    QueuedCommand* cmd = proc->queue_head;
+    if (cmd) {
+        proc->queue_head = cmd->next;
+        if (!proc->queue_head) proc->queue_tail = NULL;
+    }
+    drv_unlock(proc->queue_lock);
+    if (!cmd) {
+        DRV_DEBUG("No command left to run: it was cancelled");
+        return;
+    }
+
+    DRV_DEBUG("Running queued command %lu (kind %d)", (unsigned long)cmd->request_id, cmd->kind);
+    // Imports made by the command are tagged with its request.
+    proc->request_id = cmd->request_id;
+    if (cmd->kind == HB_QUEUED_CALL) {
+        wasm_execute_call(proc, cmd);
+    } else {
+        run_memory_command(proc, cmd);
+    }
+    proc->request_id = 0;
+    queue_discard(proc, cmd);
+}
+
+void queue_submit(Proc* proc, QueuedCommand* cmd) {
+    cmd->next = NULL;
+    drv_lock(proc->queue_lock);
+    if (proc->queue_tail) proc->queue_tail->next = cmd;
+    else proc->queue_head = cmd;
+    proc->queue_tail = cmd;
+    drv_unlock(proc->queue_lock);
+    threads_submit(proc, run_next_command, proc);
+}
+
+int queue_cancel(Proc* proc, uint64_t request_id) {
+    // Untagged commands have no ID to be cancelled by.
+    if (request_id == 0) return 0;
+    QueuedCommand* cancelled = NULL;
+    drv_lock(proc->queue_lock);
+    QueuedCommand** link = &proc->queue_head;
+    QueuedCommand* prev = NULL;
+    while (*link) {
+        QueuedCommand* cmd = *link;
+        if (cmd->request_id == request_id) {
+            *link = cmd->next;
+            if (proc->queue_tail == cmd) proc->queue_tail = prev;
+            cancelled = cmd;
+            break;
+        }
+        prev = cmd;
+        link = &cmd->next;
+    }
+    drv_unlock(proc->queue_lock);
+    if (!cancelled) return 0;
+    DRV_DEBUG("Cancelled queued command %lu", (unsigned long)request_id);
+    if (cancelled->kind == HB_QUEUED_CALL) budget_cancel(proc, cancelled->time_ms);
+    queue_discard(proc, cancelled);
+    return 1;
+}
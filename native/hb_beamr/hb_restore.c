@@ -0,0 +1,132 @@
+#include "include/hb_restore.h"
+#include "include/hb_driver.h"
+#include "include/hb_helpers.h"
+#include "include/hb_logging.h"
+#include "include/hb_stats.h"
+#include "include/hb_threads.h"
+#include "include/hb_wasi.h"
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+extern ErlDrvTermData atom_execution_result;
+
+// Read the whole file into memory, for when it can not be mapped.
+static int read_file(int fd, byte_t* dest, long size) {
+    long done = 0;
+    while (done < size) {
+        ssize_t res = pread(fd, dest + done, size - done, done);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return -1;
+        done += res;
+    }
+    return 0;
+}
+
+int restore_file(Proc* proc, const char* path, char* error, size_t error_len) {
+    wasm_memory_t* memory = proc->is_initialized ? get_memory(proc) : NULL;
+    if (!memory) {
+        snprintf(error, error_len, "Instance has no memory");
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(error, error_len, "Failed to open snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        snprintf(error, error_len, "Failed to stat snapshot %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    long size = (long)st.st_size;
+    long memory_size = get_memory_size(proc);
+    if (size > memory_size) {
+        wasm_memory_pages_t grow = (size - memory_size + 65535) / 65536;
+        if (!wasm_memory_grow(memory, grow)) {
+            snprintf(error, error_len, "Failed to grow memory to %ld bytes", size);
+            close(fd);
+            return -1;
+        }
+    }
+    byte_t* memory_data = wasm_memory_data(memory);
+    int mapped = 0;
+    long page_size = sysconf(_SC_PAGESIZE);
+    // Only a runtime with hardware bounds checks is known to reserve the
+    // memory with mmap, so that its pages can be replaced in place: others
+    // may have taken it from their heap. The mapping holds its own reference
+    // to the file, which can be closed straight away.
+    if (threads_hw_bounds() && size > 0 &&
+            ((uintptr_t)memory_data % page_size) == 0 && (size % page_size) == 0) {
+        void* res = mmap(memory_data, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, fd, 0);
+        mapped = (res != MAP_FAILED);
+        DRV_DEBUG("Mapped snapshot %s copy-on-write: %d", path, mapped);
+    }
+    if (!mapped && size > 0) {
+        if (read_file(fd, memory_data, size) != 0) {
+            snprintf(error, error_len, "Failed to read snapshot %s", path);
+            close(fd);
+            return -1;
+        }
+        stats_memory(proc, 0, size);
+    }
+    close(fd);
+    return mapped;
+}
+
+void restore_file_job(void* raw) {
+    RestoreReq* req = (RestoreReq*)raw;
+    Proc* proc = req->proc;
+    threads_enter_runtime();
+    char error[4352];
+    drv_lock(proc->is_running);
+    int mapped = restore_file(proc, req->path, error, sizeof(error));
+    // The snapshot holds only the memory: `random_get' starts over from the seed.
+    if (mapped >= 0) wasi_seed_random(proc);
+    drv_unlock(proc->is_running);
+    driver_free(req);
+    if (mapped < 0) {
+        send_error(proc, "%s", error);
+        return;
+    }
+    ErlDrvTermData msg[] = {
+        ERL_DRV_ATOM, atom_execution_result,
+        ERL_DRV_INT, mapped,
+        ERL_DRV_TUPLE, 2
+    };
+    erl_drv_output_term(proc->port_term, msg, sizeof(msg) / sizeof(msg[0]));
+}
+
+void snapshot_job(void* raw) {
+    Proc* proc = (Proc*)raw;
+    threads_enter_runtime();
+    drv_lock(proc->is_running);
+    long memory_size = get_memory_size(proc);
+    if (proc->snapshot) {
+        driver_free_binary(proc->snapshot);
+        proc->snapshot = NULL;
+    }
+    proc->snapshot = driver_alloc_binary(memory_size);
+    if (proc->snapshot && memory_size > 0) {
+        memcpy(proc->snapshot->orig_bytes, wasm_memory_data(get_memory(proc)), memory_size);
+    }
+    drv_unlock(proc->is_running);
+    if (!proc->snapshot) {
+        send_error(proc, "Failed to allocate snapshot of %ld bytes", memory_size);
+        return;
+    }
+    DRV_DEBUG("Snapshot taken. Size: %ld", memory_size);
+    ErlDrvTermData msg[] = {
+        ERL_DRV_ATOM, atom_execution_result,
+        ERL_DRV_INT, memory_size,
+        ERL_DRV_TUPLE, 2
+    };
+    erl_drv_output_term(proc->port_term, msg, sizeof(msg) / sizeof(msg[0]));
+}
@@ -0,0 +1,219 @@
+#include "include/hb_stats.h"
+#include "include/hb_driver.h"
+#include "include/hb_helpers.h"
+#include "include/hb_logging.h"
+#include "include/hb_threads.h"
+#include "include/hb_trace.h"
+
+// Padded so that each shard sits on its own cache lines.
+typedef struct {
+    Stats stats;
+} __attribute__((aligned(64))) StatsShard;
+
+static StatsShard shards[HB_STATS_SHARDS];
+static unsigned int next_shard = 0;
+static __thread int thread_shard = -1;
+static int64_t instances = 0;
+
+static ErlDrvMutex* imports_lock = NULL;
+static ImportStats import_stats[HB_STATS_MAX_IMPORTS];
+static int import_count = 0;
+
+static Stats* global_stats(void) {
+    if (thread_shard < 0) {
+        thread_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % HB_STATS_SHARDS;
+    }
+    return &shards[thread_shard].stats;
+}
+
+int stats_init(void) {
+    imports_lock = erl_drv_mutex_create("wasm_stats_imports_mutex");
+    return imports_lock ? 0 : -1;
+}
+
+void stats_destroy(void) {
+    for (int i = 0; i < import_count; i++) {
+        driver_free(import_stats[i].module_name);
+        driver_free(import_stats[i].field_name);
+    }
+    import_count = 0;
+    if (imports_lock) erl_drv_mutex_destroy(imports_lock);
+    imports_lock = NULL;
+}
+
+uint64_t stats_now(void) {
+    return (uint64_t)erl_drv_monotonic_time(ERL_DRV_NSEC);
+}
+
+void stats_instance_started(Proc* proc) {
+    memset(&proc->stats, 0, sizeof(Stats));
+}
+
+// Record the current size of an instance's memory. The driver-wide counter
+// is adjusted by the change, so that it holds the total of all instances.
+static void update_memory_size(Proc* proc, uint64_t size) {
+    uint64_t old = __atomic_exchange_n(&proc->stats.memory_bytes, size, __ATOMIC_RELAXED);
+    if (size != old) STATS_ADD(global_stats()->memory_bytes, size - old);
+    if (old && size > old) trace_event(proc, HB_TRACE_MEMORY_GROW, (int64_t)size);
+}
+
+void stats_instance_stopped(Proc* proc) {
+    update_memory_size(proc, 0);
+    if (proc->is_initialized) STATS_ADD(instances, -1);
+}
+
+static int latency_bucket(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (bucket < HB_STATS_BUCKETS - 1 && us >= (1ULL << bucket)) bucket++;
+    return bucket;
+}
+
+void stats_call(Proc* proc, uint64_t ns, int trapped) {
+    int bucket = latency_bucket(ns);
+    Stats* stats[] = { &proc->stats, global_stats() };
+    for (int i = 0; i < 2; i++) {
+        STATS_ADD(stats[i]->calls, 1);
+        STATS_ADD(stats[i]->call_ns, ns);
+        STATS_ADD(stats[i]->latency[bucket], 1);
+        if (trapped) STATS_ADD(stats[i]->traps, 1);
+    }
+    update_memory_size(proc, (uint64_t)get_memory_size(proc));
+}
+
+ImportStats* stats_import_slot(const char* module_name, const char* field_name) {
+    ImportStats* slot = NULL;
+    drv_lock(imports_lock);
+    for (int i = 0; i < import_count && !slot; i++) {
+        if (strcmp(import_stats[i].field_name, field_name) == 0 &&
+                strcmp(import_stats[i].module_name, module_name) == 0) {
+            slot = &import_stats[i];
+        }
+    }
+    if (!slot && import_count < HB_STATS_MAX_IMPORTS) {
+        slot = &import_stats[import_count];
+        slot->index = import_count;
+        slot->module_name = driver_alloc(strlen(module_name) + 1);
+        strcpy(slot->module_name, module_name);
+        slot->field_name = driver_alloc(strlen(field_name) + 1);
+        strcpy(slot->field_name, field_name);
+        slot->calls = 0;
+        slot->wait_ns = 0;
+        // Readers only look at the slots below the count.
+        __atomic_store_n(&import_count, import_count + 1, __ATOMIC_RELEASE);
+    }
+    drv_unlock(imports_lock);
+    return slot;
+}
+
+void stats_import(ImportHook* hook, uint64_t wait_ns) {
+    Stats* stats[] = { &hook->proc->stats, global_stats() };
+    for (int i = 0; i < 2; i++) {
+        STATS_ADD(stats[i]->imports, 1);
+        STATS_ADD(stats[i]->import_wait_ns, wait_ns);
+    }
+    if (hook->stats) {
+        STATS_ADD(hook->stats->calls, 1);
+        STATS_ADD(hook->stats->wait_ns, wait_ns);
+    }
+}
+
+void stats_memory(Proc* proc, uint64_t read, uint64_t written) {
+    Stats* stats[] = { &proc->stats, global_stats() };
+    for (int i = 0; i < 2; i++) {
+        if (read) STATS_ADD(stats[i]->bytes_read, read);
+        if (written) STATS_ADD(stats[i]->bytes_written, written);
+    }
+}
+
+void stats_instance_init(Proc* proc, uint64_t ns, uint64_t compile_ns) {
+    Stats* stats[] = { &proc->stats, global_stats() };
+    for (int i = 0; i < 2; i++) {
+        STATS_ADD(stats[i]->inits, 1);
+        STATS_ADD(stats[i]->init_ns, ns);
+        if (compile_ns) {
+            STATS_ADD(stats[i]->compiles, 1);
+            STATS_ADD(stats[i]->compile_ns, compile_ns);
+        }
+    }
+    STATS_ADD(instances, 1);
+    update_memory_size(proc, (uint64_t)get_memory_size(proc));
+}
+
+static uint64_t load(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Encode a set of counters, with `extra' further pairs to follow in the map.
+static void encode_stats(ei_x_buff* x, const Stats* stats, int extra) {
+    const struct { const char* name; const uint64_t* value; } fields[] = {
+        { "calls", &stats->calls },
+        { "traps", &stats->traps },
+        { "call_ns", &stats->call_ns },
+        { "imports", &stats->imports },
+        { "import_wait_ns", &stats->import_wait_ns },
+        { "bytes_read", &stats->bytes_read },
+        { "bytes_written", &stats->bytes_written },
+        { "inits", &stats->inits },
+        { "init_ns", &stats->init_ns },
+        { "compiles", &stats->compiles },
+        { "compile_ns", &stats->compile_ns },
+        { "memory_bytes", &stats->memory_bytes }
+    };
+    int count = sizeof(fields) / sizeof(fields[0]);
+    ei_x_encode_map_header(x, count + 1 + extra);
+    for (int i = 0; i < count; i++) {
+        ei_x_encode_atom(x, fields[i].name);
+        ei_x_encode_ulonglong(x, load(fields[i].value));
+    }
+    ei_x_encode_atom(x, "latency");
+    ei_x_encode_list_header(x, HB_STATS_BUCKETS);
+    for (int i = 0; i < HB_STATS_BUCKETS; i++) {
+        ei_x_encode_ulonglong(x, load(&stats->latency[i]));
+    }
+    ei_x_encode_empty_list(x);
+}
+
+void stats_encode(Proc* proc, ei_x_buff* x) {
+    // Sum the shards of the driver-wide counters.
+    Stats global;
+    memset(&global, 0, sizeof(Stats));
+    for (int i = 0; i < HB_STATS_SHARDS; i++) {
+        const uint64_t* shard = (const uint64_t*)&shards[i].stats;
+        uint64_t* sum = (uint64_t*)&global;
+        for (size_t j = 0; j < sizeof(Stats) / sizeof(uint64_t); j++) {
+            sum[j] += load(&shard[j]);
+        }
+    }
+
+    ei_x_encode_map_header(x, 3);
+    ei_x_encode_atom(x, "global");
+    encode_stats(x, &global, 2);
+    ei_x_encode_atom(x, "instances");
+    ei_x_encode_ulonglong(x, (unsigned long long)__atomic_load_n(&instances, __ATOMIC_RELAXED));
+    // Whether the runtime was built with hardware bounds checks.
+    ei_x_encode_atom(x, "hw_bounds");
+    ei_x_encode_atom(x, threads_hw_bounds() ? "true" : "false");
+
+    ei_x_encode_atom(x, "instance");
+    if (proc && proc->is_initialized) {
+        encode_stats(x, &proc->stats, 1);
+        // The key that identifies the instance in trace events.
+        ei_x_encode_atom(x, "key");
+        ei_x_encode_ulonglong(x, proc->async_key);
+    } else {
+        ei_x_encode_atom(x, "undefined");
+    }
+
+    ei_x_encode_atom(x, "imports");
+    int count = __atomic_load_n(&import_count, __ATOMIC_ACQUIRE);
+    if (count > 0) ei_x_encode_list_header(x, count);
+    for (int i = 0; i < count; i++) {
+        ei_x_encode_tuple_header(x, 4);
+        ei_x_encode_binary(x, import_stats[i].module_name, strlen(import_stats[i].module_name));
+        ei_x_encode_binary(x, import_stats[i].field_name, strlen(import_stats[i].field_name));
+        ei_x_encode_ulonglong(x, load(&import_stats[i].calls));
+        ei_x_encode_ulonglong(x, load(&import_stats[i].wait_ns));
+    }
+    ei_x_encode_empty_list(x);
+}
@@ -0,0 +1,202 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "include/hb_template.h"
+#include "include/hb_helpers.h"
+#include "include/hb_logging.h"
+#include "include/hb_driver.h"
+#include "include/hb_threads.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+typedef struct Template {
+    long id;
+    int fd;                     // memfd holding the image, or -1
+    byte_t* image;              // Read-only view (or copy) of the image
+    long size;                  // Size of the image in bytes
+    uint64_t random_state;      // State of the native `random_get'
+    struct Template* next;
+} Template;
+
+static Template* template_head = NULL;
+static ErlDrvMutex* template_lock = NULL;
+static long template_next_id = 1;
+
+extern ErlDrvTermData atom_ok;
+extern ErlDrvTermData atom_execution_result;
+
+void template_init(void) {
+    template_lock = erl_drv_mutex_create("wasm_template_mutex");
+}
+
+static void delete_template(Template* t) {
+    DRV_DEBUG("Deleting template %ld", t->id);
+    if (t->fd >= 0) {
+        if (t->image && t->size > 0) munmap(t->image, t->size);
+        close(t->fd);
+    } else if (t->image) {
+        driver_free(t->image);
+    }
+    driver_free(t);
+}
+
+void template_destroy(void) {
+    Template* t = template_head;
+    while (t) {
+        Template* next = t->next;
+        delete_template(t);
+        t = next;
+    }
+    template_head = NULL;
+    erl_drv_mutex_destroy(template_lock);
+}
+
+// Create a read-only, shareable image of the memory. Returns the memfd, or -1
+// (with the image copied to the driver heap) where memfds are not available.
+static int create_image(Template* t, const byte_t* memory_data) {
+    t->fd = -1;
+    t->image = NULL;
+#ifdef __linux__
+    int fd = memfd_create("hb_beamr_template", MFD_CLOEXEC);
+    if (fd >= 0) {
+        if (t->size == 0) {
+            t->fd = fd;
+            return 0;
+        }
+        if (ftruncate(fd, t->size) == 0) {
+            byte_t* writable = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (writable != MAP_FAILED) {
+                memcpy(writable, memory_data, t->size);
+                munmap(writable, t->size);
+                byte_t* image = mmap(NULL, t->size, PROT_READ, MAP_SHARED, fd, 0);
+                if (image != MAP_FAILED) {
+                    t->fd = fd;
+                    t->image = image;
+                    return 0;
+                }
+            }
+        }
+        close(fd);
+    }
+    DRV_DEBUG("memfd unavailable for template. Falling back to a heap copy");
+#endif
+    t->image = driver_alloc(t->size ? t->size : 1);
+    if (!t->image) return -1;
+    memcpy(t->image, memory_data, t->size);
+    return 0;
+}
+
+long template_create(Proc* proc, char* error, size_t error_len) {
+    if (!proc->is_initialized) {
+        snprintf(error, error_len, "Instance is not initialized");
+        return -1;
+    }
+    Template* t = driver_alloc(sizeof(Template));
+    t->size = get_memory_size(proc);
+    t->random_state = proc->wasi_random_state;
+    byte_t* memory_data = t->size > 0 ? wasm_memory_data(get_memory(proc)) : NULL;
+    if (create_image(t, memory_data) != 0) {
+        snprintf(error, error_len, "Failed to allocate template of %ld bytes", t->size);
+        driver_free(t);
+        return -1;
+    }
+    drv_lock(template_lock);
+    t->id = template_next_id++;
+    t->next = template_head;
+    template_head = t;
+    drv_unlock(template_lock);
+    DRV_DEBUG("Created template %ld. Size: %ld. memfd: %d", t->id, t->size, t->fd);
+    return t->id;
+}
+
+int template_apply(Proc* proc, long id, char* error, size_t error_len) {
+    wasm_memory_t* memory = get_memory(proc);
+    if (!proc->is_initialized || !memory) {
+        snprintf(error, error_len, "Instance has no memory");
+        return -1;
+    }
+    // Hold the registry lock while applying, so that the template can not be
+    // released (and its image unmapped) underneath us.
+    drv_lock(template_lock);
+    Template* t = template_head;
+    while (t && t->id != id) t = t->next;
+    if (!t) {
+        drv_unlock(template_lock);
+        snprintf(error, error_len, "Unknown template: %ld", id);
+        return -1;
+    }
+    long memory_size = get_memory_size(proc);
+    if (t->size > memory_size) {
+        wasm_memory_pages_t grow = (t->size - memory_size + 65535) / 65536;
+        if (!wasm_memory_grow(memory, grow)) {
+            drv_unlock(template_lock);
+            snprintf(error, error_len, "Failed to grow memory to %ld bytes", t->size);
+            return -1;
+        }
+    }
+    byte_t* memory_data = wasm_memory_data(memory);
+    int mapped = 0;
+#ifdef __linux__
+    long page_size = sysconf(_SC_PAGESIZE);
+    // Only a runtime with hardware bounds checks is known to reserve the
+    // memory with mmap, so that its pages can be replaced in place with a
+    // private (copy-on-write) mapping of the image: others may have taken it
+    // from their heap.
+    if (threads_hw_bounds() && t->fd >= 0 && t->size > 0 &&
+            ((uintptr_t)memory_data % page_size) == 0 && (t->size % page_size) == 0) {
+        void* res = mmap(memory_data, t->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, t->fd, 0);
+        mapped = (res != MAP_FAILED);
+        DRV_DEBUG("Mapped template %ld copy-on-write: %d", id, mapped);
+    }
+#endif
+    if (!mapped && t->size > 0) {
+        memcpy(memory_data, t->image, t->size);
+    }
+    proc->wasi_random_state = t->random_state;
+    drv_unlock(template_lock);
+    return 0;
+}
+
+void template_job(void* raw) {
+    TemplateReq* req = (TemplateReq*)raw;
+    Proc* proc = req->proc;
+    long id = req->id;
+    driver_free(req);
+    threads_enter_runtime();
+    char error[256];
+    drv_lock(proc->is_running);
+    long res = id == 0 ?
+        template_create(proc, error, sizeof(error)) :
+        template_apply(proc, id, error, sizeof(error));
+    drv_unlock(proc->is_running);
+    if (res < 0) {
+        send_error(proc, "%s", error);
+        return;
+    }
+    if (id != 0) {
+        ErlDrvTermData msg[] = { ERL_DRV_ATOM, atom_ok };
+        erl_drv_output_term(proc->port_term, msg, 2);
+        return;
+    }
+    ErlDrvTermData msg[] = {
+        ERL_DRV_ATOM, atom_execution_result,
+        ERL_DRV_INT, res,
+        ERL_DRV_TUPLE, 2
+    };
+    erl_drv_output_term(proc->port_term, msg, sizeof(msg) / sizeof(msg[0]));
+}
+
+int template_release(long id) {
+    drv_lock(template_lock);
+    Template** link = &template_head;
+    while (*link && (*link)->id != id) link = &(*link)->next;
+    Template* t = *link;
+    if (t) *link = t->next;
+    drv_unlock(template_lock);
+    if (!t) return -1;
+    delete_template(t);
+    return 0;
+}
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include "include/hb_threads.h"
+#include "include/hb_driver.h"
+#include "include/hb_logging.h"
+#include <stdlib.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// Only present in runtimes built with hardware bounds checks, in which WAMR
+// handles SIGSEGV. The symbol is weak, so that its absence can be detected.
+extern int os_thread_signal_init() __attribute__((weak));
+
+typedef struct Job {
+    Proc* proc;
+    void (*fn)(void*);
+    void* arg;
+    struct Job* next;
+} Job;
+
+typedef struct {
+    int index;
+    ErlDrvTid tid;
+    int busy;                       // Whether the thread is running a job
+    Job* head;                      // Jobs assigned to this thread, oldest first
+    Job* tail;
+} Worker;
+
+static ErlDrvMutex* pool_lock = NULL;
+static ErlDrvCond* work_available = NULL;
+static Worker* workers = NULL;
+static int worker_count = 0;
+static int pin_threads = 0;
+static int shutting_down = 0;
+static int next_worker = 0;
+static unsigned int next_async_key = 0;
+
+// Remove the oldest job of a queue whose process is not already running a
+// job. Must be called with the pool lock held.
+static Job* take_job(Worker* w) {
+    Job** link = &w->head;
+    Job* prev = NULL;
+    while (*link) {
+        Job* job = *link;
+        if (!job->proc->job_running) {
+            *link = job->next;
+            if (w->tail == job) w->tail = prev;
+            return job;
+        }
+        prev = job;
+        link = &job->next;
+    }
+    return NULL;
+}
+
+static void pin_to_core(int index) {
+#ifdef __linux__
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores <= 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % cores, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        DRV_DEBUG("Failed to pin worker %d to core %ld", index, index % cores);
+    }
+#endif
+}
+
+static void* worker_loop(void* raw) {
+    Worker* self = (Worker*)raw;
+    if (pin_threads) pin_to_core(self->index);
+    threads_enter_runtime();
+    drv_lock(pool_lock);
+    while (!shutting_down) {
+        // Prefer our own jobs, for the locality of the instances assigned to
+        // us. Otherwise help threads that are busy (or blocked on an import),
+        // leaving the jobs of idle threads to them.
+        Job* job = take_job(self);
+        for (int i = 1; !job && i < worker_count; i++) {
+            Worker* other = &workers[(self->index + i) % worker_count];
+            if (other->busy) job = take_job(other);
+        }
+        if (!job) {
+            erl_drv_cond_wait(work_available, pool_lock);
+            continue;
+        }
+        job->proc->job_running = 1;
+        self->busy = 1;
+        drv_unlock(pool_lock);
+
+        job->fn(job->arg);
+
+        drv_lock(pool_lock);
+        job->proc->job_running = 0;
+        self->busy = 0;
+        driver_free(job);
+        // Further jobs of the same process may now be taken.
+        erl_drv_cond_broadcast(work_available);
+    }
+    drv_unlock(pool_lock);
+    wasm_runtime_destroy_thread_env();
+    return NULL;
+}
+
+void threads_enter_runtime(void) {
+    if (wasm_runtime_thread_env_inited()) return;
+    if (!wasm_runtime_init_thread_env()) {
+        DRV_DEBUG("Failed to initialize the runtime's environment for this thread");
+    }
+}
+
+int threads_hw_bounds(void) {
+    return os_thread_signal_init != NULL;
+}
+
+int threads_init(void) {
+    pool_lock = erl_drv_mutex_create("wasm_thread_pool_mutex");
+    work_available = erl_drv_cond_create("wasm_thread_pool_cond");
+    return (pool_lock && work_available) ? 0 : -1;
+}
+
+static void start_pool(int count, int pin) {
+    workers = driver_alloc(sizeof(Worker) * count);
+    memset(workers, 0, sizeof(Worker) * count);
+    pin_threads = pin;
+    for (int i = 0; i < count; i++) {
+        workers[i].index = i;
+        if (erl_drv_thread_create("wasm_worker", &workers[i].tid, worker_loop, &workers[i], NULL) != 0) {
+            DRV_DEBUG("Failed to create worker thread %d", i);
+            break;
+        }
+        worker_count = i + 1;
+    }
+    DRV_DEBUG("Started %d worker threads (pinned: %d)", worker_count, pin);
+}
+
+void threads_configure(Proc* proc, const char* command) {
+    int threads = 0, pin = 0;
+    const char* arg;
+    if (command && (arg = strstr(command, "threads="))) threads = atoi(arg + 8);
+    if (command && (arg = strstr(command, "pin="))) pin = atoi(arg + 4);
+    if (threads > HB_THREADS_MAX) threads = HB_THREADS_MAX;
+
+    drv_lock(pool_lock);
+    if (threads > 0 && !workers) {
+        start_pool(threads, pin);
+    }
+    proc->job_running = 0;
+    proc->async_jobs = 0;
+    proc->releasing = 0;
+    proc->async_key = next_async_key++;
+    proc->thread_ix = worker_count > 0 ? next_worker++ % worker_count : -1;
+    drv_unlock(pool_lock);
+}
+
+// Runs a job on the ERTS async pool. ERTS runs the jobs of a port even once
+// it has stopped, so the process is only freed once they have all finished
+// (see threads_release), and those that had not started by then are dropped.
+static void run_async_job(void* raw) {
+    Job* job = (Job*)raw;
+    Proc* proc = job->proc;
+    drv_lock(pool_lock);
+    int releasing = proc->releasing;
+    drv_unlock(pool_lock);
+    if (!releasing) job->fn(job->arg);
+    drv_lock(pool_lock);
+    proc->async_jobs--;
+    erl_drv_cond_broadcast(work_available);
+    drv_unlock(pool_lock);
+    driver_free(job);
+}
+
+void threads_submit(Proc* proc, void (*fn)(void*), void* arg) {
+    Job* job = driver_alloc(sizeof(Job));
+    job->proc = proc;
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+    if (proc->thread_ix < 0) {
+        drv_lock(pool_lock);
+        proc->async_jobs++;
+        drv_unlock(pool_lock);
+        driver_async(proc->port, &proc->async_key, run_async_job, job, NULL);
+        return;
+    }
+    drv_lock(pool_lock);
+    Worker* w = &workers[proc->thread_ix];
+    if (w->tail) w->tail->next = job;
+    else w->head = job;
+    w->tail = job;
+    erl_drv_cond_broadcast(work_available);
+    drv_unlock(pool_lock);
+}
+
+void threads_release(Proc* proc) {
+    drv_lock(pool_lock);
+    // Drop the jobs that have not started, which will now never run, then
+    // wait for the job that last ran: it may still be finishing up after
+    // releasing the instance. Jobs on the ERTS async pool can not be taken
+    // back, so they are waited for, and skip their work.
+    proc->releasing = 1;
+    for (int i = 0; i < worker_count; i++) {
+        Worker* w = &workers[i];
+        Job** link = &w->head;
+        Job* prev = NULL;
+        while (*link) {
+            Job* job = *link;
+            if (job->proc == proc) {
+                *link = job->next;
+                if (w->tail == job) w->tail = prev;
+                driver_free(job);
+            } else {
+                prev = job;
+                link = &job->next;
+            }
+        }
+    }
+    while (proc->job_running || proc->async_jobs > 0) {
+        erl_drv_cond_wait(work_available, pool_lock);
+    }
+    drv_unlock(pool_lock);
+}
+
+void threads_destroy(void) {
+    if (workers) {
+        drv_lock(pool_lock);
+        shutting_down = 1;
+        erl_drv_cond_broadcast(work_available);
+        drv_unlock(pool_lock);
+        for (int i = 0; i < worker_count; i++) {
+            erl_drv_thread_join(workers[i].tid, NULL);
+            Job* job = workers[i].head;
+            while (job) {
+                Job* next = job->next;
+                driver_free(job);
+                job = next;
+            }
+        }
+        driver_free(workers);
+        workers = NULL;
+        worker_count = 0;
+    }
+    if (work_available) erl_drv_cond_destroy(work_available);
+    if (pool_lock) erl_drv_mutex_destroy(pool_lock);
+    work_available = NULL;
+    pool_lock = NULL;
+}
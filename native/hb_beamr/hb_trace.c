@@ -0,0 +1,94 @@
+#include "include/hb_trace.h"
+#include "include/hb_driver.h"
+#include "include/hb_stats.h"
+
+typedef struct {
+    uint64_t head;                 // Events written so far
+    TraceEvent events[HB_TRACE_RING_SIZE];
+} TraceRing;
+
+static ErlDrvMutex* rings_lock = NULL;
+static TraceRing* rings[HB_TRACE_MAX_THREADS];
+static int ring_count = 0;
+static __thread TraceRing* thread_ring = NULL;
+static __thread int thread_untraced = 0;
+
+static const char* kind_names[] = {
+    "call_start", "call_end", "import_enter", "import_exit", "trap", "memory_grow"
+};
+
+int trace_init(void) {
+    rings_lock = erl_drv_mutex_create("wasm_trace_mutex");
+    return rings_lock ? 0 : -1;
+}
+
+void trace_destroy(void) {
+    for (int i = 0; i < ring_count; i++) {
+        driver_free(rings[i]);
+    }
+    ring_count = 0;
+    if (rings_lock) erl_drv_mutex_destroy(rings_lock);
+    rings_lock = NULL;
+}
+
+static TraceRing* register_ring(void) {
+    drv_lock(rings_lock);
+    if (ring_count < HB_TRACE_MAX_THREADS) {
+        TraceRing* ring = driver_alloc(sizeof(TraceRing));
+        memset(ring, 0, sizeof(TraceRing));
+        rings[ring_count] = ring;
+        // Readers only look at the rings below the count.
+        __atomic_store_n(&ring_count, ring_count + 1, __ATOMIC_RELEASE);
+        thread_ring = ring;
+    } else {
+        thread_untraced = 1;
+    }
+    drv_unlock(rings_lock);
+    return thread_ring;
+}
+
+void trace_event(Proc* proc, uint32_t kind, int64_t arg) {
+    TraceRing* ring = thread_ring;
+    if (!ring) {
+        if (thread_untraced || !(ring = register_ring())) return;
+    }
+    // Only this thread writes to its ring, so the head needs no atomic
+    // increment. The slot's sequence number is cleared while it is written,
+    // and set once it is complete.
+    uint64_t pos = ring->head;
+    TraceEvent* event = &ring->events[pos % HB_TRACE_RING_SIZE];
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->time_ns = stats_now();
+    event->kind = kind;
+    event->instance = proc->async_key;
+    event->arg = arg;
+    __atomic_store_n(&event->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, pos + 1, __ATOMIC_RELEASE);
+}
+
+void trace_encode(ei_x_buff* x) {
+    int count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        TraceRing* ring = rings[i];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > HB_TRACE_RING_SIZE ? head - HB_TRACE_RING_SIZE : 0;
+        for (uint64_t pos = first; pos < head; pos++) {
+            const TraceEvent* slot = &ring->events[pos % HB_TRACE_RING_SIZE];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) continue;
+            TraceEvent event = *slot;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            // Skip the event if the writer reused its slot as it was copied.
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != pos + 1) continue;
+            if (event.kind >= sizeof(kind_names) / sizeof(kind_names[0])) continue;
+            ei_x_encode_list_header(x, 1);
+            ei_x_encode_tuple_header(x, 5);
+            ei_x_encode_ulonglong(x, event.time_ns);
+            ei_x_encode_ulonglong(x, (unsigned long long)i);
+            ei_x_encode_atom(x, kind_names[event.kind]);
+            ei_x_encode_ulonglong(x, event.instance);
+            ei_x_encode_longlong(x, event.arg);
+        }
+    }
+    ei_x_encode_empty_list(x);
+}
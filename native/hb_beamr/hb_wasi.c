@@ -0,0 +1,237 @@
+#include "include/hb_wasi.h"
+#include "include/hb_driver.h"
+#include "include/hb_wasm.h"
+#include "include/hb_helpers.h"
+#include "include/hb_logging.h"
+
+extern ErlDrvTermData atom_import;
+extern ErlDrvTermData atom_ok;
+
+// WASI errno values
+#define WASI_ESUCCESS 0
+#define WASI_EFAULT 21
+
+typedef struct {
+    const char* name;
+    unsigned int flag;
+    // The signatures the implementation handles: with 32-bit and with 64-bit
+    // pointers and sizes (for wasm64 modules)
+    const char* signatures[2];
+    wasm_trap_t* (*impl)(ImportHook* hook, const wasm_val_vec_t* args, wasm_val_vec_t* results);
+} NativeImport;
+
+static wasm_trap_t* wasi_fd_write(ImportHook* hook, const wasm_val_vec_t* args, wasm_val_vec_t* results);
+static wasm_trap_t* wasi_clock_time_get(ImportHook* hook, const wasm_val_vec_t* args, wasm_val_vec_t* results);
+static wasm_trap_t* wasi_random_get(ImportHook* hook, const wasm_val_vec_t* args, wasm_val_vec_t* results);
+static wasm_trap_t* wasi_sizes_get(ImportHook* hook, const wasm_val_vec_t* args, wasm_val_vec_t* results);
+
+static const NativeImport native_imports[] = {
+    { "fd_write", HB_WASI_FD_WRITE, { "(iiii)i", "(iIII)i" }, wasi_fd_write },
+    { "clock_time_get", HB_WASI_CLOCK_TIME_GET, { "(iIi)i", "(iII)i" }, wasi_clock_time_get },
+    { "random_get", HB_WASI_RANDOM_GET, { "(ii)i", "(II)i" }, wasi_random_get },
+    { "args_sizes_get", HB_WASI_ARGS_SIZES_GET, { "(ii)i", "(II)i" }, wasi_sizes_get },
+    { "environ_sizes_get", HB_WASI_ENVIRON_SIZES_GET, { "(ii)i", "(II)i" }, wasi_sizes_get },
+    { NULL, 0, { NULL, NULL }, NULL }
+};
+
+unsigned int wasi_native_flag(const char* name) {
+    for (const NativeImport* n = native_imports; n->name; n++) {
+        if (strcmp(n->name, name) == 0) return n->flag;
+    }
+    return 0;
+}
+
+void wasi_resolve_native(ImportHook* hook) {
+    hook->native = NULL;
+    if (strcmp(hook->module_name, "wasi_snapshot_preview1") != 0) return;
+    for (const NativeImport* n = native_imports; n->name; n++) {
+        if ((hook->proc->opts.native_wasi & n->flag) && strcmp(n->name, hook->field_name) == 0) {
+            // Imports declared with another type are left to Erlang, rather
+            // than read with the wrong layout.
+            if (strcmp(hook->signature, n->signatures[0]) != 0 &&
+                    strcmp(hook->signature, n->signatures[1]) != 0) {
+                DRV_DEBUG("Not resolving %s.%s natively: unexpected signature %s",
+                    hook->module_name, hook->field_name, hook->signature);
+                return;
+            }
+            DRV_DEBUG("Resolved %s.%s natively", hook->module_name, hook->field_name);
+            hook->native = n->impl;
+            return;
+        }
+    }
+}
+
+static wasm_trap_t* return_errno(wasm_val_vec_t* results, int32_t errno_val) {
+    if (results->size > 0) {
+        results->data[0].kind = WASM_I32;
+        results->data[0].of.i32 = errno_val;
+        results->num_elems = 1;
+    }
+    return NULL;
+}
+
+static const char* send_output(Proc* proc, int fd, const char* data, size_t len) {
+    ErlDrvTermData msg[] = {
+        ERL_DRV_ATOM, atom_import,
+        ERL_DRV_STRING, (ErlDrvTermData)"wasi_snapshot_preview1", 22,
+        ERL_DRV_STRING, (ErlDrvTermData)"fd_write_buffered", 17,
+        ERL_DRV_INT, (ErlDrvTermData)fd,
+        ERL_DRV_BUF2BINARY, (ErlDrvTermData)data, len,
+        ERL_DRV_NIL,
+        ERL_DRV_LIST, 3,
+        ERL_DRV_STRING, (ErlDrvTermData)"(ib)", 4,
+        ERL_DRV_TUPLE, 5
+    };
+    DRV_DEBUG("Flushing %zu bytes of output for fd %d", len, fd);
+    const char* error = wasm_import_rendezvous(proc, msg, sizeof(msg) / sizeof(msg[0]));
+    wasm_import_release(proc);
+    return error;
+}
+
+const char* wasi_flush(Proc* proc) {
+    if (proc->wasi_out_len == 0) return NULL;
+    size_t len = proc->wasi_out_len;
+    proc->wasi_out_len = 0;
+    return send_output(proc, proc->wasi_out_fd, proc->wasi_out, len);
+}
+
+static const char* buffer_output(Proc* proc, int fd, const byte_t* data, size_t len) {
+    const char* error = NULL;
+    if (proc->wasi_out_len > 0 &&
+            (proc->wasi_out_fd != fd || proc->wasi_out_len + len > HB_WASI_BUFFER_SIZE)) {
+        if ((error = wasi_flush(proc))) return error;
+    }
+    if (len > HB_WASI_BUFFER_SIZE) {
+        // Too large to buffer: send it on directly.
+        return send_output(proc, fd, (const char*)data, len);
+    }
+    if (!proc->wasi_out) {
+        proc->wasi_out = driver_alloc(HB_WASI_BUFFER_SIZE);
+    }
+    memcpy(proc->wasi_out + proc->wasi_out_len, data, len);
+    proc->wasi_out_len += len;
+    proc->wasi_out_fd = fd;
+    return NULL;
+}
+
+void wasi_free(Proc* proc) {
+    if (proc->wasi_out) driver_free(proc->wasi_out);
+    proc->wasi_out = NULL;
+    proc->wasi_out_len = 0;
+}
+
+// fd_write(fd, iovs, iovs_len, nwritten) -> errno
+// Output to stdout and stderr is buffered, and reaches Erlang in bulk. Writes
+// to any other descriptor are files in the VFS of `dev_wasi', so they are
+// handed to Erlang as usual.
+static wasm_trap_t* wasi_fd_write(ImportHook* hook, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    Proc* proc = hook->proc;
+    if (args->size < 4 || !get_memory(proc)) {
+        return wasm_handle_import_erlang(hook, args, results);
+    }
+    uint64_t fd = wasm_arg_u64(args, 0);
+    if (fd != 1 && fd != 2) {
+        return wasm_handle_import_erlang(hook, args, results);
+    }
+    // Pointers (and sizes) are 64-bit in wasm64 modules and 32-bit otherwise.
+    size_t width = args->data[1].kind == WASM_I64 ? 8 : 4;
+    uint64_t iovs = wasm_arg_u64(args, 1);
+    uint64_t count = wasm_arg_u64(args, 2);
+    uint64_t nwritten_ptr = wasm_arg_u64(args, 3);
+    byte_t* memory_data = wasm_memory_data(get_memory(proc));
+    uint64_t memory_size = (uint64_t)get_memory_size(proc);
+
+    if (count > memory_size / (2 * width) || !memory_in_bounds(iovs, count * 2 * width, memory_size) ||
+            !memory_in_bounds(nwritten_ptr, width, memory_size)) {
+        return return_errno(results, WASI_EFAULT);
+    }
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        const byte_t* iov = memory_data + iovs + i * 2 * width;
+        uint64_t base = load_uint_le(iov, width);
+        uint64_t len = load_uint_le(iov + width, width);
+        if (!memory_in_bounds(base, len, memory_size)) {
+            return return_errno(results, WASI_EFAULT);
+        }
+        const char* error = buffer_output(proc, (int)fd, memory_data + base, len);
+        if (error) {
+            wasm_name_t message;
+            wasm_name_new_from_string_nt(&message, error);
+            return wasm_trap_new(proc->store, &message);
+        }
+        // Flushing may have let Erlang write to (and grow) the memory.
+        memory_data = wasm_memory_data(get_memory(proc));
+        total += len;
+    }
+    store_uint_le(memory_data + nwritten_ptr, width, total);
+    return return_errno(results, WASI_ESUCCESS);
+}
+
+// clock_time_get(id, precision, time) -> errno
+// Execution must be deterministic, so as in `dev_wasi' the clock is not read:
+// the call returns 1 without writing a time.
+static wasm_trap_t* wasi_clock_time_get(ImportHook* hook, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    return return_errno(results, 1);
+}
+
+// random_get(buf, len) -> errno
+// Fills the buffer from a xorshift generator seeded per instance, so that
+// execution stays deterministic (and reproducible from the seed).
+static wasm_trap_t* wasi_random_get(ImportHook* hook, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    Proc* proc = hook->proc;
+    if (args->size < 2 || !get_memory(proc)) {
+        return wasm_handle_import_erlang(hook, args, results);
+    }
+    uint64_t buf = wasm_arg_u64(args, 0);
+    uint64_t len = wasm_arg_u64(args, 1);
+    if (!memory_in_bounds(buf, len, (uint64_t)get_memory_size(proc))) {
+        return return_errno(results, WASI_EFAULT);
+    }
+    byte_t* out = wasm_memory_data(get_memory(proc)) + buf;
+    uint64_t state = proc->wasi_random_state;
+    for (uint64_t i = 0; i < len; i++) {
+        if (i % 8 == 0) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+        }
+        out[i] = (state >> (8 * (i % 8))) & 0xff;
+    }
+    proc->wasi_random_state = state;
+    return return_errno(results, WASI_ESUCCESS);
+}
+
+void wasi_seed_random(Proc* proc) {
+    // xorshift never leaves a zero state, so the seed is mixed with a constant.
+    proc->wasi_random_state = proc->opts.random_seed ^ 0x9e3779b97f4a7c15ULL;
+}
+
+void wasi_seed_random_job(void* raw) {
+    Proc* proc = (Proc*)raw;
+    drv_lock(proc->is_running);
+    wasi_seed_random(proc);
+    drv_unlock(proc->is_running);
+    ErlDrvTermData msg[] = { ERL_DRV_ATOM, atom_ok };
+    erl_drv_output_term(proc->port_term, msg, 2);
+}
+
+// args_sizes_get(argc, argv_buf_size) -> errno
+// environ_sizes_get(environc, environ_buf_size) -> errno
+// Guests are given no arguments and an empty environment.
+static wasm_trap_t* wasi_sizes_get(ImportHook* hook, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    Proc* proc = hook->proc;
+    if (args->size < 2 || !get_memory(proc)) {
+        return wasm_handle_import_erlang(hook, args, results);
+    }
+    size_t width = args->data[0].kind == WASM_I64 ? 8 : 4;
+    uint64_t count_ptr = wasm_arg_u64(args, 0);
+    uint64_t size_ptr = wasm_arg_u64(args, 1);
+    uint64_t memory_size = (uint64_t)get_memory_size(proc);
+    if (!memory_in_bounds(count_ptr, width, memory_size) || !memory_in_bounds(size_ptr, width, memory_size)) {
+        return return_errno(results, WASI_EFAULT);
+    }
+    byte_t* memory_data = wasm_memory_data(get_memory(proc));
+    store_uint_le(memory_data + count_ptr, width, 0);
+    store_uint_le(memory_data + size_ptr, width, 0);
+    return return_errno(results, WASI_ESUCCESS);
+}
@@ -1,28 +1,100 @@
 #include "include/hb_wasm.h"
+#include <stdio.h>
 #include "include/hb_logging.h"
 #include "include/hb_helpers.h"
 #include "include/hb_driver.h"
+#include "include/hb_module_cache.h"
+#include "include/hb_wasi.h"
+#include "include/hb_prefetch.h"
+#include "include/hb_budget.h"
+#include "include/hb_stats.h"
+#include "include/hb_trace.h"
+#include "include/hb_indirect.h"
+#include "include/hb_threads.h"
 
 extern ErlDrvTermData atom_ok;
+extern ErlDrvTermData atom_error;
 extern ErlDrvTermData atom_import;
 extern ErlDrvTermData atom_execution_result;
 
+ErlDrvTermData* wasm_import_msg_buffer(Proc* proc, size_t terms) {
+    if (terms > proc->import_msg_size) {
+        DRV_DEBUG("Growing import message buffer to %zu terms", terms);
+        proc->import_msg = proc->import_msg ?
+            driver_realloc(proc->import_msg, sizeof(ErlDrvTermData) * terms) :
+            driver_alloc(sizeof(ErlDrvTermData) * terms);
+        proc->import_msg_size = terms;
+    }
+    return proc->import_msg;
+}
+
+const char* wasm_import_rendezvous(Proc* proc, ErlDrvTermData* msg, int msg_len) {
+    // Reset the rendezvous, which is created once with the port and reused
+    ImportResponse* response = &proc->import;
+    __atomic_store_n(&response->ready, 0, __ATOMIC_RELAXED);
+    response->error_message = NULL;
+    response->result_terms = NULL;
+    proc->current_import = response;
+
+    DRV_DEBUG("Sending %d terms...", msg_len);
+    // Send the message to the caller process
+    drv_output_reply(proc->port_term, proc->request_id, msg, msg_len);
+    // Wait for the response, spinning first so that quick handlers do not pay
+    // for a sleep and wake-up of this thread.
+    drv_spin_wait(response->response_ready, response->cond, &response->ready, HB_SPIN_ITERATIONS);
+    DRV_DEBUG("Response ready");
+    return response->error_message;
+}
+
+void wasm_import_release(Proc* proc) {
+    DRV_DEBUG("Cleaning up import response");
+    if (proc->import.result_terms) {
+        driver_free(proc->import.result_terms);
+        proc->import.result_terms = NULL;
+    }
+    proc->current_import = NULL;
+}
+
 wasm_trap_t* wasm_handle_import(void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
     DRV_DEBUG("generic_import_handler called");
     ImportHook* import_hook = (ImportHook*)env;
     Proc* proc = import_hook->proc;
 
+    // Imports resolved to a native implementation at instantiation time
+    if (import_hook->native) {
+        stats_import(import_hook, 0);
+        return import_hook->native(import_hook, args, results);
+    }
+
     // Check if the field name is "invoke"; if not, exit early
     if (strncmp(import_hook->field_name, "invoke", 6) == 0) {
-        wasm_execute_indirect_function(proc, import_hook->field_name, args, results); 
-        return NULL;
+        stats_import(import_hook, 0);
+        return indirect_call(proc, args, results);
+    }
+
+    return wasm_handle_import_erlang(import_hook, args, results);
+}
+
+wasm_trap_t* wasm_handle_import_erlang(ImportHook* import_hook, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    Proc* proc = import_hook->proc;
+
+    // Output buffered by native imports must reach Erlang before this import
+    // does, so that the two are seen in the order the guest produced them.
+    const char* flush_error = wasi_flush(proc);
+    if (flush_error) {
+        wasm_name_t message;
+        wasm_name_new_from_string_nt(&message, flush_error);
+        return wasm_trap_new(proc->store, &message);
     }
 
     DRV_DEBUG("Proc: %p. Args size: %d", proc, args->size);
     DRV_DEBUG("Import name: %s.%s [%s]", import_hook->module_name, import_hook->field_name, import_hook->signature);
 
     // Initialize the message object
-    ErlDrvTermData* msg = driver_alloc(sizeof(ErlDrvTermData) * ((2+(2*3)) + ((args->size + 1) * 2) + ((results->size + 1) * 2) + 2));
+    PrefetchEntry* prefetch = prefetch_lookup(proc, import_hook);
+    ErlDrvTermData* msg =
+        wasm_import_msg_buffer(proc,
+            import_hook->msg_size + (prefetch ? prefetch_terms(proc, prefetch, args) : 0));
     int msg_index = 0;
     msg[msg_index++] = ERL_DRV_ATOM;
     msg[msg_index++] = atom_import;
@@ -46,105 +118,139 @@ wasm_trap_t* wasm_handle_import(void* env, const wasm_val_vec_t* args, wasm_val_
     msg[msg_index++] = (ErlDrvTermData) import_hook->signature;
     msg[msg_index++] = strlen(import_hook->signature) - 1;
 
+    // Attach the memory the import was registered to read, so that Erlang
+    // does not need to read it back while the instance waits.
+    if (prefetch) {
+        msg_index += prefetch_encode(proc, prefetch, args, &msg[msg_index]);
+    }
+
     // Prepare the message to send to the Erlang side
     msg[msg_index++] = ERL_DRV_TUPLE;
-    msg[msg_index++] = 5;
-
-    // Initialize the result vector and set the required result types
-    proc->current_import = driver_alloc(sizeof(ImportResponse));
-
-    // Create and initialize a is_running and condition variable for the response
-    proc->current_import->response_ready = erl_drv_mutex_create("response_mutex");
-    proc->current_import->cond = erl_drv_cond_create("response_cond");
-    proc->current_import->ready = 0;
-
-    DRV_DEBUG("Sending %d terms...", msg_index);
-    // Send the message to the caller process
-    int msg_res = erl_drv_output_term(proc->port_term, msg, msg_index);
-    // Wait for the response (we set this directly after the message was sent
-    // so we have the lock, before Erlang sends us data back)
-    drv_wait(proc->current_import->response_ready, proc->current_import->cond, &proc->current_import->ready);
+    msg[msg_index++] = prefetch ? 6 : 5;
 
-    DRV_DEBUG("Response ready");
+    trace_event(proc, HB_TRACE_IMPORT_ENTER, import_hook->stats ? import_hook->stats->index : -1);
+    uint64_t wait_start = stats_now();
+    const char* error_message = wasm_import_rendezvous(proc, msg, msg_index);
+    uint64_t wait_ns = stats_now() - wait_start;
+    trace_event(proc, HB_TRACE_IMPORT_EXIT, (int64_t)wait_ns);
+    stats_import(import_hook, wait_ns);
 
     // Handle error in the response
-    if (proc->current_import->error_message) {
-        DRV_DEBUG("Import execution failed. Error message: %s", proc->current_import->error_message);
+    if (error_message) {
+        DRV_DEBUG("Import execution failed. Error message: %s", error_message);
         wasm_name_t message;
-        wasm_name_new_from_string_nt(&message, proc->current_import->error_message);
+        wasm_name_new_from_string_nt(&message, error_message);
         wasm_trap_t* trap = wasm_trap_new(proc->store, &message);
-        driver_free(proc->current_import);
-        proc->current_import = NULL;
+        wasm_import_release(proc);
         return trap;
     }
 
     // Convert the response back to WASM values
     const wasm_valtype_vec_t* result_types = wasm_functype_results(wasm_func_type(import_hook->stub_func));
-    for(int i = 0; i < proc->current_import->result_length; i++) {
+    for(size_t i = 0; i < result_types->size && i < results->size; i++) {
         results->data[i].kind = wasm_valtype_kind(result_types->data[i]);
     }
     int res = erl_terms_to_wasm_vals(results, proc->current_import->result_terms);
     if(res == -1) {
         DRV_DEBUG("Failed to convert terms to wasm vals");
+        wasm_import_release(proc);
         return NULL;
     }
 
     results->num_elems = result_types->num_elems;
 
-    // Clean up
-    DRV_DEBUG("Cleaning up import response");
-    erl_drv_cond_destroy(proc->current_import->cond);
-    erl_drv_mutex_destroy(proc->current_import->response_ready);
-    driver_free(proc->current_import);
-
-    proc->current_import = NULL;
+    wasm_import_release(proc);
     return NULL;
 }
 
+// Frees what an instantiation that failed has created: the stub functions of
+// its imports (with their hooks), its type vectors, its init message and its
+// store, and releases its module.
+static void discard_instantiation(Proc* proc, wasm_extern_vec_t* externs, ImportHook** hooks,
+        wasm_importtype_vec_t* imports, wasm_exporttype_vec_t* exports, ErlDrvTermData* init_msg) {
+    // Deleting the externs deletes the stub functions, after which their
+    // hooks (which refer to the names held by the imports) can go.
+    wasm_extern_vec_delete(externs);
+    for (size_t i = 0; i < imports->size; i++) {
+        if (!hooks[i]) continue;
+        driver_free(hooks[i]->signature);
+        driver_free(hooks[i]);
+    }
+    wasm_importtype_vec_delete(imports);
+    wasm_exporttype_vec_delete(exports);
+    driver_free(init_msg);
+    wasm_store_delete(proc->store);
+    proc->store = NULL;
+    module_cache_release(proc->module_entry);
+    proc->module_entry = NULL;
+}
+
 void wasm_initialize_runtime(void* raw) {
+    threads_enter_runtime();
     DRV_DEBUG("Initializing WASM module");
     LoadWasmReq* mod_bin = (LoadWasmReq*)raw;
     Proc* proc = mod_bin->proc;
     drv_lock(proc->is_running);
+    uint64_t init_start = stats_now();
     // Initialize WASM engine, store, etc.
 
-#if HB_DEBUG==1
-    wasm_runtime_set_log_level(WASM_LOG_LEVEL_VERBOSE);
-#else
-    wasm_runtime_set_log_level(WASM_LOG_LEVEL_ERROR);
-#endif
-
     DRV_DEBUG("Mode: %s", mod_bin->mode);
+    proc->opts = mod_bin->opts;
+    wasi_seed_random(proc);
+
+    // WAMR picks the loader from the image itself: precompiled AOT images
+    // begin with "\0aot", rather than the "\0asm" of WASM bytecode. Make sure
+    // that the image matches the mode that the caller asked for.
+    int is_aot = mod_bin->size >= 4 && memcmp(mod_bin->binary, "\0aot", 4) == 0;
+    const char* mode_error = NULL;
+    if (strcmp(mod_bin->mode, "aot") == 0 && !is_aot) {
+        mode_error = "AOT mode requires a precompiled AOT image.";
+    } else if (strcmp(mod_bin->mode, "wasm") == 0 && is_aot) {
+        mode_error = "WASM mode can not load a precompiled AOT image.";
+    } else if (proc->opts.running_mode != Mode_Default &&
+            !wasm_runtime_is_running_mode_supported(proc->opts.running_mode)) {
+        mode_error = "Engine not supported by this build of the runtime.";
+    } else if (proc->opts.bounds_checks == HB_BOUNDS_HARDWARE && !threads_hw_bounds()) {
+        mode_error = "Hardware bounds checks not supported by this build of the runtime.";
+    } else if (proc->opts.bounds_checks == HB_BOUNDS_SOFTWARE && threads_hw_bounds() && !is_aot) {
+        // The interpreters and JITs of such a runtime check 32-bit memories
+        // with guard regions only. AOT images carry their own checks.
+        mode_error = "Software bounds checks require an AOT image with this build of the runtime.";
+    }
+    if (mode_error) {
+        DRV_DEBUG("%s", mode_error);
+        driver_free(mod_bin->binary);
+        driver_free(mod_bin->mode);
+        driver_free(mod_bin);
+        drv_unlock(proc->is_running);
+        send_error(proc, "%s", mode_error);
+        return;
+    }
+    DRV_DEBUG("Using %s mode.", is_aot ? "AOT" : "WASM");
 
-    // if(strcmp(mod_bin->mode, "wasm") == 0) {
-    //     DRV_DEBUG("Using WASM mode.");
-    //     wasm_runtime_set_default_running_mode(Mode_Interp);
-    // } else {
-    //     DRV_DEBUG("Using AOT mode.");
-    // }
-
-    proc->engine = wasm_engine_new();
-    DRV_DEBUG("Created engine");
+    proc->engine = hb_engine;
     proc->store = wasm_store_new(proc->engine);
     DRV_DEBUG("Created store");
 
-
-    // Load WASM module
-    wasm_byte_vec_t binary;
-    wasm_byte_vec_new(&binary, mod_bin->size, (const wasm_byte_t*)mod_bin->binary);
-
-    proc->module = wasm_module_new(proc->store, &binary);
-    DRV_DEBUG("Module created: %p", proc->module);
-    if (!proc->module) {
+    // Fetch the compiled module from the driver-wide cache, compiling it
+    // only if no other instance has loaded the same image.
+    int cache_hit = 0;
+    uint64_t compile_start = stats_now();
+    proc->module_entry =
+        module_cache_acquire(mod_bin->hash, mod_bin->binary, mod_bin->size, &cache_hit);
+    uint64_t compile_ns = cache_hit ? 0 : stats_now() - compile_start;
+    DRV_DEBUG("Module cache entry: %p. Hit: %d", proc->module_entry, cache_hit);
+    driver_free(mod_bin->binary);
+    driver_free(mod_bin->mode);
+    driver_free(mod_bin);
+    if (!proc->module_entry) {
         DRV_DEBUG("Failed to create module");
-        send_error(proc, "Failed to create module.");
-        wasm_byte_vec_delete(&binary);
         wasm_store_delete(proc->store);
-        wasm_engine_delete(proc->engine);
         drv_unlock(proc->is_running);
+        send_error(proc, "Failed to create module.");
         return;
     }
-    //wasm_byte_vec_delete(&binary);
+    proc->module = proc->module_entry->module;
     DRV_DEBUG("Created module");
 
     // Get imports
@@ -152,6 +258,7 @@ void wasm_initialize_runtime(void* raw) {
     wasm_module_imports(proc->module, &imports);
     DRV_DEBUG("Imports size: %d", imports.size);
     wasm_extern_t *stubs[imports.size];
+    ImportHook* hooks[imports.size];
 
     // Get exports
     wasm_exporttype_vec_t exports;
@@ -176,10 +283,13 @@ void wasm_initialize_runtime(void* raw) {
 
         //DRV_DEBUG("Import: %s.%s", module_name->data, name->data);
 
+        stubs[i] = NULL;
+        hooks[i] = NULL;
         char* type_str = driver_alloc(256);
         // TODO: What happpens here?
         if(!get_function_sig(type, type_str)) {
             // TODO: Handle other types of imports?
+            driver_free(type_str);
             continue;
         }
         // 13 items in the each import message
@@ -203,6 +313,15 @@ void wasm_initialize_runtime(void* raw) {
         hook->field_name = name->data;
         hook->proc = proc;
         hook->signature = type_str;
+        // The import tuple, module and field names, each argument, the
+        // argument list and signature: sized once, so calls need no allocation.
+        const wasm_functype_t* functype = wasm_externtype_as_functype_const(type);
+        hook->msg_size =
+            (2 + (2 * 3)) +
+            ((wasm_functype_params(functype)->size + 1) * 2) +
+            ((wasm_functype_results(functype)->size + 1) * 2) + 2;
+        hook->stats = stats_import_slot(module_name->data, name->data);
+        wasi_resolve_native(hook);
 
         hook->stub_func =
             wasm_func_new_with_env(
@@ -213,6 +332,7 @@ void wasm_initialize_runtime(void* raw) {
                 NULL
             );
         stubs[i] = wasm_func_as_extern(hook->stub_func);
+        hooks[i] = hook;
     }
 
     init_msg[msg_i++] = ERL_DRV_NIL;
@@ -223,18 +343,31 @@ void wasm_initialize_runtime(void* raw) {
     wasm_extern_vec_t externs;
     wasm_extern_vec_new(&externs, imports.size, stubs);
     wasm_trap_t* trap = NULL;
-    proc->instance = wasm_instance_new_with_args(proc->store, proc->module, &externs, &trap, 0x10000, 0x10000);
+    InstantiationArgs inst_args = {
+        .default_stack_size = proc->opts.stack_size ? proc->opts.stack_size : HB_DEFAULT_STACK_SIZE,
+        .host_managed_heap_size = proc->opts.heap_size ? proc->opts.heap_size : HB_DEFAULT_HEAP_SIZE,
+        .max_memory_pages = proc->opts.max_pages
+    };
+    proc->instance = wasm_instance_new_with_args_ex(proc->store, proc->module, &externs, &trap, &inst_args);
     if (!proc->instance) {
         DRV_DEBUG("Failed to create WASM instance");
-        send_error(proc, "Failed to create WASM instance (although module was created).");
+        if (trap) wasm_trap_delete(trap);
+        discard_instantiation(proc, &externs, hooks, &imports, &exports, init_msg);
         drv_unlock(proc->is_running);
+        send_error(proc, "Failed to create WASM instance (although module was created).");
         return;
     }
 
+    if (proc->opts.running_mode != Mode_Default && !is_aot) {
+        DRV_DEBUG("Setting running mode: %d", proc->opts.running_mode);
+        wasm_runtime_set_running_mode(proc->instance->inst_comm_rt, proc->opts.running_mode);
+    }
+
     wasm_extern_vec_t exported_externs;
     wasm_instance_exports(proc->instance, &exported_externs);
 
     // Refresh the exports now that we have an instance
+    wasm_exporttype_vec_delete(&exports);
     wasm_module_exports(proc->module, &exports);
     for (size_t i = 0; i < exports.size; i++) {
         //DRV_DEBUG("Processing export %d", i);
@@ -247,14 +380,13 @@ void wasm_initialize_runtime(void* raw) {
         if (strcmp(name->data, "__indirect_function_table") == 0) {
             DRV_DEBUG("Found indirect function table: %s. Index: %d", name->data, i);
             proc->indirect_func_table_ix = i;
-            const wasm_tabletype_t* table_type = wasm_externtype_as_tabletype_const(type);
-            const wasm_limits_t* table_limits = wasm_tabletype_limits(table_type);
             // Retrieve the indirect function table
             proc->indirect_func_table = wasm_extern_as_table(exported_externs.data[i]);
 
         }
 
         char* type_str = driver_alloc(256);
+        type_str[0] = '\0';
         get_function_sig(type, type_str);
         DRV_DEBUG("Export: %s [%s] -> %s", name->data, kind_str, type_str);
 
@@ -278,67 +410,92 @@ void wasm_initialize_runtime(void* raw) {
     init_msg[msg_i++] = ERL_DRV_TUPLE;
     init_msg[msg_i++] = 3;
 
-    DRV_DEBUG("Sending init message to Erlang. Elements: %d", msg_i);
-
-    int send_res = erl_drv_output_term(proc->port_term, init_msg, msg_i);
-    DRV_DEBUG("Send result: %d", send_res);
+    // Index the exports once, so that calls and memory operations do not
+    // need to scan them again.
+    build_export_table(proc, &exports, &exported_externs);
+
+    // Grow the memory to its initial size in one step, rather than by the
+    // guest's own (smaller) steps, each of which may copy the memory.
+    wasm_memory_t* memory = get_memory(proc);
+    if (memory && proc->opts.initial_pages > wasm_memory_size(memory)) {
+        wasm_memory_pages_t grow = proc->opts.initial_pages - wasm_memory_size(memory);
+        DRV_DEBUG("Reserving %u pages of memory", grow);
+        if (!wasm_memory_grow(memory, grow)) {
+            DRV_DEBUG("Failed to reserve memory: the module's limit is lower");
+            // The export table owns the instance's externs.
+            free_export_table(proc);
+            wasm_instance_delete(proc->instance);
+            proc->instance = NULL;
+            proc->indirect_func_table = NULL;
+            discard_instantiation(proc, &externs, hooks, &imports, &exports, init_msg);
+            drv_unlock(proc->is_running);
+            send_error(proc, "Failed to grow the memory to its initial size.");
+            return;
+        }
+    }
 
     proc->current_import = NULL;
     proc->is_initialized = 1;
+    stats_instance_init(proc, stats_now() - init_start, compile_ns);
+    // Release the instance before replying, so that synchronous memory
+    // operations issued as soon as the reply arrives do not find it busy. The
+    // message only refers to this job's own buffers.
+    ErlDrvTermData port_term = proc->port_term;
     drv_unlock(proc->is_running);
-}
 
-void wasm_execute_function(void* raw) {
-    Proc* proc = (Proc*)raw;
-    DRV_DEBUG("Calling function: %s", proc->current_function);
-    drv_lock(proc->is_running);
-    char* function_name = proc->current_function;
-
-    // Find the function in the exports
-    wasm_func_t* func = get_exported_function(proc, function_name);
-    if (!func) {
-        send_error(proc, "Function not found: %s", function_name);
-        drv_unlock(proc->is_running);
-        return;
-    }
-    DRV_DEBUG("Func: %p", func);
-
-    const wasm_functype_t* func_type = wasm_func_type(func);
-    const wasm_valtype_vec_t* param_types = wasm_functype_params(func_type);
-    const wasm_valtype_vec_t* result_types = wasm_functype_results(func_type);
-
-    wasm_val_vec_t args, results;
-    wasm_val_vec_new_uninitialized(&args, param_types->size);
-    args.num_elems = param_types->num_elems;
-    // CONV: ei_term* -> wasm_val_vec_t
-    for(int i = 0; i < param_types->size; i++) {
-        args.data[i].kind = wasm_valtype_kind(param_types->data[i]);
-    }
-    int res = erl_terms_to_wasm_vals(&args, proc->current_args);
+    DRV_DEBUG("Sending init message to Erlang. Elements: %d", msg_i);
+    int send_res = erl_drv_output_term(port_term, init_msg, msg_i);
+    DRV_DEBUG("Send result: %d", send_res);
+    wasm_exporttype_vec_delete(&exports);
+    driver_free(init_msg);
+}
 
-    for(int i = 0; i < args.size; i++) {
-        DRV_DEBUG("Arg %d: %d", i, args.data[i].of.i64);
-        DRV_DEBUG("Source term: %d", proc->current_args[i].value.i_val);
+// Finds an export to call, and allocates the vector of its arguments.
+static ExportEntry* prepare_call(Proc* proc, const char* function_name, wasm_val_vec_t* args, char* error, size_t error_len) {
+    ExportEntry* export = lookup_export(proc, function_name);
+    if (!export) {
+        snprintf(error, error_len, "Function not found: %s", function_name);
+        return NULL;
     }
-
-    if(res == -1) {
-        send_error(proc, "Failed to convert terms to wasm vals");
-        drv_unlock(proc->is_running);
-        return;
+    DRV_DEBUG("Func: %p", export->func);
+    wasm_val_vec_new_uninitialized(args, export->param_count);
+    args->num_elems = export->param_count;
+    for(int i = 0; i < export->param_count; i++) {
+        args->data[i].kind = export->param_kinds[i];
     }
+    return export;
+}
 
-    wasm_val_vec_new_uninitialized(&results, result_types->size);
-    results.num_elems = result_types->num_elems;
-    for (size_t i = 0; i < result_types->size; i++) {
-        results.data[i].kind = wasm_valtype_kind(result_types->data[i]);
+// Runs a call whose arguments are prepared, deleting them.
+static int invoke_export(Proc* proc, ExportEntry* export, const char* function_name, wasm_val_vec_t* args, wasm_val_vec_t* results, char* error, size_t error_len) {
+    wasm_func_t* func = export->func;
+    wasm_val_vec_new_uninitialized(results, export->result_count);
+    results->num_elems = export->result_count;
+    for (size_t i = 0; i < export->result_count; i++) {
+        results->data[i].kind = export->result_kinds[i];
     }
 
     proc->exec_env = wasm_runtime_get_exec_env_singleton(func->inst_comm_rt);
 
     // Call the function
     DRV_DEBUG("Calling function: %s", function_name);
-    wasm_trap_t* trap = wasm_func_call(func, &args, &results);
-    
+    trace_event(proc, HB_TRACE_CALL_START, 0);
+    uint64_t call_start = stats_now();
+    wasm_trap_t* trap = wasm_func_call(func, args, results);
+    uint64_t call_ns = stats_now() - call_start;
+    if (trap) trace_event(proc, HB_TRACE_TRAP, 0);
+    trace_event(proc, HB_TRACE_CALL_END, (int64_t)call_ns);
+    stats_call(proc, call_ns, trap != NULL);
+    wasm_val_vec_delete(args);
+
+    // Deliver any output that the guest buffered through native imports
+    // before the result of the call.
+    const char* flush_error = wasi_flush(proc);
+    if (!trap && flush_error) {
+        snprintf(error, error_len, "%s", flush_error);
+        wasm_val_vec_delete(results);
+        return -1;
+    }
 
     if (trap) {
         wasm_message_t trap_msg;
@@ -349,167 +506,461 @@ void wasm_execute_function(void* raw) {
         // char* func_name;
 
         // DRV_DEBUG("WASM Exception: [func_index: %d, func_offset: %d] %.*s", func_index, func_offset, trap_msg.size, trap_msg.data);
-        send_error(proc, "%.*s", trap_msg.size, trap_msg.data);
-        drv_unlock(proc->is_running);
-        return;
+        snprintf(error, error_len, "%.*s", (int)trap_msg.size, trap_msg.data);
+        wasm_byte_vec_delete(&trap_msg);
+        wasm_trap_delete(trap);
+        wasm_val_vec_delete(results);
+        return -1;
     }
 
-    // Send the results back to Erlang
-    DRV_DEBUG("Results size: %d", results.size);
-    ErlDrvTermData* msg = driver_alloc(sizeof(ErlDrvTermData) * (7 + (results.size * 2)));
-    DRV_DEBUG("Allocated msg");
-    int msg_index = 0;
-    msg[msg_index++] = ERL_DRV_ATOM;
-    msg[msg_index++] = atom_execution_result;
-    for (size_t i = 0; i < results.size; i++) {
+    DRV_DEBUG("Results size: %d", results->size);
+    for (size_t i = 0; i < results->size; i++) {
         DRV_DEBUG("Processing result %d", i);
-        DRV_DEBUG("Result type: %d", results.data[i].kind);
-        switch(results.data[i].kind) {
+        DRV_DEBUG("Result type: %d", results->data[i].kind);
+        switch(results->data[i].kind) {
             case WASM_I32:
-                DRV_DEBUG("Value: %d", results.data[i].of.i32);
+                DRV_DEBUG("Value: %d", results->data[i].of.i32);
                 break;
             case WASM_I64:
-                DRV_DEBUG("Value: %ld", results.data[i].of.i64);
+                DRV_DEBUG("Value: %ld", results->data[i].of.i64);
                 break;
             case WASM_F32:
-                DRV_DEBUG("Value: %f", results.data[i].of.f32);
+                DRV_DEBUG("Value: %f", results->data[i].of.f32);
                 break;
             case WASM_F64:
-                DRV_DEBUG("Value: %f", results.data[i].of.f64);
+                DRV_DEBUG("Value: %f", results->data[i].of.f64);
                 break;
             default:
-                DRV_DEBUG("Unknown result type.", results.data[i].kind);
+                DRV_DEBUG("Unknown result type.", results->data[i].kind);
                 break;
         }
-        
-        int res_size = wasm_val_to_erl_term(&msg[msg_index], &results.data[i]);
-        msg_index += res_size;
     }
-    msg[msg_index++] = ERL_DRV_NIL;
-    msg[msg_index++] = ERL_DRV_LIST;
-    msg[msg_index++] = results.size + 1;
-    msg[msg_index++] = ERL_DRV_TUPLE;
-    msg[msg_index++] = 2;
-    DRV_DEBUG("Sending %d terms", msg_index);
-    int response_msg_res = erl_drv_output_term(proc->port_term, msg, msg_index);
-    driver_free(msg);
-    DRV_DEBUG("Msg: %d", response_msg_res);
-
-    wasm_val_vec_delete(&results);
-    proc->current_import = NULL;
-
-	DRV_DEBUG("Unlocking is_running mutex: %p", proc->is_running);
-    drv_unlock(proc->is_running);
+    return 0;
 }
 
-int wasm_execute_indirect_function(Proc* proc, const char *field_name, const wasm_val_vec_t* input_args, wasm_val_vec_t* output_results) {
-
-
-    DRV_DEBUG("=================================================");
-    DRV_DEBUG("Starting function invocation");
-    DRV_DEBUG("=================================================");
-
-    wasm_table_t* indirect_function_table = proc->indirect_func_table;
+// Calls an exported function with arguments decoded from Erlang. On success
+// the results vector holds the function's results, and must be deleted by the
+// caller. On failure, an error message is written to `error`.
+static int call_export(Proc* proc, const char* function_name, ei_term* arg_terms, wasm_val_vec_t* results, char* error, size_t error_len) {
+    wasm_val_vec_t args;
+    ExportEntry* export = prepare_call(proc, function_name, &args, error, error_len);
+    if (!export) return -1;
+    // CONV: ei_term* -> wasm_val_vec_t
+    int res = erl_terms_to_wasm_vals(&args, arg_terms);
 
+    for(int i = 0; i < args.size; i++) {
+        DRV_DEBUG("Arg %d: %d", i, args.data[i].of.i64);
+        DRV_DEBUG("Source term: %d", arg_terms[i].value.i_val);
+    }
 
-    int result = 0;
-    DRV_DEBUG("Function name: %s", field_name);
+    if(res == -1) {
+        snprintf(error, error_len, "Failed to convert terms to wasm vals");
+        wasm_val_vec_delete(&args);
+        return -1;
+    }
+    return invoke_export(proc, export, function_name, &args, results, error, error_len);
+}
 
-// Extract the function index from the input arguments
-    int function_index = input_args->data[0].of.i32;  
-    DRV_DEBUG("Function index retrieved from input_args: %d", function_index);
+// Calls an exported function with arguments packed by Erlang for a signature,
+// which must be that of the export. As call_export otherwise.
+static int call_export_packed(Proc* proc, const char* function_name, const char* sig, const char* packed, long packed_len, wasm_val_vec_t* results, char* error, size_t error_len) {
+    wasm_val_vec_t args;
+    char expected[256];
+    ExportEntry* export = prepare_call(proc, function_name, &args, error, error_len);
+    if (!export) return -1;
+    if (export_signature(export, expected, sizeof(expected)) != 0 || strcmp(expected, sig) != 0) {
+        snprintf(error, error_len, "Signature mismatch for %s: expected %s, got %s", function_name, expected, sig);
+        wasm_val_vec_delete(&args);
+        return -1;
+    }
+    if (unpack_wasm_vals(&args, (const byte_t*)packed, (size_t)packed_len) != 0) {
+        snprintf(error, error_len, "Failed to unpack arguments of %s", function_name);
+        wasm_val_vec_delete(&args);
+        return -1;
+    }
+    return invoke_export(proc, export, function_name, &args, results, error, error_len);
+}
 
-    // Get the function reference from the table and cast it to a function
-    wasm_ref_t* function_ref = wasm_table_get(indirect_function_table, function_index);
-    const wasm_func_t* func = wasm_ref_as_func(function_ref);
-    DRV_DEBUG("Function pointer: %p", func);
+// Calls an export with v128 parameters or results, which the C API's values
+// can not hold, through the runtime API instead. Packed values are laid out
+// as the runtime's argument cells (see packed_size), so the arguments are
+// copied in, and the results out, as they are. On success, `out' holds the
+// packed results, and must be freed by the caller.
+static int call_export_cells(Proc* proc, ExportEntry* export, const char* function_name, const char* sig, const char* packed, long packed_len, byte_t** out, size_t* out_len, char* error, size_t error_len) {
+    char expected[256];
+    if (export_signature(export, expected, sizeof(expected)) != 0 || strcmp(expected, sig) != 0) {
+        snprintf(error, error_len, "Signature mismatch for %s: expected %s, got %s", function_name, expected, sig);
+        return -1;
+    }
+    size_t params_len = packed_size(export->param_kinds, export->param_count);
+    size_t results_len = packed_size(export->result_kinds, export->result_count);
+    if ((export->param_count > 0 && params_len == 0) ||
+            (export->result_count > 0 && results_len == 0) ||
+            (size_t)packed_len != params_len) {
+        snprintf(error, error_len, "Failed to unpack arguments of %s", function_name);
+        return -1;
+    }
+    // Arguments go in, and results come out, in the same buffer.
+    size_t cells_len = params_len > results_len ? params_len : results_len;
+    uint32_t* argv = driver_alloc(cells_len ? cells_len : sizeof(uint32_t));
+    if (params_len > 0) memcpy(argv, packed, params_len);
 
-    // Retrieve the function type and log its parameters and results
-    const wasm_functype_t* function_type = wasm_func_type(func);
-    if (!function_type) {
-        DRV_DEBUG("Failed to retrieve function type for function at index %d", function_index);
+    wasm_func_t* func = export->func;
+    proc->exec_env = wasm_runtime_get_exec_env_singleton(func->inst_comm_rt);
+    DRV_DEBUG("Calling function with v128 values: %s", function_name);
+    trace_event(proc, HB_TRACE_CALL_START, 0);
+    uint64_t call_start = stats_now();
+    int ok = wasm_runtime_call_wasm(proc->exec_env, func->func_comm_rt, params_len / 4, argv);
+    uint64_t call_ns = stats_now() - call_start;
+    if (!ok) trace_event(proc, HB_TRACE_TRAP, 0);
+    trace_event(proc, HB_TRACE_CALL_END, (int64_t)call_ns);
+    stats_call(proc, call_ns, !ok);
+
+    const char* flush_error = wasi_flush(proc);
+    if (!ok) {
+        const char* exception = wasm_runtime_get_exception(func->inst_comm_rt);
+        snprintf(error, error_len, "%s", exception ? exception : "Call failed");
+        wasm_runtime_clear_exception(func->inst_comm_rt);
+        driver_free(argv);
+        return -1;
+    }
+    if (flush_error) {
+        snprintf(error, error_len, "%s", flush_error);
+        driver_free(argv);
+        return -1;
     }
+    *out = (byte_t*)argv;
+    *out_len = results_len;
+    return 0;
+}
 
-    // Log the function's parameter types
-    const wasm_valtype_vec_t* param_types = wasm_functype_params(function_type);
-    DRV_DEBUG("Function at index %d has %zu parameters", function_index, param_types->size);
-    for (size_t j = 0; j < param_types->size; ++j) {
-        const wasm_valtype_t* param_type = param_types->data[j];
-        wasm_valkind_t param_kind = wasm_valtype_kind(param_type);
-        DRV_DEBUG("Param %zu: %s", j, get_wasm_type_name(param_kind));
+// Encodes a vector of results as an Erlang list, returning the number of
+// terms written. Requires (results->size * 2) + 3 terms of space.
+static int encode_results(ErlDrvTermData* msg, const wasm_val_vec_t* results) {
+    int msg_index = 0;
+    for (size_t i = 0; i < results->size; i++) {
+        msg_index += wasm_val_to_erl_term(&msg[msg_index], &results->data[i]);
     }
+    msg[msg_index++] = ERL_DRV_NIL;
+    msg[msg_index++] = ERL_DRV_LIST;
+    msg[msg_index++] = results->size + 1;
+    return msg_index;
+}
 
-    
-    // Log the function's result types
-    const wasm_valtype_vec_t* result_types = wasm_functype_results(function_type);
-    DRV_DEBUG("Function at index %d has %zu results", function_index, result_types->size);
-    for (size_t k = 0; k < result_types->size; ++k) {
-        const wasm_valtype_t* result_type = result_types->data[k];
-        wasm_valkind_t result_kind = wasm_valtype_kind(result_type);
-        DRV_DEBUG("Result %zu: %s", k, get_wasm_type_name(result_kind));
+void wasm_execute_call(Proc* proc, QueuedCommand* cmd) {
+    DRV_DEBUG("Calling function: %s", cmd->function_name);
+    drv_lock(proc->is_running);
+    char* function_name = cmd->function_name;
+    uint64_t request_id = cmd->request_id;
+    // The memory to attach to imports during this call, if any.
+    prefetch_install(proc, cmd->prefetch, cmd->prefetch_count);
+    cmd->prefetch = NULL;
+    cmd->prefetch_count = 0;
+
+    wasm_val_vec_t results;
+    wasm_val_vec_new_empty(&results);
+    // The packed results of calls with v128 values, which bypass `results'.
+    byte_t* cell_results = NULL;
+    size_t cell_results_len = 0;
+    char error[256];
+    budget_enter(proc, cmd->fuel, cmd->time_ms, cmd->budget_seq);
+    int packed = cmd->sig[0] != '\0';
+    ExportEntry* export = lookup_export(proc, function_name);
+    int res;
+    if (export && export->has_v128) {
+        if (packed) {
+            res = call_export_cells(proc, export, function_name, cmd->sig, cmd->data,
+                cmd->data_size, &cell_results, &cell_results_len, error, sizeof(error));
+        } else {
+            snprintf(error, sizeof(error),
+                "%s takes or returns v128 values, which need a packed call", function_name);
+            res = -1;
+        }
+    } else {
+        res = packed ?
+            call_export_packed(proc, function_name, cmd->sig,
+                cmd->data, cmd->data_size, &results, error, sizeof(error)) :
+            call_export(proc, function_name, cmd->args, &results, error, sizeof(error));
+    }
+    // As on success, the instance is released before any reply, so that the
+    // caller can use it as soon as it has the reply.
+    if (budget_leave(proc, res != 0 ? error : NULL) == HB_BUDGET_EXHAUSTED) {
+        drv_unlock(proc->is_running);
+        budget_send_exhausted(proc->port_term, request_id);
+        return;
+    }
+    if (res != 0) {
+        drv_unlock(proc->is_running);
+        send_reply_error(proc, request_id, "%s", error);
+        return;
     }
 
-    // Prepare the arguments for the function call
-    wasm_val_vec_t prepared_args;
-        // If there are no arguments or only one argument (function index), no preparation is needed
-    if (input_args->size <= 1) {
-        DRV_DEBUG("Not enough arguments to create new wasm_val_vec_t");
-        return 0;
+    // Send the results back to Erlang: as a list of terms, or packed into a
+    // binary in the layout of the arguments.
+    byte_t packed_results[8 * (results.size ? results.size : 1)];
+    ErlDrvTermData* msg = driver_alloc(sizeof(ErlDrvTermData) * (7 + (results.size * 2)));
+    DRV_DEBUG("Allocated msg");
+    int msg_index = 0;
+    msg[msg_index++] = ERL_DRV_ATOM;
+    msg[msg_index++] = atom_execution_result;
+    if (cell_results) {
+        msg[msg_index++] = ERL_DRV_BUF2BINARY;
+        msg[msg_index++] = (ErlDrvTermData)cell_results;
+        msg[msg_index++] = (ErlDrvTermData)cell_results_len;
+    } else if (packed) {
+        msg[msg_index++] = ERL_DRV_BUF2BINARY;
+        msg[msg_index++] = (ErlDrvTermData)packed_results;
+        msg[msg_index++] = (ErlDrvTermData)pack_wasm_vals(&results, packed_results);
+    } else {
+        msg_index += encode_results(&msg[msg_index], &results);
     }
+    msg[msg_index++] = ERL_DRV_TUPLE;
+    msg[msg_index++] = 2;
+    proc->current_import = NULL;
 
-    // Allocate memory for the prepared arguments
-    wasm_val_t* prepared_data = malloc(sizeof(wasm_val_t) * (input_args->size - 1));
+    // As on initialization, the instance is released before the reply.
+	DRV_DEBUG("Unlocking is_running mutex: %p", proc->is_running);
+    ErlDrvTermData port_term = proc->port_term;
+    drv_unlock(proc->is_running);
 
-    // Copy the arguments starting from the second element (skip function index)
-    for (size_t i = 1; i < input_args->size; ++i) {
-        prepared_data[i - 1] = input_args->data[i];
-    }
+    DRV_DEBUG("Sending %d terms", msg_index);
+    int response_msg_res = drv_output_reply(port_term, request_id, msg, msg_index);
+    driver_free(msg);
+    DRV_DEBUG("Msg: %d", response_msg_res);
+    if (cell_results) driver_free(cell_results);
+    wasm_val_vec_delete(&results);
+}
 
-    // Create a new wasm_val_vec_t with the prepared arguments
-    wasm_val_vec_new(&prepared_args, input_args->size - 1, prepared_data);
-    DRV_DEBUG("Prepared %zu arguments for function call", prepared_args.size);
+void wasm_execute_batch(void* raw) {
+    threads_enter_runtime();
+    CallBatch* batch = (CallBatch*)raw;
+    Proc* proc = batch->proc;
+    DRV_DEBUG("Executing batch of %d calls", batch->count);
+    drv_lock(proc->is_running);
 
-    uint64_t argc = prepared_args.size;
-    uint64_t* argv = malloc(sizeof(uint64_t) * argc);
-    
-    // Convert prepared arguments to an array of 64-bit integers
-    for (uint64_t i = 0; i < argc; ++i) {
-        argv[i] = prepared_args.data[i].of.i64;
+    // Results are kept until the whole batch has run, as the reply message
+    // refers to the 64-bit and float values by pointer.
+    wasm_val_vec_t* results = driver_alloc(sizeof(wasm_val_vec_t) * (batch->count ? batch->count : 1));
+    int msg_size = 7;
+    char error[256];
+    for (int i = 0; i < batch->count; i++) {
+        BatchItem* item = &batch->items[i];
+        DRV_DEBUG("Batch call %d: %s", i, item->function_name);
+        if (call_export(proc, item->function_name, item->args, &results[i], error, sizeof(error)) != 0) {
+            DRV_DEBUG("Batch call %d failed: %s", i, error);
+            for (int j = 0; j < i; j++) {
+                wasm_val_vec_delete(&results[j]);
+            }
+            driver_free(results);
+            free_call_batch(batch);
+            proc->current_import = NULL;
+            drv_unlock(proc->is_running);
+            // Reply with {error, {Index, Message}}, using a 1-based index.
+            ErlDrvTermData msg[] = {
+                ERL_DRV_ATOM, atom_error,
+                ERL_DRV_INT, (ErlDrvTermData)(i + 1),
+                ERL_DRV_STRING, (ErlDrvTermData)error, strlen(error),
+                ERL_DRV_TUPLE, 2,
+                ERL_DRV_TUPLE, 2
+            };
+            erl_drv_output_term(proc->port_term, msg, sizeof(msg) / sizeof(msg[0]));
+            return;
+        }
+        msg_size += (results[i].size * 2) + 3;
+    }
+
+    ErlDrvTermData* msg = driver_alloc(sizeof(ErlDrvTermData) * msg_size);
+    int msg_index = 0;
+    msg[msg_index++] = ERL_DRV_ATOM;
+    msg[msg_index++] = atom_execution_result;
+    for (int i = 0; i < batch->count; i++) {
+        msg_index += encode_results(&msg[msg_index], &results[i]);
     }
+    msg[msg_index++] = ERL_DRV_NIL;
+    msg[msg_index++] = ERL_DRV_LIST;
+    msg[msg_index++] = batch->count + 1;
+    msg[msg_index++] = ERL_DRV_TUPLE;
+    msg[msg_index++] = 2;
+    proc->current_import = NULL;
+    ErlDrvTermData port_term = proc->port_term;
+    drv_unlock(proc->is_running);
 
+    DRV_DEBUG("Sending %d terms for batch", msg_index);
+    erl_drv_output_term(port_term, msg, msg_index);
+    driver_free(msg);
 
-    /* ---------------- STACK SAVE -----------------*/
+    for (int i = 0; i < batch->count; i++) {
+        wasm_val_vec_delete(&results[i]);
+    }
+    driver_free(results);
+    free_call_batch(batch);
+}
 
-    // const char* stack_save_name = "emscripten_stack_get_current";
-    // wasm_val_t *stack_save_params = NULL;
-    // wasm_val_t stack_save_results[1];
-    // if (call_exported_function_runtime(proc, stack_save_name, stack_save_params, stack_save_results) != 0) {
-    //     DRV_DEBUG("Failed to call stack save function");
-    // }
+void free_call_batch(CallBatch* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        driver_free(batch->items[i].function_name);
+        if (batch->items[i].args) driver_free(batch->items[i].args);
+    }
+    driver_free(batch->items);
+    driver_free(batch);
+}
 
-    /* ---------------- STACK SAVE -----------------*/
+// Calls an export of a single integer argument, such as `malloc' or `free',
+// yielding its first result (or 0, if it has none).
+static int call_export_u64(Proc* proc, const char* function_name, uint64_t arg, uint64_t* result, char* error, size_t error_len) {
+    ei_term term;
+    memset(&term, 0, sizeof(term));
+    term.value.i_val = (long)arg;
+    wasm_val_vec_t results;
+    if (call_export(proc, function_name, &term, &results, error, error_len) != 0) return -1;
+    *result = results.size > 0 ? wasm_arg_u64(&results, 0) : 0;
+    wasm_val_vec_delete(&results);
+    return 0;
+}
 
-    // Attempt to call the function and check for any exceptions
-    if (!wasm_runtime_call_indirect(proc->exec_env, function_index, argc, argv)) {
-        if (wasm_runtime_get_exception(proc->exec_env)) {
-            DRV_DEBUG("%s", wasm_runtime_get_exception(proc->exec_env));
+// Copies an input buffer into a fresh, NUL-terminated allocation in the guest.
+static int place_buffer(Proc* proc, int i, const char* data, long size, uint64_t* ptr, char* error, size_t error_len) {
+    if (call_export_u64(proc, "malloc", (uint64_t)size + 1, ptr, error, error_len) != 0) return -1;
+    // The allocation may have grown the memory, so it is looked up afresh.
+    wasm_memory_t* memory = get_memory(proc);
+    if (*ptr == 0 || !memory ||
+            !memory_in_bounds(*ptr, (uint64_t)size + 1, (uint64_t)get_memory_size(proc))) {
+        snprintf(error, error_len, "Failed to allocate input buffer %d.", i + 1);
+        return -1;
+    }
+    byte_t* memory_data = wasm_memory_data(memory);
+    memcpy(memory_data + *ptr, data, size);
+    memory_data[*ptr + size] = '\0';
+    stats_memory(proc, 0, size + 1);
+    return 0;
+}
+
+// Finds the NUL-terminated string that each result of a call points to.
+static int find_outputs(Proc* proc, const wasm_val_vec_t* results, uint64_t* ptrs, uint64_t* lens, char* error, size_t error_len) {
+    wasm_memory_t* memory = get_memory(proc);
+    uint64_t memory_size = memory ? (uint64_t)get_memory_size(proc) : 0;
+    for (size_t i = 0; i < results->size; i++) {
+        int kind = results->data[i].kind;
+        ptrs[i] = (kind == WASM_I32 || kind == WASM_I64) ? wasm_arg_u64(results, i) : 0;
+        const byte_t* end = ptrs[i] < memory_size ?
+            memchr(wasm_memory_data(memory) + ptrs[i], '\0', memory_size - ptrs[i]) : NULL;
+        if (!end) {
+            snprintf(error, error_len, "Result %d is not a pointer to a string.", (int)i + 1);
+            return -1;
         }
-        DRV_DEBUG("WASM function call failed");
-        result = -1;
+        lens[i] = (uint64_t)(end - (wasm_memory_data(memory) + ptrs[i]));
+        stats_memory(proc, lens[i], 0);
     }
+    return 0;
+}
 
-    if(result != 0) {
+void wasm_execute_buffer_call(void* raw) {
+    threads_enter_runtime();
+    BufferCall* call = (BufferCall*)raw;
+    Proc* proc = call->proc;
+    DRV_DEBUG("Calling %s with %d buffers", call->function_name, call->count);
+    drv_lock(proc->is_running);
 
-    
+    char error[256];
+    int slots = call->count ? call->count : 1;
+    uint64_t* inputs = driver_alloc(sizeof(uint64_t) * slots);
+    ei_term* args = driver_alloc(sizeof(ei_term) * slots);
+    memset(args, 0, sizeof(ei_term) * slots);
+    wasm_val_vec_t results;
+    int placed = 0, called = 0, exhausted = 0;
+    uint64_t *output_ptrs = NULL, *output_lens = NULL;
+
+    // Imports of the call are not prefetched.
+    prefetch_free(proc);
+    budget_enter(proc, call->fuel, call->time_ms, call->budget_seq);
+    int res = 0;
+    for (; res == 0 && placed < call->count; placed++) {
+        res = place_buffer(proc, placed, call->data[placed], call->sizes[placed],
+            &inputs[placed], error, sizeof(error));
+        args[placed].value.i_val = (long)inputs[placed];
+    }
+    if (res == 0) {
+        res = call_export(proc, call->function_name, args, &results, error, sizeof(error));
+        called = res == 0;
+    }
+    if (called) {
+        output_ptrs = driver_alloc(sizeof(uint64_t) * (results.size ? results.size : 1));
+        output_lens = driver_alloc(sizeof(uint64_t) * (results.size ? results.size : 1));
+        res = find_outputs(proc, &results, output_ptrs, output_lens, error, sizeof(error));
+    }
+    exhausted = budget_leave(proc, res != 0 ? error : NULL) == HB_BUDGET_EXHAUSTED;
+    if (exhausted || res != 0) goto done;
+
+    // The outputs are copied out of the guest before it may free them, and
+    // before the instance is released to other (synchronous) users.
+    uint64_t total = 0;
+    for (size_t i = 0; i < results.size; i++) total += output_lens[i];
+    char* outputs = driver_alloc(total ? total : 1);
+    ErlDrvTermData* msg = driver_alloc(sizeof(ErlDrvTermData) * (7 + (results.size * 3)));
+    const byte_t* memory_data = wasm_memory_data(get_memory(proc));
+    int msg_index = 0;
+    msg[msg_index++] = ERL_DRV_ATOM;
+    msg[msg_index++] = atom_execution_result;
+    for (size_t i = 0, offset = 0; i < results.size; offset += output_lens[i], i++) {
+        memcpy(outputs + offset, memory_data + output_ptrs[i], output_lens[i]);
+        msg[msg_index++] = ERL_DRV_BUF2BINARY;
+        msg[msg_index++] = (ErlDrvTermData)(outputs + offset);
+        msg[msg_index++] = (ErlDrvTermData)output_lens[i];
+    }
+    msg[msg_index++] = ERL_DRV_NIL;
+    msg[msg_index++] = ERL_DRV_LIST;
+    msg[msg_index++] = results.size + 1;
+    msg[msg_index++] = ERL_DRV_TUPLE;
+    msg[msg_index++] = 2;
 
+    if (call->free_buffers && lookup_export(proc, "free")) {
+        uint64_t ignored;
+        for (int i = 0; i < placed; i++) {
+            call_export_u64(proc, "free", inputs[i], &ignored, error, sizeof(error));
+        }
+        for (size_t i = 0; i < results.size; i++) {
+            call_export_u64(proc, "free", output_ptrs[i], &ignored, error, sizeof(error));
+        }
     }
+    proc->current_import = NULL;
+    ErlDrvTermData port_term = proc->port_term;
+    drv_unlock(proc->is_running);
 
+    DRV_DEBUG("Sending %d terms for buffer call", msg_index);
+    erl_drv_output_term(port_term, msg, msg_index);
+    driver_free(msg);
+    driver_free(outputs);
+    driver_free(output_ptrs);
+    driver_free(output_lens);
+    wasm_val_vec_delete(&results);
+    driver_free(inputs);
+    driver_free(args);
+    free_buffer_call(call);
+    return;
+
+done:
+    // The call failed: the instance is released before the reply, as on
+    // success.
+    proc->current_import = NULL;
+    drv_unlock(proc->is_running);
+    if (exhausted) budget_send_exhausted(proc->port_term, 0);
+    else send_error(proc, "%s", error);
+    if (called) wasm_val_vec_delete(&results);
+    if (output_ptrs) driver_free(output_ptrs);
+    if (output_lens) driver_free(output_lens);
+    driver_free(inputs);
+    driver_free(args);
+    free_buffer_call(call);
+}
 
-    // Free allocated memory
-    free(argv);
-    free(prepared_args.data);
-    DRV_DEBUG("Function call completed successfully");
-    return result;
+void free_buffer_call(BufferCall* call) {
+    for (int i = 0; i < call->count; i++) {
+        driver_free(call->data[i]);
+    }
+    if (call->data) driver_free(call->data);
+    if (call->sizes) driver_free(call->sizes);
+    driver_free(call->function_name);
+    driver_free(call);
 }
 
 int wasm_execute_exported_function(Proc* proc, const *function_name, wasm_val_t* params, wasm_val_t * results) {
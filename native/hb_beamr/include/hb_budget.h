@@ -0,0 +1,120 @@
+#ifndef HB_BUDGET_H
+#define HB_BUDGET_H
+
+#include "hb_core.h"
+
+// Returned by budget_check when a call was stopped for exceeding its budget.
+#define HB_BUDGET_EXHAUSTED 1
+
+/*
+ * Function: budget_init
+ * --------------------
+ * Initializes the execution budget of a process, with no limits.
+ *
+ *  proc: The process structure to initialize the budget of.
+ */
+void budget_init(Proc* proc);
+
+/*
+ * Function: budget_destroy
+ * --------------------
+ * Cancels the budget's timer and frees its lock. Called when the port stops.
+ *
+ *  proc: The process structure whose budget to destroy.
+ */
+void budget_destroy(Proc* proc);
+
+/*
+ * Function: budget_decode
+ * --------------------
+ * Decodes a `{Fuel, TimeMs}' budget for a call, where either may be 0 for no
+ * limit. The budget is kept with the call until it is armed and entered, as
+ * calls may be queued behind others.
+ *
+ *  buff: The buffer containing the encoded tuple.
+ *  index: The index in the buffer, advanced past the tuple.
+ *  fuel: Set to the instruction limit of the call.
+ *  time_ms: Set to the time limit of the call.
+ *  error: The message to report if the budget is invalid or unsupported.
+ *
+ *  returns: 0 on success, or -1 on failure.
+ */
+int budget_decode(const char* buff, int* index, long* fuel, long* time_ms, const char** error);
+
+/*
+ * Function: budget_arm
+ * --------------------
+ * Called on the scheduler thread, just before a call is submitted. Gives the
+ * call its sequence number and, if it has a time limit, sets the port's timer
+ * to go off no later than the limit from now. The time limit counts from when
+ * the call starts, so excludes any time spent queued behind other calls.
+ *
+ *  proc: The process structure of the call.
+ *  time_ms: The time limit of the call, or 0 for none.
+ *
+ *  returns: The sequence number of the call, to enter it with.
+ */
+unsigned long budget_arm(Proc* proc, long time_ms);
+
+/*
+ * Function: budget_cancel
+ * --------------------
+ * Called on the scheduler thread for an armed call that is cancelled before
+ * it starts, so that the timer no longer waits on it.
+ *
+ *  proc: The process structure of the call.
+ *  time_ms: The time limit the call was armed with, or 0 for none.
+ */
+void budget_cancel(Proc* proc, long time_ms);
+
+/*
+ * Function: budget_enter
+ * --------------------
+ * Called by a call's job before executing it, with the instance locked. Marks
+ * the call as running and starts its time limit, so that the timer can
+ * terminate it, and sets its instruction limit.
+ *
+ *  proc: The process structure of the call.
+ *  fuel: The instruction limit of the call, or 0 for none.
+ *  time_ms: The time limit of the call, or 0 for none.
+ *  seq: The sequence number the call was armed with.
+ */
+void budget_enter(Proc* proc, long fuel, long time_ms, unsigned long seq);
+
+/*
+ * Function: budget_leave
+ * --------------------
+ * Called by a call's job after executing it. Marks the call as finished, and
+ * clears its instruction limit.
+ *
+ *  proc: The process structure of the call.
+ *  error: The error the call failed with, or NULL if it succeeded.
+ *
+ *  returns: HB_BUDGET_EXHAUSTED if the call failed for exceeding its budget,
+ *      or 0 otherwise.
+ */
+int budget_leave(Proc* proc, const char* error);
+
+/*
+ * Function: budget_timeout
+ * --------------------
+ * Handles the expiry of a budget's timer, terminating the running call if
+ * its time has run out. The timer is set again for the rest of the running
+ * call's time, or for the calls yet to start. Runs on a scheduler thread, as
+ * the driver's timeout callback.
+ *
+ *  proc: The process structure whose timer expired.
+ */
+void budget_timeout(Proc* proc);
+
+/*
+ * Function: budget_send_exhausted
+ * --------------------
+ * Sends `{error, budget_exhausted}' to the port's owner.
+ *
+ *  port_term: The port to send the message from.
+ *  request_id: The request to tag the message with, or 0 (see drv_output_reply).
+ */
+void budget_send_exhausted(ErlDrvTermData port_term, uint64_t request_id);
+
+#endif
@@ -5,6 +5,7 @@
 #include <ei.h>
 #include <wasm_c_api.h>
 #include <wasm_export.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
@@ -14,51 +15,294 @@
 typedef struct {
     ErlDrvMutex* response_ready;    // Mutex to synchronize response readiness
     ErlDrvCond* cond;               // Condition variable to signal readiness
-    int ready;                       // Flag indicating if the response is ready
+    int ready;                       // Flag indicating if the response is ready (accessed atomically)
     char* error_message;            // Error message (if any)
     ei_term* result_terms;          // List of result terms from the import
     int result_length;              // Length of the result_terms
 } ImportResponse;
 
+// Structure to represent a compiled module held in the driver-wide cache
+typedef struct ModuleCacheEntry {
+    unsigned char hash[32];         // SHA-256 of the WASM binary
+    wasm_store_t* store;            // Store owning the compiled module
+    wasm_module_t* module;          // Compiled WASM module
+    wasm_byte_vec_t binary;         // Copy of the binary the module was compiled from
+    long refs;                      // Number of instances using the module
+    int loading;                    // Flag indicating the module is being compiled
+    unsigned long last_release;     // Sequence number of the last release
+    struct ModuleCacheEntry* next;  // Next entry in the cache
+} ModuleCacheEntry;
+
+// Structure to represent a resolved export of an instance
+typedef struct {
+    char* name;                     // Name of the export (NUL-terminated)
+    size_t name_len;                // Length of the name
+    wasm_func_t* func;              // Exported function
+    wasm_valkind_t* param_kinds;    // Kinds of the function's parameters
+    size_t param_count;             // Number of parameters
+    wasm_valkind_t* result_kinds;   // Kinds of the function's results
+    size_t result_count;            // Number of results
+    int has_v128;                   // Whether any parameter or result is a v128
+} ExportEntry;
+
+// Structure to represent the precomputed export index of an instance
+typedef struct {
+    wasm_extern_vec_t externs;      // The instance's exports (owned by the table)
+    ExportEntry* entries;           // Exported functions
+    size_t count;                   // Number of exported functions
+    size_t* slots;                  // Open-addressed hash slots (entry index + 1, 0 if empty)
+    size_t slot_mask;               // Number of slots - 1 (slot count is a power of 2)
+    wasm_memory_t* memory;          // The instance's exported memory
+} ExportTable;
+
+// The stack and host-managed heap sizes of instances that do not set them.
+#define HB_DEFAULT_STACK_SIZE 0x10000
+#define HB_DEFAULT_HEAP_SIZE 0x10000
+
+// How an instance asks for its linear memory accesses to be bounds-checked.
+// Hardware checks (guard regions, with out-of-bounds accesses trapping on
+// SIGSEGV) need a runtime built with `WAMR_BOUNDS=hardware'.
+#define HB_BOUNDS_DEFAULT 0
+#define HB_BOUNDS_SOFTWARE 1
+#define HB_BOUNDS_HARDWARE 2
+
+// Per-instance options, given to `init' as a proplist
+typedef struct {
+    RunningMode running_mode;      // WAMR execution engine for the instance
+    unsigned int native_wasi;      // WASI imports to implement natively (HB_WASI_* flags)
+    uint64_t random_seed;          // Seed of the deterministic `random_get'
+    uint32_t stack_size;           // WASM operand stack of the instance, in bytes (0 for the default)
+    uint32_t heap_size;            // Host-managed heap of the instance, in bytes (0 for the default)
+    uint32_t initial_pages;        // Pages to grow the memory to when instantiated, or 0
+    uint32_t max_pages;            // Pages the memory may grow to, or 0 for the module's own limit
+    int bounds_checks;             // HB_BOUNDS_* mode of the instance
+} InstanceOpts;
+
+// Structure to describe guest memory that an import reads, by its arguments
+typedef struct {
+    int kind;                      // HB_PREFETCH_BYTES, HB_PREFETCH_FIXED or HB_PREFETCH_IOVEC
+    int ptr_arg;                   // Index of the argument holding the pointer
+    long len;                      // Index of the length (or count) argument, or the fixed length
+} PrefetchDesc;
+
+// Structure to represent the prefetch descriptors registered for an import
+typedef struct {
+    char* module_name;             // Module of the import
+    char* field_name;              // Name of the import
+    int count;                     // Number of descriptors
+    PrefetchDesc* descs;           // Descriptors, in the order they are sent
+} PrefetchEntry;
+
+// The number of buckets of the call latency histogram. Bucket N counts calls
+// that took less than 2^N microseconds, and the last bucket all others.
+#define HB_STATS_BUCKETS 24
+
+// The most parameters and results of a function that is called indirectly.
+#define HB_INDIRECT_MAX_PARAMS 16
+#define HB_INDIRECT_MAX_RESULTS 4
+
+// Structure to represent the cached type of an indirect function table entry
+typedef struct {
+    uint8_t resolved;              // Whether the type has been read from the table
+    wasm_function_inst_t func;     // The function the type was read from, if known
+    uint8_t param_count;           // Number of parameters
+    uint8_t result_count;          // Number of results
+    wasm_valkind_t params[HB_INDIRECT_MAX_PARAMS];   // Kinds of the parameters
+    wasm_valkind_t results[HB_INDIRECT_MAX_RESULTS]; // Kinds of the results
+} IndirectEntry;
+
+// Structure to represent the counters kept by the driver, for an instance and
+// for the driver as a whole. Counters are updated with relaxed atomics.
+typedef struct {
+    uint64_t calls;                // Exported functions called
+    uint64_t traps;                // Calls that trapped
+    uint64_t call_ns;              // Time spent in calls
+    uint64_t latency[HB_STATS_BUCKETS]; // Histogram of call times
+    uint64_t imports;              // Imports called
+    uint64_t import_wait_ns;       // Time spent waiting on Erlang for imports
+    uint64_t bytes_read;           // Memory read by Erlang
+    uint64_t bytes_written;        // Memory written by Erlang
+    uint64_t inits;                // Instances initialized
+    uint64_t init_ns;              // Time spent initializing instances
+    uint64_t compiles;             // Modules compiled (module cache misses)
+    uint64_t compile_ns;           // Time spent compiling modules
+    uint64_t memory_bytes;         // Size of the linear memory, as of the last call
+} Stats;
+
+// Structure to represent the driver-wide counters of an import
+typedef struct {
+    int index;                     // Position of the import in the driver's table
+    char* module_name;             // Module of the import
+    char* field_name;              // Name of the import
+    uint64_t calls;                // Calls of the import
+    uint64_t wait_ns;              // Time spent waiting on Erlang for its responses
+} ImportStats;
+
+// Structure to represent the execution budget of the instance's calls
+typedef struct {
+    long fuel;                     // Instructions the executing call may execute, or 0 for no limit
+    unsigned long seq;             // Sequence number of the last call submitted
+    unsigned long running_seq;     // Sequence number of the executing call, or 0
+    ErlDrvTime running_deadline;   // When the executing call's time runs out (ms), or 0 for never
+    int pending;                   // Calls with a time limit that have been armed but not entered
+    long pending_ms;               // The shortest time limit of the pending calls, since there were none
+    ErlDrvTime timer_at;           // When the port's timer is set to go off (ms), or 0 if it is not set
+    unsigned long expired_seq;     // Sequence number of the last call whose time ran out
+    ErlDrvMutex* lock;             // Orders termination against the start and end of calls
+} CallBudget;
+
+// The kinds of command that are queued for an instance's worker.
+#define HB_QUEUED_CALL 0               // Call an exported function
+#define HB_QUEUED_READ 1               // Read a range of memory
+#define HB_QUEUED_WRITE 2              // Write bytes into memory
+
+// The longest signature of packed call arguments.
+#define HB_QUEUED_MAX_SIG 256
+
+// Structure to represent a command queued for an instance. Commands are run
+// by the instance's jobs in the order they were queued, and their nodes are
+// recycled through the instance's free list.
+typedef struct QueuedCommand {
+    int kind;                      // HB_QUEUED_CALL, HB_QUEUED_READ or HB_QUEUED_WRITE
+    uint64_t request_id;           // ID that the replies are tagged with, or 0 for untagged replies
+    char function_name[MAXATOMLEN]; // Exported function to call
+    ei_term* args;                 // Arguments of the call as terms, or NULL if they are packed
+    char sig[HB_QUEUED_MAX_SIG];   // Signature of packed arguments, or empty
+    char* data;                    // Packed arguments of a call, or the bytes of a write
+    long data_size;                // Bytes used in data
+    long data_capacity;            // Bytes allocated for data, kept when the node is recycled
+    uint64_t offset;               // Memory offset of a read or write
+    uint64_t length;               // Length of a read
+    PrefetchEntry* prefetch;       // Prefetch table of the call, installed when it runs
+    int prefetch_count;            // Number of entries in the prefetch table
+    long fuel;                     // Instruction limit of the call, or 0 for none
+    long time_ms;                  // Time limit of the call, or 0 for none
+    unsigned long budget_seq;      // Sequence number the call's budget was armed with
+    struct QueuedCommand* next;    // The next command in the queue (or free list)
+} QueuedCommand;
+
 // Structure to represent a WASM process instance
 typedef struct {
     wasm_engine_t* engine;          // WASM engine instance
     wasm_instance_t* instance;      // WASM instance
     wasm_module_t* module;          // WASM module
+    ModuleCacheEntry* module_entry; // Cache entry holding the module
+    ExportTable exports;            // Index of the instance's exports
+    ErlDrvBinary* snapshot;         // Stable copy of the linear memory, if taken
+    byte_t* checkpoint;             // Copy of the linear memory at the last checkpoint
+    long checkpoint_pages;          // Number of pages covered by the checkpoint
     wasm_store_t* store;            // WASM store
     ErlDrvPort port;                // Erlang port associated with this process
     ErlDrvTermData port_term;       // Erlang term representation of the port
     ErlDrvMutex* is_running;        // Mutex to track if the process is running
-    char* current_function;        // Current function being executed
     long current_function_ix;   // Index of the current function
     int indirect_func_table_ix;    // Index of the indirect function table
     wasm_table_t* indirect_func_table; // Indirect function table
+    IndirectEntry* indirect_cache; // Resolved types of the table's entries, by index
+    size_t indirect_cache_size;    // Number of entries in the cache (the table's size)
+    wasm_table_inst_t indirect_table_inst; // The runtime's view of the table, to check entries with
+    int has_indirect_table_inst;   // Whether indirect_table_inst is set
     wasm_exec_env_t exec_env;      // Execution environment for the WASM instance
-    ei_term* current_args;         // Arguments for the current function
-    int current_args_length;       // Length of the current arguments
-    ImportResponse* current_import; // Import response structure
+    ErlDrvMutex* queue_lock;       // Guards the command queue and its free list
+    QueuedCommand* queue_head;     // Commands waiting to run, oldest first
+    QueuedCommand* queue_tail;     // The newest waiting command
+    QueuedCommand* queue_free;     // Recycled command nodes
+    uint64_t request_id;           // Request of the running command, or 0 (owned by its job)
+    ImportResponse* current_import; // The pending import response, or NULL
+    ImportResponse import;         // Import rendezvous, reused by every import
+    ErlDrvTermData* import_msg;    // Term buffer for import messages, reused by every import
+    size_t import_msg_size;        // Capacity of the import message buffer, in terms
+    PrefetchEntry* prefetch;       // Memory to send with imports during the current call
+    int prefetch_count;            // Number of imports with prefetch descriptors
+    int thread_ix;                 // Worker thread of the driver's pool, or -1 for the ERTS async pool
+    unsigned int async_key;        // Key of the process's jobs in the ERTS async pool
+    int job_running;               // Whether a job of the process is running (under the pool lock)
+    int async_jobs;                // Jobs on the ERTS async pool that have not finished (under the pool lock)
+    int releasing;                 // Whether the port is stopping, so that jobs yet to start are dropped
     ErlDrvTermData pid;            // PID of the Erlang process
     int is_initialized;            // Flag to check if the process is initialized
     time_t start_time;             // Start time of the process
+    InstanceOpts opts;             // Options the instance was started with
+    char* wasi_out;                // Output buffered by the native `fd_write'
+    size_t wasi_out_len;           // Bytes in the output buffer
+    int wasi_out_fd;               // File descriptor the buffered output is for
+    uint64_t wasi_random_state;    // State of the deterministic `random_get'
+    CallBudget budget;             // Execution budget of the current call
+    Stats stats;                   // Counters of the instance
 } Proc;
 
 // Structure to represent an import hook
-typedef struct {
+typedef struct ImportHook {
     char* module_name;             // Name of the module
     char* field_name;              // Name of the field (function)
     char* signature;               // Function signature
     Proc* proc;                    // The associated process
     wasm_func_t* stub_func;        // WASM function pointer for the import
+    size_t msg_size;               // Terms needed to send a call of the import to Erlang
+    ImportStats* stats;            // Driver-wide counters of the import, or NULL
+    // Native implementation of the import, or NULL if it is handled by Erlang
+    wasm_trap_t* (*native)(struct ImportHook* hook, const wasm_val_vec_t* args, wasm_val_vec_t* results);
 } ImportHook;
 
+// Structure to represent a single call within a batch
+typedef struct {
+    char* function_name;           // Name of the exported function
+    ei_term* args;                 // Arguments for the function
+} BatchItem;
+
+// Structure to represent a batch of calls executed in one async job
+typedef struct {
+    Proc* proc;                    // The associated process
+    int count;                     // Number of calls in the batch
+    BatchItem* items;              // The calls, in execution order
+} CallBatch;
+
+// Structure to represent a call whose arguments are buffers, copied into
+// memory allocated in the guest by its exported allocator
+typedef struct {
+    Proc* proc;                    // The associated process
+    char* function_name;           // Name of the exported function
+    int count;                     // Number of input buffers
+    char** data;                   // The contents of each buffer
+    long* sizes;                   // The size of each buffer
+    int free_buffers;              // Whether to free the buffers after the call
+    long fuel;                     // Instruction limit of the call, or 0 for none
+    long time_ms;                  // Time limit of the call, or 0 for none
+    unsigned long budget_seq;      // Sequence number the call's budget was armed with
+} BufferCall;
+
 // Structure to represent the request for loading a WASM binary
 typedef struct {
     void* binary;                  // Binary data for the WASM module
     long size;                     // Size of the binary
     Proc* proc;                    // The associated process
     char* mode;                    // Mode of the WASM module
+    unsigned char hash[32];        // SHA-256 of the binary
+    InstanceOpts opts;             // Options for the instance
 } LoadWasmReq;
 
+// Structure to represent a checkpoint, delta or restore of an instance's
+// memory, run by a job (see hb_dirty.h)
+typedef struct {
+    Proc* proc;                    // The associated process
+    int kind;                      // HB_DIRTY_CHECKPOINT, HB_DIRTY_SERIALIZE or HB_DIRTY_APPLY
+    unsigned char* delta;          // The delta to apply (owned), or NULL
+    size_t delta_len;              // Length of the delta in bytes
+} DirtyReq;
+
+// Structure to represent the request for creating a template of an instance's
+// memory (with an ID of 0), or for applying one to it
+typedef struct {
+    Proc* proc;                    // The associated process
+    long id;                       // ID of the template to apply, or 0 to create one
+} TemplateReq;
+
+// Structure to represent the request for restoring memory from a snapshot file
+typedef struct {
+    Proc* proc;                    // The associated process
+    char path[4096];               // Path of the snapshot file
+} RestoreReq;
+
 // NO_PROD: Import these from headers instead
 
 // Structure for a common WASM module instance
@@ -97,6 +341,14 @@ struct wasm_func_t {
     WASMFunctionInstanceCommon *func_comm_rt; // Function instance data
 };
 
+// Structure representing a WASM instance (extended with host-specific details)
+struct wasm_instance_t {
+    wasm_store_t *store;             // WASM store
+    wasm_extern_vec_t *exports;      // Exports of the instance
+    struct wasm_host_info host_info; // Host-specific information
+    WASMModuleInstanceCommon *inst_comm_rt; // Module instance data
+};
+
 
 
 #endif // HB_CORE_H
\ No newline at end of file
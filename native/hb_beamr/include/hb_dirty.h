@@ -0,0 +1,92 @@
+#ifndef HB_DIRTY_H
+#define HB_DIRTY_H
+
+#include "hb_core.h"
+
+// The granularity (in bytes) at which changes to linear memory are tracked.
+#define HB_DIRTY_PAGE_SIZE 4096
+// Delta header: memory size (8 bytes), page size (4 bytes), page count (4
+// bytes). Each page that follows is its index (4 bytes) and its contents. All
+// integers are big-endian.
+#define HB_DELTA_HEADER_SIZE 16
+#define HB_DELTA_PAGE_HEADER_SIZE 4
+
+// The kinds of DirtyReq that dirty_job runs.
+#define HB_DIRTY_CHECKPOINT 0          // Take a checkpoint
+#define HB_DIRTY_SERIALIZE 1           // Serialize a delta from the checkpoint
+#define HB_DIRTY_APPLY 2               // Apply a delta
+
+/*
+ * Function: dirty_checkpoint
+ * --------------------
+ * Keeps a copy of the instance's linear memory, such that a later
+ * dirty_serialize_delta only returns the pages that differ from it. Pages are
+ * compared byte for byte, so no change can be missed, at the cost of holding
+ * a second copy of the memory while a checkpoint is kept.
+ *
+ *  proc: The process structure containing the WASM instance, locked by the
+ *      caller.
+ *
+ *  returns: The number of pages recorded, or -1 on allocation failure.
+ */
+long dirty_checkpoint(Proc* proc);
+
+/*
+ * Function: dirty_serialize_delta
+ * --------------------
+ * Builds a delta of the pages that differ from the last checkpoint (every
+ * page, if no checkpoint has been taken), and advances the checkpoint to the
+ * current state of the memory (copying only the changed pages into it). Pages
+ * beyond the end of the memory at the last checkpoint are always included.
+ *
+ *  proc: The process structure containing the WASM instance, locked by the
+ *      caller.
+ *  page_count: Set to the number of pages in the delta.
+ *
+ *  returns: A driver binary holding the delta, or NULL on allocation failure.
+ */
+ErlDrvBinary* dirty_serialize_delta(Proc* proc, long* page_count);
+
+/*
+ * Function: dirty_apply_delta
+ * --------------------
+ * Writes the pages of a delta into the instance's linear memory, growing it
+ * to the size recorded in the delta if necessary. The whole delta is checked
+ * before the memory is grown or any page is written, so a malformed delta
+ * leaves the memory as it was. The checkpoint's copies of the written pages
+ * are updated, so that deltas taken after a restore stay relative to the
+ * restored state.
+ *
+ *  proc: The process structure containing the WASM instance, locked by the
+ *      caller.
+ *  delta: The delta.
+ *  len: The length of the delta in bytes.
+ *  error: Buffer for an error message, if the delta can not be applied.
+ *  error_len: Size of the error buffer.
+ *
+ *  returns: 0 on success, -1 on failure.
+ */
+int dirty_apply_delta(Proc* proc, const unsigned char* delta, size_t len, char* error, size_t error_len);
+
+/*
+ * Function: dirty_job
+ * --------------------
+ * The job that takes a checkpoint, serializes a delta or applies one, with
+ * the instance locked so that it is ordered with its calls. Replies with
+ * `{execution_result, Pages}' for a checkpoint, `{execution_result, Delta}'
+ * for a delta, `ok' for an applied delta, or an error. Frees the request.
+ *
+ *  raw: The DirtyReq of the job.
+ */
+void dirty_job(void* raw);
+
+/*
+ * Function: dirty_free
+ * --------------------
+ * Releases the checkpoint held by the instance, if any.
+ *
+ *  proc: The process structure containing the WASM instance.
+ */
+void dirty_free(Proc* proc);
+
+#endif // HB_DIRTY_H
@@ -3,6 +3,10 @@
 
 #include "hb_core.h"
 
+// Number of times a waiter polls its flag before parking on the condition
+// variable. Short import handlers in Erlang usually answer within this window.
+#define HB_SPIN_ITERATIONS 4096
+
 /*
  * Function: drv_lock
  * --------------------
@@ -44,4 +48,35 @@ void drv_signal(ErlDrvMutex* mut, ErlDrvCond* cond, int* ready);
  */
 void drv_wait(ErlDrvMutex* mut, ErlDrvCond* cond, int* ready);
 
+/*
+ * Function: drv_spin_wait
+ * --------------------
+ * Waits for the ready flag like drv_wait, but first polls it up to `spins`
+ * times without taking the mutex. This avoids the cost of parking and waking
+ * the thread when the signal arrives quickly.
+ *
+ *  mut: The mutex used to synchronize access to shared resources.
+ *  cond: The condition variable to wait on.
+ *  ready: A flag indicating the state of the condition. The thread will wait until this is set to 1.
+ *  spins: The number of polls before the thread blocks on the condition variable.
+ */
+void drv_spin_wait(ErlDrvMutex* mut, ErlDrvCond* cond, int* ready, int spins);
+
+/*
+ * Function: drv_output_reply
+ * --------------------
+ * Sends a message to the port's owner. Messages of a queued request are
+ * tagged with its ID, as `{reply, RequestId, Message}', so that the replies of
+ * pipelined requests can be told apart. Other messages are sent as they are.
+ * Safe to call from any thread, like erl_drv_output_term.
+ *
+ *  port_term: The port to send the message from.
+ *  request_id: The ID of the request the message replies to, or 0 for none.
+ *  msg: The term specification of the message.
+ *  len: The number of terms in the specification.
+ *
+ *  returns: The result of erl_drv_output_term.
+ */
+int drv_output_reply(ErlDrvTermData port_term, uint64_t request_id, ErlDrvTermData* msg, int len);
+
 #endif
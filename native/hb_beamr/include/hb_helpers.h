@@ -36,6 +36,18 @@ const char* wasm_externtype_to_kind_string(const wasm_externtype_t* type);
  */
 char wasm_valtype_kind_to_char(const wasm_valtype_t* valtype);
 
+/*
+ * Function: wasm_valkind_to_char
+ * --------------------
+ * Converts a WASM value kind to its character in a function signature, as
+ * for wasm_valtype_kind_to_char.
+ * 
+ *  kind: The WASM value kind to convert.
+ * 
+ *  returns: A character representing the value kind.
+ */
+char wasm_valkind_to_char(wasm_valkind_t kind);
+
 /*
  * Function: wasm_val_to_erl_term
  * --------------------
@@ -96,6 +108,41 @@ ei_term* decode_list(char* buff, int* index);
  */
 int get_function_sig(const wasm_externtype_t* type, char* type_str);
 
+/*
+ * Function: build_export_table
+ * --------------------
+ * Builds the export index of a freshly created instance: a hash table from
+ * export name to function (with its parameter and result kinds), and the
+ * instance's exported memory. The table takes ownership of the externs.
+ * 
+ *  proc: The process structure containing the WASM instance.
+ *  export_types: The module's export types, in the same order as externs.
+ *  externs: The instance's exports, as returned by wasm_instance_exports.
+ */
+void build_export_table(Proc* proc, const wasm_exporttype_vec_t* export_types, wasm_extern_vec_t* externs);
+
+/*
+ * Function: free_export_table
+ * --------------------
+ * Releases the export index of a process, including the externs it owns.
+ * 
+ *  proc: The process structure containing the WASM instance.
+ */
+void free_export_table(Proc* proc);
+
+/*
+ * Function: lookup_export
+ * --------------------
+ * Finds an exported function in the process's export index. Does not
+ * allocate.
+ * 
+ *  proc: The process structure containing the WASM instance.
+ *  target_name: The name of the exported function to retrieve.
+ * 
+ *  returns: A pointer to the export entry, or NULL if the function is not found.
+ */
+ExportEntry* lookup_export(Proc* proc, const char* target_name);
+
 /*
  * Function: get_exported_function
  * --------------------
@@ -130,4 +177,158 @@ wasm_memory_t* get_memory(Proc* proc);
  */
 long get_memory_size(Proc* proc);
 
+/*
+ * Function: copy_from_iovec
+ * --------------------
+ * Copies a range of bytes out of an Erlang I/O vector, spanning as many of
+ * its fragments as necessary.
+ *
+ *  ev: The I/O vector to copy from.
+ *  skip: The offset (in bytes) into the vector at which to start copying.
+ *  dest: The buffer to copy into.
+ *  len: The number of bytes to copy.
+ */
+void copy_from_iovec(ErlIOVec* ev, ErlDrvSizeT skip, char* dest, ErlDrvSizeT len);
+
+/*
+ * Function: decode_uint64_be
+ * --------------------
+ * Reads a big-endian unsigned 64-bit integer from a buffer.
+ *
+ *  buf: The buffer to read from (at least 8 bytes).
+ *
+ *  returns: The decoded integer.
+ */
+uint64_t decode_uint64_be(const unsigned char* buf);
+
+/*
+ * Function: encode_uint64_be
+ * --------------------
+ * Writes an unsigned 64-bit integer to a buffer in big-endian order.
+ *
+ *  buf: The buffer to write to (at least 8 bytes).
+ *  value: The integer to write.
+ */
+void encode_uint64_be(unsigned char* buf, uint64_t value);
+
+/*
+ * Function: wasm_arg_u64
+ * --------------------
+ * Reads an integer argument of a WASM call, whether it was passed as an i32
+ * or an i64. i32 values are zero-extended, as they are guest pointers or
+ * sizes.
+ *
+ *  args: The arguments of the call.
+ *  i: The index of the argument.
+ *
+ *  returns: The argument's value.
+ */
+uint64_t wasm_arg_u64(const wasm_val_vec_t* args, size_t i);
+
+/*
+ * Function: load_uint_le
+ * --------------------
+ * Reads a little-endian unsigned integer of a given width from linear memory.
+ *
+ *  at: The address to read from.
+ *  width: The width of the integer in bytes (at most 8).
+ *
+ *  returns: The decoded integer.
+ */
+uint64_t load_uint_le(const byte_t* at, size_t width);
+
+/*
+ * Function: store_uint_le
+ * --------------------
+ * Writes a little-endian unsigned integer of a given width to linear memory.
+ *
+ *  at: The address to write to.
+ *  width: The width of the integer in bytes (at most 8).
+ *  value: The integer to write.
+ */
+void store_uint_le(byte_t* at, size_t width, uint64_t value);
+
+/*
+ * Function: memory_in_bounds
+ * --------------------
+ * Checks that a range lies within a linear memory, without overflowing.
+ *
+ *  ptr: The start of the range.
+ *  len: The length of the range.
+ *  memory_size: The size of the memory in bytes.
+ *
+ *  returns: 1 if the range is in bounds, 0 otherwise.
+ */
+int memory_in_bounds(uint64_t ptr, uint64_t len, uint64_t memory_size);
+
+/*
+ * Function: export_signature
+ * --------------------
+ * Writes the signature of an exported function, in the format of
+ * get_function_sig (e.g. `(iI)F').
+ *
+ *  export: The export entry of the function.
+ *  out: The buffer to write the signature to.
+ *  len: The size of the buffer.
+ *
+ *  returns: 0 on success, or -1 if the buffer is too small.
+ */
+int export_signature(const ExportEntry* export, char* out, size_t len);
+
+/*
+ * Function: packed_width
+ * --------------------
+ * Returns the width of a value in the packed encoding: 4 bytes for each i32
+ * and f32, 8 for each i64 and f64, and 16 for each v128 (its lanes in
+ * little-endian order, as in linear memory).
+ *
+ *  kind: The kind of the value.
+ *
+ *  returns: The width in bytes, or 0 if the kind can not be packed.
+ */
+size_t packed_width(wasm_valkind_t kind);
+
+/*
+ * Function: packed_size
+ * --------------------
+ * Returns the size of the packed encoding of values of the given kinds. This
+ * is also the layout of WAMR's argument cells on little-endian hosts, which
+ * is how v128 values (that the C API's values can not hold) are passed.
+ *
+ *  kinds: The kinds of the values.
+ *  count: The number of values.
+ *
+ *  returns: The size in bytes, or 0 if a kind can not be packed.
+ */
+size_t packed_size(const wasm_valkind_t* kinds, size_t count);
+
+/*
+ * Function: unpack_wasm_vals
+ * --------------------
+ * Decodes a packed binary of little-endian values into a vector of values of
+ * already set kinds: 4 bytes for each i32 and f32, and 8 for each i64 and
+ * f64, in order and without padding.
+ *
+ *  vals: The vector to decode into, with the kind of each value set.
+ *  data: The packed values.
+ *  size: The size of the packed values in bytes.
+ *
+ *  returns: 0 on success, or -1 if the size does not match the kinds, or a
+ *  kind can not be packed into a value (v128s can not).
+ */
+int unpack_wasm_vals(wasm_val_vec_t* vals, const byte_t* data, size_t size);
+
+/*
+ * Function: pack_wasm_vals
+ * --------------------
+ * Encodes a vector of values as a packed binary, in the layout read by
+ * unpack_wasm_vals. Values of kinds that can not be packed are skipped.
+ *
+ *  vals: The vector of values to encode.
+ *  out: The buffer to write to, of at least 8 bytes per value.
+ *
+ *  returns: The number of bytes written.
+ */
+size_t pack_wasm_vals(const wasm_val_vec_t* vals, byte_t* out);
+
 #endif // HB_HELPERS_H
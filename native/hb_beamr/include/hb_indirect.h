@@ -0,0 +1,34 @@
+#ifndef HB_INDIRECT_H
+#define HB_INDIRECT_H
+
+#include "hb_core.h"
+
+/*
+ * Function: indirect_call
+ * --------------------
+ * Calls the function at an index of the instance's indirect function table,
+ * as the Emscripten `invoke_*' imports do. The first argument is the index,
+ * and the rest are the function's arguments. The function's results are
+ * written to the import's results. The type of each function is resolved
+ * from the table once and cached, and its arguments and results are passed
+ * through a buffer on the stack, so that calls do not allocate.
+ *
+ *  proc: The process structure of the instance.
+ *  args: The arguments of the import.
+ *  results: The results of the import, with their kinds set.
+ *
+ *  returns: NULL on success, or a trap carrying the reason the call failed
+ *  (including an exception raised by the function).
+ */
+wasm_trap_t* indirect_call(Proc* proc, const wasm_val_vec_t* args, wasm_val_vec_t* results);
+
+/*
+ * Function: indirect_cache_free
+ * --------------------
+ * Frees the cache of resolved indirect call types of a process.
+ *
+ *  proc: The process structure whose cache to free.
+ */
+void indirect_cache_free(Proc* proc);
+
+#endif
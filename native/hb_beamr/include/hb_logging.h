@@ -2,13 +2,20 @@
 #define HB_LOGGING_H
 
 #include "hb_core.h"
-// Enable debug logging by default if not defined
-#define HB_DEBUG 0
+// Debug logging is only compiled in when the driver is built with HB_DEBUG=1
+// (see `make debug').
 #ifndef HB_DEBUG
+#define HB_DEBUG 0
 #endif
 
-
-#define DRV_DEBUG(format, ...) beamr_print(HB_DEBUG, __FILE__, __LINE__, format, ##__VA_ARGS__)
+#if HB_DEBUG
+#define DRV_DEBUG(format, ...) beamr_print(1, __FILE__, __LINE__, format, ##__VA_ARGS__)
+#else
+// Compiles to nothing: the arguments are never evaluated, but still keep the
+// variables that they use referenced.
+#define DRV_DEBUG(format, ...) \
+    do { if (0) beamr_print(0, __FILE__, __LINE__, format, ##__VA_ARGS__); } while (0)
+#endif
 #define DRV_PRINT(format, ...) beamr_print(1, __FILE__, __LINE__, format, ##__VA_ARGS__)
 
 /*
@@ -37,4 +44,17 @@ void beamr_print(int print, const char* file, int line, const char* format, ...)
  */
 void send_error(Proc* proc, const char* message_fmt, ...);
 
+/*
+ * Function: send_reply_error
+ * --------------------
+ * Sends an error message like send_error, tagged as the reply to a queued
+ * request (see drv_output_reply).
+ *
+ *  proc: The process to send the error message to.
+ *  request_id: The ID of the request that failed, or 0 for an untagged error.
+ *  message_fmt: The format string for the error message.
+ *  ...: The variables to be printed in the error message.
+ */
+void send_reply_error(Proc* proc, uint64_t request_id, const char* message_fmt, ...);
+
 #endif // HB_LOGGING_H
@@ -0,0 +1,71 @@
+#ifndef HB_MODULE_CACHE_H
+#define HB_MODULE_CACHE_H
+
+#include "hb_core.h"
+
+// The number of unreferenced modules that are kept compiled in the cache,
+// such that sequential start/stop cycles of the same image do not recompile.
+#define HB_MODULE_CACHE_IDLE_MAX 8
+
+// The process-wide WASM engine, shared by every instance of the driver.
+extern wasm_engine_t* hb_engine;
+
+/*
+ * Function: module_cache_init
+ * --------------------
+ * Creates the shared WASM engine and the (empty) compiled-module cache.
+ * Must be called once, from DRIVER_INIT.
+ *
+ *  returns: 0 on success, -1 if the engine could not be created.
+ */
+int module_cache_init(void);
+
+/*
+ * Function: module_cache_destroy
+ * --------------------
+ * Releases every cached module and the shared WASM engine. Called when the
+ * driver is unloaded, at which point no instances may remain.
+ */
+void module_cache_destroy(void);
+
+/*
+ * Function: module_cache_acquire
+ * --------------------
+ * Returns a referenced cache entry for the module with the given SHA-256
+ * hash, compiling it from the binary if it is not already cached. If another
+ * thread is compiling the same image, the caller waits for it to finish
+ * rather than compiling it a second time.
+ *
+ *  hash: The SHA-256 hash of the WASM binary (32 bytes).
+ *  binary: The WASM binary.
+ *  size: The size of the binary in bytes.
+ *  hit: Set to 1 if the module was found in the cache, 0 otherwise.
+ *
+ *  returns: A cache entry (to be released with module_cache_release), or
+ *  NULL if the module failed to compile.
+ */
+ModuleCacheEntry* module_cache_acquire(const unsigned char* hash, const void* binary, long size, int* hit);
+
+/*
+ * Function: module_cache_release
+ * --------------------
+ * Drops a reference to a cache entry. Unreferenced entries are kept for
+ * reuse, up to HB_MODULE_CACHE_IDLE_MAX of them, after which the least
+ * recently released module is deleted.
+ *
+ *  entry: The cache entry to release.
+ */
+void module_cache_release(ModuleCacheEntry* entry);
+
+/*
+ * Function: module_cache_stats
+ * --------------------
+ * Reads the cache counters.
+ *
+ *  hits: Set to the number of acquisitions served from the cache.
+ *  misses: Set to the number of acquisitions that compiled a module.
+ *  entries: Set to the number of modules currently held in the cache.
+ */
+void module_cache_stats(long* hits, long* misses, long* entries);
+
+#endif // HB_MODULE_CACHE_H
@@ -0,0 +1,96 @@
+#ifndef HB_NIF_H
+#define HB_NIF_H
+
+#include <erl_nif.h>
+#include <wasm_c_api.h>
+#include <wasm_export.h>
+#include <stdint.h>
+#include <string.h>
+
+// The NIF backend of BEAMR (see `hb_beamr_nif'). Instances are resources,
+// and their calls run from dirty CPU schedulers, taking and returning terms
+// directly rather than through a port.
+//
+// WAMR can not suspend a call part-way through, so the calls of an instance
+// with imports run on a thread of the instance's own. At each import the
+// thread parks, and the dirty NIF that started (or resumed) the call returns
+// the import to Erlang. Resuming with the import's results continues the
+// call. No scheduler is held while Erlang handles an import. Instances
+// without imports run their calls on the dirty scheduler itself.
+//
+// The resource only points to the instance, so that an instance with a thread
+// can outlive its resource: the thread is joined, and the instance freed, by
+// a reaper thread of the library rather than by the scheduler that drops the
+// last reference to the resource.
+//
+// The library links its own copy of WAMR, with its own engine, rather than
+// sharing the runtime of the driver (`hb_beamr'): each has its own compiled
+// modules, and instances of one can not be used by the other. Both can be
+// loaded in the same node.
+
+// The states of an instance's call.
+#define HB_NIF_IDLE 0                  // No call is in progress
+#define HB_NIF_RUNNING 1               // The call is executing
+#define HB_NIF_IMPORT 2                // The call is parked at an import, awaiting its results
+#define HB_NIF_DONE 3                  // The call has finished, and its outcome is to be collected
+
+// The native stack of an instance's execution thread, in kilowords.
+#define HB_NIF_THREAD_STACK 1024
+
+// Memory operations of more than this many bytes are moved to a dirty
+// scheduler.
+#define HB_NIF_DIRTY_BYTES 65536
+
+// The longest error message of a call.
+#define HB_NIF_ERROR_LEN 256
+
+// The longest signature of an import.
+#define HB_NIF_MAX_SIG 256
+
+struct NifInstance;
+
+// Structure to represent an import of an instance, handled by Erlang
+typedef struct {
+    struct NifInstance* inst;      // The instance the import belongs to
+    const char* module_name;       // Module of the import (owned by the import types)
+    const char* field_name;        // Name of the import (owned by the import types)
+    char signature[HB_NIF_MAX_SIG]; // Signature of the import
+    const wasm_functype_t* type;   // Type of the import (owned by the import types)
+} NifImport;
+
+// Structure to represent an instance of the NIF backend, held as a resource
+typedef struct NifInstance {
+    wasm_store_t* store;           // WASM store
+    wasm_module_t* module;         // WASM module
+    wasm_instance_t* instance;     // WASM instance, or NULL if instantiation failed
+    wasm_importtype_vec_t import_types; // Imports of the module
+    wasm_exporttype_vec_t export_types; // Exports of the module, by index
+    wasm_extern_vec_t import_externs; // Host functions standing in for the imports (owned)
+    wasm_extern_vec_t exports;     // Exported externs of the instance, by index
+    wasm_memory_t* memory;         // The instance's exported memory, or NULL
+    NifImport* imports;            // Imports of the instance, by index
+    size_t import_count;           // Number of imports
+    ErlNifMutex* lock;             // Guards the state of the call
+    ErlNifCond* cond;              // Signals changes of the state of the call
+    int state;                     // HB_NIF_* state of the call
+    int stopping;                  // Whether the instance has been stopped
+    int has_thread;                // Whether the instance has an execution thread
+    ErlNifTid tid;                 // The execution thread, if any
+    wasm_func_t* func;             // Function of the call
+    wasm_val_vec_t args;           // Arguments of the call
+    wasm_val_vec_t results;        // Results of the call
+    int trapped;                   // Whether the call trapped
+    char error[HB_NIF_ERROR_LEN];  // Message of the trap
+    NifImport* import;             // The import the call is parked at
+    const wasm_val_vec_t* import_args; // Arguments of the import
+    wasm_val_vec_t* import_results; // Results of the import, set by the resume
+    int import_failed;             // Whether the import is to trap
+    struct NifInstance* next;      // Next instance awaiting the reaper
+} NifInstance;
+
+// Structure to represent the resource of an instance
+typedef struct {
+    NifInstance* inst;             // The instance, or NULL once it has been handed to the reaper
+} NifHandle;
+
+#endif // HB_NIF_H
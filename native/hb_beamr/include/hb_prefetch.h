@@ -0,0 +1,119 @@
+#ifndef HB_PREFETCH_H
+#define HB_PREFETCH_H
+
+#include "hb_core.h"
+
+// The kinds of memory that a prefetch descriptor can describe.
+#define HB_PREFETCH_BYTES 0   // `{bytes, PtrArg, LenArg}': bytes at an argument, of a length in another
+#define HB_PREFETCH_FIXED 1   // `{fixed, PtrArg, Len}': a constant number of bytes at an argument
+#define HB_PREFETCH_IOVEC 2   // `{iovec, PtrArg, CountArg}': the buffers of an array of I/O vectors
+
+// The most I/O vectors that a single descriptor will read.
+#define HB_PREFETCH_MAX_IOVECS 1024
+
+/*
+ * Function: prefetch_decode
+ * --------------------
+ * Decodes a list of `{Module, Field, [Descriptor]}' tuples into a prefetch
+ * table, which is kept with its call until the call runs (see
+ * prefetch_install).
+ *
+ *  buff: The buffer containing the encoded list.
+ *  index: The index in the buffer, advanced past the list.
+ *  table: Set to the decoded table, or NULL if the list is empty.
+ *  count: Set to the number of entries in the table.
+ *
+ *  returns: 0 on success, or -1 if the list is malformed.
+ */
+int prefetch_decode(const char* buff, int* index, PrefetchEntry** table, int* count);
+
+/*
+ * Function: prefetch_install
+ * --------------------
+ * Replaces the process's prefetch table with one decoded for the call that is
+ * about to run, taking ownership of it. Called by the call's job.
+ *
+ *  proc: The process structure to install the table in.
+ *  table: The table, or NULL for none.
+ *  count: The number of entries in the table.
+ */
+void prefetch_install(Proc* proc, PrefetchEntry* table, int count);
+
+/*
+ * Function: prefetch_free_table
+ * --------------------
+ * Frees a prefetch table that was not installed.
+ *
+ *  table: The table, or NULL.
+ *  count: The number of entries in the table.
+ */
+void prefetch_free_table(PrefetchEntry* table, int count);
+
+/*
+ * Function: prefetch_free
+ * --------------------
+ * Frees the process's prefetch table.
+ *
+ *  proc: The process structure whose table to free.
+ */
+void prefetch_free(Proc* proc);
+
+/*
+ * Function: prefetch_lookup
+ * --------------------
+ * Finds the prefetch entry for an import.
+ *
+ *  proc: The process structure holding the table.
+ *  hook: The import to find the entry for.
+ *
+ *  returns: The entry, or NULL if the import has no descriptors.
+ */
+PrefetchEntry* prefetch_lookup(Proc* proc, ImportHook* hook);
+
+/*
+ * Function: prefetch_terms
+ * --------------------
+ * Calculates the number of message terms that prefetch_encode will produce
+ * for a call of the import.
+ *
+ *  proc: The process structure containing the WASM instance.
+ *  entry: The prefetch entry of the import.
+ *  args: The arguments of the call.
+ *
+ *  returns: The number of terms.
+ */
+size_t prefetch_terms(Proc* proc, PrefetchEntry* entry, const wasm_val_vec_t* args);
+
+/*
+ * Function: prefetch_encode
+ * --------------------
+ * Encodes the memory described by an import's descriptors as a list with one
+ * element per descriptor: a binary, a list of binaries for `iovec', or
+ * `undefined' if the memory is out of bounds. The binaries are copies, so the
+ * message stays valid if the memory changes.
+ *
+ *  proc: The process structure containing the WASM instance.
+ *  entry: The prefetch entry of the import.
+ *  args: The arguments of the call.
+ *  msg: The message terms to write to.
+ *
+ *  returns: The number of terms written.
+ */
+int prefetch_encode(Proc* proc, PrefetchEntry* entry, const wasm_val_vec_t* args, ErlDrvTermData* msg);
+
+/*
+ * Function: prefetch_apply_writes
+ * --------------------
+ * Decodes a list of `{Offset, Binary}' memory writes from an import response,
+ * and applies them to the instance's memory. Every write is bounds-checked
+ * before any of them are applied.
+ *
+ *  proc: The process structure containing the WASM instance.
+ *  buff: The buffer containing the encoded list.
+ *  index: The index in the buffer, advanced past the list.
+ *
+ *  returns: 0 on success, or -1 if a write is malformed or out of bounds.
+ */
+int prefetch_apply_writes(Proc* proc, const char* buff, int* index);
+
+#endif
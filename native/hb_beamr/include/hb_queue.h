@@ -0,0 +1,91 @@
+#ifndef HB_QUEUE_H
+#define HB_QUEUE_H
+
+#include "hb_core.h"
+
+/*
+ * Function: queue_init
+ * --------------------
+ * Initializes the empty command queue of a process.
+ *
+ *  proc: The process structure to initialize the queue of.
+ */
+void queue_init(Proc* proc);
+
+/*
+ * Function: queue_destroy
+ * --------------------
+ * Frees the commands that are still queued, and the recycled nodes. Called
+ * when the port stops, once its jobs have been released.
+ *
+ *  proc: The process structure whose queue to destroy.
+ */
+void queue_destroy(Proc* proc);
+
+/*
+ * Function: queue_alloc
+ * --------------------
+ * Takes a command node from the process's free list, or allocates one if the
+ * list is empty. Called on the scheduler thread, while decoding a command.
+ *
+ *  proc: The process structure to allocate the command for.
+ *  kind: The kind of the command (HB_QUEUED_*).
+ *  request_id: The ID to tag the command's replies with, or 0.
+ *
+ *  returns: The command, with no arguments, data or prefetch table.
+ */
+QueuedCommand* queue_alloc(Proc* proc, int kind, uint64_t request_id);
+
+/*
+ * Function: queue_reserve
+ * --------------------
+ * Ensures that a command's data buffer can hold a number of bytes. The buffer
+ * is kept when the node is recycled, so it is only grown.
+ *
+ *  cmd: The command.
+ *  size: The number of bytes needed.
+ *
+ *  returns: The data buffer.
+ */
+char* queue_reserve(QueuedCommand* cmd, long size);
+
+/*
+ * Function: queue_discard
+ * --------------------
+ * Releases the arguments and prefetch table of a command, and returns its
+ * node to the free list. Used for commands that fail to decode, and by jobs
+ * once they have run their command.
+ *
+ *  proc: The process structure the command was allocated for.
+ *  cmd: The command.
+ */
+void queue_discard(Proc* proc, QueuedCommand* cmd);
+
+/*
+ * Function: queue_submit
+ * --------------------
+ * Appends a command to the process's queue, and submits a job to run it. Each
+ * job runs the oldest queued command, so commands run in the order they were
+ * submitted, whichever job runs them.
+ *
+ *  proc: The process structure to queue the command for.
+ *  cmd: The command.
+ */
+void queue_submit(Proc* proc, QueuedCommand* cmd);
+
+/*
+ * Function: queue_cancel
+ * --------------------
+ * Removes a command that has not started from the queue. The job submitted
+ * for it then runs the next command (or nothing), and the command sends no
+ * reply.
+ *
+ *  proc: The process structure of the queue.
+ *  request_id: The ID of the command's request.
+ *
+ *  returns: 1 if the command was removed, or 0 if it is not queued (it is
+ *      running, has finished, or never existed).
+ */
+int queue_cancel(Proc* proc, uint64_t request_id);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef HB_RESTORE_H
+#define HB_RESTORE_H
+
+#include "hb_core.h"
+
+/*
+ * Function: restore_file
+ * --------------------
+ * Restores the linear memory of an instance from a snapshot file (the raw
+ * memory, as written by `hb_beamr:serialize/1'), growing the memory to the
+ * size of the file first if necessary. When the runtime reserves memory with
+ * guard regions (hardware bounds checks, see `threads_hw_bounds') and the
+ * memory and the file are page-aligned, the file is mapped copy-on-write over
+ * the memory, so that restoring costs no copies: pages are read from the file
+ * as they are first touched, and only copied when written. Otherwise the file
+ * is read in. The instance must be locked by the caller.
+ *
+ * A mapped file must not be truncated or rewritten in place while the
+ * instance is running, as untouched pages are still read from it. Replacing
+ * or deleting the file is safe.
+ *
+ *  proc: The process structure containing the WASM instance.
+ *  path: The path of the snapshot file.
+ *  error: Buffer for an error message, if the file can not be restored.
+ *  error_len: Size of the error buffer.
+ *
+ *  returns: 1 if the file was mapped, 0 if it was copied, or -1 on failure.
+ */
+int restore_file(Proc* proc, const char* path, char* error, size_t error_len);
+
+/*
+ * Function: restore_file_job
+ * --------------------
+ * The job that restores an instance's memory from a snapshot file (see
+ * restore_file), ordered with its calls. Replies with
+ * `{execution_result, Mapped}', where Mapped is 1 if the file was mapped and
+ * 0 if it was read in, or an error. Frees the request.
+ *
+ *  raw: The RestoreReq of the restore.
+ */
+void restore_file_job(void* raw);
+
+/*
+ * Function: snapshot_job
+ * --------------------
+ * The job that copies an instance's memory into its snapshot (replacing any
+ * previous one, see `hb_beamr:snapshot/1'), ordered with its calls. Replies
+ * with `{execution_result, Size}', or an error if the copy could not be
+ * allocated.
+ *
+ *  raw: The Proc of the instance.
+ */
+void snapshot_job(void* raw);
+
+#endif // HB_RESTORE_H
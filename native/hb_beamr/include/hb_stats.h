@@ -0,0 +1,137 @@
+#ifndef HB_STATS_H
+#define HB_STATS_H
+
+#include "hb_core.h"
+
+// The number of shards of the driver-wide counters. Each thread updates the
+// counters of one shard, so that threads rarely contend on a cache line.
+#define HB_STATS_SHARDS 16
+
+// The most imports (by module and field) that have their own counters.
+#define HB_STATS_MAX_IMPORTS 512
+
+// Update a counter, from any thread.
+#define STATS_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+
+/*
+ * Function: stats_init
+ * --------------------
+ * Initializes the driver-wide counters. Called once, when the driver is
+ * loaded.
+ *
+ *  returns: 0 on success, or -1 on failure.
+ */
+int stats_init(void);
+
+/*
+ * Function: stats_destroy
+ * --------------------
+ * Frees the driver-wide import counters. Called once, when the driver is
+ * unloaded.
+ */
+void stats_destroy(void);
+
+/*
+ * Function: stats_now
+ * --------------------
+ * Reads the monotonic clock that the counters measure time with.
+ *
+ *  returns: The current time, in nanoseconds.
+ */
+uint64_t stats_now(void);
+
+/*
+ * Function: stats_instance_started / stats_instance_stopped
+ * --------------------
+ * Reset the counters of an instance as its port starts, and remove it from
+ * the number of live instances as its port stops. Instances are counted once
+ * they have been initialized (see stats_instance_init), so ports that are only
+ * opened to read the driver-wide counters are not.
+ *
+ *  proc: The process structure of the instance.
+ */
+void stats_instance_started(Proc* proc);
+void stats_instance_stopped(Proc* proc);
+
+/*
+ * Function: stats_call
+ * --------------------
+ * Records a call of an exported function.
+ *
+ *  proc: The process structure of the instance.
+ *  ns: The time the call took.
+ *  trapped: Whether the call trapped.
+ *
+ * Also records the size of the instance's memory, so must be called by the
+ * thread running the call.
+ */
+void stats_call(Proc* proc, uint64_t ns, int trapped);
+
+/*
+ * Function: stats_import_slot
+ * --------------------
+ * Finds (or creates) the driver-wide counters of an import, which are shared
+ * by every instance importing the same module and field. Resolved once per
+ * import, when it is instantiated.
+ *
+ *  module_name: The module of the import.
+ *  field_name: The name of the import.
+ *
+ *  returns: The counters, or NULL if the table of imports is full.
+ */
+ImportStats* stats_import_slot(const char* module_name, const char* field_name);
+
+/*
+ * Function: stats_import
+ * --------------------
+ * Records a call of an import.
+ *
+ *  hook: The import that was called.
+ *  wait_ns: The time spent waiting on Erlang for its response (0 for native
+ *      imports).
+ */
+void stats_import(ImportHook* hook, uint64_t wait_ns);
+
+/*
+ * Function: stats_memory
+ * --------------------
+ * Records memory read or written by Erlang.
+ *
+ *  proc: The process structure of the instance.
+ *  read: The number of bytes read.
+ *  written: The number of bytes written.
+ */
+void stats_memory(Proc* proc, uint64_t read, uint64_t written);
+
+/*
+ * Function: stats_instance_init
+ * --------------------
+ * Records the initialization of an instance.
+ *
+ *  proc: The process structure of the instance.
+ *  ns: The time the initialization took, including any compilation.
+ *  compile_ns: The time spent compiling the module, or 0 if it was cached.
+ *
+ * Also counts the instance as live, and records the size of its memory.
+ */
+void stats_instance_init(Proc* proc, uint64_t ns, uint64_t compile_ns);
+
+/*
+ * Function: stats_encode
+ * --------------------
+ * Encodes the counters as an external term format map:
+ * `#{global => Stats, instance => Stats | undefined, imports => Imports}', in
+ * which each `Stats' is a map of the counters (with the histogram as a list,
+ * `latency'), and `Imports' is a list of `{Module, Field, Calls, WaitNs}'.
+ * The global counters also include the number of live `instances' and
+ * whether the runtime has hardware bounds checks (`hw_bounds'), and their
+ * `memory_bytes' is the total of all instances. The instance's counters also
+ * include its `key' in trace events.
+ *
+ *  proc: The process structure of the instance, or NULL for an uninitialized
+ *      port.
+ *  x: A buffer (created with ei_x_new_with_version) to encode into.
+ */
+void stats_encode(Proc* proc, ei_x_buff* x);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef HB_TEMPLATE_H
+#define HB_TEMPLATE_H
+
+#include "hb_core.h"
+
+/*
+ * Function: template_init
+ * --------------------
+ * Creates the (empty) registry of memory templates. Must be called once,
+ * from DRIVER_INIT.
+ */
+void template_init(void);
+
+/*
+ * Function: template_destroy
+ * --------------------
+ * Releases every remaining template. Called when the driver is unloaded.
+ */
+void template_destroy(void);
+
+/*
+ * Function: template_create
+ * --------------------
+ * Captures the linear memory of an initialized instance as a template that
+ * new instances of the same module can be forked from. On Linux, the image
+ * is held in an anonymous memory file (memfd) so that forks can map it
+ * copy-on-write. The instance must be locked by the caller.
+ *
+ *  proc: The process structure containing the template WASM instance.
+ *  error: Buffer for an error message, if the template can not be created.
+ *  error_len: Size of the error buffer.
+ *
+ *  returns: The ID of the new template, or -1 on failure.
+ */
+long template_create(Proc* proc, char* error, size_t error_len);
+
+/*
+ * Function: template_apply
+ * --------------------
+ * Replaces the linear memory of an instance with the image of a template,
+ * growing the memory to the template's size first if necessary. When the
+ * runtime reserves memory with guard regions (hardware bounds checks, see
+ * `threads_hw_bounds') and the memory is page-aligned, the image is mapped
+ * copy-on-write over it, such that only the pages the instance goes on to
+ * write are copied. Otherwise the image is copied in. The instance must be
+ * locked by the caller.
+ *
+ *  proc: The process structure containing the WASM instance to fork into.
+ *  id: The ID of the template.
+ *  error: Buffer for an error message, if the template can not be applied.
+ *  error_len: Size of the error buffer.
+ *
+ *  returns: 0 on success, -1 on failure.
+ */
+int template_apply(Proc* proc, long id, char* error, size_t error_len);
+
+/*
+ * Function: template_job
+ * --------------------
+ * The job that creates a template of an instance's memory, or applies one to
+ * it, with the instance locked so that it is ordered with its calls. Replies
+ * with `{execution_result, Id}' for a new template, `ok' for an applied one,
+ * or an error. Frees the request.
+ *
+ *  raw: The TemplateReq of the job: an ID of 0 creates a template.
+ */
+void template_job(void* raw);
+
+/*
+ * Function: template_release
+ * --------------------
+ * Drops a template from the registry. Instances already forked from it are
+ * unaffected, as their mappings hold their own reference to the image.
+ *
+ *  id: The ID of the template.
+ *
+ *  returns: 0 on success, -1 if no template has the given ID.
+ */
+int template_release(long id);
+
+#endif // HB_TEMPLATE_H
@@ -0,0 +1,93 @@
+#ifndef HB_THREADS_H
+#define HB_THREADS_H
+
+#include "hb_core.h"
+
+// The most worker threads that the driver's pool may be configured with.
+#define HB_THREADS_MAX 256
+
+/*
+ * Function: threads_init
+ * --------------------
+ * Initializes the driver's thread pool state. The pool itself is started by
+ * the first port that asks for it (see threads_configure). Called once, when
+ * the driver is loaded.
+ *
+ *  returns: 0 on success, or -1 on failure.
+ */
+int threads_init(void);
+
+/*
+ * Function: threads_destroy
+ * --------------------
+ * Stops and joins the threads of the pool, if it was started. Called once,
+ * when the driver is unloaded.
+ */
+void threads_destroy(void);
+
+/*
+ * Function: threads_configure
+ * --------------------
+ * Parses the `threads=N' and `pin=0|1' arguments of a port's open command,
+ * and starts the pool with them if it has not been started yet. The pool is
+ * shared by every port, so only the first port to ask for it decides its
+ * size and pinning policy. Then assigns the port's process a worker thread.
+ *
+ *  proc: The process structure of the port.
+ *  command: The command the port was opened with.
+ */
+void threads_configure(Proc* proc, const char* command);
+
+/*
+ * Function: threads_submit
+ * --------------------
+ * Runs a job for a process on its assigned thread of the pool. Jobs of a
+ * process always run one at a time, in the order they were submitted. When
+ * the thread assigned to a process is busy with another process (e.g. waiting
+ * on an import), an idle thread may take the job instead. Without a pool, the
+ * job runs on the ERTS async pool, keyed by the process so that its jobs
+ * still always run on the same thread. Every job of a process (queued
+ * commands, batches, buffer calls, and the rest) goes through here, so they
+ * all run in the order that they were submitted.
+ *
+ *  proc: The process structure the job is for.
+ *  fn: The function to run.
+ *  arg: The argument to pass to the function.
+ */
+void threads_submit(Proc* proc, void (*fn)(void*), void* arg);
+
+/*
+ * Function: threads_release
+ * --------------------
+ * Discards the queued jobs of a process, and waits for its running job (if
+ * any) to finish, such that the process can be freed. Jobs already submitted
+ * to the ERTS async pool are waited for instead, as they can not be
+ * withdrawn, and do nothing when they run. Called when its port stops. The
+ * arguments of the discarded jobs are not freed.
+ *
+ *  proc: The process structure to release.
+ */
+void threads_release(Proc* proc);
+
+/*
+ * Function: threads_enter_runtime
+ * --------------------
+ * Prepares the calling thread to run WASM, if it has not been already. With
+ * hardware bounds checks, WAMR traps out-of-bounds accesses through per-thread
+ * signal state (an alternate signal stack and the jump buffer of the running
+ * call), which must be set up on every thread that calls into an instance.
+ * Called at the start of each job, as jobs may run on ERTS async threads.
+ */
+void threads_enter_runtime(void);
+
+/*
+ * Function: threads_hw_bounds
+ * --------------------
+ * Returns whether the runtime was built with hardware bounds checks (see
+ * `WAMR_BOUNDS' in the Makefile).
+ *
+ *  returns: 1 if it was, 0 otherwise.
+ */
+int threads_hw_bounds(void);
+
+#endif
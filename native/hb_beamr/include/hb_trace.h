@@ -0,0 +1,71 @@
+#ifndef HB_TRACE_H
+#define HB_TRACE_H
+
+#include "hb_core.h"
+
+// The number of events each thread's ring holds. Older events are
+// overwritten by newer ones.
+#define HB_TRACE_RING_SIZE 4096
+
+// The most threads that keep a trace ring. Further threads do not trace.
+#define HB_TRACE_MAX_THREADS 512
+
+// The kinds of trace events, and the meaning of their argument.
+#define HB_TRACE_CALL_START 0     // A call of an export began. No argument.
+#define HB_TRACE_CALL_END 1       // A call of an export ended. The time it took (ns).
+#define HB_TRACE_IMPORT_ENTER 2   // An import was sent to Erlang. Its index in the stats' imports, or -1.
+#define HB_TRACE_IMPORT_EXIT 3    // An import's response arrived. The time waited for it (ns).
+#define HB_TRACE_TRAP 4           // A call trapped. No argument.
+#define HB_TRACE_MEMORY_GROW 5    // An instance's memory grew. Its new size (bytes).
+
+// A trace event, as held in a ring.
+typedef struct {
+    uint64_t seq;                  // Position of the event in its ring plus one, or 0 while being written
+    uint64_t time_ns;              // Monotonic time of the event
+    uint32_t kind;                 // HB_TRACE_* kind of the event
+    uint32_t instance;             // Key of the instance the event is for
+    int64_t arg;                   // Argument of the event
+} TraceEvent;
+
+/*
+ * Function: trace_init
+ * --------------------
+ * Initializes the registry of trace rings. Called once, when the driver is
+ * loaded.
+ *
+ *  returns: 0 on success, or -1 on failure.
+ */
+int trace_init(void);
+
+/*
+ * Function: trace_destroy
+ * --------------------
+ * Frees the trace rings. Called once, when the driver is unloaded.
+ */
+void trace_destroy(void);
+
+/*
+ * Function: trace_event
+ * --------------------
+ * Records an event in the calling thread's ring, creating the ring on the
+ * thread's first event. Never blocks, other than on that first event.
+ *
+ *  proc: The process structure of the instance the event is for.
+ *  kind: The HB_TRACE_* kind of the event.
+ *  arg: The argument of the event.
+ */
+void trace_event(Proc* proc, uint32_t kind, int64_t arg);
+
+/*
+ * Function: trace_encode
+ * --------------------
+ * Encodes the events of every ring as an external term format list of
+ * `{TimeNs, Thread, Kind, Instance, Arg}' tuples, where Kind is an atom. The
+ * rings are read without stopping their threads: events that are overwritten
+ * while being read are skipped.
+ *
+ *  x: A buffer (created with ei_x_new_with_version) to encode into.
+ */
+void trace_encode(ei_x_buff* x);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef HB_WASI_H
+#define HB_WASI_H
+
+#include "hb_core.h"
+
+// The WASI (preview 1) imports that can be implemented natively by the driver
+// rather than by `dev_wasi'. Each instance selects a set of them at `init'.
+#define HB_WASI_FD_WRITE            (1 << 0)
+#define HB_WASI_CLOCK_TIME_GET      (1 << 1)
+#define HB_WASI_RANDOM_GET          (1 << 2)
+#define HB_WASI_ARGS_SIZES_GET      (1 << 3)
+#define HB_WASI_ENVIRON_SIZES_GET   (1 << 4)
+
+// Output from the native `fd_write' is sent to Erlang once this much of it has
+// been buffered, and otherwise before the next Erlang import or the end of the
+// call.
+#define HB_WASI_BUFFER_SIZE (64 * 1024)
+
+/*
+ * Function: wasi_native_flag
+ * --------------------
+ * Returns the HB_WASI_* flag for the name of a WASI import.
+ *
+ *  name: The name of the import (e.g. "fd_write").
+ *
+ *  returns: The flag, or 0 if the import has no native implementation.
+ */
+unsigned int wasi_native_flag(const char* name);
+
+/*
+ * Function: wasi_resolve_native
+ * --------------------
+ * Attaches the native implementation of an import to its hook, if the import
+ * is a WASI function that the instance has enabled natively, declared with
+ * the type that the implementation expects. Imports of any other type are
+ * left to Erlang.
+ *
+ *  hook: The import hook, with its module and field names and signature set.
+ */
+void wasi_resolve_native(ImportHook* hook);
+
+/*
+ * Function: wasi_seed_random
+ * --------------------
+ * Resets the state of the native `random_get' to the one derived from the
+ * instance's `random_seed', as at its start. Used when the instance's memory
+ * is restored from a snapshot, which does not carry the state. The instance
+ * must be locked by the caller.
+ *
+ *  proc: The process structure containing the WASM instance.
+ */
+void wasi_seed_random(Proc* proc);
+
+/*
+ * Function: wasi_seed_random_job
+ * --------------------
+ * The job that resets the state of the native `random_get' (see
+ * wasi_seed_random), ordered with the instance's calls. Replies with `ok'.
+ *
+ *  raw: The Proc of the instance.
+ */
+void wasi_seed_random_job(void* raw);
+
+/*
+ * Function: wasi_flush
+ * --------------------
+ * Sends any output buffered by the native `fd_write' to Erlang, as a single
+ * `wasi_snapshot_preview1.fd_write_buffered(FD, Data)' import, and waits
+ * for it to be handled.
+ *
+ *  proc: The process structure containing the WASM instance.
+ *
+ *  returns: NULL on success, or the error message of the failed import.
+ */
+const char* wasi_flush(Proc* proc);
+
+/*
+ * Function: wasi_free
+ * --------------------
+ * Releases the output buffer of an instance.
+ *
+ *  proc: The process structure containing the WASM instance.
+ */
+void wasi_free(Proc* proc);
+
+#endif // HB_WASI_H
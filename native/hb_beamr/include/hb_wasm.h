@@ -16,6 +16,59 @@
  */
 wasm_trap_t* wasm_handle_import(void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results);
 
+/*
+ * Function:  wasm_handle_import_erlang
+ * --------------------
+ * Handles an import by sending it to the Erlang process driving the call,
+ * and waiting for its response.
+ * 
+ *  import_hook: The import hook of the import being called.
+ *  args: The arguments for the import function.
+ *  results: The results of the import will be stored here.
+ *
+ *  returns: A WASM trap in case of an error, or NULL on success.
+ */
+wasm_trap_t* wasm_handle_import_erlang(ImportHook* import_hook, const wasm_val_vec_t* args, wasm_val_vec_t* results);
+
+/*
+ * Function:  wasm_import_msg_buffer
+ * --------------------
+ * Returns the process's reusable buffer for import messages, growing it if it
+ * holds fewer than `terms` terms. The buffer is owned by the process and
+ * freed when the port stops.
+ *
+ *  proc: The process whose buffer to return.
+ *  terms: The number of terms the message needs.
+ *
+ *  returns: The term buffer.
+ */
+ErlDrvTermData* wasm_import_msg_buffer(Proc* proc, size_t terms);
+
+/*
+ * Function:  wasm_import_rendezvous
+ * --------------------
+ * Sends an import message to the Erlang process driving the call, and blocks
+ * until the response has been received. The response is left in
+ * proc->current_import, which must be released with wasm_import_release.
+ * 
+ *  proc: The current process structure.
+ *  msg: The import message terms.
+ *  msg_len: The number of terms in the message.
+ *
+ *  returns: NULL on success, or the error message if the import failed.
+ */
+const char* wasm_import_rendezvous(Proc* proc, ErlDrvTermData* msg, int msg_len);
+
+/*
+ * Function:  wasm_import_release
+ * --------------------
+ * Releases the response of the last import, leaving the process's
+ * rendezvous ready to be reused by the next.
+ * 
+ *  proc: The current process structure.
+ */
+void wasm_import_release(Proc* proc);
+
 /*
  * Function:  wasm_initialize_runtime
  * --------------------
@@ -26,27 +79,62 @@ wasm_trap_t* wasm_handle_import(void* env, const wasm_val_vec_t* args, wasm_val_
 void wasm_initialize_runtime(void* raw);
 
 /*
- * Function:  wasm_execute_function_async
+ * Function:  wasm_execute_call
  * --------------------
- * Asynchronously executes a WASM function.
+ * Executes a queued call of an exported function, on the instance's job. Its
+ * arguments are either decoded terms, or a binary packed for the function's
+ * signature, in which case the results are replied packed in the same way.
+ * The replies are tagged with the command's request ID, if it has one.
  * 
- *  raw: A pointer to the process structure containing the function call details.
+ *  proc: The process structure of the instance.
+ *  cmd: The queued call. It is recycled by the caller.
  */
-void wasm_execute_function(void* raw);
+void wasm_execute_call(Proc* proc, QueuedCommand* cmd);
 
 /*
- * Function:  wasm_execute_indirect_function
+ * Function:  wasm_execute_batch
  * --------------------
- * Executes an indirect WASM function asynchronously.
+ * Executes a batch of exported functions back-to-back on the same async job,
+ * replying with a single list of result lists. Execution stops at the first
+ * failing call, in which case `{error, {Index, Message}}` is sent instead.
+ * Frees the batch.
  * 
- *  proc: The current process structure.
- *  function_name: The name of the indirect function to call.
- *  input_args: The input arguments for the function call.
- *  output_results: The results of the function call will be stored here.
+ *  raw: A pointer to the CallBatch structure describing the calls.
+ */
+void wasm_execute_batch(void* raw);
+
+/*
+ * Function:  free_call_batch
+ * --------------------
+ * Frees a batch of calls, including the decoded names and arguments.
+ * 
+ *  batch: The batch to free.
+ */
+void free_call_batch(CallBatch* batch);
+
+/*
+ * Function:  wasm_execute_buffer_call
+ * --------------------
+ * Copies each input buffer of a call into guest memory, NUL-terminated and
+ * allocated with the module's exported `malloc', then calls an exported
+ * function with the resulting pointers as its arguments. Each pointer result
+ * of the function is read as a NUL-terminated string, and the strings are sent
+ * back to Erlang as a list of binaries. Optionally, the inputs and outputs are
+ * then released with the module's exported `free'. All of this happens in a
+ * single async job. Frees the call.
+ *
+ *  raw: A pointer to the BufferCall structure describing the call.
+ */
+void wasm_execute_buffer_call(void* raw);
+
+/*
+ * Function:  free_buffer_call
+ * --------------------
+ * Frees a buffer call, including its function name and input buffers.
  *
- *  returns: 0 on success or -1 on failure.
+ *  call: The call to free.
  */
-int wasm_execute_indirect_function(Proc* proc, const char *function_name, const wasm_val_vec_t* input_args, wasm_val_vec_t* output_results);
+void free_buffer_call(BufferCall* call);
 
 /*
  * Function:  wasm_execute_exported_function
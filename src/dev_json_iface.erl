@@ -20,10 +20,10 @@
 %%%             M2/Assignment/Block-Height
 %%%         Generates:
 %%%             /wasm/handler
-%%%             /wasm/params
+%%%             /priv/wasm/buffers
 %%%         Side-effects:
-%%%             Writes the process and message as JSON representations into the
-%%%             WASM environment.
+%%%             None. The WASM device writes the process and message buffers
+%%%             (as JSON) into the WASM environment as part of its call.
 %%% 
 %%%     M1/Computed when M2/Pass == 2 ->
 %%%         Assumes:
@@ -54,11 +54,11 @@ compute(M1, M2, Opts) ->
         _ -> {ok, M1}
     end.
 
-%% @doc Prepare the WASM environment for execution by writing the process string and
-%% the message as JSON representations into the WASM environment.
+%% @doc Prepare the WASM environment for execution by encoding the process and
+%% the message as JSON, to be written into the WASM environment by the WASM
+%% device when it calls `handle'.
 prep_call(M1, M2, Opts) ->
     ?event({prep_call, M1, M2, Opts}),
-    Instance = hb_private:get(<<"priv/wasm/instance">>, M1, Opts),
     Process = hb_converge:get(<<"process">>, M1, Opts#{ hashpath => ignore }),
     Message = hb_converge:get(<<"body">>, M2, Opts#{ hashpath => ignore }),
     Image = hb_converge:get(<<"process/image">>, M1, Opts),
@@ -74,20 +74,22 @@ prep_call(M1, M2, Opts) ->
                 ]
         ),
     MsgJson = jiffy:encode({MsgProps}),
-    {ok, MsgJsonPtr} = hb_beamr_io:write_string(Instance, MsgJson),
     ProcessProps =
         normalize_props(
             [{<<"Process">>, message_to_json_struct(Process)}]
         ),
     ProcessJson = jiffy:encode({ProcessProps}),
-    {ok, ProcessJsonPtr} = hb_beamr_io:write_string(Instance, ProcessJson),
+    % The JSON strings are written into the WASM environment by the WASM
+    % device, in the same round trip as its call to `handle'.
     {ok,
-        hb_converge:set(
-            M1,
-            #{
-                <<"wasm-function">> => <<"handle">>,
-                <<"wasm-params">> => [MsgJsonPtr, ProcessJsonPtr]
-            },
+        hb_private:set(
+            hb_converge:set(
+                M1,
+                #{ <<"wasm-function">> => <<"handle">> },
+                Opts
+            ),
+            <<"wasm/buffers">>,
+            [MsgJson, ProcessJson],
             Opts
         )
     }.
@@ -300,8 +302,11 @@ results(M1, _M2, Opts) ->
                 )
             };
         <<"ok">> ->
-            [Ptr] = hb_converge:get(<<"results/wasm/output">>, M1, Opts),
-            {ok, Str} = hb_beamr_io:read_string(Instance, Ptr),
+            {ok, Str} =
+                case hb_converge:get(<<"results/wasm/output">>, M1, Opts) of
+                    [Output] when is_binary(Output) -> {ok, Output};
+                    [Ptr] -> hb_beamr_io:read_string(Instance, Ptr)
+                end,
             try jiffy:decode(Str, [return_maps]) of
                 #{<<"ok">> := true, <<"response">> := Resp} ->
                     {ok, ProcessedResults} = json_to_message(Resp, Opts),
@@ -6,7 +6,8 @@
 %%% modules.
 -module(dev_wasi).
 -export([init/3, compute/1, stdout/1]).
--export([path_open/3, fd_write/3, fd_read/3, clock_time_get/3]).
+-export([path_open/3, fd_write/3, fd_write_buffered/3, fd_read/3]).
+-export([clock_time_get/3]).
 -include("include/hb.hrl").
 -include_lib("eunit/include/eunit.hrl").
 
@@ -140,30 +141,80 @@ fd_write(Msg1, Msg2, Opts) ->
     ?event({fd_write, {fd, FD}, {ptr, Ptr}, {vecs, Vecs}, {retptr, RetPtr}}),
     Signature = hb_converge:get(<<"func-sig">>, Msg2, Opts),
     ?event({signature, Signature}),
-    fd_write(State, Instance, [FD, Ptr, Vecs, RetPtr], 0, Opts).
+    Width = pointer_width(Signature),
+    case hb_converge:get(<<"prefetched">>, Msg2, Opts) of
+        [Buffers] when is_list(Buffers) ->
+            % BEAMR sent the buffers with the import, so neither they nor the
+            % count of bytes written need a round trip to the instance.
+            Data = iolist_to_binary(Buffers),
+            {ok,
+                #{
+                    <<"state">> => write_to_fd(State, FD, Data, Opts),
+                    <<"results">> => [0],
+                    <<"writes">> =>
+                        [{RetPtr, <<(byte_size(Data)):Width/little-unsigned-integer>>}]
+                }
+            };
+        _ ->
+            fd_write(State, Instance, [FD, Ptr, Vecs, RetPtr], 0, Width, Opts)
+    end.
 
-fd_write(S, Instance, [_, _Ptr, 0, RetPtr], BytesWritten, _Opts) ->
+fd_write(S, Instance, [_, _Ptr, 0, RetPtr], BytesWritten, Width, _Opts) ->
     hb_beamr_io:write(
         Instance,
         RetPtr,
-        <<BytesWritten:64/little-unsigned-integer>>
+        <<BytesWritten:Width/little-unsigned-integer>>
     ),
     {ok, #{ <<"state">> => S, <<"results">> => [0] }};
-fd_write(S, Instance, [FDnum, Ptr, Vecs, RetPtr], BytesWritten, Opts) ->
-    FDNumStr = integer_to_binary(FDnum),
+fd_write(S, Instance, [FDnum, Ptr, Vecs, RetPtr], BytesWritten, Width, Opts) ->
+    {VecPtr, Len} = parse_iovec(Instance, Ptr, Width),
+    {ok, Data} = hb_beamr_io:read(Instance, VecPtr, Len),
+    S2 = write_to_fd(S, FDnum, Data, Opts),
+    fd_write(
+        S2,
+        Instance,
+        [FDnum, Ptr + 2 * (Width div 8), Vecs - 1, RetPtr],
+        BytesWritten + byte_size(Data),
+        Width,
+        Opts
+    ).
+
+%% @doc The destination of output that BEAMR gathers natively, when it
+%% implements `fd_write' itself (see the `native_wasi' option of
+%% `hb_beamr:start/3'). Rather than one call per I/O vector, the output of
+%% the instance reaches us in bulk, as a single binary.
+fd_write_buffered(Msg1, Msg2, Opts) ->
+    State = hb_converge:get(<<"state">>, Msg1, Opts),
+    [FD, Data|_] = hb_converge:get(<<"args">>, Msg2, Opts),
+    ?event({fd_write_buffered, {fd, FD}, {bytes, byte_size(Data)}}),
+    {ok, #{ <<"state">> => write_to_fd(State, FD, Data, Opts), <<"results">> => [] }}.
+
+%% @doc Write data to a file at the offset of its descriptor, advancing the
+%% offset past it. As with POSIX `write', the data replaces the bytes of the
+%% file at that offset (extending the file if needed), rather than being
+%% inserted before them. The file's contents are those held in the VFS, as
+%% descriptors do not keep a copy of them.
+write_to_fd(S, FDNum, Data, Opts) ->
+    FDNumStr = integer_to_binary(FDNum),
     FD = hb_converge:get(<<"file-descriptors/", FDNumStr/binary>>, S, Opts),
     Filename = hb_converge:get(<<"filename">>, FD, Opts),
     StartOffset = hb_converge:get(<<"offset">>, FD, Opts),
-    {VecPtr, Len} = parse_iovec(Instance, Ptr),
-    {ok, Data} = hb_beamr_io:read(Instance, VecPtr, Len),
-    Before =
-        binary:part(
-            OrigData = hb_converge:get(<<"data">>, FD, Opts),
-            0,
-            StartOffset
-        ),
+    OrigData =
+        case hb_converge:get(<<"vfs/", Filename/binary>>, S, Opts) of
+            not_found -> <<>>;
+            Existing -> Existing
+        end,
+    Before = binary:part(OrigData, 0, min(StartOffset, byte_size(OrigData))),
     After =
-        binary:part(OrigData, StartOffset, byte_size(OrigData) - StartOffset),
+        case StartOffset + byte_size(Data) < byte_size(OrigData) of
+            true ->
+                binary:part(
+                    OrigData,
+                    StartOffset + byte_size(Data),
+                    byte_size(OrigData) - StartOffset - byte_size(Data)
+                );
+            false -> <<>>
+        end,
     S1 =
         hb_converge:set(
             S,
@@ -171,18 +222,10 @@ fd_write(S, Instance, [FDnum, Ptr, Vecs, RetPtr], BytesWritten, Opts) ->
             StartOffset + byte_size(Data),
             Opts
         ),
-    S2 =
-        hb_converge:set(
-            S1,
-            <<"vfs/", Filename/binary>>,
-            <<Before/binary, Data/binary, After/binary>>,
-            Opts
-        ),
-    fd_write(
-        S2,
-        Instance,
-        [FD, Ptr + 16, Vecs - 1, RetPtr],
-        BytesWritten + byte_size(Data),
+    hb_converge:set(
+        S1,
+        <<"vfs/", Filename/binary>>,
+        <<Before/binary, Data/binary, After/binary>>,
         Opts
     ).
 
@@ -193,21 +236,22 @@ fd_read(Msg1, Msg2, Opts) ->
     [FD, VecsPtr, NumVecs, RetPtr|_] = hb_converge:get(<<"args">>, Msg2, Opts),
     Signature = hb_converge:get(<<"func-sig">>, Msg2, Opts),
     ?event({signature, Signature}),
-    fd_read(State, Instance, [FD, VecsPtr, NumVecs, RetPtr], 0, Opts).
+    fd_read(State, Instance, [FD, VecsPtr, NumVecs, RetPtr], 0,
+        pointer_width(Signature), Opts).
 
-fd_read(S, Instance, [FD, _VecsPtr, 0, RetPtr], BytesRead, _Opts) ->
+fd_read(S, Instance, [FD, _VecsPtr, 0, RetPtr], BytesRead, Width, _Opts) ->
     ?event({{completed_read, FD, BytesRead}}),
     hb_beamr_io:write(Instance, RetPtr,
-        <<BytesRead:64/little-unsigned-integer>>),
+        <<BytesRead:Width/little-unsigned-integer>>),
     {ok, #{ <<"state">> => S, <<"results">> => [0] }};
-fd_read(S, Instance, [FDNum, VecsPtr, NumVecs, RetPtr], BytesRead, Opts) ->
+fd_read(S, Instance, [FDNum, VecsPtr, NumVecs, RetPtr], BytesRead, Width, Opts) ->
     ?event({fd_read, FDNum, VecsPtr, NumVecs, RetPtr}),
     % Parse the request
     FDNumStr = integer_to_binary(FDNum),
     Filename =
         hb_converge:get(
             <<"file-descriptors/", FDNumStr/binary, "/filename">>, S, Opts),
-    {VecPtr, Len} = parse_iovec(Instance, VecsPtr),
+    {VecPtr, Len} = parse_iovec(Instance, VecsPtr, Width),
     % Read the bytes from the file
     Data = hb_converge:get(<<"vfs/", Filename/binary>>, S, Opts),
     Offset =
@@ -225,17 +269,25 @@ fd_read(S, Instance, [FDNum, VecsPtr, NumVecs, RetPtr], BytesRead, Opts) ->
             Opts
         ),
         Instance,
-        [FDNum, VecsPtr + 16, NumVecs - 1, RetPtr],
+        [FDNum, VecsPtr + 2 * (Width div 8), NumVecs - 1, RetPtr],
         BytesRead + ReadSize,
+        Width,
         Opts
     ).
 
-%% @doc Parse an iovec in WASI-preview-1 format.
-parse_iovec(Instance, Ptr) ->
-    {ok, VecStruct} = hb_beamr_io:read(Instance, Ptr, 16),
+%% @doc The width (in bits) of the pointers and sizes of a WASI import, from
+%% its signature: 64-bit in wasm64 modules, whose pointer arguments are `I',
+%% and 32-bit otherwise.
+pointer_width(<<"(", _FD, $I, _/binary>>) -> 64;
+pointer_width(_) -> 32.
+
+%% @doc Parse an iovec in WASI-preview-1 format, with pointers and sizes of
+%% the given width.
+parse_iovec(Instance, Ptr, Width) ->
+    {ok, VecStruct} = hb_beamr_io:read(Instance, Ptr, 2 * (Width div 8)),
     <<
-        BinPtr:64/little-unsigned-integer,
-        Len:64/little-unsigned-integer
+        BinPtr:Width/little-unsigned-integer,
+        Len:Width/little-unsigned-integer
     >> = VecStruct,
     {BinPtr, Len}.
 
@@ -264,6 +316,40 @@ generate_wasi_stack(File, Func, Params) ->
     {ok, Msg2} = hb_converge:resolve(Msg1, <<"init">>, #{}),
     Msg2.
 
+%% @doc Test that consecutive writes to a descriptor accumulate, and that a
+%% write at an earlier offset replaces the bytes that it covers.
+write_to_fd_test() ->
+    {ok, S} = init(#{}, #{}, #{}),
+    S1 = write_to_fd(S, 1, <<"Hello, ">>, #{}),
+    S2 = write_to_fd(S1, 1, <<"World!">>, #{}),
+    ?assertEqual(<<"Hello, World!">>, stdout(S2)),
+    S3 = hb_converge:set(S2, <<"file-descriptors/1/offset">>, 0, #{}),
+    S4 = write_to_fd(S3, 1, <<"Howdy">>, #{}),
+    ?assertEqual(<<"Howdy, World!">>, stdout(S4)),
+    ?assertEqual(5, hb_converge:get(<<"file-descriptors/1/offset">>, S4, #{})).
+
+%% @doc Test that the count of bytes written by a prefetched `fd_write' is
+%% returned as a write of the size type of the module: 32-bit, or 64-bit for
+%% wasm64 modules.
+prefetched_fd_write_test() ->
+    {ok, S} = init(#{}, #{}, #{}),
+    Write =
+        fun(Signature) ->
+            {ok, #{ <<"writes">> := Writes }} =
+                fd_write(
+                    #{ <<"state">> => S },
+                    #{
+                        <<"args">> => [1, 16, 1, 64],
+                        <<"func-sig">> => Signature,
+                        <<"prefetched">> => [[<<"Hello, ">>, <<"World!">>]]
+                    },
+                    #{}
+                ),
+            Writes
+        end,
+    ?assertEqual([{64, <<13:32/little>>}], Write(<<"(iiii)i">>)),
+    ?assertEqual([{64, <<13:64/little>>}], Write(<<"(iIII)i">>)).
+
 vfs_is_serializable_test() ->
     StackMsg = generate_wasi_stack("test/test-print.wasm", <<"hello">>, []),
     VFSMsg = hb_converge:get(<<"vfs">>, StackMsg),
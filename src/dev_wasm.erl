@@ -22,6 +22,7 @@
 %%%             M2/message
 %%%             M2/message/wasm-function OR M1/wasm-function
 %%%             M2/message/wasm-params OR M1/wasm-params
+%%%             OR M1/priv/wasm/buffers, binaries passed by pointer
 %%%         Generates:
 %%%             /results/wasm/type
 %%%             /results/wasm/body
@@ -96,14 +97,43 @@ init(M1, M2, Opts) ->
                     false -> wasm
                 end
         end,
-    % Start the WASM executor.
-    {ok, Instance, _Imports, _Exports} = hb_beamr:start(ImageBin, Mode),
+    % Start the WASM executor. In AOT mode the image is compiled (once per
+    % node, as the result is cached), falling back to interpreting it if no
+    % compiler is available.
+    EngineOpts =
+        #{
+            engine => hb_opts:get(wasm_engine, default, Opts),
+            native_wasi => hb_opts:get(wasm_native_wasi, [], Opts),
+            threads => hb_opts:get(wasm_threads, 0, Opts),
+            thread_pinning => hb_opts:get(wasm_thread_pinning, false, Opts),
+            stack_size => hb_opts:get(wasm_stack_size, 0, Opts),
+            heap_size => hb_opts:get(wasm_heap_size, 0, Opts),
+            initial_memory => hb_opts:get(wasm_initial_memory, 0, Opts),
+            max_memory => hb_opts:get(wasm_max_memory, 0, Opts),
+            bounds_checks => hb_opts:get(wasm_bounds_checks, default, Opts)
+        },
+    {ok, Instance, _Imports, Exports} =
+        case Mode of
+            aot ->
+                case hb_beamr_aot:start(ImageBin, Opts) of
+                    {ok, _, _, _} = AOTRes -> AOTRes;
+                    {error, AOTError} ->
+                        ?event({aot_unavailable_falling_back, AOTError}),
+                        hb_beamr:start(ImageBin, wasm, EngineOpts)
+                end;
+            wasm ->
+                case hb_opts:get(wasm_pool, false, Opts) of
+                    true -> hb_beamr_pool:checkout(ImageBin, wasm, EngineOpts, Opts);
+                    false -> hb_beamr:start(ImageBin, wasm, EngineOpts)
+                end
+        end,
     % Set the WASM Instance, handler, and standard library invokation function.
     ?event({setting_wasm_instance, Instance, {prefix, Prefix}}),
     {ok,
         hb_private:set(M1,
             #{
                 <<Prefix/binary, "/instance">> => Instance,
+                <<Prefix/binary, "/exports">> => Exports,
                 <<Prefix/binary, "/import-resolver">> =>
                     fun default_import_resolver/3
             },
@@ -121,6 +151,14 @@ default_import_resolver(Msg1, Msg2, Opts) ->
         func_sig := Signature
     } = Msg2,
     Prefix = dev_stack:prefix(Msg1, Msg2, Opts),
+    ImportMsg =
+        #{
+            <<"path">> => <<"import">>,
+            <<"module">> => list_to_binary(Module),
+            <<"func">> => list_to_binary(Func),
+            <<"args">> => Args,
+            <<"func-sig">> => list_to_binary(Signature)
+        },
     {ok, Msg3} =
         hb_converge:resolve(
             hb_private:set(
@@ -128,18 +166,21 @@ default_import_resolver(Msg1, Msg2, Opts) ->
                 #{ <<Prefix/binary, "/instance">> => WASM },
                 Opts
             ),
-            #{
-                <<"path">> => <<"import">>,
-                <<"module">> => list_to_binary(Module),
-                <<"func">> => list_to_binary(Func),
-                <<"args">> => Args,
-                <<"func-sig">> => list_to_binary(Signature)
-            },
+            case Msg2 of
+                #{ prefetched := Prefetched } ->
+                    ImportMsg#{ <<"prefetched">> => Prefetched };
+                _ -> ImportMsg
+            end,
             Opts
         ),
     NextState = hb_converge:get(state, Msg3, Opts),
     Response = hb_converge:get(results, Msg3, Opts),
-    {ok, Response, NextState}.
+    % Handlers may return the memory writes of the import, rather than
+    % making them with `hb_beamr_io'.
+    case hb_converge:get(<<"writes">>, Msg3, Opts) of
+        not_found -> {ok, Response, NextState};
+        Writes -> {ok, Response, NextState, Writes}
+    end.
 
 %% @doc Call the WASM executor with a message that has been prepared by a prior
 %% pass.
@@ -198,18 +239,46 @@ compute(RawM1, M2, Opts) ->
                             {priv, hb_private:from_message(M1)}
                         }
                     ),
+                    ImportResolver =
+                        hb_private:get(<<Prefix/binary, "/import-resolver">>, M1, Opts),
+                    Budget = hb_opts:get(wasm_call_budget, #{}, Opts),
+                    % Buffers left in `priv/' by a device before us (e.g.
+                    % `dev_json_iface') are placed in memory and passed to the
+                    % function in the same round trip as the call, and its
+                    % output is the strings its results point to.
                     {ResType, Res, MsgAfterExecution} =
-                        hb_beamr:call(
-                            instance(M1, M2, Opts),
-                            WASMFunction,
-                            case WASMParams of
-                                not_found -> [];
-                                Params -> Params
-                            end,
-                            hb_private:get(<<Prefix/binary, "/import-resolver">>, M1, Opts),
-                            M1,
-                            Opts
-                        ),
+                        case hb_private:get(<<Prefix/binary, "/buffers">>, M1, Opts) of
+                            Buffers when is_list(Buffers) ->
+                                hb_beamr:call_with_buffers(
+                                    instance(M1, M2, Opts),
+                                    WASMFunction,
+                                    Buffers,
+                                    ImportResolver,
+                                    hb_private:set(M1, <<Prefix/binary, "/buffers">>, unset, Opts),
+                                    Opts#{ budget => Budget }
+                                );
+                            _ ->
+                                Params =
+                                    case WASMParams of
+                                        not_found -> [];
+                                        ExplicitParams -> ExplicitParams
+                                    end,
+                                hb_beamr:call(
+                                    instance(M1, M2, Opts),
+                                    WASMFunction,
+                                    Params,
+                                    ImportResolver,
+                                    M1,
+                                    maps:merge(
+                                        Opts#{
+                                            import_prefetch =>
+                                                hb_opts:get(wasm_import_prefetch, [], Opts),
+                                            budget => Budget
+                                        },
+                                        signature_opts(M1, Prefix, WASMFunction, Params, Opts)
+                                    )
+                                )
+                        end,
                     {ok,
                         hb_converge:set(MsgAfterExecution,
                             #{
@@ -222,6 +291,26 @@ compute(RawM1, M2, Opts) ->
         _ -> {ok, M1}
     end.
 
+%% @doc The options of a call that pass its arguments packed for the
+%% signature of the export, as `init' found it (see `hb_beamr:call/6'), such
+%% that i64 values keep their full range. The arguments of functions that the
+%% instance does not export, or that do not fit the signature, are sent as
+%% terms.
+signature_opts(M1, Prefix, Function, Params, Opts) ->
+    Name = hb_util:list(Function),
+    case hb_private:get(<<Prefix/binary, "/exports">>, M1, Opts#{ hashpath => ignore }) of
+        Exports when is_list(Exports) ->
+            case lists:keyfind(Name, 2, Exports) of
+                {func, Name, Signature} ->
+                    case hb_beamr:is_valid_call_args(#{ signature => Signature }, Params) of
+                        true -> #{ signature => Signature };
+                        false -> #{}
+                    end;
+                _ -> #{}
+            end;
+        _ -> #{}
+    end.
+
 %% @doc Normalize the message to have an open WASM instance, but no literal
 %% `State' key. Ensure that we do not change the hashpath during this process.
 normalize(RawM1, M2, Opts) ->
@@ -249,9 +338,19 @@ normalize(RawM1, M2, Opts) ->
                     not_found -> throw({error, no_wasm_instance_or_snapshot});
                     State ->
                         {ok, M1} = init(RawM1, State, Opts),
-                        Res = hb_beamr:deserialize(instance(M1, M2, Opts), State),
+                        Res =
+                            case hb_beamr_pages:is_manifest(State) of
+                                true ->
+                                    hb_beamr_pages:restore(
+                                        instance(M1, M2, Opts), State, Opts);
+                                false ->
+                                    hb_beamr:deserialize(instance(M1, M2, Opts), State)
+                            end,
                         ?event(snapshot, {wasm_deserialized, {result, Res}}),
-                        M1
+                        case Res of
+                            ok -> M1;
+                            {error, Error} -> throw({error, {wasm_restore_failed, Error}})
+                        end
                 end;
             _ ->
                 ?event(wasm_instance_found_not_deserializing),
@@ -259,11 +358,16 @@ normalize(RawM1, M2, Opts) ->
         end,
     dev_message:set(M3, #{ <<"snapshot">> => unset }, Opts).
 
-%% @doc Serialize the WASM state to a binary.
+%% @doc Serialize the WASM state to a binary: either the whole memory, or a
+%% manifest of its pages if `wasm_snapshot_pages' is set.
 snapshot(M1, M2, Opts) ->
     ?event(snapshot, generating_snapshot),
     Instance = instance(M1, M2, Opts),
-    {ok, Serialized} = hb_beamr:serialize(Instance),
+    {ok, Serialized} =
+        case hb_opts:get(wasm_snapshot_pages, false, Opts) of
+            true -> hb_beamr_pages:store(Instance, Opts);
+            false -> hb_beamr:serialize(Instance)
+        end,
     {ok,
         #{
             <<"body">> => Serialized
@@ -275,7 +379,11 @@ terminate(M1, M2, Opts) ->
     ?event(terminate_called_on_dev_wasm),
     Prefix = dev_stack:prefix(M1, M2, Opts),
     Instance = instance(M1, M2, Opts),
-    hb_beamr:stop(Instance),
+    % Pooled instances are reset for reuse, rather than stopped.
+    case hb_opts:get(wasm_pool, false, Opts) of
+        true -> hb_beamr_pool:checkin(Instance);
+        false -> hb_beamr:stop(Instance)
+    end,
     {ok, hb_private:set(M1,
         #{
             <<Prefix/binary, "/Instance">> => unset
@@ -441,6 +549,43 @@ basic_execution_64_test() ->
         test_run_wasm("test/test-64.wasm", <<"fac">>, [5.0], #{})
     ).
 
+%% @doc A module exporting `id(i64) -> i64', which returns its argument.
+i64_identity_module() ->
+    <<
+        0, "asm", 1:32/little,
+        1, 6, 1, 16#60, 1, 16#7e, 1, 16#7e,
+        3, 2, 1, 0,
+        7, 6, 1, 2, "id", 0, 0,
+        10, 6, 1, 4, 0, 16#20, 0, 16#0b
+    >>.
+
+%% @doc Test that i64 arguments and results outside of the range of an Erlang
+%% small integer are passed intact, as calls pack them for the signature of
+%% the export.
+i64_range_test() ->
+    init(),
+    {ok, ID} = hb_cache:write(#{ <<"body">> => i64_identity_module() }, #{}),
+    {ok, Msg1} =
+        hb_converge:resolve(
+            #{ <<"device">> => <<"WASM-64@1.0">>, <<"image">> => ID },
+            <<"init">>,
+            #{}
+        ),
+    Max = 16#7FFFFFFFFFFFFFFF,
+    Min = -16#8000000000000000,
+    lists:foreach(
+        fun(Value) ->
+            Msg2 =
+                maps:merge(
+                    Msg1,
+                    #{ <<"wasm-function">> => <<"id">>, <<"wasm-params">> => [Value] }
+                ),
+            {ok, Res} = hb_converge:resolve(Msg2, <<"compute">>, #{}),
+            ?assertEqual({ok, [Value]}, hb_converge:resolve(Res, <<"results/output">>, #{}))
+        end,
+        [Max, Min, 1 bsl 40]
+    ).
+
 imported_function_test() ->
     ?assertEqual(
         {ok, [32]},
@@ -22,6 +22,51 @@
 %%%                 Args, Signature}.
 %%%             Exports is a list of tuples of the form {Function, Args,
 %%%                 Signature}.
+%%%     start(WasmBinary, Mode, Opts) -> {ok, Port, Imports, Exports}
+%%%         Where:
+%%%             Mode is `wasm' or `aot' (for precompiled images).
+%%%             Opts may contain the `engine' that executes the instance:
+%%%                 `default', `interp', `fast_jit', `llvm_jit' or
+%%%                 `multi_tier_jit'. Which are available depends on the
+%%%                 `WAMR_PROFILE' the runtime was built with.
+%%%             Opts may also contain `native_wasi', a list of the WASI
+%%%                 imports that BEAMR implements in C rather than sending
+%%%                 to Erlang: `fd_write', `clock_time_get', `random_get',
+%%%                 `args_sizes_get' and `environ_sizes_get'. Output written
+%%%                 natively to stdout and stderr is buffered, and delivered
+%%%                 in bulk as a `fd_write_buffered' import of `[FD, Data]'
+%%%                 before the next import and at the end of each call.
+%%%                 `random_get' is seeded by the `random_seed' option. Its
+%%%                 state is carried by templates (for `fork' and `reset'),
+%%%                 and restarts from the seed when a serialized memory is
+%%%                 restored.
+%%%             Opts may also contain `threads', the number of threads of the
+%%%                 driver's own pool to run WASM on (instances stick to one
+%%%                 thread), and `thread_pinning', whether to pin them to
+%%%                 cores. The pool is shared, so the first instance to ask
+%%%                 for one sets these. With no pool (`threads' of 0), the
+%%%                 ERTS async pool is used, with each instance kept on one of
+%%%                 its threads.
+%%%             Opts may also size the instance: its `stack_size' and the
+%%%                 `heap_size' that the runtime manages for it (in bytes,
+%%%                 64KB each by default), the `initial_memory' to grow its
+%%%                 memory to up front, in one step rather than over its
+%%%                 first calls, and the `max_memory' it may grow to (in
+%%%                 bytes, rounded up to whole pages). Starting fails if the
+%%%                 memory can not be grown to its `initial_memory'.
+%%%             Opts may also contain `bounds_checks': `default' (as the runtime
+%%%                 was built, see `WAMR_BOUNDS' in the Makefile),
+%%%                 `hardware' (guard regions around 32-bit memories, with
+%%%                 out-of-bounds accesses reported as ordinary traps: this
+%%%                 requires a runtime built with them) or `software' (checks
+%%%                 in code: with a hardware build, only AOT images have
+%%%                 them). 64-bit memories are always checked in software.
+%%%             Opts may also select the `backend' of the instance: `driver'
+%%%                 (the default) or `nif', whose instances are NIF resources
+%%%                 rather than processes, and whose calls run on dirty
+%%%                 schedulers without a port round trip. It only supports
+%%%                 the term calls of call/6 and the memory operations of
+%%%                 `hb_beamr_io' (see `hb_beamr_nif').
 %%%     stop(Port) -> ok
 %%%     call(Port, FunctionName, Args) -> {ok, Result}
 %%%         Where:
@@ -35,7 +80,74 @@
 %%%             ImportFun must have an arity of 2: Taking an arbitrary `state`
 %%%             term, and a map containing the `port`, `module`, `func`, `args`,
 %%%             `signature`, and the `options` map of the import.
-%%%             It must return a tuple of the form {ok, Response, NewState}.
+%%%             It must return a tuple of the form {ok, Response, NewState},
+%%%             or {ok, Response, NewState, Writes}, where Writes is a list of
+%%%             {Offset, Binary} memory writes that BEAMR applies before the
+%%%             import returns, saving a round trip for each of them.
+%%%             Opts may contain `import_prefetch', a list of
+%%%                 {Module, Func, Descriptors} tuples that describe the
+%%%                 memory an import reads, by its (0-based) arguments:
+%%%                 {bytes, PtrArg, LenArg}, {fixed, PtrArg, Len} or
+%%%                 {iovec, PtrArg, CountArg}. That memory is then sent with
+%%%                 each call of the import, and given to ImportFun as the
+%%%                 `prefetched' list: a binary per descriptor (a list of
+%%%                 binaries for `iovec'), or `undefined' if it could not be
+%%%                 read.
+%%%             Opts may also contain a `budget' for the call: a map of the
+%%%                 `fuel' (instructions) and `time' (milliseconds, counted
+%%%                 from when the call starts, after any queued before it)
+%%%                 that it may use. A call that
+%%%                 exceeds its budget is stopped, returning
+%%%                 {error, budget_exhausted, State}, and the instance remains
+%%%                 usable. Fuel requires a runtime built with instruction
+%%%                 metering.
+%%%             Opts may also contain the `signature' of the function, as
+%%%                 given in the exports of `start/3' (e.g. "(iI)F"). The
+%%%                 arguments and results are then sent as packed binaries of
+%%%                 their little-endian values, which the driver checks
+%%%                 against the function's own signature, instead of as terms.
+%%%                 This avoids allocating for each argument, and keeps the
+%%%                 full range of i64 values. Functions that take or return
+%%%                 v128 values (`v' in signatures) can only be called this
+%%%                 way: each v128 is a 16-byte binary of its lanes, in
+%%%                 little-endian order. Imports can not take or return them.
+%%%     call_batch(Port, Calls[, ImportFun, State, Opts]) -> {ok, Results}
+%%%         Where:
+%%%             Calls is a list of {FunctionName, Args} tuples, executed in
+%%%                 order by a single job on the driver's worker thread.
+%%%             Results is a list of the result lists of each call.
+%%%             Imports are handled as for call/6. If a call fails, the
+%%%                 batch stops and {error, {Index, Message}} is returned,
+%%%                 where Index is the (1-based) position of the failed call.
+%%%     call_with_buffers(Port, FunctionName, Buffers[, ImportFun, State, Opts])
+%%%             -> {ok, Outputs}
+%%%         Where:
+%%%             Buffers is a list of binaries, each copied into memory
+%%%                 allocated with the module's `malloc' export (followed by a
+%%%                 NUL byte). The function is called with their pointers.
+%%%             Outputs is a list of binaries: the NUL-terminated strings that
+%%%                 the results of the function point to.
+%%%             Opts may set `free_buffers' to true to release the inputs and
+%%%                 outputs with the module's `free' export afterwards, and a
+%%%                 `budget' as for call/6. Imports are handled as for call/6,
+%%%                 and all of the steps take a single round trip to the driver.
+%%%     send_call(Port, FunctionName, Args[, Opts]) -> {ok, Request}
+%%%     send_read(Port, Offset, Size) -> {ok, Request}
+%%%     send_write(Port, Offset, Binary) -> {ok, Request}
+%%%         Queue a call (with the `Opts' of call/6) or a memory operation
+%%%             without waiting for it. Each instance runs its queued work in
+%%%             order, so many requests can be in flight at once, and reads
+%%%             and writes land between the calls around them.
+%%%     await(Port, Request[, ImportFun, State, Opts]) -> {ok, Result[, State]}
+%%%         Waits for the reply to a request, handling its imports as call/6
+%%%             does. Replies are matched to their requests, so they may be
+%%%             awaited in any order, but imports are only handled for the
+%%%             request being awaited: await the running request first if
+%%%             its imports are not stubs. Reads reply with {ok, Binary},
+%%%             and writes with {ok, ok}.
+%%%     cancel(Port, Request) -> ok | {error, not_queued}
+%%%         Removes a request that has not started from the queue. It then
+%%%             never replies.
 %%%     serialize(Port) -> {ok, Mem}
 %%%         Where:
 %%%             Port is the port to the LID.
@@ -44,20 +156,122 @@
 %%%         Where:
 %%%             Port is the port to the LID.
 %%%             Mem is a binary output of a previous `serialize/1' call.
+%%%     deserialize_file(Port, Path) -> {ok, mapped | copied}
+%%%         Restores the output of `serialize/1' from a file (for example, in
+%%%             an `hb_store_fs' store: see `hb_store_fs:file_path/2'). Where
+%%%             possible, the file is mapped copy-on-write as the memory, so
+%%%             restoring only costs the pages that are touched afterwards.
+%%%     serialize_stream(Port, Opts) -> {ok, Acc}
+%%%         Where:
+%%%             Opts may contain `chunk_size' (default 1MB), `compression'
+%%%                 (`none' or `zlib'), and a `sink': either a function of
+%%%                 (Element, Acc) -> Acc, started with `acc', or a PID to
+%%%                 which each element is sent as {beamr_stream, Port, Elem}.
+%%%             Elements are {header, Bin}, then {chunk, Index, Bin} for each
+%%%                 chunk that is not all zeroes, and finally `done'.
+%%%     deserialize_stream(Port, {header, Bin}) -> {ok, Stream}
+%%%     deserialize_stream(Stream, {chunk, Index, Bin}) -> {ok, Stream}
+%%%     deserialize_stream(Stream, done) -> ok
+%%%         Restores a stream incrementally, as its elements arrive. Each
+%%%             chunk is checked against its hash in the header.
+%%%     make_template(Port, WasmBinary) -> {ok, Template}
+%%%         Captures the memory of an instance (started from WasmBinary and
+%%%             initialized as desired) as a template to fork from.
+%%%     fork(Template) -> {ok, Port, Imports, Exports}
+%%%         Starts a new instance whose memory is a copy-on-write mapping of
+%%%             the template's image (a copy, without hardware bounds
+%%%             checks). Templates may carry the `opts' of `start/3' that
+%%%             their forks are started with.
+%%%     reset(Port, Template) -> ok
+%%%         Resets the memory of an instance of the template's module to the
+%%%             template's image, as for fork/1.
+%%%     release_template(Template) -> ok
+%%%     checkpoint(Port) -> ok
+%%%         Records the current state of the memory as the base for deltas.
+%%%     serialize_delta(Port) -> {ok, Delta}
+%%%         Where:
+%%%             Delta is a binary of the (4KB) pages of memory changed since
+%%%                 the last checkpoint (or delta), which becomes the new
+%%%                 checkpoint.
+%%%     apply_delta(Port, Delta) -> ok
+%%%         Where:
+%%%             Delta is a binary output of a previous `serialize_delta/1'
+%%%                 call, applied on top of the state it was taken against.
+%%%     module_cache_info(Port) -> {ok, #{hits, misses, entries}}
+%%%         Where:
+%%%             hits/misses count the `start' calls that did/did not find
+%%%                 the compiled module in the driver's shared cache.
+%%%             entries is the number of modules currently held compiled.
+%%%     stats([Port]) -> {ok, #{global, instance, imports}}
+%%%         Where:
+%%%             global and instance (`undefined' without a Port) are maps of
+%%%                 the driver's counters: `calls', `traps', `call_ns',
+%%%                 `latency' (a histogram of call times, whose Nth bucket
+%%%                 counts calls of under 2^N microseconds, and whose last
+%%%                 bucket counts all others), `imports', `import_wait_ns',
+%%%                 `bytes_read', `bytes_written', `inits', `init_ns',
+%%%                 `compiles', `compile_ns' and `memory_bytes'. The global
+%%%                 counters also hold the number of live `instances', and
+%%%                 `hw_bounds': whether the runtime was built with hardware
+%%%                 bounds checks.
+%%%             imports is a list of {Module, Field, Calls, WaitNs} tuples,
+%%%                 counting the calls of each import by all instances.
+%%%             Times are in nanoseconds. See `hb_metrics_collector' for
+%%%                 their Prometheus metrics. The instance's counters also
+%%%                 hold its `key' in trace events.
+%%%     trace() -> {ok, Events}
+%%%         Where:
+%%%             Events are the most recent events of each thread that runs
+%%%                 WASM, oldest first, as maps of their `time' (monotonic,
+%%%                 in nanoseconds), `thread', `instance' key, `kind' and
+%%%                 `arg': `call_start', `call_end' (the time taken),
+%%%                 `import_enter' ({Module, Field}), `import_exit' (the time
+%%%                 waited on Erlang), `trap' and `memory_grow' (the new
+%%%                 size). They are always recorded, into a ring per thread.
 %%% '''
 %%% 
+%%% Compiled modules are shared between all instances of the driver, keyed by
+%%% the SHA-256 hash of the WASM binary, so starting many instances of the same
+%%% image only parses and validates it once.
+%%% 
 %%% BEAMR was designed for use in the HyperBEAM project, but is suitable for
 %%% deployment in other Erlang applications that need to run WASM modules. PRs
 %%% are welcome.
 -module(hb_beamr).
 %%% Control API:
--export([start/1, start/2, call/3, call/4, call/5, call/6, stop/1, wasm_send/2]).
+-export([start/1, start/2, start/3, call/3, call/4, call/5, call/6, stop/1, wasm_send/2]).
+-export([call_batch/2, call_batch/3, call_batch/5]).
+-export([call_with_buffers/3, call_with_buffers/4, call_with_buffers/6]).
+-export([send_call/3, send_call/4, send_read/3, send_write/3]).
+-export([await/2, await/5, cancel/2]).
 %%% Utility API:
--export([serialize/1, deserialize/2, stub/3]).
+-export([serialize/1, deserialize/2, deserialize_file/2, stub/3, module_cache_info/1]).
+-export([checkpoint/1, serialize_delta/1, apply_delta/2]).
+-export([serialize_stream/2, deserialize_stream/2, decode_stream_header/1]).
+-export([make_template/2, fork/1, reset/2, release_template/1]).
+-export([control/3, stats/0, stats/1, trace/0]).
+-export([is_valid_call_args/2]).
 
 -include("src/include/hb.hrl").
 -include_lib("eunit/include/eunit.hrl").
 
+%% The opcode of the driver's raw (non-term) delta application command.
+-define(APPLY_DELTA_OPCODE, 2).
+
+%% The operations of the driver's `port_control/3' interface that read its
+%% counters and trace events (see `hb_beamr_io' for the others).
+-define(CONTROL_STATS, 4).
+-define(CONTROL_TRACE, 5).
+%% The operation that removes a queued request that has not started.
+-define(CONTROL_CANCEL, 6).
+
+%% Snapshot stream format: a header with the memory size, page count, chunk
+%% size and a flag and SHA-256 hash per chunk, followed by the data chunks.
+-define(STREAM_MAGIC, "HBSS").
+-define(STREAM_VERSION, 1).
+-define(DEFAULT_CHUNK_SIZE, 1024 * 1024).
+-define(WASM_PAGE_SIZE, 65536).
+
 %% @doc Load the driver for the WASM executor.
 load_driver() ->
     case erl_ddll:load(code:priv_dir(hb), ?MODULE) of
@@ -72,17 +286,38 @@ load_driver() ->
 start(WasmBinary) when is_binary(WasmBinary) ->
     start(WasmBinary, wasm).
 start(WasmBinary, Mode) when is_binary(WasmBinary) ->
-    ?event({loading_module, {bytes, byte_size(WasmBinary)}, Mode}),
+    start(WasmBinary, Mode, #{}).
+start(WasmBinary, Mode, Opts = #{ backend := nif }) when is_binary(WasmBinary) ->
+    ?event({loading_module, {bytes, byte_size(WasmBinary)}, Mode, Opts}),
+    hb_beamr_nif:start(WasmBinary, Mode, instance_opts(Opts));
+start(WasmBinary, Mode, Opts) when is_binary(WasmBinary) andalso is_map(Opts) ->
+    ?event({loading_module, {bytes, byte_size(WasmBinary)}, Mode, Opts}),
+    InstanceOpts = instance_opts(Opts),
+    Command = port_command(Opts),
     Self = self(),
     WASM = spawn(
         fun() ->
             ok = load_driver(),
-            Port = open_port({spawn, "hb_beamr"}, []),
-            Port ! {self(), {command, term_to_binary({init, WasmBinary, Mode})}},
+            Port = open_port({spawn, Command}, []),
+            Self ! {wasm_port, self(), Port},
+            Port !
+                {self(),
+                    {command,
+                        term_to_binary(
+                            {init,
+                                WasmBinary,
+                                Mode,
+                                crypto:hash(sha256, WasmBinary),
+                                InstanceOpts
+                            }
+                        )
+                    }
+                },
             ?event({waiting_for_init_from, Port}),
             worker(Port, Self)
         end
     ),
+    receive {wasm_port, WASM, Port} -> erlang:put({wasm_port, WASM}, Port) end,
     receive
         {execution_result, Imports, Exports} ->
             ?event(
@@ -96,6 +331,41 @@ start(WasmBinary, Mode) when is_binary(WasmBinary) ->
             {error, Error}
     end.
 
+%% @doc Convert the options map of `start/3' to the proplist of instance
+%% options understood by the driver.
+instance_opts(Opts) ->
+    [
+        {engine, maps:get(engine, Opts, default)},
+        {native_wasi, maps:get(native_wasi, Opts, [])},
+        {random_seed, maps:get(random_seed, Opts, 0)},
+        {stack_size, maps:get(stack_size, Opts, 0)},
+        {heap_size, maps:get(heap_size, Opts, 0)},
+        {initial_pages, memory_pages(maps:get(initial_memory, Opts, 0))},
+        {max_pages, memory_pages(maps:get(max_memory, Opts, 0))},
+        {bounds_checks, maps:get(bounds_checks, Opts, default)}
+    ].
+
+%% @doc The number of WASM pages needed to hold a number of bytes.
+memory_pages(Bytes) ->
+    (Bytes + ?WASM_PAGE_SIZE - 1) div ?WASM_PAGE_SIZE.
+
+%% @doc The command to open the driver's port with, carrying the settings of
+%% its thread pool. The pool is shared by every instance, so it is sized by the
+%% first instance to ask for one.
+port_command(Opts) ->
+    lists:flatten(
+        io_lib:format(
+            "hb_beamr threads=~B pin=~B",
+            [
+                maps:get(threads, Opts, 0),
+                case maps:get(thread_pinning, Opts, false) of
+                    true -> 1;
+                    false -> 0
+                end
+            ]
+        )
+    ).
+
 %% @doc A worker process that is responsible for handling a WASM instance.
 %% It wraps the WASM port, handling inputs and outputs from the WASM module.
 %% The last sender to the port is always the recipient of its messages, so
@@ -128,7 +398,10 @@ wasm_send(WASM, Message) when is_pid(WASM) ->
     ok.
 
 %% @doc Stop a WASM executor context.
+stop(WASM) when is_reference(WASM) ->
+    hb_beamr_nif:stop(WASM);
 stop(WASM) when is_pid(WASM) ->
+    erlang:erase({wasm_port, WASM}),
     WASM ! stop,
     ok.
 
@@ -143,13 +416,22 @@ call(PID, FuncRef, Args, ImportFun, StateMsg) ->
 call(PID, FuncRef, Args, ImportFun, StateMsg, Opts)
         when is_binary(FuncRef) ->
     call(PID, binary_to_list(FuncRef), Args, ImportFun, StateMsg, Opts);
+call(WASM, FuncRef, Args, ImportFun, StateMsg, Opts)
+        when is_reference(WASM)
+        andalso is_list(Args)
+        andalso is_function(ImportFun)
+        andalso is_map(Opts) ->
+    case is_valid_arg_list(Args) of
+        true -> hb_beamr_nif:call(WASM, FuncRef, Args, ImportFun, StateMsg, Opts);
+        false -> {error, {invalid_args, Args}}
+    end;
 call(WASM, FuncRef, Args, ImportFun, StateMsg, Opts) 
         when is_pid(WASM)
         andalso (is_list(FuncRef) or is_integer(FuncRef))
         andalso is_list(Args)
         andalso is_function(ImportFun)
         andalso is_map(Opts) ->
-    case is_valid_arg_list(Args) of
+    case is_valid_call_args(Opts, Args) of
         true ->
             ?event(
                 {call_started,
@@ -159,22 +441,193 @@ call(WASM, FuncRef, Args, ImportFun, StateMsg, Opts)
                     ImportFun,
                     StateMsg,
                     Opts}),
+            Signature = maps:get(signature, Opts, undefined),
+            CallArgs =
+                case Signature of
+                    undefined -> Args;
+                    _ -> {Signature, pack_args(Signature, Args)}
+                end,
             wasm_send(WASM,
                 {command,
                     term_to_binary(
-                        case is_integer(FuncRef) of
-                            true -> {indirect_call, FuncRef, Args};
-                            false -> {call, FuncRef, Args}
+                        case {is_integer(FuncRef),
+                                maps:get(import_prefetch, Opts, []),
+                                maps:get(budget, Opts, #{})} of
+                            {true, _, _} -> {indirect_call, FuncRef, Args};
+                            {false, [], Budget} when map_size(Budget) == 0 ->
+                                {call, FuncRef, CallArgs};
+                            {false, Prefetch, Budget} when map_size(Budget) == 0 ->
+                                {call, FuncRef, CallArgs, normalize_prefetch(Prefetch)};
+                            {false, Prefetch, Budget} ->
+                                {call, FuncRef, CallArgs, normalize_prefetch(Prefetch),
+                                    {maps:get(fuel, Budget, 0), maps:get(time, Budget, 0)}}
                         end
                     )
                 }
             ),
             ?event({waiting_for_call_result, self(), WASM}),
+            case monitor_call(WASM, ImportFun, StateMsg, Opts) of
+                {ok, Packed, StateMsg2} when is_binary(Packed) ->
+                    {ok, unpack_results(Signature, Packed), StateMsg2};
+                Res -> Res
+            end;
+        false ->
+            {error, {invalid_args, Args}}
+    end.
+
+%% @doc Call a list of functions in the WASM executor in a single round trip
+%% to the driver (see moduledoc for more details).
+call_batch(WASM, Calls) ->
+    case call_batch(WASM, Calls, fun stub/3) of
+        {ok, Results, _} -> {ok, Results};
+        {error, Error, _} -> {error, Error}
+    end.
+call_batch(WASM, Calls, ImportFun) ->
+    call_batch(WASM, Calls, ImportFun, #{}, #{}).
+call_batch(WASM, Calls, ImportFun, StateMsg, Opts)
+        when is_pid(WASM)
+        andalso is_list(Calls)
+        andalso is_function(ImportFun)
+        andalso is_map(Opts) ->
+    NormCalls =
+        lists:map(
+            fun({FuncRef, Args}) when is_binary(FuncRef) ->
+                    {binary_to_list(FuncRef), Args};
+               (Call) -> Call
+            end,
+            Calls
+        ),
+    case lists:all(fun is_valid_batch_call/1, NormCalls) of
+        true ->
+            ?event({call_batch_started, WASM, {calls, length(NormCalls)}}),
+            wasm_send(WASM,
+                {command, term_to_binary({call_batch, NormCalls})}),
+            monitor_call(WASM, ImportFun, StateMsg, Opts);
+        false ->
+            {error, {invalid_batch, Calls}}
+    end.
+
+%% @doc Call a function with pointers to copies of a list of binaries, placed
+%% in the instance's memory by its exported `malloc', and read the strings that
+%% its results point to, in a single round trip to the driver (see moduledoc
+%% for more details).
+call_with_buffers(WASM, FuncRef, Buffers) ->
+    case call_with_buffers(WASM, FuncRef, Buffers, fun stub/3) of
+        {ok, Outputs, _} -> {ok, Outputs};
+        {error, Error, _} -> {error, Error}
+    end.
+call_with_buffers(WASM, FuncRef, Buffers, ImportFun) ->
+    call_with_buffers(WASM, FuncRef, Buffers, ImportFun, #{}, #{}).
+call_with_buffers(WASM, FuncRef, Buffers, ImportFun, StateMsg, Opts)
+        when is_binary(FuncRef) ->
+    call_with_buffers(WASM, binary_to_list(FuncRef), Buffers, ImportFun, StateMsg, Opts);
+call_with_buffers(WASM, FuncRef, Buffers, ImportFun, StateMsg, Opts)
+        when is_pid(WASM)
+        andalso is_list(FuncRef)
+        andalso is_list(Buffers)
+        andalso is_function(ImportFun)
+        andalso is_map(Opts) ->
+    case lists:all(fun is_binary/1, Buffers) of
+        true ->
+            ?event({call_with_buffers_started, WASM, FuncRef, {buffers, length(Buffers)}}),
+            Free = maps:get(free_buffers, Opts, false),
+            wasm_send(WASM,
+                {command,
+                    term_to_binary(
+                        case maps:get(budget, Opts, #{}) of
+                            Budget when map_size(Budget) == 0 ->
+                                {call_with_buffers, FuncRef, Buffers, Free};
+                            Budget ->
+                                {call_with_buffers, FuncRef, Buffers, Free,
+                                    {maps:get(fuel, Budget, 0), maps:get(time, Budget, 0)}}
+                        end
+                    )
+                }
+            ),
             monitor_call(WASM, ImportFun, StateMsg, Opts);
+        false ->
+            {error, {invalid_buffers, Buffers}}
+    end.
+
+%% @doc Queue a call without waiting for its result, which is then collected
+%% with `await' (see moduledoc for more details).
+send_call(WASM, FuncRef, Args) ->
+    send_call(WASM, FuncRef, Args, #{}).
+send_call(WASM, FuncRef, Args, Opts) when is_binary(FuncRef) ->
+    send_call(WASM, binary_to_list(FuncRef), Args, Opts);
+send_call(WASM, FuncRef, Args, Opts)
+        when is_pid(WASM) andalso is_list(FuncRef) andalso is_list(Args)
+        andalso is_map(Opts) ->
+    case is_valid_call_args(Opts, Args) of
+        true ->
+            Signature = maps:get(signature, Opts, undefined),
+            CallArgs =
+                case Signature of
+                    undefined -> Args;
+                    _ -> {Signature, pack_args(Signature, Args)}
+                end,
+            Budget = maps:get(budget, Opts, #{}),
+            send_request(
+                WASM,
+                {call, FuncRef, CallArgs,
+                    normalize_prefetch(maps:get(import_prefetch, Opts, [])),
+                    {maps:get(fuel, Budget, 0), maps:get(time, Budget, 0)}},
+                Signature
+            );
         false ->
             {error, {invalid_args, Args}}
     end.
 
+%% @doc Queue a read of the instance's memory, behind its queued calls.
+send_read(WASM, Offset, Size)
+        when is_pid(WASM) andalso is_integer(Offset) andalso Offset >= 0
+        andalso is_integer(Size) andalso Size >= 0 ->
+    send_request(WASM, {read, Offset, Size}, undefined).
+
+%% @doc Queue a write to the instance's memory, behind its queued calls.
+send_write(WASM, Offset, Data)
+        when is_pid(WASM) andalso is_integer(Offset) andalso Offset >= 0
+        andalso is_binary(Data) ->
+    send_request(WASM, {write, Offset, Data}, undefined).
+
+%% @doc Queue a command under a new request ID. The request also carries the
+%% signature of a packed call, to unpack its results with.
+send_request(WASM, Command, Signature) ->
+    ID = erlang:unique_integer([positive]),
+    ?event({request_queued, WASM, ID, element(1, Command)}),
+    wasm_send(WASM, {command, term_to_binary({queue, ID, Command})}),
+    {ok, {beamr_request, ID, Signature}}.
+
+%% @doc Wait for the reply to a queued request (see moduledoc for more
+%% details).
+await(WASM, Request) ->
+    case await(WASM, Request, fun stub/3, #{}, #{}) of
+        {ok, Res, _} -> {ok, Res};
+        {error, Error, _} -> {error, Error}
+    end.
+await(WASM, {beamr_request, ID, Signature}, ImportFun, StateMsg, Opts)
+        when is_pid(WASM) andalso is_function(ImportFun) andalso is_map(Opts) ->
+    case monitor_reply(WASM, ID, ImportFun, StateMsg, Opts) of
+        {ok, Packed, StateMsg2} when is_binary(Packed) andalso Signature =/= undefined ->
+            {ok, unpack_results(Signature, Packed), StateMsg2};
+        Res -> Res
+    end.
+
+%% @doc Remove a queued request that has not started yet. It never replies.
+cancel(WASM, {beamr_request, ID, _}) when is_pid(WASM) ->
+    case control(WASM, ?CONTROL_CANCEL, <<ID:64/big>>) of
+        {ok, <<1>>} -> ok;
+        {ok, <<0>>} -> {error, not_queued};
+        {error, Error} -> {error, Error}
+    end.
+
+%% @doc Check that an element of a call batch is a function name (as a string)
+%% and a valid argument list.
+is_valid_batch_call({FuncRef, Args}) when is_list(FuncRef) ->
+    io_lib:printable_latin1_list(FuncRef) andalso is_valid_arg_list(Args);
+is_valid_batch_call(_) ->
+    false.
+
 %% @doc Stub import function for the WASM executor.
 stub(Msg1, _Msg2, _Opts) ->
     ?event(stub_stdlib_called),
@@ -183,57 +636,121 @@ stub(Msg1, _Msg2, _Opts) ->
 %% @doc Synchonously monitor the WASM executor for a call result and any
 %% imports that need to be handled.
 monitor_call(WASM, ImportFun, StateMsg, Opts) ->
-    receive
+    monitor_reply(WASM, untagged, ImportFun, StateMsg, Opts).
+
+%% @doc Monitor the WASM executor for the reply to a request: an untagged
+%% call, or the queued request with an ID, whose messages are tagged with it.
+monitor_reply(WASM, Request, ImportFun, StateMsg, Opts) ->
+    Reply =
+        receive
+            {reply, Request, Msg} -> Msg;
+            {execution_result, _} = Msg when Request == untagged -> Msg;
+            {import, _, _, _, _} = Msg when Request == untagged -> Msg;
+            {import, _, _, _, _, _} = Msg when Request == untagged -> Msg;
+            {error, _} = Msg when Request == untagged -> Msg
+        end,
+    case Reply of
         {execution_result, Result} ->
             ?event({call_result, Result}),
             {ok, Result, StateMsg};
         {import, Module, Func, Args, Signature} ->
-            ?event({import_called, Module, Func, Args, Signature}),
-            try
-                {ok, Res, StateMsg2} =
-                    ImportFun(StateMsg,
-                        #{
-                            instance => WASM,
-                            module => Module,
-                            func => Func,
-                            args => Args,
-                            func_sig => Signature
-                        },
-                        Opts
-                    ),
-                ?event({import_ret, Module, Func, {args, Args}, {res, Res}}),
-                dispatch_response(WASM, Res),
-                monitor_call(WASM, ImportFun, StateMsg2, Opts)
-            catch
-                Err:Reason:Stack ->
-                    % Signal the WASM executor to stop.
-                    ?event({import_error, Err, Reason, Stack}),
-                    stop(WASM),
-                    % The driver is going to send us an error message, so we 
-                    % need to clear it from the mailbox, even if we already 
-                    % know that the import failed.
-                    receive
-                        {error, _} -> ok
-                    %after 0 -> ok
-                    end,
-                    {error, Err, Reason, Stack, StateMsg}
-            end;
+            handle_import(WASM, Request, ImportFun, StateMsg, Opts,
+                #{
+                    instance => WASM,
+                    module => Module,
+                    func => Func,
+                    args => Args,
+                    func_sig => Signature
+                }
+            );
+        {import, Module, Func, Args, Signature, Prefetched} ->
+            handle_import(WASM, Request, ImportFun, StateMsg, Opts,
+                #{
+                    instance => WASM,
+                    module => Module,
+                    func => Func,
+                    args => Args,
+                    func_sig => Signature,
+                    prefetched => Prefetched
+                }
+            );
+        ok ->
+            {ok, ok, StateMsg};
         {error, Error} ->
             ?event({wasm_error, Error}),
             {error, Error, StateMsg}
     end.
 
-%% @doc Check the type of an import response and dispatch it to a Beamr port.
-dispatch_response(WASM, Term) when is_pid(WASM) ->
-	case is_valid_arg_list(Term) of
+%% @doc Call the import function for an import of the WASM executor, send its
+%% response (and any memory writes) back, and continue monitoring the call.
+handle_import(WASM, Request, ImportFun, StateMsg, Opts, Import) ->
+    #{ module := Module, func := Func, args := Args, func_sig := Signature } = Import,
+    ?event({import_called, Module, Func, Args, Signature}),
+    try
+        {Res, StateMsg2, Writes} =
+            case ImportFun(StateMsg, Import, Opts) of
+                {ok, R, S} -> {R, S, []};
+                {ok, R, S, W} -> {R, S, W}
+            end,
+        ?event({import_ret, Module, Func, {args, Args}, {res, Res}}),
+        dispatch_response(WASM, Res, Writes),
+        monitor_reply(WASM, Request, ImportFun, StateMsg2, Opts)
+    catch
+        Err:Reason:Stack ->
+            % Signal the WASM executor to stop.
+            ?event({import_error, Err, Reason, Stack}),
+            stop(WASM),
+            % The driver is going to send us an error message, so we 
+            % need to clear it from the mailbox, even if we already 
+            % know that the import failed.
+            receive
+                {error, _} when Request == untagged -> ok;
+                {reply, Request, {error, _}} -> ok
+            %after 0 -> ok
+            end,
+            {error, Err, Reason, Stack, StateMsg}
+    end.
+
+%% @doc Check the type of an import response and dispatch it to a Beamr port,
+%% along with the memory writes of the import, if it made any.
+dispatch_response(WASM, Term, Writes) when is_pid(WASM) ->
+	case is_valid_arg_list(Term) andalso is_valid_write_list(Writes) of
 		true ->
 			wasm_send(WASM,
-				{command, term_to_binary({import_response, Term})});
+				{command,
+					term_to_binary(
+						case Writes of
+							[] -> {import_response, Term};
+							_ -> {import_response, Term, Writes}
+						end
+					)
+				});
 		false ->
-			throw({error, {invalid_response, Term}})
+			throw({error, {invalid_response, Term, Writes}})
 	end;
-dispatch_response(_WASM, Term) ->
-	throw({error, {invalid_response, Term}}).
+dispatch_response(_WASM, Term, Writes) ->
+	throw({error, {invalid_response, Term, Writes}}).
+
+%% @doc Check that the memory writes of an import response are a list of
+%% offsets and binaries.
+is_valid_write_list(Writes) when is_list(Writes) ->
+    lists:all(
+        fun({Offset, Data}) -> is_integer(Offset) andalso Offset >= 0 andalso is_binary(Data);
+           (_) -> false
+        end,
+        Writes
+    );
+is_valid_write_list(_) ->
+    false.
+
+%% @doc Normalize the module and function names of the `import_prefetch'
+%% option to binaries, as the driver expects.
+normalize_prefetch(Prefetch) ->
+    [
+        {iolist_to_binary([Module]), iolist_to_binary([Func]), Descriptors}
+    ||
+        {Module, Func, Descriptors} <- Prefetch
+    ].
 
 %% @doc Check that a list of arguments is valid for a WASM function call.
 is_valid_arg_list(Args) when is_list(Args) ->
@@ -241,6 +758,62 @@ is_valid_arg_list(Args) when is_list(Args) ->
 is_valid_arg_list(_) ->
     false.
 
+%% @doc Check the arguments of a call: numbers, unless the call has a
+%% `signature'. The signature must then be a string with a packable kind for
+%% each argument, and v128 arguments are 16-byte binaries.
+is_valid_call_args(#{ signature := Signature }, Args) ->
+    is_list(Signature)
+        andalso io_lib:printable_latin1_list(Signature)
+        andalso is_list(Args)
+        andalso begin
+            {Params, Results} = split_signature(Signature),
+            length(Params) == length(Args)
+                andalso lists:all(fun(Kind) -> lists:member(Kind, "iIfFv") end, Results)
+                andalso lists:all(
+                    fun({Kind, Arg}) -> is_valid_packed_arg(Kind, Arg) end,
+                    lists:zip(Params, Args)
+                )
+        end;
+is_valid_call_args(_Opts, Args) ->
+    is_valid_arg_list(Args).
+
+is_valid_packed_arg($v, Arg) -> is_binary(Arg) andalso byte_size(Arg) == 16;
+is_valid_packed_arg(Kind, Arg) ->
+    lists:member(Kind, "iIfF") andalso (is_integer(Arg) orelse is_float(Arg)).
+
+%% @doc Split a signature like "(iI)F" into its parameter and result kinds.
+split_signature([$( | Rest]) ->
+    case lists:splitwith(fun(C) -> C =/= $) end, Rest) of
+        {Params, [$) | Results]} -> {Params, Results};
+        _ -> {Rest, []}
+    end;
+split_signature(Signature) ->
+    {Signature, []}.
+
+%% @doc Pack a list of arguments into the little-endian values of the
+%% parameters of a signature.
+pack_args(Signature, Args) ->
+    {Params, _} = split_signature(Signature),
+    << <<(pack_value(Kind, Arg))/binary>> || {Kind, Arg} <- lists:zip(Params, Args) >>.
+
+pack_value($i, V) -> <<(trunc(V)):32/little-signed>>;
+pack_value($I, V) -> <<(trunc(V)):64/little-signed>>;
+pack_value($f, V) -> <<(float(V)):32/float-little>>;
+pack_value($F, V) -> <<(float(V)):64/float-little>>;
+pack_value($v, V) -> V.
+
+%% @doc Unpack the packed results of a call to a function of a signature.
+unpack_results(Signature, Packed) ->
+    {_, Results} = split_signature(Signature),
+    unpack_values(Results, Packed).
+
+unpack_values([], <<>>) -> [];
+unpack_values([$i | Kinds], <<V:32/little-signed, Rest/binary>>) -> [V | unpack_values(Kinds, Rest)];
+unpack_values([$I | Kinds], <<V:64/little-signed, Rest/binary>>) -> [V | unpack_values(Kinds, Rest)];
+unpack_values([$f | Kinds], <<V:32/float-little, Rest/binary>>) -> [V | unpack_values(Kinds, Rest)];
+unpack_values([$F | Kinds], <<V:64/float-little, Rest/binary>>) -> [V | unpack_values(Kinds, Rest)];
+unpack_values([$v | Kinds], <<V:16/binary, Rest/binary>>) -> [V | unpack_values(Kinds, Rest)].
+
 %% @doc Serialize the WASM state to a binary.
 serialize(WASM) when is_pid(WASM) ->
     ?event(starting_serialize),
@@ -253,10 +826,383 @@ serialize(WASM) when is_pid(WASM) ->
 %% @doc Deserialize a WASM state from a binary.
 deserialize(WASM, Bin) when is_pid(WASM) andalso is_binary(Bin) ->
     ?event(starting_deserialize),
+    % Size the memory for the snapshot in one step, before writing it.
+    ok = ensure_memory_size(WASM, byte_size(Bin)),
     Res = hb_beamr_io:write(WASM, 0, Bin),
+    ok = seed_random(WASM),
     ?event({finished_deserialize, Res}),
     ok.
 
+%% @doc Reset the native `random_get' of an instance to its seed. Serialized
+%% memories do not carry its state, so restoring one restarts the sequence.
+seed_random(WASM) ->
+    wasm_send(WASM, {command, term_to_binary({seed_random})}),
+    receive
+        ok -> ok;
+        {error, Error} -> {error, Error}
+    end.
+
+%% @doc Deserialize a WASM state from a file holding the output of
+%% `serialize/1'. With a runtime built with hardware bounds checks, whose
+%% memories are reserved with mmap, the driver maps the file copy-on-write
+%% over the memory when both are page-aligned, such that pages are only read
+%% from the file as the instance touches them. Otherwise, the file is read in
+%% by one of the driver's jobs. The file must not be rewritten in place while
+%% it is mapped.
+deserialize_file(WASM, Path) when is_pid(WASM) ->
+    ?event({starting_deserialize_file, Path}),
+    wasm_send(WASM,
+        {command, term_to_binary({restore_file, unicode:characters_to_binary(Path)})}),
+    receive
+        {execution_result, Mapped} ->
+            ?event({finished_deserialize_file, {mapped, Mapped}}),
+            {ok, case Mapped of 1 -> mapped; 0 -> copied end};
+        {error, Error} -> {error, Error}
+    end.
+
+%% @doc Serialize the WASM state as a stream of fixed-size chunks, passed to
+%% the sink one at a time (see moduledoc), such that they can be written to a
+%% store as they are produced. The chunks are sub-binaries of a single
+%% driver-side snapshot of the memory, which is released once the stream has
+%% been emitted. Chunks that are entirely zero are marked as such in the header
+%% and are not emitted at all.
+serialize_stream(WASM, Opts) when is_pid(WASM) andalso is_map(Opts) ->
+    ChunkSize = maps:get(chunk_size, Opts, ?DEFAULT_CHUNK_SIZE),
+    Compression = maps:get(compression, Opts, none),
+    {Sink, Acc0} = stream_sink(WASM, Opts),
+    ?event({starting_serialize_stream, {chunk_size, ChunkSize}, {compression, Compression}}),
+    {ok, Size} = hb_beamr_io:snapshot(WASM),
+    try
+        Offsets = lists:seq(0, Size - 1, ChunkSize),
+        Zero = binary:copy(<<0>>, ChunkSize),
+        % Hash every chunk first, as the header must precede them. Reading from
+        % the snapshot does not copy, so this only costs the hashing.
+        Chunks =
+            lists:map(
+                fun(Offset) ->
+                    Len = min(ChunkSize, Size - Offset),
+                    {ok, Data} = hb_beamr_io:read_snapshot(WASM, Offset, Len),
+                    case Data =:= binary:part(Zero, 0, Len) of
+                        true -> {zero, Data};
+                        false -> {crypto:hash(sha256, Data), Data}
+                    end
+                end,
+                Offsets
+            ),
+        Header =
+            <<
+                ?STREAM_MAGIC,
+                ?STREAM_VERSION:8,
+                (compression_to_code(Compression)):8,
+                Size:64/big,
+                (Size div ?WASM_PAGE_SIZE):32/big,
+                ChunkSize:32/big,
+                (length(Chunks)):32/big,
+                << <<(chunk_entry(Hash))/binary>> || {Hash, _} <- Chunks >>/binary
+            >>,
+        {_, AccN} =
+            lists:foldl(
+                fun({zero, _}, {Index, Acc}) -> {Index + 1, Acc};
+                   ({_Hash, Data}, {Index, Acc}) ->
+                        {Index + 1,
+                            Sink({chunk, Index, compress(Compression, Data)}, Acc)}
+                end,
+                {0, Sink({header, Header}, Acc0)},
+                Chunks
+            ),
+        ?event({finished_serialize_stream, {chunks, length(Chunks)}}),
+        {ok, Sink(done, AccN)}
+    after
+        hb_beamr_io:release_snapshot(WASM)
+    end.
+
+%% @doc Restore a snapshot stream into a WASM instance incrementally. Given the
+%% header, the memory is grown to the size of the image (if necessary) and
+%% the zero chunks are cleared, returning a stream state. Each data chunk is
+%% then verified against its hash and written as it arrives. `done' checks
+%% that no chunks are missing.
+deserialize_stream(WASM, {header, Header}) when is_pid(WASM) ->
+    case decode_stream_header(Header) of
+        {ok, #{ size := Size, chunk_size := ChunkSize, compression := Compression, chunks := Indexed }} ->
+            ok = ensure_memory_size(WASM, Size),
+            ok = seed_random(WASM),
+            Zero = binary:copy(<<0>>, ChunkSize),
+            lists:foreach(
+                fun({Index, zero}) ->
+                    Offset = Index * ChunkSize,
+                    Len = min(ChunkSize, Size - Offset),
+                    ok = hb_beamr_io:write(WASM, Offset, binary:part(Zero, 0, Len));
+                   (_) -> ok
+                end,
+                Indexed
+            ),
+            {ok,
+                #{
+                    instance => WASM,
+                    compression => Compression,
+                    chunk_size => ChunkSize,
+                    pending => maps:from_list([ I || I = {_, Hash} <- Indexed, Hash =/= zero ])
+                }
+            };
+        Error -> Error
+    end;
+deserialize_stream(Stream = #{ instance := WASM, pending := Pending }, {chunk, Index, Data}) ->
+    case maps:find(Index, Pending) of
+        {ok, Hash} ->
+            Raw = decompress(maps:get(compression, Stream), Data),
+            case crypto:hash(sha256, Raw) of
+                Hash ->
+                    ok = hb_beamr_io:write(WASM, Index * maps:get(chunk_size, Stream), Raw),
+                    {ok, Stream#{ pending => maps:remove(Index, Pending) }};
+                _ -> {error, {chunk_hash_mismatch, Index}}
+            end;
+        error -> {error, {unexpected_chunk, Index}}
+    end;
+deserialize_stream(#{ pending := Pending }, done) ->
+    case maps:keys(Pending) of
+        [] -> ok;
+        Missing -> {error, {missing_chunks, lists:sort(Missing)}}
+    end.
+
+%% @doc Decode the header of a snapshot stream: the size of the memory, the
+%% size and compression of its chunks, and the hash of each chunk by index
+%% (`zero' for chunks that are all zeroes, which are not sent).
+decode_stream_header(
+        <<?STREAM_MAGIC, ?STREAM_VERSION:8, CompressionCode:8, Size:64/big,
+            _Pages:32/big, ChunkSize:32/big, Count:32/big,
+            Entries:(Count * 33)/binary>>) ->
+    {ok,
+        #{
+            size => Size,
+            chunk_size => ChunkSize,
+            compression => code_to_compression(CompressionCode),
+            chunks => lists:zip(lists:seq(0, Count - 1), decode_chunk_entries(Entries))
+        }
+    };
+decode_stream_header(_) ->
+    {error, invalid_stream_header}.
+
+%% @doc Normalize the sink of a stream to a fold function and accumulator.
+stream_sink(WASM, Opts) ->
+    case maps:get(sink, Opts, undefined) of
+        undefined ->
+            {fun(Elem, Acc) -> [Elem | Acc] end, []};
+        PID when is_pid(PID) ->
+            {fun(Elem, Acc) -> PID ! {beamr_stream, WASM, Elem}, Acc end, ok};
+        Fun when is_function(Fun, 2) ->
+            {Fun, maps:get(acc, Opts, undefined)}
+    end.
+
+chunk_entry(zero) -> <<0:8, 0:256>>;
+chunk_entry(Hash) -> <<1:8, Hash/binary>>.
+
+decode_chunk_entries(<<>>) -> [];
+decode_chunk_entries(<<0:8, _:32/binary, Rest/binary>>) ->
+    [zero | decode_chunk_entries(Rest)];
+decode_chunk_entries(<<1:8, Hash:32/binary, Rest/binary>>) ->
+    [Hash | decode_chunk_entries(Rest)].
+
+compression_to_code(none) -> 0;
+compression_to_code(zlib) -> 1.
+
+code_to_compression(0) -> none;
+code_to_compression(1) -> zlib.
+
+compress(none, Data) -> Data;
+compress(zlib, Data) -> zlib:compress(Data).
+
+decompress(none, Data) -> Data;
+decompress(zlib, Data) -> zlib:uncompress(Data).
+
+%% @doc Grow the WASM memory to at least the given size, by applying an empty
+%% delta of that size.
+ensure_memory_size(WASM, Size) ->
+    {ok, Current} = hb_beamr_io:size(WASM),
+    case Current >= Size of
+        true -> ok;
+        false -> apply_delta(WASM, <<Size:64/big, 4096:32/big, 0:32/big>>)
+    end.
+
+%% @doc Capture the memory of a (warm) WASM instance as a template that new
+%% instances can be forked from. The instance must have been started from
+%% `WasmBinary'. The template is held by the driver until it is released, and
+%% does not change if the instance continues to execute.
+make_template(WASM, WasmBinary) when is_pid(WASM) andalso is_binary(WasmBinary) ->
+    wasm_send(WASM, {command, term_to_binary({make_template})}),
+    receive
+        {execution_result, ID} ->
+            ?event({template_created, ID}),
+            {ok, #{ id => ID, binary => WasmBinary, mode => wasm }};
+        {error, Error} -> {error, Error}
+    end.
+
+%% @doc Start a new WASM instance from a template. The module is taken from the
+%% driver's compiled module cache, and the template's memory image is mapped
+%% copy-on-write (when the runtime has hardware bounds checks, and so reserves
+%% memories with mmap; it is copied otherwise), so forking does not re-run the
+%% initialization of the template.
+fork(Template = #{ binary := WasmBinary, mode := Mode }) ->
+    case start(WasmBinary, Mode, maps:get(opts, Template, #{})) of
+        {ok, WASM, Imports, Exports} ->
+            case reset(WASM, Template) of
+                ok ->
+                    {ok, WASM, Imports, Exports};
+                {error, Error} ->
+                    stop(WASM),
+                    {error, Error}
+            end;
+        Error -> Error
+    end.
+
+%% @doc Reset the memory of an instance of a template's module to the
+%% template's image, as `fork/1' does. Memory beyond the end of the image is left
+%% as it is, so instances that have grown should not be reset.
+reset(WASM, #{ id := ID }) when is_pid(WASM) ->
+    wasm_send(WASM, {command, term_to_binary({apply_template, ID})}),
+    receive
+        ok -> ok;
+        {error, Error} -> {error, Error}
+    end.
+
+%% @doc Release a template. Instances already forked from it are unaffected.
+%% Templates are held by the driver rather than by an instance, so this uses a
+%% transient (uninitialized) port.
+release_template(#{ id := ID }) ->
+    ok = load_driver(),
+    Port = open_port({spawn, "hb_beamr"}, []),
+    Port ! {self(), {command, term_to_binary({release_template, ID})}},
+    Res =
+        receive
+            ok -> ok;
+            {error, Error} -> {error, Error}
+        end,
+    port_close(Port),
+    Res.
+
+%% @doc Record the current state of the WASM memory as the base against which
+%% the next delta is taken. To continue a chain of deltas after a full restore
+%% (`deserialize/2'), take a checkpoint once the state has been written.
+checkpoint(WASM) when is_pid(WASM) ->
+    wasm_send(WASM, {command, term_to_binary({checkpoint})}),
+    receive
+        {execution_result, _Pages} -> ok;
+        {error, Error} -> {error, Error}
+    end.
+
+%% @doc Serialize the pages of the WASM memory that have changed since the
+%% last checkpoint, advancing the checkpoint to the current state.
+serialize_delta(WASM) when is_pid(WASM) ->
+    ?event(starting_serialize_delta),
+    wasm_send(WASM, {command, term_to_binary({serialize_delta})}),
+    receive
+        {execution_result, Delta} ->
+            ?event({finished_serialize_delta, byte_size(Delta)}),
+            {ok, Delta};
+        {error, Error} -> {error, Error}
+    end.
+
+%% @doc Apply a delta from `serialize_delta/1' to the WASM memory. The delta
+%% is streamed to the driver as an iolist, as for `hb_beamr_io:write/3'.
+apply_delta(WASM, Delta) when is_pid(WASM) andalso is_binary(Delta) ->
+    ?event({starting_apply_delta, byte_size(Delta)}),
+    wasm_send(WASM,
+        {command,
+            [<<?APPLY_DELTA_OPCODE:8, 0:64, (byte_size(Delta)):64/big>>, Delta]
+        }
+    ),
+    receive
+        ok -> ok;
+        {error, Error} -> {error, Error}
+    end.
+
+%% @doc Get the hit/miss counters of the driver's shared module cache.
+module_cache_info(WASM) when is_pid(WASM) ->
+    wasm_send(WASM, {command, term_to_binary({module_cache_info})}),
+    receive
+        {execution_result, {Hits, Misses, Entries}} ->
+            {ok, #{ hits => Hits, misses => Misses, entries => Entries }}
+    end.
+
+%% @doc Get the driver's counters, for the driver as a whole and for an
+%% instance (see the moduledoc). Without an instance, a port is opened just
+%% to read the driver-wide counters. It is never initialized, so it is not
+%% counted among the driver's `instances'.
+stats() ->
+    ok = load_driver(),
+    Port = open_port({spawn, "hb_beamr"}, []),
+    <<0:8, Bin/binary>> = erlang:port_control(Port, ?CONTROL_STATS, <<>>),
+    port_close(Port),
+    {ok, binary_to_term(Bin)}.
+stats(WASM) when is_pid(WASM) ->
+    case control(WASM, ?CONTROL_STATS, <<>>) of
+        {ok, Bin} -> {ok, binary_to_term(Bin)};
+        {error, Error} -> {error, Error}
+    end.
+
+%% @doc Get the recent trace events of every thread that runs WASM, oldest
+%% first (see the moduledoc). Import events are labelled with the module and
+%% field of the import.
+trace() ->
+    ok = load_driver(),
+    Port = open_port({spawn, "hb_beamr"}, []),
+    <<0:8, TraceBin/binary>> = erlang:port_control(Port, ?CONTROL_TRACE, <<>>),
+    <<0:8, StatsBin/binary>> = erlang:port_control(Port, ?CONTROL_STATS, <<>>),
+    port_close(Port),
+    #{ imports := Imports } = binary_to_term(StatsBin),
+    ImportNames = list_to_tuple([ {Module, Field} || {Module, Field, _, _} <- Imports ]),
+    Events =
+        [
+            #{
+                time => Time,
+                thread => Thread,
+                kind => Kind,
+                instance => Instance,
+                arg =>
+                    case Kind of
+                        import_enter when Arg >= 0, Arg < tuple_size(ImportNames) ->
+                            element(Arg + 1, ImportNames);
+                        _ -> Arg
+                    end
+            }
+        ||
+            {Time, Thread, Kind, Instance, Arg} <- binary_to_term(TraceBin)
+        ],
+    {ok, lists:sort(fun(#{ time := A }, #{ time := B }) -> A =< B end, Events)}.
+
+%% @doc Run one of the driver's synchronous operations on an instance. The
+%% driver serves them directly, without a round trip through the worker
+%% process or a job on its threads. Memory operations (see `hb_beamr_io')
+%% are only served while the instance is idle or blocked on an import (as it
+%% is while its import handlers run). While a call is executing, they fail
+%% with an error instead of racing with it.
+control(WASM, Op, Data) ->
+    try erlang:port_control(port(WASM), Op, Data) of
+        <<0:8, Result/binary>> -> {ok, Result};
+        <<1:8, Error/binary>> -> {error, binary_to_list(Error)}
+    catch
+        error:badarg -> {error, "WASM instance is not running"}
+    end.
+
+%% @doc Find the port of an instance. `start/3' records it for the process
+%% that started the instance. Other processes look for it once among the
+%% worker's links (the worker opens the port, so it is the only port that it
+%% is linked to), and record it too.
+port(WASM) ->
+    case erlang:get({wasm_port, WASM}) of
+        undefined ->
+            case erlang:process_info(WASM, links) of
+                {links, Links} ->
+                    case [ Link || Link <- Links, is_port(Link) ] of
+                        [Port] ->
+                            erlang:put({wasm_port, WASM}, Port),
+                            Port;
+                        _ -> undefined
+                    end;
+                undefined -> undefined
+            end;
+        Port -> Port
+    end.
+
 %% Tests
 
 driver_loads_test() ->
@@ -269,6 +1215,21 @@ simple_wasm_test() ->
     {ok, [Result]} = call(WASM, "fac", [5.0]),
     ?assertEqual(120.0, Result).
 
+%% @doc Test that a second instance of the same image is served from the
+%% module cache, and that both instances still execute independently.
+module_cache_test() ->
+    {ok, File} = file:read_file("test/test.wasm"),
+    {ok, WASM1, _, _} = start(File),
+    {ok, #{ hits := Hits1, misses := Misses1 }} = module_cache_info(WASM1),
+    {ok, WASM2, _, _} = start(File),
+    {ok, #{ hits := Hits2, misses := Misses2 }} = module_cache_info(WASM2),
+    ?assertEqual(Hits1 + 1, Hits2),
+    ?assertEqual(Misses1, Misses2),
+    ?assertEqual({ok, [120.0]}, call(WASM1, "fac", [5.0])),
+    ?assertEqual({ok, [120.0]}, call(WASM2, "fac", [5.0])),
+    stop(WASM1),
+    stop(WASM2).
+
 %% @doc Test that imported functions can be called from the WASM module.
 imported_function_test() ->
     {ok, File} = file:read_file("test/pow_calculator.wasm"),
@@ -280,6 +1241,480 @@ imported_function_test() ->
             end),
     ?assertEqual(32, Result).
 
+%% @doc Test that a batch of calls executes in order, that imports are handled
+%% in the middle of a batch, and that a failing call reports its index.
+call_batch_test() ->
+    {ok, File} = file:read_file("test/test.wasm"),
+    {ok, WASM, _Imports, _Exports} = start(File),
+    ?assertEqual(
+        {ok, [[120.0], [6.0]]},
+        call_batch(WASM, [{"fac", [5.0]}, {<<"fac">>, [3.0]}])
+    ),
+    ?assertMatch(
+        {error, {2, _}},
+        call_batch(WASM, [{"fac", [5.0]}, {"not_an_export", []}])
+    ),
+    {ok, PowFile} = file:read_file("test/pow_calculator.wasm"),
+    {ok, PowWASM, _, _} = start(PowFile),
+    ?assertMatch(
+        {ok, [[32], [27]], _},
+        call_batch(PowWASM, [{"pow", [2, 5]}, {"pow", [3, 3]}],
+            fun(Msg1, #{ args := [Arg1, Arg2] }, _Opts) ->
+                {ok, [Arg1 * Arg2], Msg1}
+            end
+        )
+    ).
+
+%% @doc Test that packed arguments and results match those of term calls, keep
+%% the full range of i64 values, and are checked against the signature.
+packed_call_test() ->
+    {ok, File} = file:read_file("test/test.wasm"),
+    {ok, WASM, _Imports, Exports} = start(File),
+    {value, {func, "fac", Sig}} = lists:keysearch("fac", 2, Exports),
+    ?assertEqual({ok, [120.0]}, call(WASM, "fac", [5.0])),
+    ?assertMatch(
+        {ok, [120.0], _},
+        call(WASM, "fac", [5.0], fun stub/3, #{}, #{ signature => Sig })
+    ),
+    ?assertMatch(
+        {error, _, _},
+        call(WASM, "fac", [5], fun stub/3, #{}, #{ signature => "(I)I" })
+    ),
+    ?assertEqual(
+        {error, {invalid_args, [1.0, 2.0]}},
+        call(WASM, "fac", [1.0, 2.0], fun stub/3, #{}, #{ signature => Sig })
+    ),
+    stop(WASM),
+    ?assertEqual([-1, 16#7FFFFFFFFFFFFFFF], unpack_results("()iI", pack_args("(iI)", [-1, 16#7FFFFFFFFFFFFFFF]))).
+
+%% @doc A module exporting `add(v128, v128) -> v128' (`i32x4.add'), with a
+%% page of memory.
+simd_module() ->
+    <<
+        0, "asm", 1:32/little,
+        1, 7, 1, 16#60, 2, 16#7b, 16#7b, 1, 16#7b,
+        3, 2, 1, 0,
+        5, 3, 1, 0, 1,
+        7, 7, 1, 3, "add", 0, 0,
+        10, 11, 1, 9, 0, 16#20, 0, 16#20, 1, 16#fd, 16#ae, 1, 16#0b
+    >>.
+
+%% @doc Test that v128 values are packed and unpacked as 16-byte binaries, and
+%% passed to and from SIMD functions by packed calls.
+simd_test() ->
+    A = <<1:32/little, 2:32/little, 3:32/little, 16#FFFFFFFF:32/little>>,
+    B = <<10:32/little, 20:32/little, 30:32/little, 1:32/little>>,
+    ?assertEqual([A, B], unpack_results("()vv", pack_args("(vv)", [A, B]))),
+    ?assertNot(is_valid_call_args(#{ signature => "(v)v" }, [<<1, 2, 3>>])),
+    ?assertNot(is_valid_call_args(#{ signature => "(v)v" }, [1])),
+    case start(simd_module()) of
+        {ok, WASM, _, Exports} ->
+            ?assertEqual({value, {func, "add", "(vv)v"}}, lists:keysearch("add", 2, Exports)),
+            ?assertMatch(
+                {ok, [<<11:32/little, 22:32/little, 33:32/little, 0:32>>], _},
+                call(WASM, "add", [A, B], fun stub/3, #{}, #{ signature => "(vv)v" })
+            ),
+            % Without a signature, the values can not be sent as terms.
+            ?assertMatch(
+                {error, {invalid_args, _}},
+                call(WASM, "add", [A, B], fun stub/3, #{}, #{})
+            ),
+            stop(WASM);
+        {error, _} ->
+            % Depending on the WAMR release, the interpreters may not run SIMD
+            % code: only JIT and AOT builds must load the module.
+            case os:getenv("WAMR_PROFILE") of
+                Profile when Profile == "llvm-jit" orelse Profile == "tiered" ->
+                    ?assert(false);
+                _ -> ok
+            end
+    end.
+
+%% @doc A module calling through its table with Emscripten-style
+%% `invoke_ii(index, i32) -> i32' and `invoke_jjj(index, i64, i64) -> i64'
+%% imports, exported as `call_ii' and `call_jjj'. The table holds `x * 2',
+%% a trap, `a + b' (on i64s) and `x * 3', and `swap' replaces its first
+%% element with `x * 3'.
+invoke_module() ->
+    <<
+        0, "asm", 1:32/little,
+        1, 28, 5,
+            16#60, 2, 16#7f, 16#7f, 1, 16#7f,
+            16#60, 3, 16#7f, 16#7e, 16#7e, 1, 16#7e,
+            16#60, 1, 16#7f, 1, 16#7f,
+            16#60, 2, 16#7e, 16#7e, 1, 16#7e,
+            16#60, 0, 0,
+        2, 34, 2, 3, "env", 9, "invoke_ii", 0, 0, 3, "env", 10, "invoke_jjj", 0, 1,
+        3, 8, 7, 2, 2, 2, 3, 0, 1, 4,
+        4, 4, 1, 16#70, 0, 4,
+        5, 3, 1, 0, 1,
+        7, 57, 4,
+            25, "__indirect_function_table", 1, 0,
+            7, "call_ii", 0, 6,
+            8, "call_jjj", 0, 7,
+            4, "swap", 0, 8,
+        9, 10, 1, 0, 16#41, 0, 16#0b, 4, 2, 4, 5, 3,
+        10, 58, 7,
+            7, 0, 16#20, 0, 16#41, 2, 16#6c, 16#0b,
+            7, 0, 16#20, 0, 16#41, 3, 16#6c, 16#0b,
+            3, 0, 0, 16#0b,
+            7, 0, 16#20, 0, 16#20, 1, 16#7c, 16#0b,
+            8, 0, 16#20, 0, 16#20, 1, 16#10, 0, 16#0b,
+            10, 0, 16#20, 0, 16#20, 1, 16#20, 2, 16#10, 1, 16#0b,
+            8, 0, 16#41, 0, 16#d2, 3, 16#26, 0, 16#0b
+    >>.
+
+%% @doc Test that `invoke_*' imports call the table's functions in the driver:
+%% that their results (of both widths) are returned, that mismatched types,
+%% traps and bad indices fail the call without breaking the instance, and
+%% that replacing an element of the table is seen by the next call.
+invoke_test() ->
+    {ok, WASM, _Imports, _Exports} = start(invoke_module()),
+    ?assertMatch({ok, [42], _}, call(WASM, "call_ii", [0, 21], fun stub/3)),
+    ?assertMatch({ok, [(1 bsl 40) + 5], _},
+        call(WASM, "call_jjj", [2, 1 bsl 40, 5], fun stub/3, #{}, #{ signature => "(iII)I" })),
+    % An `invoke_ii' of `a + b' on i64s does not match its type.
+    ?assertMatch({error, _, _}, call(WASM, "call_ii", [2, 1], fun stub/3)),
+    ?assertMatch({error, _, _}, call(WASM, "call_ii", [1, 1], fun stub/3)),
+    ?assertMatch({error, _, _}, call(WASM, "call_ii", [7, 1], fun stub/3)),
+    ?assertMatch({ok, [10], _}, call(WASM, "call_ii", [0, 5], fun stub/3)),
+    ?assertMatch({ok, [], _}, call(WASM, "swap", [], fun stub/3)),
+    ?assertMatch({ok, [15], _}, call(WASM, "call_ii", [0, 5], fun stub/3)),
+    stop(WASM).
+
+%% @doc Test that a call with buffers runs the function with them, and rejects
+%% inputs that are not binaries. `dev_json_iface' tests its string outputs.
+call_with_buffers_test() ->
+    {ok, File} = file:read_file("test/test-calling.wasm"),
+    {ok, WASM, _Imports, _Exports} = start(File),
+    ?assertEqual({ok, []}, call_with_buffers(WASM, "print_args", [<<"Hello">>, <<"World">>])),
+    ?assertMatch({error, {invalid_buffers, _}}, call_with_buffers(WASM, "print_args", [1, 2])),
+    ?assertMatch({error, _}, call_with_buffers(WASM, "not_an_export", [<<"x">>])),
+    stop(WASM).
+
+%% @doc Test that deltas only hold the pages changed since the checkpoint, and
+%% that a base image plus a delta restores the full state.
+delta_snapshot_test() ->
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    {ok, WASM, _, _} = start(File),
+    {ok, Base} = serialize(WASM),
+    ok = checkpoint(WASM),
+    ok = hb_beamr_io:write(WASM, 66, <<"Hello, Beamr!">>),
+    ok = hb_beamr_io:write(WASM, 40000, <<"Delta">>),
+    {ok, Delta} = serialize_delta(WASM),
+    % Header, plus two pages of 4KB with their indices.
+    ?assertEqual(16 + 2 * (4 + 4096), byte_size(Delta)),
+    % Nothing has changed since the delta, so the next one is empty.
+    ?assertMatch({ok, <<_:64, 4096:32, 0:32>>}, serialize_delta(WASM)),
+    {ok, WASM2, _, _} = start(File),
+    ok = deserialize(WASM2, Base),
+    ok = apply_delta(WASM2, Delta),
+    ?assertEqual({ok, <<"Hello, Beamr!">>}, hb_beamr_io:read(WASM2, 66, 13)),
+    ?assertEqual({ok, <<"Delta">>}, hb_beamr_io:read(WASM2, 40000, 5)),
+    ?assertMatch({error, _}, apply_delta(WASM2, <<"bad delta">>)),
+    % A delta with a page out of bounds is rejected before any page is written.
+    {ok, Size} = hb_beamr_io:size(WASM2),
+    Page = binary:copy(<<"X">>, 4096),
+    ?assertMatch({error, _},
+        apply_delta(WASM2,
+            <<Size:64/big, 4096:32/big, 2:32/big, 0:32/big, Page/binary,
+                (Size div 4096):32/big, Page/binary>>)),
+    ?assertEqual({ok, <<"Hello, Beamr!">>}, hb_beamr_io:read(WASM2, 66, 13)),
+    ?assertEqual({ok, Size}, hb_beamr_io:size(WASM2)).
+
+%% @doc Test that a snapshot restored from a file matches the original, and
+%% that writes to the restored memory do not reach the file.
+deserialize_file_test() ->
+    Store = #{ prefix => "TEST-cache-restore" },
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    {ok, WASM, _, _} = start(File),
+    ok = hb_beamr_io:write(WASM, 66, <<"Mapped">>),
+    {ok, Mem} = serialize(WASM),
+    ok = hb_store_fs:write(Store, <<"snapshot">>, Mem),
+    {ok, Path} = hb_store_fs:file_path(Store, <<"snapshot">>),
+    {ok, WASM2, _, _} = start(File),
+    ?assertMatch({ok, Mode} when Mode == mapped orelse Mode == copied,
+        deserialize_file(WASM2, Path)),
+    ?assertEqual({ok, <<"Mapped">>}, hb_beamr_io:read(WASM2, 66, 6)),
+    ?assertEqual({ok, Mem}, serialize(WASM2)),
+    ok = hb_beamr_io:write(WASM2, 66, <<"Copied">>),
+    ?assertEqual({ok, Mem}, file:read_file(Path)),
+    ?assertMatch({error, _}, deserialize_file(WASM2, "TEST-cache-restore/missing")),
+    stop(WASM),
+    stop(WASM2).
+
+%% @doc Test that a snapshot stream elides zero chunks and restores the same
+%% state, with and without compression.
+snapshot_stream_test() ->
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    {ok, WASM, _, _} = start(File),
+    ok = hb_beamr_io:write(WASM, 40000, <<"Streamed">>),
+    {ok, Mem} = serialize(WASM),
+    lists:foreach(
+        fun(Compression) ->
+            {ok, Elements} =
+                serialize_stream(WASM,
+                    #{ chunk_size => 16384, compression => Compression }),
+            [done | Rest] = Elements,
+            [{header, Header} | Chunks] = lists:reverse(Rest),
+            % 64KB of memory: 4 chunks, of which only those holding the data
+            % segment and the written string are non-zero.
+            ?assertMatch(<<"HBSS", 1:8, _:8, 65536:64, 1:32, 16384:32, 4:32, _/binary>>, Header),
+            ?assertEqual(2, length(Chunks)),
+            {ok, WASM2, _, _} = start(File),
+            {ok, Stream0} = deserialize_stream(WASM2, {header, Header}),
+            StreamN =
+                lists:foldl(
+                    fun(Chunk, S) ->
+                        {ok, S2} = deserialize_stream(S, Chunk),
+                        S2
+                    end,
+                    Stream0,
+                    Chunks
+                ),
+            ?assertEqual(ok, deserialize_stream(StreamN, done)),
+            ?assertEqual({ok, Mem}, serialize(WASM2)),
+            ?assertMatch({error, {missing_chunks, _}}, deserialize_stream(Stream0, done))
+        end,
+        [none, zlib]
+    ).
+
+%% @doc Test that forks start from the template's memory, and that writes to a
+%% fork are private to it.
+fork_test() ->
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    {ok, WASM, _, _} = start(File),
+    ok = hb_beamr_io:write(WASM, 40000, <<"Template">>),
+    {ok, Template} = make_template(WASM, File),
+    % Changes to the template instance after the fact are not seen by forks.
+    ok = hb_beamr_io:write(WASM, 40000, <<"Original">>),
+    {ok, Fork1, _, _} = fork(Template),
+    {ok, Fork2, _, _} = fork(Template),
+    ?assertEqual({ok, <<"Template">>}, hb_beamr_io:read(Fork1, 40000, 8)),
+    ok = hb_beamr_io:write(Fork1, 40000, <<"Modified">>),
+    ?assertEqual({ok, <<"Modified">>}, hb_beamr_io:read(Fork1, 40000, 8)),
+    ?assertEqual({ok, <<"Template">>}, hb_beamr_io:read(Fork2, 40000, 8)),
+    ?assertEqual({ok, <<"Hello, World!">>}, hb_beamr_io:read(Fork2, 66, 13)),
+    ?assertEqual(ok, release_template(Template)),
+    % Forks keep working after their template is released.
+    ?assertEqual({ok, <<"Template">>}, hb_beamr_io:read(Fork2, 40000, 8)),
+    ?assertMatch({error, _}, fork(Template)).
+
+%% @doc Test that the interpreter can be selected explicitly, and that engines
+%% that are not built into the runtime are rejected.
+engine_selection_test() ->
+    {ok, File} = file:read_file("test/test.wasm"),
+    {ok, WASM, _, _} = start(File, wasm, #{ engine => interp }),
+    ?assertEqual({ok, [120.0]}, call(WASM, "fac", [5.0])),
+    case os:getenv("WAMR_PROFILE") of
+        Profile when Profile == false orelse Profile == "classic-interp" ->
+            ?assertMatch({error, _}, start(File, wasm, #{ engine => llvm_jit }));
+        _ -> ok
+    end.
+
+%% @doc Test that output written with a native `fd_write' reaches Erlang as
+%% buffered writes, rather than as one import per I/O vector.
+native_wasi_test() ->
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    {ok, WASM, _, _} = start(File, wasm, #{ native_wasi => [fd_write] }),
+    {ok, _, Imports} =
+        call(WASM, "hello", [],
+            fun(Acc, #{ func := Func, args := Args }, _) ->
+                {ok, [], [{Func, Args} | Acc]}
+            end,
+            [],
+            #{}
+        ),
+    ?assertNotEqual([], Imports),
+    ?assert(
+        lists:all(
+            fun({Func, [FD, Data]}) ->
+                Func == "fd_write_buffered" andalso FD == 1 andalso is_binary(Data);
+               (_) -> false
+            end,
+            Imports
+        )
+    ),
+    Output = iolist_to_binary([ Data || {_, [_, Data]} <- lists:reverse(Imports) ]),
+    ?assertNotEqual(nomatch, binary:match(Output, <<"Hello, World!">>)).
+
+%% @doc A module exporting `run() -> i32', which calls its
+%% `wasi_snapshot_preview1.fd_write' import declared with 64-bit arguments
+%% throughout, unlike that of WASI, as `fd_write(1, 0, 0, 0)'.
+mistyped_fd_write_module() ->
+    <<
+        0, "asm", 1:32/little,
+        1, 13, 2, 16#60, 4, 16#7e, 16#7e, 16#7e, 16#7e, 1, 16#7f, 16#60, 0, 1, 16#7f,
+        2, 35, 1, 22, "wasi_snapshot_preview1", 8, "fd_write", 0, 0,
+        3, 2, 1, 1,
+        5, 3, 1, 0, 1,
+        7, 7, 1, 3, "run", 0, 1,
+        10, 14, 1, 12, 0, 16#42, 1, 16#42, 0, 16#42, 0, 16#42, 0, 16#10, 0, 16#0b
+    >>.
+
+%% @doc Test that WASI imports whose type differs from the one the native
+%% implementation expects are handled by Erlang instead.
+native_wasi_signature_test() ->
+    {ok, WASM, _, _} = start(mistyped_fd_write_module(), wasm, #{ native_wasi => [fd_write] }),
+    ?assertEqual(
+        {ok, [0], [{"fd_write", [1, 0, 0, 0]}]},
+        call(WASM, "run", [],
+            fun(Acc, #{ func := Func, args := Args }, _) ->
+                {ok, [0], [{Func, Args} | Acc]}
+            end,
+            [],
+            #{}
+        )
+    ),
+    stop(WASM).
+
+%% @doc A module exporting its memory and `run() -> i64', which fills the
+%% first 8 bytes of memory with `random_get(0, 8)' and returns them.
+random_module() ->
+    <<
+        0, "asm", 1:32/little,
+        1, 11, 2, 16#60, 2, 16#7f, 16#7f, 1, 16#7f, 16#60, 0, 1, 16#7e,
+        2, 37, 1, 22, "wasi_snapshot_preview1", 10, "random_get", 0, 0,
+        3, 2, 1, 1,
+        5, 3, 1, 0, 1,
+        7, 16, 2, 3, "run", 0, 1, 6, "memory", 2, 0,
+        10, 16, 1, 14, 0, 16#41, 0, 16#41, 8, 16#10, 0, 16#1a, 16#41, 0, 16#29, 3, 0, 16#0b
+    >>.
+
+%% @doc Test that the native `random_get' restarts from its seed when a
+%% serialized memory is restored, and continues from a template's state in
+%% its forks.
+native_random_restore_test() ->
+    Opts = #{ native_wasi => [random_get], random_seed => 7 },
+    {ok, WASM, _, _} = start(random_module(), wasm, Opts),
+    {ok, Mem} = serialize(WASM),
+    {ok, [First], _} = call(WASM, "run", []),
+    {ok, [Second], _} = call(WASM, "run", []),
+    ?assertNotEqual(First, Second),
+    ok = deserialize(WASM, Mem),
+    ?assertMatch({ok, [First], _}, call(WASM, "run", [])),
+    {ok, Template} = make_template(WASM, random_module()),
+    {ok, Fork, _, _} = fork(Template#{ opts => Opts }),
+    ?assertMatch({ok, [Second], _}, call(Fork, "run", [])),
+    ok = release_template(Template),
+    stop(Fork),
+    stop(WASM).
+
+%% @doc Test that the memory an import reads is sent with it, and that memory
+%% writes in the import response are applied before it returns.
+import_prefetch_test() ->
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    {ok, WASM, _, _} = start(File),
+    Prefetch = [{<<"wasi_snapshot_preview1">>, <<"fd_write">>, [{iovec, 1, 2}]}],
+    {ok, _, Writes} =
+        call(WASM, "hello", [],
+            fun(Acc, #{ args := [_, _, _, RetPtr], prefetched := [Buffers] }, _) ->
+                Data = iolist_to_binary(Buffers),
+                {ok, [0], [{RetPtr, Data} | Acc],
+                    [{RetPtr, <<(byte_size(Data)):32/little>>}]}
+            end,
+            [],
+            #{ import_prefetch => Prefetch }
+        ),
+    ?assertNotEqual([], Writes),
+    [{RetPtr, Last} | _] = Writes,
+    ?assertEqual({ok, <<(byte_size(Last)):32/little>>}, hb_beamr_io:read(WASM, RetPtr, 4)),
+    Output = iolist_to_binary([ Data || {_, Data} <- lists:reverse(Writes) ]),
+    ?assertNotEqual(nomatch, binary:match(Output, <<"Hello, World!">>)).
+
+%% @doc Test that instances run on the driver's own thread pool.
+thread_pool_test() ->
+    {ok, File} = file:read_file("test/test.wasm"),
+    Instances =
+        [
+            begin
+                {ok, WASM, _, _} = start(File, wasm, #{ threads => 2 }),
+                WASM
+            end
+        ||
+            _ <- lists:seq(1, 4)
+        ],
+    lists:foreach(
+        fun(WASM) -> ?assertEqual({ok, [120.0]}, call(WASM, "fac", [5.0])) end,
+        Instances
+    ),
+    lists:foreach(fun stop/1, Instances).
+
+%% @doc Test that a call that exceeds its time budget is stopped with a
+%% distinct error, and that the instance can still be called afterwards.
+call_budget_test() ->
+    {ok, File} = file:read_file("test/pow_calculator.wasm"),
+    {ok, WASM, _Imports, _Exports} = start(File),
+    SlowMul =
+        fun(Msg1, #{ args := [Arg1, Arg2] }, _Opts) ->
+            timer:sleep(50),
+            {ok, [Arg1 * Arg2], Msg1}
+        end,
+    ?assertMatch(
+        {ok, [32], _},
+        call(WASM, <<"pow">>, [2, 5], SlowMul, #{}, #{ budget => #{ time => 5000 } })
+    ),
+    ?assertMatch(
+        {error, budget_exhausted, _},
+        call(WASM, <<"pow">>, [2, 5], SlowMul, #{}, #{ budget => #{ time => 10 } })
+    ),
+    ?assertMatch({ok, [32], _}, call(WASM, <<"pow">>, [2, 5], SlowMul)),
+    % A queued call's time starts when it does: the second call's time runs
+    % while the first waits on its import, but it has not started yet.
+    Mul = fun(Msg1, #{ args := [Arg1, Arg2] }, _Opts) -> {ok, [Arg1 * Arg2], Msg1} end,
+    {ok, First} = send_call(WASM, "pow", [2, 5], #{ budget => #{ time => 5000 } }),
+    {ok, Second} = send_call(WASM, "pow", [3, 3], #{ budget => #{ time => 100 } }),
+    timer:sleep(200),
+    ?assertMatch({ok, [32], _}, await(WASM, First, Mul, #{}, #{})),
+    ?assertMatch({ok, [27], _}, await(WASM, Second, Mul, #{}, #{})),
+    stop(WASM).
+
+%% @doc Test that the driver counts calls, imports and memory reads, for the
+%% instance and for the driver as a whole.
+stats_test() ->
+    {ok, File} = file:read_file("test/pow_calculator.wasm"),
+    {ok, WASM, _Imports, _Exports} = start(File),
+    {ok, [32], _} =
+        call(WASM, <<"pow">>, [2, 5],
+            fun(Msg1, #{ args := [Arg1, Arg2] }, _Opts) ->
+                {ok, [Arg1 * Arg2], Msg1}
+            end),
+    {ok, _} = hb_beamr_io:read(WASM, 0, 16),
+    {ok, #{ instance := Instance, global := Global, imports := Imports }} = stats(WASM),
+    ?assertMatch(#{ calls := 1, inits := 1, bytes_read := 16 }, Instance),
+    ?assert(maps:get(imports, Instance) > 0),
+    ?assertEqual(1, lists:sum(maps:get(latency, Instance))),
+    ?assert(maps:get(calls, Global) >= 1),
+    ?assert(maps:get(instances, Global) >= 1),
+    ?assert(lists:sum([ Calls || {_, _, Calls, _} <- Imports ]) >= maps:get(imports, Instance)),
+    % The port that stats/0 reads the counters through is not an instance.
+    ?assertMatch(
+        {ok, #{ instance := undefined, global := #{ instances := Instances } }}
+            when Instances == map_get(instances, Global),
+        stats()
+    ),
+    stop(WASM).
+
+%% @doc Test that a call and its imports are recorded in the trace rings.
+trace_test() ->
+    {ok, File} = file:read_file("test/pow_calculator.wasm"),
+    {ok, WASM, _Imports, _Exports} = start(File),
+    {ok, #{ instance := #{ key := Key } }} = stats(WASM),
+    {ok, [32], _} =
+        call(WASM, <<"pow">>, [2, 5],
+            fun(Msg1, #{ args := [Arg1, Arg2] }, _Opts) ->
+                {ok, [Arg1 * Arg2], Msg1}
+            end),
+    {ok, Events} = trace(),
+    Kinds = [ Kind || #{ instance := I, kind := Kind } <- Events, I == Key ],
+    ?assertMatch([call_start, import_enter | _], Kinds),
+    ?assertEqual(call_end, lists:last(Kinds)),
+    ?assert(lists:all(
+        fun(#{ arg := {_Module, _Field} }) -> true; (_) -> false end,
+        [ E || E = #{ instance := I, kind := import_enter } <- Events, I == Key ]
+    )),
+    stop(WASM).
+
 %% @doc Test that WASM Memory64 modules load and execute correctly.
 wasm64_test() ->
     {ok, File} = file:read_file("test/test-64.wasm"),
@@ -287,6 +1722,107 @@ wasm64_test() ->
     {ok, [Result]} = call(WASM, "fac", [5.0]),
     ?assertEqual(120.0, Result).
 
+%% @doc Test that an instance can be started with its memory grown up front,
+%% and that a snapshot of a larger memory is restored into a smaller one.
+memory_sizing_test() ->
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    {ok, WASM, _, _} =
+        start(File, wasm,
+            #{ stack_size => 131072, heap_size => 131072, initial_memory => 4 * ?WASM_PAGE_SIZE }),
+    ?assertEqual({ok, 4 * ?WASM_PAGE_SIZE}, hb_beamr_io:size(WASM)),
+    ok = hb_beamr_io:write(WASM, 3 * ?WASM_PAGE_SIZE, <<"Sized">>),
+    {ok, Snapshot} = serialize(WASM),
+    {ok, Small, _, _} = start(File),
+    ok = deserialize(Small, Snapshot),
+    ?assertEqual({ok, <<"Sized">>}, hb_beamr_io:read(Small, 3 * ?WASM_PAGE_SIZE, 5)),
+    ?assertMatch(
+        {error, _},
+        start(File, wasm,
+            #{ initial_memory => 4 * ?WASM_PAGE_SIZE, max_memory => 2 * ?WASM_PAGE_SIZE })
+    ),
+    stop(WASM),
+    stop(Small).
+
+%% @doc A module exporting `load(i32) -> i32' (`i32.load'), with a page of
+%% 32-bit memory.
+load_module() ->
+    <<
+        0, "asm", 1:32/little,
+        1, 6, 1, 16#60, 1, 16#7f, 1, 16#7f,
+        3, 2, 1, 0,
+        5, 3, 1, 0, 1,
+        7, 8, 1, 4, "load", 0, 0,
+        10, 9, 1, 7, 0, 16#20, 0, 16#28, 2, 0, 16#0b
+    >>.
+
+%% @doc Test that out-of-bounds accesses are ordinary traps, leaving the
+%% instance usable, in each of the bounds-check modes that the runtime has.
+bounds_checks_test() ->
+    {ok, #{ global := #{ hw_bounds := Hardware } }} = stats(),
+    Modes = [default | case Hardware of true -> [hardware]; false -> [] end],
+    lists:foreach(
+        fun(Mode) ->
+            {ok, WASM, _, _} = start(load_module(), wasm, #{ bounds_checks => Mode }),
+            ok = hb_beamr_io:write(WASM, 4, <<42:32/little>>),
+            ?assertEqual({ok, [42]}, call(WASM, "load", [4])),
+            ?assertMatch({error, _, _}, call(WASM, "load", [?WASM_PAGE_SIZE - 2], fun stub/3)),
+            ?assertMatch({error, _, _}, call(WASM, "load", [16#7FFFFFF0], fun stub/3)),
+            ?assertEqual({ok, [42]}, call(WASM, "load", [4])),
+            stop(WASM)
+        end,
+        Modes
+    ),
+    case Hardware of
+        true -> ok;
+        false -> ?assertMatch({error, _}, start(load_module(), wasm, #{ bounds_checks => hardware }))
+    end.
+
+%% @doc Test that queued calls and memory operations run in order, that their
+%% replies can be awaited in any order, and that requests that have not
+%% started can be cancelled.
+queued_requests_test() ->
+    {ok, File} = file:read_file("test/test.wasm"),
+    {ok, WASM, _Imports, Exports} = start(File),
+    {value, {func, "fac", Sig}} = lists:keysearch("fac", 2, Exports),
+    Requests =
+        [
+            begin {ok, Request} = send_call(WASM, "fac", [float(N)]), Request end
+        ||
+            N <- lists:seq(1, 5)
+        ],
+    ?assertEqual({ok, [120.0]}, await(WASM, lists:last(Requests))),
+    ?assertEqual(
+        [{ok, [1.0]}, {ok, [2.0]}, {ok, [6.0]}, {ok, [24.0]}],
+        [ await(WASM, Request) || Request <- lists:droplast(Requests) ]
+    ),
+    {ok, Packed} = send_call(WASM, "fac", [3.0], #{ signature => Sig }),
+    ?assertEqual({ok, [6.0]}, await(WASM, Packed)),
+    stop(WASM),
+    {ok, IOFile} = file:read_file("test/test-print.wasm"),
+    {ok, IOWASM, _, _} = start(IOFile),
+    {ok, Write} = send_write(IOWASM, 0, <<"Queued">>),
+    {ok, Read} = send_read(IOWASM, 0, 6),
+    ?assertEqual({ok, <<"Queued">>}, await(IOWASM, Read)),
+    ?assertEqual({ok, ok}, await(IOWASM, Write)),
+    stop(IOWASM),
+    {ok, PowFile} = file:read_file("test/pow_calculator.wasm"),
+    {ok, PowWASM, _, _} = start(PowFile),
+    % The first call waits on its import until it is awaited, so the second
+    % is still queued behind it.
+    {ok, First} = send_call(PowWASM, "pow", [2, 5]),
+    {ok, Second} = send_call(PowWASM, "pow", [3, 3]),
+    ?assertEqual(ok, cancel(PowWASM, Second)),
+    ?assertMatch(
+        {ok, [32], _},
+        await(PowWASM, First,
+            fun(Msg1, #{ args := [Arg1, Arg2] }, _Opts) -> {ok, [Arg1 * Arg2], Msg1} end,
+            #{}, #{})
+    ),
+    ?assertEqual({error, not_queued}, cancel(PowWASM, First)),
+    {beamr_request, SecondID, _} = Second,
+    receive {reply, SecondID, _} -> ?assert(false) after 100 -> ok end,
+    stop(PowWASM).
+
 %% @doc Ensure that processes outside of the initial one can interact with
 %% the WASM executor.
 multiclient_test() ->
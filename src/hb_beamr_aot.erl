@@ -0,0 +1,354 @@
+%%% @doc Ahead-of-time compilation of WASM images for BEAMR.
+%%%
+%%% WAMR can execute precompiled AOT images at native speed, instead of
+%%% interpreting WASM bytecode. This module produces those images with the
+%%% WAMR compiler (`wamrc', built with `make wamrc'), and caches them in the
+%%% node's store keyed by the SHA-256 hash of the WASM image, the target
+%%% architecture and the compiler configuration, such that each image is only
+%%% compiled once per node and configuration.
+%%%
+%%% The compiler's options must match the features that the runtime was built
+%%% with (see the `Makefile'), so they can be set with the
+%%% `wasm_aot_compiler_flags' option alongside the `wasm_aot_compiler' path.
+%%% The effective flags, and the path, size and modification time of the
+%%% compiler, are hashed into the cache path, so that changing them (or
+%%% rebuilding the compiler) does not serve images compiled differently.
+%%%
+%%% With `wasm_bounds_checks' set to `hardware', images whose memories are all
+%%% 32-bit are compiled without bounds checks in their code, relying on the
+%%% runtime's guard regions instead, and are cached separately. Their
+%%% instances are started in the `hardware' mode, which fails on runtimes
+%%% built without guard regions rather than running unchecked code.
+-module(hb_beamr_aot).
+-export([compile/2, is_aot/1, start/2, has_memory64/1, has_mutable_globals/1]).
+-include("include/hb.hrl").
+-include_lib("eunit/include/eunit.hrl").
+
+%% The magic bytes at the start of a precompiled WAMR AOT image.
+-define(AOT_MAGIC, "\0aot").
+
+%% @doc Returns whether the given binary is a precompiled AOT image.
+is_aot(<<?AOT_MAGIC, _/binary>>) -> true;
+is_aot(_) -> false.
+
+%% @doc Start a BEAMR instance of the given WASM image in AOT mode, compiling
+%% it (or fetching the cached compilation) first.
+start(WasmBinary, Opts) ->
+    case compile(WasmBinary, Opts) of
+        {ok, AOTBinary} ->
+            hb_beamr:start(AOTBinary, aot,
+                #{ bounds_checks => hb_opts:get(wasm_bounds_checks, default, Opts) });
+        {error, Error} -> {error, Error}
+    end.
+
+%% @doc Get the AOT image for a WASM image, from the store if it has already
+%% been compiled, or else by compiling it and writing the result to the store.
+compile(WasmBinary, Opts) when is_binary(WasmBinary) ->
+    case is_aot(WasmBinary) of
+        true -> {ok, WasmBinary};
+        false ->
+            % AOT images are machine code for this node's architecture and
+            % runtime, so they are only cached in its local stores.
+            Store = hb_store:scope(local, hb_opts:get(store, no_viable_store, Opts)),
+            Compiler = hb_opts:get(wasm_aot_compiler, no_compiler, Opts),
+            Flags =
+                compiler_flags(
+                    hb_opts:get(wasm_aot_compiler_flags, [], Opts),
+                    unchecked(WasmBinary, Opts)
+                ),
+            Path = cache_path(WasmBinary, Compiler, Flags),
+            case hb_store:read(Store, Path) of
+                {ok, AOTBinary} ->
+                    ?event({aot_cache_hit, Path}),
+                    {ok, AOTBinary};
+                _ ->
+                    ?event({aot_cache_miss, Path}),
+                    case run_compiler(WasmBinary, Compiler, Flags) of
+                        {ok, AOTBinary} ->
+                            ok = hb_store:write(Store, Path, AOTBinary),
+                            {ok, AOTBinary};
+                        Error -> Error
+                    end
+            end
+    end.
+
+%% @doc Whether to compile an image without bounds checks in its code: only
+%% in the `hardware' mode, and only if it has no 64-bit memories, which the
+%% runtime does not guard.
+unchecked(WasmBinary, Opts) ->
+    hb_opts:get(wasm_bounds_checks, default, Opts) == hardware
+        andalso not has_memory64(WasmBinary).
+
+%% @doc The store path of the AOT image for a WASM image on this
+%% architecture, compiled by the given compiler with the given flags.
+cache_path(WasmBinary, Compiler, Flags) ->
+    Config =
+        {
+            Compiler,
+            filelib:file_size(Compiler),
+            filelib:last_modified(Compiler),
+            Flags
+        },
+    <<
+        "beamr-aot/",
+        (hb_util:encode(crypto:hash(sha256, WasmBinary)))/binary,
+        "/",
+        (list_to_binary(erlang:system_info(system_architecture)))/binary,
+        "-",
+        (hb_util:encode(crypto:hash(sha256, term_to_binary(Config))))/binary
+    >>.
+
+%% @doc Compile a WASM image with `wamrc', via temporary files.
+run_compiler(WasmBinary, Compiler, Flags) ->
+    case filelib:is_regular(Compiler) of
+        false ->
+            {error, {aot_compiler_not_found, Compiler}};
+        true ->
+            Base =
+                filename:join(
+                    temp_dir(),
+                    "hb-aot-" ++ integer_to_list(erlang:unique_integer([positive]))
+                ),
+            In = Base ++ ".wasm",
+            Out = Base ++ ".aot",
+            ok = file:write_file(In, WasmBinary),
+            try
+                Port =
+                    open_port(
+                        {spawn_executable, Compiler},
+                        [
+                            {args, Flags ++ ["-o", Out, In]},
+                            exit_status,
+                            stderr_to_stdout,
+                            binary
+                        ]
+                    ),
+                case await_compiler(Port, []) of
+                    {0, _} ->
+                        ?event({aot_compiled, {bytes, byte_size(WasmBinary)}}),
+                        file:read_file(Out);
+                    {Status, Output} ->
+                        {error, {aot_compilation_failed, Status, Output}}
+                end
+            after
+                file:delete(In),
+                file:delete(Out)
+            end
+    end.
+
+%% @doc Replace the bounds-check flag of the compiler for unchecked images.
+compiler_flags(Flags, false) -> Flags;
+compiler_flags(Flags, true) ->
+    [ F || F <- Flags, not lists:prefix("--bounds-checks", F) ] ++ ["--bounds-checks=0"].
+
+%% @doc Whether a WASM image defines or imports a 64-bit memory. Images that
+%% can not be parsed are assumed to.
+has_memory64(<<"\0asm", 1:32/little, Sections/binary>>) ->
+    try sections_memory64(Sections)
+    catch _:_ -> true
+    end;
+has_memory64(_) ->
+    true.
+
+sections_memory64(<<>>) -> false;
+sections_memory64(<<Id, Rest/binary>>) ->
+    {Size, Rest2} = leb128(Rest),
+    <<Section:Size/binary, Next/binary>> = Rest2,
+    Found =
+        case Id of
+            2 -> imports_memory64(Section);
+            5 -> memories_memory64(Section);
+            _ -> false
+        end,
+    Found orelse sections_memory64(Next).
+
+memories_memory64(Section) ->
+    {Count, Rest} = leb128(Section),
+    memories_memory64(Count, Rest).
+memories_memory64(0, _) -> false;
+memories_memory64(N, Bin) ->
+    {Is64, Rest} = limits(Bin),
+    Is64 orelse memories_memory64(N - 1, Rest).
+
+imports_memory64(Section) ->
+    {Count, Rest} = leb128(Section),
+    imports_memory64(Count, Rest).
+imports_memory64(0, _) -> false;
+imports_memory64(N, Bin) ->
+    {ModuleLen, R1} = leb128(Bin),
+    <<_:ModuleLen/binary, R2/binary>> = R1,
+    {NameLen, R3} = leb128(R2),
+    <<_:NameLen/binary, Kind, R4/binary>> = R3,
+    case Kind of
+        0 -> {_, Rest} = leb128(R4), imports_memory64(N - 1, Rest);
+        1 -> <<_RefType, R5/binary>> = R4, {_, Rest} = limits(R5), imports_memory64(N - 1, Rest);
+        2 ->
+            {Is64, Rest} = limits(R4),
+            Is64 orelse imports_memory64(N - 1, Rest);
+        3 -> <<_ValType, _Mut, Rest/binary>> = R4, imports_memory64(N - 1, Rest);
+        4 -> <<_Attr, R5/binary>> = R4, {_, Rest} = leb128(R5), imports_memory64(N - 1, Rest)
+    end.
+
+%% @doc Whether a WASM image defines or imports a mutable global. Images that
+%% can not be parsed (including AOT images) are assumed to.
+has_mutable_globals(<<"\0asm", 1:32/little, Sections/binary>>) ->
+    try sections_mutable_globals(Sections)
+    catch _:_ -> true
+    end;
+has_mutable_globals(_) ->
+    true.
+
+sections_mutable_globals(<<>>) -> false;
+sections_mutable_globals(<<Id, Rest/binary>>) ->
+    {Size, Rest2} = leb128(Rest),
+    <<Section:Size/binary, Next/binary>> = Rest2,
+    Found =
+        case Id of
+            2 -> imports_mutable_global(Section);
+            6 -> globals_mutable(Section);
+            _ -> false
+        end,
+    Found orelse sections_mutable_globals(Next).
+
+globals_mutable(Section) ->
+    {Count, Rest} = leb128(Section),
+    globals_mutable(Count, Rest).
+globals_mutable(0, _) -> false;
+globals_mutable(N, <<ValType, Mut, Rest/binary>>) when ValType >= 16#6f ->
+    Mut == 1 orelse globals_mutable(N - 1, skip_const_expr(Rest)).
+
+%% @doc Skip a constant (initializer) expression, up to its `end'.
+skip_const_expr(<<16#0b, Rest/binary>>) -> Rest;
+skip_const_expr(<<Op, Rest/binary>>) when Op == 16#41; Op == 16#42; Op == 16#23; Op == 16#d2 ->
+    skip_const_expr(element(2, leb128(Rest)));
+skip_const_expr(<<16#43, _:4/binary, Rest/binary>>) -> skip_const_expr(Rest);
+skip_const_expr(<<16#44, _:8/binary, Rest/binary>>) -> skip_const_expr(Rest);
+skip_const_expr(<<16#d0, _HeapType, Rest/binary>>) -> skip_const_expr(Rest);
+skip_const_expr(<<Op, Rest/binary>>) when Op >= 16#6a, Op =< 16#6c; Op >= 16#7c, Op =< 16#7e ->
+    skip_const_expr(Rest).
+
+imports_mutable_global(Section) ->
+    {Count, Rest} = leb128(Section),
+    imports_mutable_global(Count, Rest).
+imports_mutable_global(0, _) -> false;
+imports_mutable_global(N, Bin) ->
+    {ModuleLen, R1} = leb128(Bin),
+    <<_:ModuleLen/binary, R2/binary>> = R1,
+    {NameLen, R3} = leb128(R2),
+    <<_:NameLen/binary, Kind, R4/binary>> = R3,
+    case Kind of
+        0 -> {_, Rest} = leb128(R4), imports_mutable_global(N - 1, Rest);
+        1 -> <<_RefType, R5/binary>> = R4, {_, Rest} = limits(R5), imports_mutable_global(N - 1, Rest);
+        2 -> {_, Rest} = limits(R4), imports_mutable_global(N - 1, Rest);
+        3 -> <<_ValType, Mut, Rest/binary>> = R4, Mut == 1 orelse imports_mutable_global(N - 1, Rest);
+        4 -> <<_Attr, R5/binary>> = R4, {_, Rest} = leb128(R5), imports_mutable_global(N - 1, Rest)
+    end.
+
+%% @doc Decode the limits of a memory (or table), returning whether they are
+%% 64-bit.
+limits(<<Flags, Rest/binary>>) ->
+    {_Min, R1} = leb128(Rest),
+    R2 =
+        case Flags band 1 of
+            1 -> element(2, leb128(R1));
+            0 -> R1
+        end,
+    {Flags band 4 =/= 0, R2}.
+
+leb128(Bin) -> leb128(Bin, 0, 0).
+leb128(<<1:1, Bits:7, Rest/binary>>, Shift, Acc) ->
+    leb128(Rest, Shift + 7, Acc bor (Bits bsl Shift));
+leb128(<<0:1, Bits:7, Rest/binary>>, Shift, Acc) ->
+    {Acc bor (Bits bsl Shift), Rest}.
+
+await_compiler(Port, Output) ->
+    receive
+        {Port, {data, Data}} -> await_compiler(Port, [Data | Output]);
+        {Port, {exit_status, Status}} ->
+            {Status, iolist_to_binary(lists:reverse(Output))}
+    end.
+
+temp_dir() ->
+    case os:getenv("TMPDIR") of
+        false -> "/tmp";
+        Dir -> Dir
+    end.
+
+%%% Tests
+
+is_aot_test() ->
+    {ok, File} = file:read_file("test/test.wasm"),
+    ?assertNot(is_aot(File)),
+    ?assert(is_aot(<<?AOT_MAGIC, 1:32/little>>)).
+
+%% @doc Images are only compiled without bounds checks if all of their
+%% memories are 32-bit.
+has_memory64_test() ->
+    Memory32 = <<0, "asm", 1:32/little, 5, 3, 1, 0, 1>>,
+    Memory64 = <<0, "asm", 1:32/little, 5, 3, 1, 4, 1>>,
+    Imported64 = <<0, "asm", 1:32/little, 2, 11, 1, 1, "m", 3, "mem", 2, 5, 1, 2>>,
+    ?assertNot(has_memory64(Memory32)),
+    ?assert(has_memory64(Memory64)),
+    ?assert(has_memory64(Imported64)),
+    ?assert(has_memory64(<<0, "asm", 1:32/little, 5, 9>>)),
+    ?assertNot(unchecked(Memory32, #{})),
+    ?assert(unchecked(Memory32, #{ wasm_bounds_checks => hardware })),
+    ?assertNot(unchecked(Memory64, #{ wasm_bounds_checks => hardware })),
+    ?assertEqual(
+        ["--enable-tail-call", "--bounds-checks=0"],
+        compiler_flags(["--bounds-checks=1", "--enable-tail-call"], true)
+    ).
+
+%% @doc Mutable globals are found whether defined or imported, past the
+%% initializers of immutable ones.
+has_mutable_globals_test() ->
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    ?assertNot(has_mutable_globals(File)),
+    Immutable = <<0, "asm", 1:32/little, 6, 11, 2, 16#7f, 0, 16#41, 16#0b, 16#0b, 16#7e, 0, 16#42, 1, 16#0b>>,
+    Mutable = <<0, "asm", 1:32/little, 6, 11, 2, 16#7f, 0, 16#41, 16#0b, 16#0b, 16#7e, 1, 16#42, 1, 16#0b>>,
+    Imported = <<0, "asm", 1:32/little, 2, 8, 1, 1, "m", 1, "g", 3, 16#7f, 1>>,
+    ?assertNot(has_mutable_globals(Immutable)),
+    ?assert(has_mutable_globals(Mutable)),
+    ?assert(has_mutable_globals(Imported)),
+    ?assert(has_mutable_globals(<<?AOT_MAGIC, 1:32/little>>)).
+
+%% @doc Images compiled with different flags are cached separately.
+cache_path_test() ->
+    {ok, File} = file:read_file("test/test.wasm"),
+    Checked = cache_path(File, "wamrc", compiler_flags([], false)),
+    ?assertEqual(Checked, cache_path(File, "wamrc", [])),
+    ?assertNotEqual(Checked, cache_path(File, "wamrc", compiler_flags([], true))),
+    ?assertNotEqual(Checked, cache_path(File, "wamrc", ["--enable-tail-call"])),
+    ?assertNotEqual(Checked, cache_path(File, "other-wamrc", [])).
+
+%% @doc The driver rejects images that do not match the requested mode.
+mode_mismatch_test() ->
+    {ok, File} = file:read_file("test/test.wasm"),
+    ?assertMatch({error, _}, hb_beamr:start(File, aot)).
+
+%% @doc Compile `pow_calculator' ahead of time and run it, if the WAMR compiler
+%% has been built on this machine.
+aot_compile_test_() ->
+    Opts = #{ store => {hb_store_fs, #{ prefix => "TEST-cache-aot" }} },
+    case filelib:is_regular(hb_opts:get(wasm_aot_compiler, no_compiler, Opts)) of
+        false -> [];
+        true ->
+            {timeout, 120,
+                fun() ->
+                    {ok, File} = file:read_file("test/pow_calculator.wasm"),
+                    {ok, AOT} = compile(File, Opts),
+                    ?assert(is_aot(AOT)),
+                    % The second compilation is served from the store.
+                    ?assertEqual({ok, AOT}, compile(File, Opts)),
+                    {ok, WASM, _, _} = hb_beamr:start(AOT, aot),
+                    ?assertMatch(
+                        {ok, [32], _},
+                        hb_beamr:call(WASM, "pow", [2, 5],
+                            fun(State, #{ args := [Arg1, Arg2] }, _) ->
+                                {ok, [Arg1 * Arg2], State}
+                            end
+                        )
+                    )
+                end
+            }
+    end.
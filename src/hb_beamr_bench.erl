@@ -0,0 +1,333 @@
+%%% @doc Benchmarks of the BEAMR driver, covering the costs that a WASM
+%%% process pays on each of its paths through the driver: calls, imports,
+%%% memory I/O, snapshots and instantiation.
+%%%
+%%% Each benchmark times every one of its operations individually (after a
+%%% warm-up), and reports the mean and percentiles of their latency, along
+%%% with a throughput where that is meaningful. Results are written as JSON
+%%% (a list of objects) or CSV (one row per result), so that they can be
+%%% tracked across releases:
+%%% ```
+%%%     make bench BENCH_OUT=bench.json
+%%%     hb_beamr_bench:run(#{ output => "bench.csv", format => csv })
+%%% '''
+%%%
+%%% Options of `run/1':
+%%% ```
+%%%     benchmarks:   The benchmarks to run (default: all of them):
+%%%                   `empty_call', `concurrency', `import_round_trip',
+%%%                   `memory_io', `read_string', `snapshot', `start'.
+%%%     iterations:   Timed operations per benchmark (default 1000).
+%%%     duration:     Milliseconds that each level of `concurrency' runs
+%%%                   for (default 1000).
+%%%     concurrency:  Numbers of concurrent instances (default [1, 2, 4, 8]).
+%%%     sizes:        Byte sizes of `memory_io' (default [64, 4KB, 64KB, 1MB]).
+%%%     backend:      The `backend' of the instances of `empty_call',
+%%%                   `concurrency', `import_round_trip' and `memory_io':
+%%%                   `driver' (default) or `nif' (see `hb_beamr_nif').
+%%%     output:       A file to write the results to, or `stdout' (default).
+%%%     format:       `json' (default) or `csv'.
+%%% '''
+-module(hb_beamr_bench).
+-export([main/1, run/0, run/1]).
+-include("include/hb.hrl").
+-include_lib("eunit/include/eunit.hrl").
+
+-define(BENCHMARKS,
+    [
+        empty_call,
+        concurrency,
+        import_round_trip,
+        memory_io,
+        read_string,
+        snapshot,
+        start
+    ]).
+-define(DEFAULT_SIZES, [64, 4096, 65536, 1024 * 1024]).
+
+%% @doc Entry point for `make bench': `[Output]' or `[Output, Format]'.
+main([]) -> main(["stdout"]);
+main([Output]) -> main([Output, "json"]);
+main([Output, Format]) ->
+    run(#{
+        output => case Output of "stdout" -> stdout; _ -> Output end,
+        format => list_to_atom(Format)
+    }),
+    ok.
+
+%% @doc Run the benchmarks, write their results and return them.
+run() -> run(#{}).
+run(Opts) ->
+    Results =
+        lists:flatmap(
+            fun(Benchmark) ->
+                ?event(bench, {running, Benchmark}),
+                bench(Benchmark, Opts)
+            end,
+            maps:get(benchmarks, Opts, ?BENCHMARKS)
+        ),
+    write(Results, Opts),
+    Results.
+
+%%% Benchmarks
+
+%% @doc The latency of a call that does (almost) no work.
+bench(empty_call, Opts) ->
+    WASM = start_file("test/test.wasm", Opts),
+    Result =
+        measure(<<"empty_call">>, Opts,
+            fun() -> {ok, _} = hb_beamr:call(WASM, "fac", [0.0]) end),
+    hb_beamr:stop(WASM),
+    [Result];
+%% @doc The call throughput of 1..N instances, each called by its own process.
+bench(concurrency, Opts) ->
+    Duration = maps:get(duration, Opts, 1000),
+    lists:map(
+        fun(N) ->
+            Instances = [ start_file("test/test.wasm", Opts) || _ <- lists:seq(1, N) ],
+            Self = self(),
+            Deadline = erlang:monotonic_time(millisecond) + Duration,
+            Workers =
+                [
+                    spawn_link(
+                        fun() ->
+                            Latencies = call_until(WASM, Deadline, []),
+                            Self ! {bench_done, self(), Latencies}
+                        end
+                    )
+                ||
+                    WASM <- Instances
+                ],
+            Latencies =
+                lists:append(
+                    [ receive {bench_done, W, L} -> L end || W <- Workers ]
+                ),
+            lists:foreach(fun hb_beamr:stop/1, Instances),
+            (summarize(<<"concurrent_calls">>, Latencies))#{
+                instances => N,
+                ops_per_second => length(Latencies) * 1000 / Duration
+            }
+        end,
+        maps:get(concurrency, Opts, [1, 2, 4, 8])
+    );
+%% @doc The latency of a call of an import, from the guest to Erlang and back.
+%% `pow' calls its import once per multiplication, so its latency (less that
+%% of a call without imports) is divided among them.
+bench(import_round_trip, Opts) ->
+    WASM = start_file("test/pow_calculator.wasm", Opts),
+    ImportFun =
+        fun(Count, #{ args := [A, B] }, _) -> {ok, [A * B], Count + 1} end,
+    {ok, [_], Imports} = hb_beamr:call(WASM, <<"pow">>, [2, 8], ImportFun, 0),
+    Base =
+        measure(<<"import_base_call">>, Opts,
+            fun() -> {ok, [_], _} = hb_beamr:call(WASM, <<"pow">>, [2, 0], ImportFun, 0) end),
+    Result =
+        measure(<<"import_round_trip">>, Opts,
+            fun() -> {ok, [_], _} = hb_beamr:call(WASM, <<"pow">>, [2, 8], ImportFun, 0) end),
+    hb_beamr:stop(WASM),
+    PerImport =
+        fun(Key) ->
+            max(0, (maps:get(Key, Result) - maps:get(Key, Base)) / max(1, Imports))
+        end,
+    [Base, Result#{
+        imports_per_call => Imports,
+        per_import_mean_us => PerImport(mean_us),
+        per_import_p50_us => PerImport(p50_us),
+        per_import_p99_us => PerImport(p99_us)
+    }];
+%% @doc The throughput of `hb_beamr_io' reads and writes, by size.
+bench(memory_io, Opts) ->
+    WASM = start_file("test/aos-2-pure-xs.wasm", Opts),
+    Results =
+        lists:flatmap(
+            fun(Size) ->
+                Data = crypto:strong_rand_bytes(Size),
+                Write =
+                    measure(<<"write">>, Opts,
+                        fun() -> ok = hb_beamr_io:write(WASM, 0, Data) end),
+                Read =
+                    measure(<<"read">>, Opts,
+                        fun() -> {ok, _} = hb_beamr_io:read(WASM, 0, Size) end),
+                [ with_bandwidth(R#{ bytes => Size }, Size) || R <- [Write, Read] ]
+            end,
+            maps:get(sizes, Opts, ?DEFAULT_SIZES)
+        ),
+    hb_beamr:stop(WASM),
+    Results;
+%% @doc The cost of reading a NUL-terminated string, by its length.
+bench(read_string, Opts) ->
+    WASM = start_file("test/test-calling.wasm"),
+    Results =
+        lists:map(
+            fun(Len) ->
+                {ok, Ptr} = hb_beamr_io:write_string(WASM, binary:copy(<<"a">>, Len)),
+                (measure(<<"read_string">>, Opts,
+                    fun() -> {ok, _} = hb_beamr_io:read_string(WASM, Ptr) end))#{
+                        bytes => Len
+                    }
+            end,
+            [16, 256, 4096]
+        ),
+    hb_beamr:stop(WASM),
+    Results;
+%% @doc The bandwidth of serializing and deserializing a full memory snapshot.
+bench(snapshot, Opts) ->
+    WASM = start_file("test/aos-2-pure-xs.wasm"),
+    {ok, Mem} = hb_beamr:serialize(WASM),
+    Size = byte_size(Mem),
+    % Snapshots are large, so fewer are taken.
+    SnapOpts = Opts#{ iterations => max(1, maps:get(iterations, Opts, 1000) div 100) },
+    Serialize =
+        measure(<<"serialize">>, SnapOpts,
+            fun() -> {ok, _} = hb_beamr:serialize(WASM) end),
+    Deserialize =
+        measure(<<"deserialize">>, SnapOpts,
+            fun() -> ok = hb_beamr:deserialize(WASM, Mem) end),
+    hb_beamr:stop(WASM),
+    [ with_bandwidth(R#{ bytes => Size }, Size) || R <- [Serialize, Deserialize] ];
+%% @doc The time to start an instance of a large image, when it must be
+%% compiled (cold) and when it is served from the module cache (cached).
+bench(start, Opts) ->
+    {ok, Bin} = file:read_file("test/aos-2-pure.wasm"),
+    StartOpts = Opts#{ iterations => max(1, maps:get(iterations, Opts, 1000) div 100) },
+    Start =
+        fun(Image) ->
+            {ok, WASM, _, _} = hb_beamr:start(Image),
+            hb_beamr:stop(WASM)
+        end,
+    % Keep an instance of the image, so that it stays in the module cache.
+    {ok, Cached, _, _} = hb_beamr:start(Bin),
+    Results =
+        [
+            measure(<<"start_cold">>, StartOpts,
+                % A unique custom section changes the image's hash, without
+                % changing its behavior, so each start compiles it afresh.
+                fun() -> Start(with_custom_section(Bin, crypto:strong_rand_bytes(16))) end),
+            measure(<<"start_cached">>, StartOpts, fun() -> Start(Bin) end)
+        ],
+    hb_beamr:stop(Cached),
+    Results.
+
+%%% Measurement
+
+%% @doc Time each of a number of runs of a function, after a warm-up of a
+%% tenth as many runs.
+measure(Name, Opts, Fun) ->
+    Iterations = maps:get(iterations, Opts, 1000),
+    lists:foreach(fun(_) -> Fun() end, lists:seq(1, max(1, Iterations div 10))),
+    Latencies =
+        [
+            begin
+                T0 = erlang:monotonic_time(nanosecond),
+                Fun(),
+                erlang:monotonic_time(nanosecond) - T0
+            end
+        ||
+            _ <- lists:seq(1, Iterations)
+        ],
+    summarize(Name, Latencies).
+
+%% @doc Call an instance repeatedly until a deadline, timing each call.
+call_until(WASM, Deadline, Acc) ->
+    case erlang:monotonic_time(millisecond) >= Deadline of
+        true -> Acc;
+        false ->
+            T0 = erlang:monotonic_time(nanosecond),
+            {ok, _} = hb_beamr:call(WASM, "fac", [5.0]),
+            call_until(WASM, Deadline, [erlang:monotonic_time(nanosecond) - T0 | Acc])
+    end.
+
+%% @doc Summarize a list of latencies (in nanoseconds) as microseconds.
+summarize(Name, Latencies) ->
+    Sorted = lists:sort(Latencies),
+    N = length(Sorted),
+    Us = fun(Ns) -> Ns / 1000 end,
+    #{
+        name => Name,
+        n => N,
+        mean_us => Us(lists:sum(Sorted) / max(1, N)),
+        p50_us => Us(percentile(Sorted, N, 50)),
+        p90_us => Us(percentile(Sorted, N, 90)),
+        p99_us => Us(percentile(Sorted, N, 99)),
+        max_us => Us(percentile(Sorted, N, 100))
+    }.
+
+%% @doc The nearest-rank percentile of a sorted list.
+percentile([], _N, _P) -> 0;
+percentile(Sorted, N, P) ->
+    lists:nth(max(1, min(N, ceil(P * N / 100))), Sorted).
+
+%% @doc Add the bandwidth of an operation on a number of bytes to its result.
+with_bandwidth(Result = #{ mean_us := MeanUs }, Bytes) ->
+    Result#{ mb_per_second => Bytes / max(MeanUs, 0.001) }.
+
+%% @doc Append a custom section (id 0) to a WASM image.
+with_custom_section(Image, Payload) ->
+    Name = <<"hb-bench">>,
+    Content = <<(leb128(byte_size(Name)))/binary, Name/binary, Payload/binary>>,
+    <<Image/binary, 0, (leb128(byte_size(Content)))/binary, Content/binary>>.
+
+leb128(N) when N < 128 -> <<N>>;
+leb128(N) -> <<(N band 127 bor 128), (leb128(N bsr 7))/binary>>.
+
+start_file(Path) -> start_file(Path, #{}).
+start_file(Path, Opts) ->
+    {ok, Bin} = file:read_file(Path),
+    {ok, WASM, _, _} = hb_beamr:start(Bin, wasm, maps:with([backend], Opts)),
+    WASM.
+
+%%% Output
+
+write(Results, Opts) ->
+    Data =
+        case maps:get(format, Opts, json) of
+            json -> [jiffy:encode(Results, [pretty]), "\n"];
+            csv -> to_csv(Results)
+        end,
+    case maps:get(output, Opts, stdout) of
+        stdout -> io:put_chars(Data);
+        File -> ok = file:write_file(File, Data)
+    end.
+
+%% @doc Render results as CSV, with a column for every key of any result.
+to_csv(Results) ->
+    Keys = [name | lists:usort(lists:flatmap(fun maps:keys/1, Results)) -- [name]],
+    Cell =
+        fun(undefined) -> "";
+           (V) when is_binary(V) -> V;
+           (V) when is_float(V) -> io_lib:format("~.3f", [V]);
+           (V) -> io_lib:format("~p", [V])
+        end,
+    Row = fun(Cells) -> [lists:join(",", Cells), "\n"] end,
+    [
+        Row([ atom_to_list(K) || K <- Keys ])
+    |
+        [ Row([ Cell(maps:get(K, R, undefined)) || K <- Keys ]) || R <- Results ]
+    ].
+
+%%% Tests
+
+%% @doc Test that a short run of the quick benchmarks produces summaries, in
+%% both output formats.
+quick_run_test() ->
+    Opts = #{ benchmarks => [empty_call, memory_io], iterations => 10, sizes => [64] },
+    File = "bench-test.csv",
+    Results = run(Opts#{ output => File, format => csv }),
+    ?assertMatch(
+        [#{ name := <<"empty_call">>, n := 10 }, #{ name := <<"write">> }, #{ name := <<"read">> }],
+        Results
+    ),
+    ?assert(lists:all(fun(#{ p50_us := P50, p99_us := P99 }) -> P50 =< P99 end, Results)),
+    {ok, CSV} = file:read_file(File),
+    ?assertEqual(length(Results) + 1, length(binary:split(CSV, <<"\n">>, [global, trim]))),
+    file:delete(File).
+
+%% @doc Test that appending a custom section changes an image's hash, but not
+%% whether it loads.
+custom_section_test() ->
+    {ok, Bin} = file:read_file("test/test.wasm"),
+    Image = with_custom_section(Bin, <<"x">>),
+    ?assertNotEqual(crypto:hash(sha256, Bin), crypto:hash(sha256, Image)),
+    {ok, WASM, _, _} = hb_beamr:start(Image),
+    ?assertEqual({ok, [120.0]}, hb_beamr:call(WASM, "fac", [5.0])),
+    hb_beamr:stop(WASM).
@@ -11,32 +11,68 @@
 -module(hb_beamr_io).
 -export([size/1, read/3, write/3]).
 -export([read_string/2, write_string/2]).
+-export([snapshot/1, read_snapshot/3, release_snapshot/1]).
 -export([malloc/2, free/2]).
 -include("include/hb.hrl").
 -include_lib("eunit/include/eunit.hrl").
 
+%% The opcode of the driver's raw (non-term) memory write command.
+-define(WRITE_OPCODE, 1).
+
+%% The operations of the driver's synchronous `port_control/3' interface.
+-define(CONTROL_SIZE, 1).
+-define(CONTROL_READ, 2).
+-define(CONTROL_WRITE, 3).
+%% Writes up to this many bytes are applied synchronously. Larger writes are
+%% streamed to the driver as an iolist, avoiding the flattening of `Data' that
+%% `port_control/3' requires.
+-define(CONTROL_WRITE_LIMIT, 65536).
+
 %% @doc Get the size (in bytes) of the native memory allocated in the Beamr
 %% instance. Note that WASM memory can never be reduced once granted to an
 %% instance (although it can, of course, be reallocated _inside_ the 
 %% environment).
+size(WASM) when is_reference(WASM) ->
+    hb_beamr_nif:size(WASM);
 size(WASM) when is_pid(WASM) ->
-    hb_beamr:wasm_send(WASM, {command, term_to_binary({size})}),
-    receive
-        {execution_result, Size} ->
-            {ok, Size}
+    case hb_beamr:control(WASM, ?CONTROL_SIZE, <<>>) of
+        {ok, <<Size:64/big>>} -> {ok, Size};
+        {error, Error} -> {error, Error}
     end.
 
-%% @doc Write a binary to the Beamr instance's native memory at a given offset.
+%% @doc Write a binary (or iolist) to the Beamr instance's native memory at a
+%% given offset. Small writes are applied synchronously by the driver. Larger
+%% ones are sent to the driver as an iolist behind a compact binary header
+%% rather than as an encoded term, so large (refc) binaries are copied
+%% directly into the instance's memory without being re-encoded. Either way,
+%% writing fails with `Instance is busy' while the instance is executing,
+%% unless it is waiting on an import.
+write(WASM, Offset, Data)
+        when is_reference(WASM)
+        andalso (is_binary(Data) orelse is_list(Data))
+        andalso is_integer(Offset)
+        andalso Offset >= 0 ->
+    hb_beamr_nif:write(WASM, Offset, Data);
 write(WASM, Offset, Data)
         when is_pid(WASM)
-        andalso is_binary(Data)
-        andalso is_integer(Offset) ->
+        andalso (is_binary(Data) orelse is_list(Data))
+        andalso is_integer(Offset)
+        andalso Offset >= 0 ->
     ?event(writing_to_mem),
-    hb_beamr:wasm_send(WASM, {command, term_to_binary({write, Offset, Data})}),
-    ?event(mem_written),
-    receive
-        ok -> ok;
-        {error, Error} -> {error, Error}
+    case iolist_size(Data) of
+        Size when Size =< ?CONTROL_WRITE_LIMIT ->
+            case hb_beamr:control(WASM, ?CONTROL_WRITE, [<<Offset:64/big>>, Data]) of
+                {ok, <<>>} -> ok;
+                {error, Error} -> {error, Error}
+            end;
+        Size ->
+            hb_beamr:wasm_send(WASM,
+                {command, [<<?WRITE_OPCODE:8, Offset:64/big, Size:64/big>>, Data]}),
+            ?event(mem_written),
+            receive
+                ok -> ok;
+                {error, Error} -> {error, Error}
+            end
     end.
 
 %% @doc Simple helper function to allocate space for (via malloc) and write a
@@ -60,25 +96,72 @@ write_string(WASM, Data) when is_pid(WASM) andalso is_binary(Data) ->
     end.
 
 %% @doc Read a binary from the Beamr instance's native memory at a given offset
-%% and of a given size.
+%% and of a given size. The read is served synchronously by the driver.
+read(WASM, Offset, Size)
+        when is_reference(WASM)
+        andalso is_integer(Offset)
+        andalso is_integer(Size) ->
+    case Offset >= 0 andalso Size >= 0 of
+        false -> {error, "Read request out of bounds"};
+        true -> hb_beamr_nif:read(WASM, Offset, Size)
+    end;
 read(WASM, Offset, Size)
         when is_pid(WASM)
         andalso is_integer(Offset)
         andalso is_integer(Size) ->
     ?event({read_request, {port, WASM}, {location, Offset}, {size, Size}}),
-    hb_beamr:wasm_send(WASM, {command, term_to_binary({read, Offset, Size})}),
-    ?event(read_req_sent),
+    case Offset >= 0 andalso Size >= 0 of
+        false -> {error, "Read request out of bounds"};
+        true ->
+            case hb_beamr:control(WASM, ?CONTROL_READ, <<Offset:64/big, Size:64/big>>) of
+                {ok, Result} ->
+                    ?event(
+                        {read_result,
+                            {wasm, WASM},
+                            {location, Offset},
+                            {size, Size},
+                            {result, Result}}),
+                    {ok, Result};
+                {error, Error} ->
+                    {error, Error}
+            end
+    end.
+
+%% @doc Take a stable copy of the Beamr instance's full native memory, held
+%% by the driver until it is released or replaced by another snapshot. Reads
+%% from the snapshot (`read_snapshot/3') return sub-binaries of this single
+%% copy, so any number of them can be taken without copying memory again, and
+%% they remain consistent with each other even if the instance continues to
+%% execute. The copy is taken in order with the instance's calls, once those
+%% sent before it have finished. Returns the size of the snapshot in bytes.
+snapshot(WASM) when is_pid(WASM) ->
+    ?event({snapshot_request, {wasm, WASM}}),
+    hb_beamr:wasm_send(WASM, {command, term_to_binary({snapshot})}),
     receive
-        {execution_result, Result} ->
-            ?event(
-                {read_result,
-                    {wasm, WASM},
-                    {location, Offset},
-                    {size, Size},
-                    {result, Result}}),
-            {ok, Result};
-        {error, Error} ->
-            {error, Error}
+        {execution_result, Size} -> {ok, Size};
+        {error, Error} -> {error, Error}
+    end.
+
+%% @doc Read a binary from the Beamr instance's last memory snapshot. The
+%% result references the snapshot buffer rather than copying from it.
+read_snapshot(WASM, Offset, Size)
+        when is_pid(WASM)
+        andalso is_integer(Offset)
+        andalso is_integer(Size) ->
+    hb_beamr:wasm_send(WASM,
+        {command, term_to_binary({read_snapshot, Offset, Size})}),
+    receive
+        {execution_result, Result} -> {ok, Result};
+        {error, Error} -> {error, Error}
+    end.
+
+%% @doc Drop the driver's reference to the Beamr instance's memory snapshot.
+%% The buffer is freed once all binaries read from it are garbage collected.
+release_snapshot(WASM) when is_pid(WASM) ->
+    hb_beamr:wasm_send(WASM, {command, term_to_binary({release_snapshot})}),
+    receive
+        ok -> ok;
+        {error, Error} -> {error, Error}
     end.
 
 %% @doc Simple helper function to read a string from the Beamr instance's native
@@ -148,6 +231,9 @@ write_test() ->
     {ok, WASM, _Imports, _Exports} = hb_beamr:start(File),
     % Check that we can write memory inside the bounds of the WASM module.
     ?assertEqual(ok, write(WASM, 0, <<"Hello, World!">>)),
+    % Check that iolists are written contiguously.
+    ?assertEqual(ok, write(WASM, 0, [<<"Hello, ">>, [<<"io">>, "list!"]])),
+    ?assertEqual({ok, <<"Hello, iolist!">>}, read(WASM, 0, 14)),
     % Check that we can safely handle out-of-bounds writes.
     ?assertMatch({error, _}, write(WASM, 1000000, <<"Bad hello world!">>)).
 
@@ -160,7 +246,37 @@ read_test() ->
     % Check that we can read memory inside the bounds of the WASM module.
     ?assertEqual({ok, <<"Hello, World!">>}, read(WASM, 66, 13)),
     % Check that we can safely handle out-of-bounds reads.
-    ?assertMatch({error, _}, read(WASM, 1000000, 13)).
+    ?assertMatch({error, _}, read(WASM, 1000000, 13)),
+    ?assertMatch({error, _}, read(WASM, -1, 13)).
+
+%% @doc Test that writes above the synchronous write limit take the streamed
+%% path, and that both paths write to the same memory.
+large_write_test() ->
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    {ok, WASM, _Imports, _Exports} = hb_beamr:start(File),
+    Large = binary:copy(<<"ab">>, ?CONTROL_WRITE_LIMIT div 2 + 1),
+    ?assertEqual(ok, write(WASM, 0, Large)),
+    ?assertEqual({ok, Large}, read(WASM, 0, byte_size(Large))),
+    ?assertEqual(ok, write(WASM, 1, <<"c">>)),
+    ?assertEqual({ok, <<"acab">>}, read(WASM, 0, 4)),
+    hb_beamr:stop(WASM),
+    % Once the instance has stopped, its port can no longer be found.
+    timer:sleep(10),
+    ?assertMatch({error, _}, hb_beamr_io:size(WASM)).
+
+%% @doc Test that snapshot reads are stable across writes to the live memory,
+%% and that they fail once the snapshot has been released.
+snapshot_test() ->
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    {ok, WASM, _Imports, _Exports} = hb_beamr:start(File),
+    {ok, Size} = hb_beamr_io:size(WASM),
+    ?assertEqual({ok, Size}, snapshot(WASM)),
+    ?assertEqual(ok, write(WASM, 66, <<"Hello, Beamr!">>)),
+    ?assertEqual({ok, <<"Hello, World!">>}, read_snapshot(WASM, 66, 13)),
+    ?assertEqual({ok, <<"Hello, Beamr!">>}, read(WASM, 66, 13)),
+    ?assertMatch({error, _}, read_snapshot(WASM, Size - 4, 13)),
+    ?assertEqual(ok, release_snapshot(WASM)),
+    ?assertMatch({error, _}, read_snapshot(WASM, 66, 13)).
 
 %% @doc Test allocating and freeing memory.
 malloc_test() ->
@@ -0,0 +1,204 @@
+%%% @doc The NIF backend of BEAMR, selected with `backend => nif' in the options
+%%% of `hb_beamr:start/3'. Its instances are NIF resources rather than worker
+%%% processes wrapping a port, and the `hb_beamr' and `hb_beamr_io' functions
+%%% that they support dispatch to this module.
+%%%
+%%% Calls run from dirty CPU schedulers, with their arguments and results
+%%% passed as terms, and memory is read and written without a port message
+%%% (on a dirty scheduler for more than 64KB). Imports use a yield/resume
+%%% protocol: the call returns each import to the calling process, which
+%%% handles it as the driver's imports are handled (see `hb_beamr:call/6') and
+%%% resumes the call with its results. A call that is waiting on an import
+%%% holds no scheduler.
+%%%
+%%% The backend only supports `call/6' with term arguments, and `size/1',
+%%% `read/3' and `write/3'. The driver's other features (packed signatures,
+%%% budgets, prefetching, native WASI imports, engine and bounds check
+%%% selection, snapshots and queued requests) are not available on it, and
+%%% options that ask for them are rejected.
+%%%
+%%% The NIF library links its own copy of the runtime, separate from the
+%%% driver's, so the two do not share compiled modules (nor the driver's
+%%% module cache), and each instance belongs to the backend that started it.
+-module(hb_beamr_nif).
+-export([start/3, call/6, stop/1]).
+-export([size/1, read/3, write/3]).
+-include("include/hb.hrl").
+-include_lib("eunit/include/eunit.hrl").
+
+-on_load(init/0).
+-define(NOT_LOADED, not_loaded(?LINE)).
+
+init() ->
+    erlang:load_nif(filename:join(code:priv_dir(hb), "hb_beamr_nif"), 0).
+
+not_loaded(Line) ->
+    erlang:nif_error({not_loaded, [{module, ?MODULE}, {line, Line}]}).
+
+nif_start(_WasmBinary, _Mode, _InstanceOpts) ->
+    ?NOT_LOADED.
+
+nif_call(_Instance, _FuncName, _Args) ->
+    ?NOT_LOADED.
+
+nif_resume(_Instance, _Results) ->
+    ?NOT_LOADED.
+
+nif_read(_Instance, _Offset, _Size) ->
+    ?NOT_LOADED.
+
+nif_write(_Instance, _Offset, _Data) ->
+    ?NOT_LOADED.
+
+nif_size(_Instance) ->
+    ?NOT_LOADED.
+
+nif_stop(_Instance) ->
+    ?NOT_LOADED.
+
+%% @doc Start an instance, with the driver's proplist of instance options.
+start(WasmBinary, Mode, InstanceOpts) ->
+    case nif_start(WasmBinary, Mode, InstanceOpts) of
+        {ok, Instance, Imports, Exports} ->
+            ?event({wasm_init_success, {imports, Imports}, {exports, Exports}}),
+            {ok, Instance, Imports, Exports};
+        {error, Error} ->
+            ?event({wasm_init_error, Error}),
+            {error, Error}
+    end.
+
+%% @doc Stop an instance. A call waiting on an import fails, and the
+%% resource is freed once it is no longer referenced.
+stop(Instance) ->
+    nif_stop(Instance).
+
+%% @doc Call a function of an instance, handling its imports with `ImportFun'.
+call(Instance, FuncRef, Args, ImportFun, StateMsg, Opts) ->
+    case [ Key || Key <- [signature, budget, import_prefetch], maps:is_key(Key, Opts) ] of
+        [] when is_list(FuncRef) ->
+            ?event({call_started, Instance, FuncRef, Args}),
+            handle(Instance, nif_call(Instance, list_to_binary(FuncRef), Args),
+                ImportFun, StateMsg, Opts);
+        [] ->
+            {error, {unsupported_by_backend, indirect_call}, StateMsg};
+        Keys ->
+            {error, {unsupported_by_backend, Keys}, StateMsg}
+    end.
+
+%% @doc Handle the outcome of a call or resume: its results, or an import to
+%% handle before resuming it.
+handle(_Instance, {ok, Results}, _ImportFun, StateMsg, _Opts) ->
+    ?event({call_result, Results}),
+    {ok, Results, StateMsg};
+handle(_Instance, {error, Error}, _ImportFun, StateMsg, _Opts) ->
+    ?event({wasm_error, Error}),
+    {error, Error, StateMsg};
+handle(Instance, {import, Module, Func, Args, Signature}, ImportFun, StateMsg, Opts) ->
+    ?event({import_called, Module, Func, Args, Signature}),
+    Import =
+        #{
+            instance => Instance,
+            module => Module,
+            func => Func,
+            args => Args,
+            func_sig => Signature
+        },
+    try
+        {Res, StateMsg2, Writes} =
+            case ImportFun(StateMsg, Import, Opts) of
+                {ok, R, S} -> {R, S, []};
+                {ok, R, S, W} -> {R, S, W}
+            end,
+        ?event({import_ret, Module, Func, {args, Args}, {res, Res}}),
+        lists:foreach(fun({Offset, Data}) -> ok = write(Instance, Offset, Data) end, Writes),
+        {StateMsg2, nif_resume(Instance, Res)}
+    of
+        {StateMsg3, {error, Error}} ->
+            % The results were rejected, and the call is still parked at the
+            % import: fail the import, such that the instance is idle again.
+            ?event({import_results_rejected, Module, Func, Error}),
+            nif_resume(Instance, abort),
+            {error, Error, StateMsg3};
+        {StateMsg3, Next} -> handle(Instance, Next, ImportFun, StateMsg3, Opts)
+    catch
+        Err:Reason:Stack ->
+            % Fail the import, and stop the instance as the driver does.
+            ?event({import_error, Err, Reason, Stack}),
+            nif_resume(Instance, abort),
+            stop(Instance),
+            {error, Err, Reason, Stack, StateMsg}
+    end.
+
+%% @doc Get the size (in bytes) of the memory of an instance.
+size(Instance) ->
+    nif_size(Instance).
+
+%% @doc Read from the memory of an instance.
+read(Instance, Offset, Size) ->
+    nif_read(Instance, Offset, Size).
+
+%% @doc Write a binary (or iolist) to the memory of an instance.
+write(Instance, Offset, Data) ->
+    nif_write(Instance, Offset, Data).
+
+%%% Tests
+
+%% @doc Test that calls behave as they do on the driver.
+nif_call_test() ->
+    {ok, File} = file:read_file("test/test.wasm"),
+    {ok, WASM, _Imports, _Exports} = hb_beamr:start(File, wasm, #{ backend => nif }),
+    ?assert(is_reference(WASM)),
+    ?assertEqual({ok, [120.0]}, hb_beamr:call(WASM, "fac", [5.0])),
+    ?assertMatch({error, "Function not found: " ++ _, _},
+        hb_beamr:call(WASM, "missing", [], fun hb_beamr:stub/3, #{}, #{})),
+    ?assertMatch({error, "Call arguments do not match" ++ _, _},
+        hb_beamr:call(WASM, "fac", [1.0, 2.0], fun hb_beamr:stub/3, #{}, #{})),
+    ?assertEqual({ok, [120.0]}, hb_beamr:call(WASM, "fac", [5.0])),
+    hb_beamr:stop(WASM).
+
+%% @doc Test that imports are handled between resumes of a call, that results
+%% of the wrong types fail the call, and that a failing import stops the
+%% instance.
+nif_import_test() ->
+    {ok, File} = file:read_file("test/pow_calculator.wasm"),
+    {ok, WASM, _Imports, _Exports} = hb_beamr:start(File, wasm, #{ backend => nif }),
+    {ok, [Result], Calls} =
+        hb_beamr:call(WASM, <<"pow">>, [2, 5],
+            fun(Calls, #{ instance := Instance, args := [Arg1, Arg2] }, _Opts) ->
+                ?assertEqual(WASM, Instance),
+                {ok, [Arg1 * Arg2], Calls + 1}
+            end,
+            0,
+            #{}
+        ),
+    ?assertEqual(32, Result),
+    ?assert(Calls > 0),
+    ?assertMatch({error, "Import results do not match" ++ _, _},
+        hb_beamr:call(WASM, <<"pow">>, [2, 5], fun(S, _, _) -> {ok, [1.5], S} end, 0, #{})),
+    ?assertMatch({ok, [32], _},
+        hb_beamr:call(WASM, <<"pow">>, [2, 5],
+            fun(S, #{ args := [Arg1, Arg2] }, _) -> {ok, [Arg1 * Arg2], S} end, 0, #{})),
+    ?assertMatch({error, error, boom, _, 0},
+        hb_beamr:call(WASM, <<"pow">>, [2, 5],
+            fun(_, _, _) -> error(boom) end, 0, #{})),
+    ?assertMatch({error, "Instance stopped.", _}, hb_beamr:call(WASM, <<"pow">>, [2, 5],
+        fun hb_beamr:stub/3, #{}, #{})).
+
+%% @doc Test memory operations, including those moved to dirty schedulers, and
+%% that the options the backend does not support are rejected.
+nif_memory_test() ->
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    {ok, WASM, _, _} = hb_beamr:start(File, wasm, #{ backend => nif }),
+    {ok, Size} = hb_beamr_io:size(WASM),
+    ?assert(Size > 0),
+    ?assertEqual(ok, hb_beamr_io:write(WASM, 100, [<<"Hello, ">>, <<"NIF">>])),
+    ?assertEqual({ok, <<"Hello, NIF">>}, hb_beamr_io:read(WASM, 100, 10)),
+    Large = crypto:strong_rand_bytes(min(Size, 2 * 65536)),
+    ?assertEqual(ok, hb_beamr_io:write(WASM, 0, Large)),
+    ?assertEqual({ok, Large}, hb_beamr_io:read(WASM, 0, byte_size(Large))),
+    ?assertMatch({error, _}, hb_beamr_io:read(WASM, Size, 1)),
+    ?assertEqual({error, {unsupported_by_backend, [budget]}, #{}},
+        hb_beamr:call(WASM, "main", [], fun hb_beamr:stub/3, #{}, #{ budget => #{ fuel => 1 } })),
+    ?assertMatch({error, _},
+        hb_beamr:start(File, wasm, #{ backend => nif, native_wasi => [fd_write] })),
+    hb_beamr:stop(WASM).
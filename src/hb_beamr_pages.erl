@@ -0,0 +1,135 @@
+%%% @doc Content-addressed snapshots of BEAMR instances.
+%%%
+%%% A snapshot is stored as a manifest: the header of a snapshot stream (see
+%%% `hb_beamr:serialize_stream/2') over 64KB WASM pages, which holds the hash
+%%% of every page. The bodies of the pages are written to the node's local
+%%% stores under their hashes, and only if they are not there already, so the
+%%% snapshots of many processes running the same image share all of the pages
+%%% that they have not changed. Pages that are all zeroes are not stored.
+%%%
+%%% Restoring a manifest reads only the pages that differ from the memory of
+%%% the instance being restored into. For a fresh instance of the same image,
+%%% that is typically only the pages that the process wrote to.
+-module(hb_beamr_pages).
+-export([store/2, restore/3, is_manifest/1]).
+-include("include/hb.hrl").
+-include_lib("eunit/include/eunit.hrl").
+
+%% The size of the pages of a manifest (that of WASM pages).
+-define(PAGE_SIZE, 65536).
+
+%% @doc Snapshot the memory of an instance, storing the pages that are not yet
+%% stored. Returns the manifest of the snapshot.
+store(WASM, Opts) when is_pid(WASM) ->
+    Store = local_store(Opts),
+    Sink =
+        fun({header, Header}, undefined) ->
+                {ok, #{ chunks := Chunks }} = hb_beamr:decode_stream_header(Header),
+                {Header, maps:from_list(Chunks), 0};
+           ({chunk, Index, Page}, {Header, Hashes, Written}) ->
+                Path = page_path(maps:get(Index, Hashes)),
+                case hb_store:type(Store, Path) of
+                    not_found ->
+                        ok = hb_store:write(Store, Path, Page),
+                        {Header, Hashes, Written + 1};
+                    _ ->
+                        {Header, Hashes, Written}
+                end;
+           (done, {Header, Hashes, Written}) ->
+                ?event({stored_wasm_pages, {pages, map_size(Hashes)}, {written, Written}}),
+                Header
+        end,
+    hb_beamr:serialize_stream(
+        WASM,
+        #{ chunk_size => ?PAGE_SIZE, compression => none, sink => Sink }
+    ).
+
+%% @doc Restore a manifest into an instance, reading the pages that its memory
+%% does not already hold from the node's local stores.
+restore(WASM, Manifest, Opts) when is_pid(WASM) ->
+    case hb_beamr:decode_stream_header(Manifest) of
+        {ok, #{ chunk_size := ?PAGE_SIZE, compression := none, chunks := Chunks }} ->
+            % Grows the memory and clears its zero pages.
+            {ok, _} = hb_beamr:deserialize_stream(WASM, {header, Manifest}),
+            restore_pages(WASM, local_store(Opts), [ C || C = {_, Hash} <- Chunks, Hash =/= zero ], 0);
+        {ok, _} -> {error, unsupported_manifest};
+        Error -> Error
+    end.
+
+restore_pages(_WASM, _Store, [], Read) ->
+    ?event({restored_wasm_pages, {read, Read}}),
+    ok;
+restore_pages(WASM, Store, [{Index, Hash} | Rest], Read) ->
+    Offset = Index * ?PAGE_SIZE,
+    {ok, Current} = hb_beamr_io:read(WASM, Offset, ?PAGE_SIZE),
+    case crypto:hash(sha256, Current) of
+        Hash -> restore_pages(WASM, Store, Rest, Read);
+        _ ->
+            case hb_store:read(Store, page_path(Hash)) of
+                {ok, Page} ->
+                    case crypto:hash(sha256, Page) of
+                        Hash ->
+                            ok = hb_beamr_io:write(WASM, Offset, Page),
+                            restore_pages(WASM, Store, Rest, Read + 1);
+                        _ -> {error, {corrupt_page, hb_util:encode(Hash)}}
+                    end;
+                _ -> {error, {missing_page, hb_util:encode(Hash)}}
+            end
+    end.
+
+%% @doc Check whether a snapshot body is a manifest, rather than the memory.
+is_manifest(Bin) when is_binary(Bin) ->
+    case hb_beamr:decode_stream_header(Bin) of
+        {ok, #{ chunk_size := ?PAGE_SIZE, compression := none }} -> true;
+        _ -> false
+    end;
+is_manifest(_) ->
+    false.
+
+%% @doc The stores that pages are kept in: the node's local stores, as pages
+%% are only ever looked up by their hashes.
+local_store(Opts) ->
+    hb_store:scope(local, hb_opts:get(store, no_viable_store, Opts)).
+
+page_path(Hash) ->
+    <<"wasm-pages/", (hb_util:encode(Hash))/binary>>.
+
+%%% Tests
+
+test_opts() ->
+    #{ store => [{hb_store_fs, #{ prefix => "TEST-cache-pages" }}] }.
+
+%% @doc Test that a snapshot is restored into another instance, that pages
+%% already stored are not written again, and that unchanged pages are not read.
+store_restore_test() ->
+    Opts = test_opts(),
+    Store = local_store(Opts),
+    hb_store:reset(Store),
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    {ok, WASM, _, _} = hb_beamr:start(File),
+    ok = hb_beamr_io:write(WASM, 100, <<"Paged">>),
+    {ok, Manifest} = store(WASM, Opts),
+    ?assert(is_manifest(Manifest)),
+    ?assertNot(is_manifest(<<0:(8 * ?PAGE_SIZE)>>)),
+    % Each distinct page that is not all zeroes is written once.
+    {ok, #{ chunks := Chunks }} = hb_beamr:decode_stream_header(Manifest),
+    {ok, Written} = hb_store:list(Store, <<"wasm-pages">>),
+    ?assertEqual(length(lists:usort([ H || {_, H} <- Chunks, H =/= zero ])), length(Written)),
+    % Storing again writes nothing: a page changed in the store is kept.
+    {0, Hash} = lists:keyfind(0, 1, Chunks),
+    {ok, Page} = hb_store:read(Store, page_path(Hash)),
+    ok = hb_store:write(Store, page_path(Hash), <<"Corrupt">>),
+    ?assertEqual({ok, Manifest}, store(WASM, Opts)),
+    ?assertEqual({ok, Written}, hb_store:list(Store, <<"wasm-pages">>)),
+    ?assertEqual({ok, <<"Corrupt">>}, hb_store:read(Store, page_path(Hash))),
+    {ok, WASM2, _, _} = hb_beamr:start(File),
+    ?assertEqual({error, {corrupt_page, hb_util:encode(Hash)}}, restore(WASM2, Manifest, Opts)),
+    ok = hb_store:write(Store, page_path(Hash), Page),
+    ok = restore(WASM2, Manifest, Opts),
+    ?assertEqual({ok, <<"Paged">>}, hb_beamr_io:read(WASM2, 100, 5)),
+    ?assertEqual(hb_beamr:serialize(WASM), hb_beamr:serialize(WASM2)),
+    % Restoring into an instance that holds every page reads none of them.
+    hb_store:reset(Store),
+    ?assertEqual(ok, restore(WASM2, Manifest, Opts)),
+    hb_beamr:stop(WASM),
+    hb_beamr:stop(WASM2).
@@ -0,0 +1,378 @@
+%%% @doc A pool of pre-warmed BEAMR instances, keyed by the hash of their WASM
+%%% module (and the mode and options they are started with).
+%%%
+%%% Starting an instance instantiates its module and runs the initialization
+%%% of its memory. Under bursts of requests to cold processes, that latency
+%%% dominates, so this pool keeps up to `wasm_pool_size' ready instances of
+%%% each module. Instances are handed out by `checkout/4' and, when they are
+%%% returned with `checkin/1', their memory is reset to the clean image of
+%%% the module (a copy-on-write mapping of a template taken from a fresh
+%%% instance, see `hb_beamr:make_template/2') rather than the port being
+%%% closed. Whenever a pool is below its size, it is refilled in the
+%%% background by forking the template.
+%%%
+%%% Only the memory of an instance (and the state of its native `random_get')
+%%% is reset, so instances whose memory has grown beyond the clean image are
+%%% stopped rather than recycled. Globals are not reset, so modules that define
+%%% or import mutable globals are not pooled at all: their instances are
+%%% started and stopped as without the pool. This includes AOT images, which
+%%% can not be inspected. Tables are not reset either, so the pool must not be
+%%% used for modules that change their tables as they run. Idle
+%%% instances are stopped after `wasm_pool_idle_timeout' milliseconds. The
+%%% hits, misses, resets and evictions of the pool are available from
+%%% `stats/0'.
+-module(hb_beamr_pool).
+-behaviour(gen_server).
+-export([start/0, start/1, checkout/2, checkout/4, checkin/1, stats/0, stop/0]).
+-export([init/1, handle_call/3, handle_cast/2, handle_info/2, terminate/2]).
+-include("include/hb.hrl").
+-include_lib("eunit/include/eunit.hrl").
+
+-record(state, {
+    pools = #{},
+    leases = #{},
+    hits = 0,
+    misses = 0,
+    resets = 0,
+    discards = 0,
+    evictions = 0,
+    opts
+}).
+
+%%%===================================================================
+%%% Public interface.
+%%%===================================================================
+
+%% @doc Start the pool if it is not already running, returning its PID.
+start() -> start(#{}).
+start(Opts) ->
+    case whereis(?MODULE) of
+        undefined ->
+            case gen_server:start({local, ?MODULE}, ?MODULE, Opts, []) of
+                {ok, PID} -> PID;
+                {error, {already_started, PID}} -> PID
+            end;
+        PID -> PID
+    end.
+
+%% @doc Stop the pool and all of its idle instances.
+stop() ->
+    case whereis(?MODULE) of
+        undefined -> ok;
+        PID -> gen_server:stop(PID)
+    end.
+
+%% @doc Get an instance of a WASM module from the pool, starting one if there
+%% are none ready. Has the same result as `hb_beamr:start/3'. Instances of
+%% modules with mutable globals are always started afresh, and are stopped
+%% when they are checked in.
+checkout(WasmBinary, Opts) ->
+    checkout(WasmBinary, wasm, #{}, Opts).
+checkout(WasmBinary, Mode, StartOpts, Opts) when is_binary(WasmBinary) ->
+    case hb_beamr_aot:has_mutable_globals(WasmBinary) of
+        true ->
+            ?event({beamr_pool_unpooled, mutable_globals}),
+            hb_beamr:start(WasmBinary, Mode, StartOpts);
+        false -> checkout_pooled(WasmBinary, Mode, StartOpts, Opts)
+    end.
+
+checkout_pooled(WasmBinary, Mode, StartOpts, Opts) ->
+    Key = {crypto:hash(sha256, WasmBinary), Mode, StartOpts},
+    Size = hb_opts:get(wasm_pool_size, 2, Opts),
+    case gen_server:call(start(Opts), {checkout, Key, Size}, infinity) of
+        {hit, WASM, Imports, Exports} ->
+            ?event({beamr_pool_hit, {instance, WASM}}),
+            {ok, WASM, Imports, Exports};
+        {miss, HasTemplate} ->
+            ?event({beamr_pool_miss, {has_template, HasTemplate}}),
+            case hb_beamr:start(WasmBinary, Mode, StartOpts) of
+                {ok, WASM, Imports, Exports} ->
+                    HasTemplate orelse
+                        register_template(Key, WasmBinary, {WASM, Imports, Exports}, Size),
+                    gen_server:cast(?MODULE, {leased, Key, WASM}),
+                    {ok, WASM, Imports, Exports};
+                Error -> Error
+            end
+    end.
+
+%% @doc Return an instance to the pool. Its memory is reset to the clean image
+%% of its module before it is handed out again. Instances that the pool does
+%% not know are stopped.
+checkin(WASM) when is_pid(WASM) ->
+    case whereis(?MODULE) of
+        undefined -> hb_beamr:stop(WASM);
+        PID ->
+            case gen_server:call(PID, {lease, WASM}, infinity) of
+                {ok, Template, BaseSize} ->
+                    Result =
+                        case recyclable(WASM, BaseSize) of
+                            true -> hb_beamr:reset(WASM, Template);
+                            false -> {error, grown}
+                        end,
+                    gen_server:cast(PID, {checkin, WASM, Result});
+                not_found ->
+                    hb_beamr:stop(WASM)
+            end
+    end,
+    ok.
+
+%% @doc Return the counters and the number of idle and leased instances of
+%% the pool.
+stats() ->
+    gen_server:call(start(), stats, infinity).
+
+%%%===================================================================
+%%% Generic server callbacks.
+%%%===================================================================
+
+init(Opts) ->
+    process_flag(trap_exit, true),
+    schedule_eviction(Opts),
+    {ok, #state{ opts = Opts }}.
+
+handle_call({checkout, Key, Size}, _From, State) ->
+    Pool = maps:get(Key, State#state.pools, undefined),
+    case take_idle(Pool) of
+        {{WASM, Imports, Exports, _Since}, Pool2} ->
+            State2 = lease(Key, WASM, State#state{ hits = State#state.hits + 1 }),
+            {reply, {hit, WASM, Imports, Exports},
+                refill(Key, Pool2#{ size => Size }, State2)};
+        empty ->
+            State2 = State#state{ misses = State#state.misses + 1 },
+            case Pool of
+                undefined -> {reply, {miss, false}, State2};
+                _ ->
+                    {reply, {miss, true},
+                        refill(Key, Pool#{ size => Size }, State2)}
+            end
+    end;
+handle_call({lease, WASM}, _From, State = #state{ leases = Leases, pools = Pools }) ->
+    case maps:find(WASM, Leases) of
+        {ok, {Key, _Ref}} ->
+            case maps:find(Key, Pools) of
+                {ok, #{ template := Template, base_size := BaseSize }} ->
+                    {reply, {ok, Template, BaseSize}, State};
+                error -> {reply, not_found, State}
+            end;
+        error -> {reply, not_found, State}
+    end;
+handle_call(stats, _From, State) ->
+    {reply,
+        #{
+            hits => State#state.hits,
+            misses => State#state.misses,
+            resets => State#state.resets,
+            discards => State#state.discards,
+            evictions => State#state.evictions,
+            idle =>
+                lists:sum([ length(Idle) || #{ idle := Idle } <- maps:values(State#state.pools) ]),
+            leased => maps:size(State#state.leases)
+        },
+        State};
+handle_call(Request, _From, State) ->
+    ?event(warning, {unhandled_call, {module, ?MODULE}, {request, Request}}),
+    {reply, ok, State}.
+
+handle_cast({template, Key, Template, Interface, Size}, State = #state{ pools = Pools }) ->
+    case maps:is_key(Key, Pools) of
+        true ->
+            % A concurrent miss registered one first.
+            hb_beamr:release_template(Template),
+            {noreply, State};
+        false ->
+            {BaseSize, Imports, Exports} = Interface,
+            Pool =
+                #{
+                    template => Template,
+                    base_size => BaseSize,
+                    imports => Imports,
+                    exports => Exports,
+                    idle => [],
+                    filling => 0,
+                    size => Size
+                },
+            {noreply, refill(Key, Pool, State)}
+    end;
+handle_cast({leased, Key, WASM}, State) ->
+    {noreply, lease(Key, WASM, State)};
+handle_cast({filled, Key, Result}, State = #state{ pools = Pools }) ->
+    case {maps:find(Key, Pools), Result} of
+        {{ok, Pool = #{ idle := Idle, filling := Filling }}, {ok, WASM, Imports, Exports}} ->
+            Pool2 = Pool#{ idle => [{WASM, Imports, Exports, now_ms()} | Idle], filling => Filling - 1 },
+            {noreply, State#state{ pools = Pools#{ Key => Pool2 } }};
+        {{ok, Pool = #{ filling := Filling }}, Error} ->
+            ?event({beamr_pool_fill_failed, Error}),
+            {noreply, State#state{ pools = Pools#{ Key => Pool#{ filling => Filling - 1 } } }};
+        {error, {ok, WASM, _, _}} ->
+            hb_beamr:stop(WASM),
+            {noreply, State};
+        {error, _} ->
+            {noreply, State}
+    end;
+handle_cast({checkin, WASM, Result}, State = #state{ leases = Leases, pools = Pools }) ->
+    case maps:take(WASM, Leases) of
+        {{Key, Ref}, Leases2} ->
+            erlang:demonitor(Ref, [flush]),
+            State2 = State#state{ leases = Leases2 },
+            case {Result, maps:find(Key, Pools)} of
+                {ok, {ok, Pool = #{ idle := Idle, size := Size }}} when length(Idle) < Size ->
+                    #{ imports := Imports, exports := Exports } = Pool,
+                    Pool2 = Pool#{ idle => [{WASM, Imports, Exports, now_ms()} | Idle] },
+                    {noreply,
+                        State2#state{
+                            pools = Pools#{ Key => Pool2 },
+                            resets = State#state.resets + 1
+                        }
+                    };
+                _ ->
+                    ?event({beamr_pool_discarding, {instance, WASM}, {result, Result}}),
+                    hb_beamr:stop(WASM),
+                    {noreply, State2#state{ discards = State#state.discards + 1 }}
+            end;
+        error ->
+            hb_beamr:stop(WASM),
+            {noreply, State}
+    end;
+handle_cast(Cast, State) ->
+    ?event(warning, {unhandled_cast, {module, ?MODULE}, {cast, Cast}}),
+    {noreply, State}.
+
+handle_info(evict, State = #state{ pools = Pools, opts = Opts }) ->
+    Timeout = hb_opts:get(wasm_pool_idle_timeout, 60000, Opts),
+    Cutoff = now_ms() - Timeout,
+    {Pools2, Evicted} =
+        maps:fold(
+            fun(Key, Pool = #{ idle := Idle }, {Acc, N}) ->
+                {Keep, Evict} = lists:partition(fun({_, _, _, Since}) -> Since >= Cutoff end, Idle),
+                lists:foreach(fun({WASM, _, _, _}) -> hb_beamr:stop(WASM) end, Evict),
+                {Acc#{ Key => Pool#{ idle => Keep } }, N + length(Evict)}
+            end,
+            {#{}, 0},
+            Pools
+        ),
+    schedule_eviction(Opts),
+    {noreply, State#state{ pools = Pools2, evictions = State#state.evictions + Evicted }};
+handle_info({'DOWN', _Ref, process, WASM, _Reason}, State = #state{ leases = Leases }) ->
+    {noreply, State#state{ leases = maps:remove(WASM, Leases) }};
+handle_info(Info, State) ->
+    ?event(warning, {unhandled_info, {module, ?MODULE}, {info, Info}}),
+    {noreply, State}.
+
+terminate(_Reason, #state{ pools = Pools }) ->
+    maps:foreach(
+        fun(_Key, #{ idle := Idle, template := Template }) ->
+            lists:foreach(fun({WASM, _, _, _}) -> hb_beamr:stop(WASM) end, Idle),
+            hb_beamr:release_template(Template)
+        end,
+        Pools
+    ).
+
+%%%===================================================================
+%%% Private functions.
+%%%===================================================================
+
+%% @doc Take a template of a freshly started instance, as the clean image to
+%% which instances of the module are reset, and register it with the pool.
+register_template(Key = {_, Mode, StartOpts}, WasmBinary, {WASM, Imports, Exports}, Size) ->
+    case hb_beamr:make_template(WASM, WasmBinary) of
+        {ok, Template} ->
+            {ok, BaseSize} = hb_beamr_io:size(WASM),
+            gen_server:cast(?MODULE,
+                {template,
+                    Key,
+                    Template#{ mode => Mode, opts => StartOpts },
+                    {BaseSize, Imports, Exports},
+                    Size
+                }
+            );
+        {error, Error} ->
+            ?event({beamr_pool_template_failed, Error}),
+            false
+    end.
+
+%% @doc Check that an instance can be reset to the clean image of its module.
+recyclable(WASM, BaseSize) ->
+    case is_process_alive(WASM) andalso hb_beamr_io:size(WASM) of
+        {ok, BaseSize} -> true;
+        _ -> false
+    end.
+
+%% @doc Take the most recently used live instance from a pool.
+take_idle(undefined) -> empty;
+take_idle(#{ idle := [] }) -> empty;
+take_idle(Pool = #{ idle := [Entry = {WASM, _, _, _} | Rest] }) ->
+    case is_process_alive(WASM) of
+        true -> {Entry, Pool#{ idle => Rest }};
+        false -> take_idle(Pool#{ idle => Rest })
+    end.
+
+%% @doc Record that an instance has been handed out, monitoring it such that
+%% instances that are never returned are forgotten when they stop.
+lease(Key, WASM, State = #state{ leases = Leases }) ->
+    Ref = erlang:monitor(process, WASM),
+    State#state{ leases = Leases#{ WASM => {Key, Ref} } }.
+
+%% @doc Fork new instances of a pool's template in the background, until the
+%% pool (with the instances already being forked) reaches its size.
+refill(Key, Pool = #{ idle := Idle, filling := Filling, size := Size, template := Template }, State) ->
+    Missing = max(0, Size - length(Idle) - Filling),
+    lists:foreach(
+        fun(_) ->
+            spawn(fun() -> gen_server:cast(?MODULE, {filled, Key, hb_beamr:fork(Template)}) end)
+        end,
+        lists:seq(1, Missing)
+    ),
+    State#state{ pools = (State#state.pools)#{ Key => Pool#{ filling => Filling + Missing } } }.
+
+schedule_eviction(Opts) ->
+    Timeout = hb_opts:get(wasm_pool_idle_timeout, 60000, Opts),
+    erlang:send_after(max(1000, Timeout div 2), self(), evict).
+
+now_ms() -> erlang:monotonic_time(millisecond).
+
+%%% Tests
+
+%% @doc Instances are recycled with their memory reset, and the pool is
+%% refilled in the background.
+checkout_checkin_test() ->
+    stop(),
+    Opts = #{ wasm_pool_size => 2 },
+    {ok, File} = file:read_file("test/test-print.wasm"),
+    {ok, WASM1, _, _} = checkout(File, Opts),
+    ?assertMatch(#{ misses := 1, hits := 0 }, stats()),
+    ok = hb_beamr_io:write(WASM1, 40000, <<"Dirty">>),
+    ok = checkin(WASM1),
+    % Wait for the background forks to be registered.
+    wait_until(fun() -> maps:get(idle, stats()) >= 2 end),
+    {ok, WASM2, _, Exports} = checkout(File, Opts),
+    ?assertNotEqual([], Exports),
+    ?assertMatch(#{ hits := 1 }, stats()),
+    ?assertEqual({ok, <<0, 0, 0, 0, 0>>}, hb_beamr_io:read(WASM2, 40000, 5)),
+    ?assertEqual({ok, <<"Hello, World!">>}, hb_beamr_io:read(WASM2, 66, 13)),
+    ok = checkin(WASM2),
+    stop().
+
+%% @doc Modules with mutable globals are not pooled, as resets would leave
+%% their globals as the last user of the instance left them.
+mutable_globals_unpooled_test() ->
+    stop(),
+    Module =
+        <<
+            0, "asm", 1:32/little,
+            5, 3, 1, 0, 1,
+            6, 6, 1, 16#7f, 1, 16#41, 0, 16#0b,
+            7, 10, 1, 6, "memory", 2, 0
+        >>,
+    {ok, WASM, _, _} = checkout(Module, #{}),
+    ok = checkin(WASM),
+    wait_until(fun() -> not is_process_alive(WASM) end),
+    ?assertMatch(#{ misses := 0, idle := 0 }, stats()),
+    stop().
+
+wait_until(Fun) -> wait_until(Fun, 100).
+wait_until(_Fun, 0) -> throw(timeout);
+wait_until(Fun, N) ->
+    case Fun() of
+        true -> ok;
+        false -> timer:sleep(20), wait_until(Fun, N - 1)
+    end.
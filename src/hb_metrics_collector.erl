@@ -36,6 +36,12 @@ collect_mf(_Registry, Callback) ->
         )
     ),
 
+    case beamr_stats() of
+        {ok, #{ global := Global, imports := Imports }} ->
+            collect_beamr_mf(Global, Imports, Callback);
+        not_loaded -> ok
+    end,
+
     ok.
 collect_metrics(system_load, SystemLoad) ->
     %% Return the gauge metric with no labels
@@ -44,6 +50,41 @@ collect_metrics(system_load, SystemLoad) ->
             {[], SystemLoad}
         ]
     );
+collect_metrics(beamr_call_duration_seconds, #{ latency := Latency, call_ns := CallNs }) ->
+    %% The driver's buckets count the calls of under 2^N microseconds, and
+    %% the last all others. Prometheus buckets are cumulative.
+    {Buckets, Count} =
+        lists:mapfoldl(
+            fun({N, BucketCount}, Acc) ->
+                Bound =
+                    case N == length(Latency) - 1 of
+                        true -> infinity;
+                        false -> math:pow(2, N) / 1000000
+                    end,
+                {{Bound, Acc + BucketCount}, Acc + BucketCount}
+            end,
+            0,
+            lists:zip(lists:seq(0, length(Latency) - 1), Latency)
+        ),
+    prometheus_model_helpers:histogram_metric([], Buckets, Count, CallNs / 1.0e9);
+collect_metrics(beamr_imports_total, Imports) ->
+    prometheus_model_helpers:counter_metrics(
+        [
+            {[{module, Module}, {field, Field}], Calls}
+        ||
+            {Module, Field, Calls, _WaitNs} <- Imports
+        ]
+    );
+collect_metrics(beamr_import_wait_seconds_total, Imports) ->
+    prometheus_model_helpers:counter_metrics(
+        [
+            {[{module, Module}, {field, Field}], WaitNs / 1.0e9}
+        ||
+            {Module, Field, _Calls, WaitNs} <- Imports
+        ]
+    );
+collect_metrics(Name, Value) when Name == beamr_instances; Name == beamr_memory_bytes ->
+    prometheus_model_helpers:gauge_metrics([{[], Value}]);
 collect_metrics(process_uptime_seconds, Uptime) ->
     %% Convert the uptime from milliseconds to seconds
     UptimeSeconds = Uptime / 1000,
@@ -53,10 +94,64 @@ collect_metrics(process_uptime_seconds, Uptime) ->
         [
             {[], UptimeSeconds}
         ]
-    ).
+    );
+collect_metrics(_BeamrCounter, Value) ->
+    prometheus_model_helpers:counter_metrics([{[], Value}]).
 
 %%====================================================================
 %% Private Functions
 %%====================================================================
 create_gauge(Name, Help, Data) ->
-    prometheus_model_helpers:create_mf(Name, Help, gauge, ?MODULE, Data).
\ No newline at end of file
+    prometheus_model_helpers:create_mf(Name, Help, gauge, ?MODULE, Data).
+
+%% @doc Read the counters of the BEAMR driver, if it has been loaded. The
+%% driver is not loaded just to report on it.
+beamr_stats() ->
+    {ok, Drivers} = erl_ddll:loaded_drivers(),
+    case lists:member("hb_beamr", Drivers) of
+        true -> hb_beamr:stats();
+        false -> not_loaded
+    end.
+
+%% @doc Report the counters of the BEAMR driver, which tell whether WASM
+%% execution is bound by compute (calls), by imports (time waiting on
+%% Erlang) or by memory transfers.
+collect_beamr_mf(Global, Imports, Callback) ->
+    Seconds = fun(Key) -> maps:get(Key, Global) / 1.0e9 end,
+    Metrics =
+        [
+            {beamr_calls_total, counter,
+                "Exported WASM functions called.", maps:get(calls, Global)},
+            {beamr_traps_total, counter,
+                "WASM calls that trapped.", maps:get(traps, Global)},
+            {beamr_call_duration_seconds, histogram,
+                "The time taken by WASM calls, including their imports.", Global},
+            {beamr_imports_total, counter,
+                "WASM imports called, by module and field.", Imports},
+            {beamr_import_wait_seconds_total, counter,
+                "Time WASM imports spent waiting on Erlang, by module and field.",
+                Imports},
+            {beamr_memory_read_bytes_total, counter,
+                "WASM memory read by Erlang.", maps:get(bytes_read, Global)},
+            {beamr_memory_written_bytes_total, counter,
+                "WASM memory written by Erlang.", maps:get(bytes_written, Global)},
+            {beamr_inits_total, counter,
+                "WASM instances initialized.", maps:get(inits, Global)},
+            {beamr_init_seconds_total, counter,
+                "Time spent initializing WASM instances, including compilation.",
+                Seconds(init_ns)},
+            {beamr_compiles_total, counter,
+                "WASM modules compiled (module cache misses).", maps:get(compiles, Global)},
+            {beamr_compile_seconds_total, counter,
+                "Time spent compiling WASM modules.", Seconds(compile_ns)},
+            {beamr_instances, gauge,
+                "Live WASM instances.", maps:get(instances, Global)},
+            {beamr_memory_bytes, gauge,
+                "Linear memory of all live WASM instances.", maps:get(memory_bytes, Global)}
+        ],
+    lists:foreach(
+        fun({Name, Type, Help, Data}) ->
+            Callback(prometheus_model_helpers:create_mf(Name, Help, Type, ?MODULE, Data))
+        end,
+        Metrics
+    ).
\ No newline at end of file
@@ -103,6 +103,60 @@ default_message() ->
         http_request_send_timeout => 60000,
         port => 8734,
         wasm_allow_aot => false,
+        %% The WAMR engine used to execute WASM (not AOT) images: `default',
+        %% `interp', `fast_jit', `llvm_jit' or `multi_tier_jit', depending on
+        %% the `WAMR_PROFILE' that the runtime was built with.
+        wasm_engine => default,
+        %% The WASI imports that BEAMR implements natively, rather than with
+        %% `dev_wasi'. See `hb_beamr:start/3' for those that are available.
+        wasm_native_wasi => [],
+        %% The number of threads that the BEAMR driver runs WASM on, and
+        %% whether they are pinned to cores. With 0 threads, the ERTS async
+        %% pool is used.
+        wasm_threads => 0,
+        wasm_thread_pinning => false,
+        %% The sizes of WASM instances, in bytes, as the options of the same
+        %% names (without `wasm_') of `hb_beamr:start/3'. 0 keeps the default:
+        %% 64KB for the stack and heap, the module's initial memory, and no
+        %% limit beyond the module's own.
+        wasm_stack_size => 0,
+        wasm_heap_size => 0,
+        wasm_initial_memory => 0,
+        wasm_max_memory => 0,
+        %% How WASM instances check their memory accesses, as the
+        %% `bounds_checks' option of `hb_beamr:start/3'. With `hardware', AOT
+        %% images are also compiled without checks in their code (see
+        %% `hb_beamr_aot').
+        wasm_bounds_checks => default,
+        %% Whether `dev_wasm' takes its instances from a pool of pre-warmed
+        %% instances (see `hb_beamr_pool'), the number of ready instances the
+        %% pool keeps of each module, and how long (in milliseconds) they may
+        %% stay idle before they are stopped.
+        wasm_pool => false,
+        wasm_pool_size => 2,
+        wasm_pool_idle_timeout => 60000,
+        %% The memory that imports read, which is sent to Erlang along with
+        %% each call of them. See the `import_prefetch' option of
+        %% `hb_beamr:call/6'.
+        wasm_import_prefetch =>
+            [{<<"wasi_snapshot_preview1">>, <<"fd_write">>, [{iovec, 1, 2}]}],
+        %% The execution budget of each call that `dev_wasm' makes. See the
+        %% `budget' option of `hb_beamr:call/6'.
+        wasm_call_budget => #{},
+        %% Whether `dev_wasm' snapshots are manifests of content-addressed
+        %% pages in the node's local stores (see `hb_beamr_pages'), rather
+        %% than the whole memory.
+        wasm_snapshot_pages => false,
+        %% The WAMR compiler used to produce AOT images (see `make wamrc'),
+        %% and its options. These must match the features the runtime is
+        %% built with.
+        wasm_aot_compiler => "_build/wamr/wamr-compiler/build/wamrc",
+        wasm_aot_compiler_flags =>
+            [
+                "--bounds-checks=1",
+                "--enable-tail-call",
+                "--enable-dump-call-stack"
+            ],
         %% Options for the relay device
         relay_http_client => httpc,
         %% Dev options
@@ -2,7 +2,7 @@
 -behavior(hb_store).
 -export([start/1, stop/1, reset/1, scope/1]).
 -export([type/2, read/2, write/3, list/2]).
--export([make_group/2, make_link/3, resolve/2]).
+-export([make_group/2, make_link/3, resolve/2, file_path/2]).
 -include_lib("kernel/include/file.hrl").
 -include("include/hb.hrl").
 
@@ -43,6 +43,15 @@ read(Path) ->
             end
     end.
 
+%% @doc Find the file that holds a key, following symlinks as needed, such
+%% that it can be used directly (for example, mapped into memory).
+file_path(Opts, Key) ->
+    Path = add_prefix(Opts, resolve(Opts, Key)),
+    case file:read_file_info(Path) of
+        {ok, #file_info{type = regular}} -> {ok, Path};
+        _ -> not_found
+    end.
+
 write(Opts, PathComponents, Value) ->
     Path = add_prefix(Opts, PathComponents),
     ?event({writing, Path, byte_size(Value)}),